@@ -36,6 +36,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "utility.h"
 #include "esp32_can.h"
 #include "can_manager.h"
+#include "textformat.h"
 #ifndef CONFIG_IDF_TARGET_ESP32S3
 #include "BluetoothSerial.h"
 #endif
@@ -60,6 +61,8 @@ ELM327Emu::ELM327Emu()
  * Initialization of hardware and parameters
  */
 void ELM327Emu::setup() {
+    //in threaded mode replies to frames are queued from the CAN task while commands are answered from the comm task
+    txBuffer.setMultiProducer(settings.threadedMode);
 #ifndef CONFIG_IDF_TARGET_ESP32S3
     serialBT.begin(settings.btName);
 #endif
@@ -97,6 +100,10 @@ void ELM327Emu::sendCmd(String cmd) {
 
 void ELM327Emu::loop() {
     int incoming;
+
+    //push out anything processCANReply queued up from the CAN task
+    if (txBuffer.numAvailableBytes() > 0) sendTxBuffer();
+
     if (!mClient) //bluetooth
     {
 #ifndef CONFIG_IDF_TARGET_ESP32S3
@@ -154,22 +161,24 @@ void ELM327Emu::loop() {
 
 void ELM327Emu::sendTxBuffer()
 {
+    //writeToStream() only consumes what the link took. The rest stays queued, including anything the CAN task
+    //added in the meantime, and goes out next time
     if (mClient)
     {
-        size_t wifiLength = txBuffer.numAvailableBytes();
-        uint8_t* buff = txBuffer.getBufferedBytes();
         if (mClient->connected())
         {
-            mClient->write(buff, wifiLength);
+            txBuffer.writeToStream(*mClient);
         }
+        else txBuffer.clearBufferedBytes(); //nobody to send it to
     }
     else //bluetooth then
     {
 #ifndef CONFIG_IDF_TARGET_ESP32S3
-        serialBT.write(txBuffer.getBufferedBytes(), txBuffer.numAvailableBytes());
+        txBuffer.writeToStream(serialBT);
+#else
+        txBuffer.clearBufferedBytes();
 #endif
     }
-    txBuffer.clearBufferedBytes();
 }
 
 /*
@@ -344,21 +353,23 @@ void ELM327Emu::processCANReply(CAN_FRAME &frame)
 {
     //at the moment assume anything sent here is a legit reply to something we sent. Package it up properly
     //and send it down the line
-    char buff[8];
+    char buff[32];
+    int len = 0;
+    int numBytes = frame.data.byte[0]; //first byte is the ISO-TP length. Never go past the end of the frame though
+    if (numBytes > 7) numBytes = 7;
     if (bHeader || bMonitorMode)
     {
-        sprintf(buff, "%03X", frame.id);
-        txBuffer.sendString(buff);
+        len += TextFormat::hex(buff + len, frame.id, 3, true);
     }
     if (bDLC)
     {
-        sprintf(buff, "%u", frame.length);
-        txBuffer.sendString(buff);
+        len += TextFormat::uintDec(buff + len, frame.length);
     }
-    for (int i = 0; i < frame.data.byte[0]; i++)
+    for (int i = 0; i < numBytes; i++)
     {
-        sprintf(buff, "%02X", frame.data.byte[1+i]);
-        txBuffer.sendString(buff);
+        len += TextFormat::hexByte2(buff + len, frame.data.byte[1+i], true);
     }
-    sendTxBuffer();
+    txBuffer.sendBytesToBuffer((uint8_t *)buff, len);
+    //the CAN task must not touch the WiFi/BT link. loop() picks the reply up from the comm task instead.
+    if (!SysSettings.isCANTaskActive) sendTxBuffer();
 }
@@ -31,6 +31,8 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "sys_io.h"
 
 void loadSettings();
+void commLoop();
+void commTaskLoop(void *param);
 void processDigToggleFrame(CAN_FRAME &frame);
 void sendDigToggleMsg();
 void sendMarkTriggered(int which);
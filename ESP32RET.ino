@@ -38,6 +38,12 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "gvret_comm.h"
 #include "can_manager.h"
 #include "lawicel.h"
+#include "udp_stream.h"
+#include "flush_policy.h"
+#include "filter_manager.h"
+#include "id_filter.h"
+#include "change_filter.h"
+#include "traffic_gen.h"
 
 //on the S3 we want the default pins to be different
 #ifdef CONFIG_IDF_TARGET_ESP32S3
@@ -46,7 +52,13 @@ MCP2517FD CAN1(10, 3);
 
 byte i = 0;
 
-uint32_t lastFlushMicros = 0;
+FlushPolicy serialFlush(SER_BUFF_SIZE);
+FlushPolicy wifiFlush(WIFI_FLUSH_BATCH);
+FlushPolicy udpFlush(UDP_STREAM_MTU);
+FilterManager filterManager;
+IDFilter idFilter;
+ChangeFilter changeFilter;
+TrafficGenerator trafficGen;
 
 bool markToggle[6];
 uint32_t lastMarkTrigger = 0;
@@ -63,6 +75,7 @@ uint8_t espChipRevision;
 ELM327Emu elmEmulator;
 
 WiFiManager wifiManager;
+UDPStreamer udpStreamer;
 
 GVRET_Comm_Handler serialGVRET; //gvret protocol over the serial to USB connection
 GVRET_Comm_Handler wifiGVRET; //GVRET over the wifi telnet port
@@ -92,6 +105,12 @@ void loadSettings()
     settings.wifiMode = nvPrefs.getUChar("wifiMode", 2); //Wifi defaults to creating an AP
     settings.enableBT = nvPrefs.getBool("enable-bt", false);
     settings.enableLawicel = nvPrefs.getBool("enableLawicel", true);
+    settings.threadedMode = nvPrefs.getBool("threaded", false);
+    settings.udpStream = nvPrefs.getBool("udpstream", false);
+    settings.exactBusLoad = nvPrefs.getBool("exactload", false);
+    settings.flushMode = nvPrefs.getUChar("flushmode", FLUSH_ADAPTIVE);
+    settings.changeOnly = nvPrefs.getBool("changeonly", false);
+    settings.changeHeartbeat = nvPrefs.getUShort("changehb", 1000);
 
     uint8_t defaultVal = (espChipRevision > 2) ? 0 : 1; //0 = A0, 1 = EVTV ESP32
 #ifdef CONFIG_IDF_TARGET_ESP32S3
@@ -267,6 +286,11 @@ void loadSettings()
         settings.canSettings[i].fdSpeed = nvPrefs.getUInt(buff, 5000000);
         sprintf(buff, "can%i-fdmode", i);
         settings.canSettings[i].fdMode = nvPrefs.getBool(buff, false);
+        sprintf(buff, "can%i-weight", i);
+        settings.canSettings[i].weight = nvPrefs.getUChar(buff, 1);
+        sprintf(buff, "can%i-filters", i);
+        memset(settings.canSettings[i].filters, 0, sizeof(settings.canSettings[i].filters)); //nothing saved means no filters
+        nvPrefs.getBytes(buff, settings.canSettings[i].filters, sizeof(settings.canSettings[i].filters));
     }
 
     nvPrefs.end();
@@ -276,6 +300,15 @@ void loadSettings()
     for (int rx = 0; rx < NUM_BUSES; rx++) SysSettings.lawicelBusReception[rx] = true; //default to showing messages on RX 
 }
 
+void commTaskLoop(void *)
+{
+    for (;;)
+    {
+        commLoop();
+        vTaskDelay(1);
+    }
+}
+
 void setup()
 {
 #ifdef CONFIG_IDF_TARGET_ESP32S3
@@ -285,6 +318,7 @@ void setup()
     //to deal with this issue.
     Serial.setTxTimeoutMs(2);
 #endif
+    Serial.setRxBufferSize(SER_RX_BUFF_SIZE); //has to come before begin
     Serial.begin(1000000); //for production
     //Serial.begin(115200); //for testing
     //delay(2000); //just for testing. Don't use in production
@@ -295,6 +329,7 @@ void setup()
     Serial.println(CFG_BUILD_NUM);
 
     SysSettings.isWifiConnected = false;
+    SysSettings.isCANTaskActive = false;
 
     loadSettings();
 
@@ -323,6 +358,16 @@ void setup()
     
     elmEmulator.setup();
 
+    if (settings.threadedMode)
+    {
+        Serial.println("Starting threaded mode");
+        canManager.startTask();
+        if (SysSettings.isCANTaskActive)
+        {
+            xTaskCreatePinnedToCore(commTaskLoop, "COMM", COMM_TASK_STACK, NULL, COMM_TASK_PRIORITY, NULL, COMM_TASK_CORE);
+        }
+    }
+
     Serial.print("Free heap after setup: ");
     Serial.println(esp_get_free_heap_size());
 
@@ -357,46 +402,71 @@ Yes, this should probably have been done more neatly but this way is likely to b
 fastest and safest with limited function calls
 */
 void loop()
+{
+    if (SysSettings.isCANTaskActive)
+    {
+        //In threaded mode the work is done by the CAN RX and comm tasks. Nothing left for this one to do.
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        return;
+    }
+
+    canManager.loop();
+    commLoop();
+}
+
+/*
+Everything that isn't CAN reception: WiFi, flushing the outgoing buffers, console/GVRET input and the ELM327 emulator.
+Called from loop() normally or from its own task pinned to COMM_TASK_CORE in threaded mode.
+*/
+void commLoop()
 {
     //uint32_t temp32;    
-    bool isConnected = false;
     int serialCnt;
-    uint8_t in_byte;
-
-    /*if (Serial)*/ isConnected = true;
+    uint8_t inputChunk[GVRET_INPUT_CHUNK];
 
     if (SysSettings.lawicelPollCounter > 0) SysSettings.lawicelPollCounter--;
     //}
 
-    canManager.loop();
     /*if (!settings.enableBT)*/ wifiManager.loop();
 
-    size_t wifiLength = wifiGVRET.numAvailableBytes();
-    size_t serialLength = serialGVRET.numAvailableBytes();
-    size_t maxLength = (wifiLength>serialLength) ? wifiLength : serialLength;
+    //frames sitting in an open compact batch count too, they go into the ring right before the flush
+    size_t wifiLength = wifiGVRET.numAvailableBytes() + wifiGVRET.numStagedBytes();
+    size_t serialLength = serialGVRET.numAvailableBytes() + serialGVRET.numStagedBytes();
+    size_t udpLength = udpStreamer.numBufferedBytes();
+    uint32_t flushStart;
 
-    //If the max time has passed or the buffer is almost filled then send buffered data out
-    if ((micros() - lastFlushMicros > SER_BUFF_FLUSH_INTERVAL) || (maxLength > (WIFI_BUFF_SIZE - 40)) ) 
+    //Each link has its own policy for when buffered data goes out. See FLUSHMODE
+    if (serialFlush.shouldFlush(serialLength)) 
     {
-        lastFlushMicros = micros();
-        if (serialLength > 0) 
-        {
-            Serial.write(serialGVRET.getBufferedBytes(), serialLength);
-            serialGVRET.clearBufferedBytes();
-        }
-        if (wifiLength > 0)
-        {
-            wifiManager.sendBufferedData();
-        }
+        flushStart = micros();
+        serialGVRET.closeBatch();
+        size_t written = serialGVRET.writeToStream(Serial);
+        serialFlush.flushed(written, micros() - flushStart);
+    }
+    if (wifiFlush.shouldFlush(wifiLength))
+    {
+        flushStart = micros();
+        wifiGVRET.closeBatch();
+        wifiManager.sendBufferedData();
+        wifiFlush.flushed(wifiLength, micros() - flushStart);
+    }
+    else wifiManager.drainClients(); //keep working on any backlog clients have between flushes
+    if (udpFlush.shouldFlush(udpLength))
+    {
+        flushStart = micros();
+        udpStreamer.flush();
+        udpFlush.flushed(udpLength, micros() - flushStart);
     }
 
-    serialCnt = 0;
-    while ( (Serial.available() > 0) && serialCnt < 128 ) 
+    //at most one chunk per pass so a host blasting frames to send can't hold off CAN reception
+    serialCnt = Serial.available();
+    if (serialCnt > 0)
     {
-        serialCnt++;
-        in_byte = Serial.read();
-        serialGVRET.processIncomingByte(in_byte);
+        if (serialCnt > GVRET_INPUT_CHUNK) serialCnt = GVRET_INPUT_CHUNK;
+        serialCnt = Serial.readBytes(inputChunk, serialCnt);
+        serialGVRET.processIncomingBytes(inputChunk, serialCnt);
     }
 
     elmEmulator.loop();
+    trafficGen.loop();
 }
@@ -156,6 +156,7 @@ boolean Logger::isDebug()
  * %% - outputs a '%' character
  * %s - prints the next parameter as string
  * %d - prints the next parameter as decimal
+ * %u - prints the next parameter as unsigned decimal
  * %f - prints the next parameter as double float
  * %x - prints the next parameter as hex value
  * %X - prints the next parameter as hex value with '0x' added before
@@ -188,6 +189,9 @@ void Logger::log(LogLevel level, const char *format, va_list args)
     case Error:
         Serial.print("ERROR");
         break;
+
+    case Off:
+        break;
     }
 
     Serial.print(": ");
@@ -203,6 +207,7 @@ void Logger::log(LogLevel level, const char *format, va_list args)
  * %% - outputs a '%' character
  * %s - prints the next parameter as string
  * %d - prints the next parameter as decimal
+ * %u - prints the next parameter as unsigned decimal
  * %f - prints the next parameter as double float
  * %x - prints the next parameter as hex value
  * %X - prints the next parameter as hex value with '0x' added before
@@ -230,7 +235,7 @@ void Logger::logMessage(const char *format, va_list args)
             }
 
             if (*format == 's') {
-                register char *s = (char *) va_arg(args, int);
+                char *s = va_arg(args, char *);
                 writeLen = sprintf((char*)&buffer[buffLen], "%s", s);
                 buffLen += writeLen;
                 continue;
@@ -242,6 +247,12 @@ void Logger::logMessage(const char *format, va_list args)
                 continue;
             }
 
+            if (*format == 'u') {
+                writeLen = sprintf((char*)&buffer[buffLen], "%u", va_arg(args, unsigned int));
+                buffLen += writeLen;
+                continue;
+            }
+
             if (*format == 'f') {
                 writeLen = sprintf((char*)&buffer[buffLen], "%.2f", va_arg(args, double));
                 buffLen += writeLen;
@@ -261,7 +272,7 @@ void Logger::logMessage(const char *format, va_list args)
             }
 
             if (*format == 'l') {
-                writeLen = sprintf((char*)&buffer[buffLen], "%l", va_arg(args, long));
+                writeLen = sprintf((char*)&buffer[buffLen], "%ld", va_arg(args, long));
                 buffLen += writeLen;
                 continue;
             }
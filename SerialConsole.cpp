@@ -35,6 +35,16 @@
 #include "config.h"
 #include "sys_io.h"
 #include "lawicel.h"
+#include "wifi_manager.h"
+#include "udp_stream.h"
+#include "can_manager.h"
+#include "flush_policy.h"
+#include "gvret_comm.h"
+#include "benchmark.h"
+#include "filter_manager.h"
+#include "id_filter.h"
+#include "change_filter.h"
+#include "traffic_gen.h"
 
 extern void CANHandler();
 
@@ -47,12 +57,12 @@ void SerialConsole::init()
 {
     //State variables for serial console
     ptrBuffer = 0;
+    lineTooLong = false;
     state = STATE_ROOT_MENU;
 }
 
 void SerialConsole::printMenu()
 {
-    char buff[80];
     //Show build # here as well in case people are using the native port and don't get to see the start up messages
     Serial.print("Build number: ");
     Serial.println(CFG_BUILD_NUM);
@@ -62,6 +72,7 @@ void SerialConsole::printMenu()
     Serial.println();
     Serial.println("Short Commands:");
     Serial.println("h = help (displays this message)");
+    Serial.println("i = show buffer and task statistics");
     Serial.println("R = reset to factory defaults");
     Serial.println("s = Start logging to file");
     Serial.println("S = Stop logging to file");
@@ -83,6 +94,16 @@ void SerialConsole::printMenu()
             Logger::console("CANFDMODE%i=%i - Allow FD traffic on CAN%i (0 = Disable, 1 = Enable)", i, settings.canSettings[i].fdMode, i);
         }
         Logger::console("CANLISTENONLY%i=%i - Enable/Disable Listen Only Mode (0 = Dis, 1 = En)", i, settings.canSettings[i].listenOnly);
+        Logger::console("CANWEIGHT%i=%i - Share of receive processing CAN%i gets when buses compete (1 - 4)", i, settings.canSettings[i].weight, i);
+        Logger::console("CAN%iFILTER<0-%i>=ID,MASK,EXT,EN - Acceptance filter for CAN%i. No enabled filters receives everything", i, FILTERS_PER_BUS - 1, i);
+        for (int f = 0; f < FILTERS_PER_BUS; f++)
+        {
+            FILTER &filt = settings.canSettings[i].filters[f];
+            if (filt.enabled) Logger::console("    CAN%iFILTER%i=0x%x,0x%x,%i,1", i, f, filt.id, filt.mask, filt.extended);
+        }
+        Logger::console("IDMODE%i=%i - Software ID filter for CAN%i (0 = Pass all, 1 = Only listed IDs, 2 = Block listed IDs)", i, idFilter.getMode(i), i);
+        Logger::console("IDADD%i=ID,EXT,EVERY,MS - List an ID on CAN%i, forward 1 in EVERY frames and at most 1 per MS ms (%i listed)", i, i, idFilter.getCount(i));
+        Logger::console("IDDEL%i=ID,EXT - Unlist an ID on CAN%i. IDCLEAR%i=1 unlists them all", i, i, i);
         Serial.println();
         Logger::console("CANSEND%i=ID,LEN,<BYTES SEPARATED BY COMMAS> - Ex: CAN0SEND=0x200,4,1,2,3,4", i);
         Serial.println();
@@ -101,6 +122,18 @@ void SerialConsole::printMenu()
     Logger::console("LAWICEL=%i - Set whether to accept LAWICEL commands (0 = Off, 1 = On)", settings.enableLawicel);
     Serial.println();
 
+    Logger::console("BENCH=ENCODE - Run the frame encoding benchmark. BENCH=BUSLOAD for the bus load calculations, BENCH=COMPRESS for WiFi compression, BENCH=PARSE for GVRET input, BENCH=IDFILTER for the software ID filter");
+    Logger::console("TRAFFIC=BUS,RATE,DLC,IDS,RANDOM,SECONDS - Send test frames on BUS at RATE frames/sec and report how many came back in. TRAFFICSTOP=1 ends it early");
+    Logger::console("EXACTLOAD=%i - Count the real stuff bits of every frame for bus load instead of the worst case (0 = Off, 1 = On)", settings.exactBusLoad);
+    Logger::console("FLUSHMODE=%i - When buffered output is sent (0 = Every %ims, 1 = Lowest latency, 2 = Full packets, 3 = Adaptive)", settings.flushMode, SER_BUFF_FLUSH_INTERVAL / 1000);
+    Logger::console("CHANGEONLY=%i - Only send frames whose data changed since the last one with that ID (0 = Off, 1 = On)", settings.changeOnly);
+    Logger::console("CHANGEHEARTBEAT=%i - Send unchanged frames anyway after this many ms in change only mode (0 = Never)", settings.changeHeartbeat);
+    Logger::console("CHANGEIDS=<bus> - List how many frames of each ID change only mode has held back on a bus");
+    Logger::console("IDSTATS=<bus> - List every ID seen on a bus with its frame count, period, jitter and last data. IDSTATSCLEAR=1 starts over");
+    Logger::console("THREADED=%i - Run CAN reception in its own task on core %i (0 = Off, 1 = On). Needs a reboot", settings.threadedMode, CAN_TASK_CORE);
+    Serial.println();
+
+    Logger::console("UDPSTREAM=%i - Stream frames as UDP datagrams to whoever pings port %i (0 = Off, 1 = On). Needs a reboot", settings.udpStream, UDP_STREAM_PORT);
     Logger::console("WIFIMODE=%i - Set mode for WiFi (0 = Wifi Off, 1 = Connect to AP, 2 = Create AP", settings.wifiMode);
     Logger::console("SSID=%s - Set SSID to either connect to or create", (char *)settings.SSID);
     Logger::console("WPA2KEY=%s - Either passphrase or actual key", (char *)settings.WPA2Key);
@@ -108,19 +141,22 @@ void SerialConsole::printMenu()
 
 /*	There is a help menu (press H or h or ?)
  This is no longer going to be a simple single character console.
- Now the system can handle up to 80 input characters. Commands are submitted
+ Now the system can handle up to CONSOLE_LINE_SIZE - 1 input characters. Commands are submitted
  by sending line ending (LF, CR, or both)
  */
 void SerialConsole::rcvCharacter(uint8_t chr)
 {
     if (chr == 10 || chr == 13) { //command done. Parse it.
-        handleConsoleCmd();
+        if (lineTooLong) {
+            if (settings.enableLawicel && SysSettings.lawicelMode) lawicel.rejectCmd();
+            else Logger::console("Line too long, ignored");
+        }
+        else handleConsoleCmd();
         ptrBuffer = 0; //reset line counter once the line has been processed
-    } else {
+        lineTooLong = false;
+    } else if (ptrBuffer < CONSOLE_LINE_SIZE - 1) { //always room left for the null
         cmdBuffer[ptrBuffer++] = (unsigned char) chr;
-        if (ptrBuffer > 79)
-            ptrBuffer = 79;
-    }
+    } else lineTooLong = true;
 }
 
 void SerialConsole::handleConsoleCmd()
@@ -142,8 +178,6 @@ void SerialConsole::handleConsoleCmd()
 
 void SerialConsole::handleShortCmd()
 {
-    uint8_t val;
-
     switch (cmdBuffer[0]) {
     //non-lawicel commands
     case 'h':
@@ -151,6 +185,9 @@ void SerialConsole::handleShortCmd()
     case 'H':
         printMenu();
         break;
+    case 'i':
+        printStats();
+        break;
     case 'R': //reset to factory defaults.
         nvPrefs.begin(PREF_NAME, false);
         nvPrefs.clear();
@@ -179,15 +216,12 @@ void SerialConsole::handleConfigCmd()
     int newValue;
     char *newString;
     bool writeEEPROM = false;
-    bool writeDigEE = false;
-    char *dataTok;
 
     //Logger::debug("Cmd size: %i", ptrBuffer);
     if (ptrBuffer < 6)
         return; //4 digit command, =, value is at least 6 characters
     cmdBuffer[ptrBuffer] = 0; //make sure to null terminate
     String cmdString = String();
-    unsigned char whichEntry = '0';
     i = 0;
 
     while (cmdBuffer[i] != '=' && i < ptrBuffer)
@@ -216,14 +250,16 @@ void SerialConsole::handleConfigCmd()
         if (newValue < 0) newValue = 0;
         if (newValue > 1) newValue = 1;
         Logger::console("Setting CAN%i Enabled to %i", idx, newValue);
+        canManager.pauseRx();
         settings.canSettings[idx].enabled = newValue;
         if (newValue == 1) 
         {
             //CAN0.enable();
             canBuses[idx]->begin(settings.canSettings[idx].nomSpeed, 255);
-            canBuses[idx]->watchFor();
+            filterManager.apply(idx);
         }
         else canBuses[idx]->disable();
+        canManager.resumeRx();
         writeEEPROM = true;
     } else if (cmdString.startsWith("CANSPEED")) {
         int idx = cmdString[cmdString.length() - 1] - '0';
@@ -232,12 +268,14 @@ void SerialConsole::handleConfigCmd()
         if (newValue > 32000 && newValue <= 1000000)
         {
             Logger::console("Setting CAN%i Nominal Speed to %i", idx, newValue);
+            canManager.pauseRx();
             settings.canSettings[idx].nomSpeed = newValue;
             if (settings.canSettings[idx].enabled) 
             {
                 if (settings.canSettings[idx].fdMode)
                     canBuses[idx]->begin(settings.canSettings[idx].nomSpeed, settings.canSettings[idx].fdSpeed);
             }
+            canManager.resumeRx();
             writeEEPROM = true;
         } 
         else Logger::console("Invalid baud rate! Enter a value 32000 - 1000000");
@@ -249,12 +287,14 @@ void SerialConsole::handleConfigCmd()
         {
             if (newValue > 499999 && newValue <= 8000000) {
                 Logger::console("Setting CAN%i FD Rate to %i", idx, newValue);
+                canManager.pauseRx();
                 settings.canSettings[idx].fdSpeed = newValue;
                 if (settings.canSettings[idx].enabled) 
                 {
                     if (settings.canSettings[idx].fdMode)
                         canBuses[idx]->beginFD(settings.canSettings[idx].nomSpeed, settings.canSettings[idx].fdSpeed);
                 }
+                canManager.resumeRx();
                 writeEEPROM = true;
             } else Logger::console("Invalid baud rate! Enter a value 500000 - 8000000");
         } 
@@ -266,11 +306,13 @@ void SerialConsole::handleConfigCmd()
         {
             if (newValue >= 0 && newValue <= 1) {
                 Logger::console("Setting CAN%i FD Mode to %i", idx, newValue);
+                canManager.pauseRx();
                 settings.canSettings[idx].fdMode = newValue;
                     if (settings.canSettings[idx].fdMode)
                         canBuses[idx]->beginFD(settings.canSettings[idx].nomSpeed, settings.canSettings[idx].fdSpeed);
                     else
                         canBuses[idx]->begin(settings.canSettings[idx].nomSpeed, 255);
+                canManager.resumeRx();
                 writeEEPROM = true;
             } else Logger::console("Invalid setting! Enter a value 0 - 1");
         }
@@ -280,46 +322,44 @@ void SerialConsole::handleConfigCmd()
         if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
         if (newValue >= 0 && newValue <= 1) {
             Logger::console("Setting CAN%i Listen Only to %i", idx, newValue);
+            canManager.pauseRx();
             settings.canSettings[idx].listenOnly = newValue;
             if (settings.canSettings[idx].listenOnly) {
                 canBuses[idx]->setListenOnlyMode(true);
             } else {
                 canBuses[idx]->setListenOnlyMode(false);
             }
+            canManager.resumeRx();
             writeEEPROM = true;
         } else Logger::console("Invalid setting! Enter a value 0 - 1");
-    } else if (cmdString == String("CAN0FILTER0")) { //someone should kick me in the face for this laziness... FIX THIS!
-        handleFilterSet(0, 0, newString);
-    } else if (cmdString == String("CAN0FILTER1")) {
-        if (handleFilterSet(0, 1, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER2")) {
-        if (handleFilterSet(0, 2, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER3")) {
-        if (handleFilterSet(0, 3, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER4")) {
-        if (handleFilterSet(0, 4, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER5")) {
-        if (handleFilterSet(0, 5, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER6")) {
-        if (handleFilterSet(0, 6, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER7")) {
-        if (handleFilterSet(0, 7, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER0")) {
-        if (handleFilterSet(1, 0, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER1")) {
-        if (handleFilterSet(1, 1, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER2")) {
-        if (handleFilterSet(1, 2, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER3")) {
-        if (handleFilterSet(1, 3, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER4")) {
-        if (handleFilterSet(1, 4, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER5")) {
-        if (handleFilterSet(1, 5, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER6")) {
-        if (handleFilterSet(1, 6, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER7")) {
-        if (handleFilterSet(1, 7, newString)) writeEEPROM = true;
+    } else if (cmdString.startsWith("CANWEIGHT")) {
+        int idx = cmdString[cmdString.length() - 1] - '0';
+        if (idx < 0) idx = 0;
+        if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
+        if (newValue >= 1 && newValue <= 4) {
+            Logger::console("Setting CAN%i Weight to %i", idx, newValue);
+            settings.canSettings[idx].weight = newValue;
+            writeEEPROM = true;
+        } else Logger::console("Invalid setting! Enter a value 1 - 4");
+    } else if (cmdString.startsWith("CAN") && cmdString.indexOf("FILTER") == 4) { //CAN<bus>FILTER<slot>
+        if (handleFilterSet(cmdString[3] - '0', atoi(cmdString.c_str() + 10), newString)) writeEEPROM = true;
+    } else if (cmdString.startsWith("IDMODE")) {
+        int idx = cmdString[cmdString.length() - 1] - '0';
+        if (idx < 0) idx = 0;
+        if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
+        if (idFilter.setMode(idx, newValue)) Logger::console("Setting CAN%i ID filter mode to %i", idx, newValue);
+        else Logger::console("Invalid setting! Enter a value 0 - 2");
+    } else if (cmdString.startsWith("IDADD") || cmdString.startsWith("IDDEL")) {
+        int idx = cmdString[cmdString.length() - 1] - '0';
+        if (idx < 0) idx = 0;
+        if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
+        if (!handleIDFilterSet(idx, newString, cmdString.startsWith("IDADD"))) Logger::console("ID filter change failed");
+    } else if (cmdString.startsWith("IDCLEAR")) {
+        int idx = cmdString[cmdString.length() - 1] - '0';
+        if (idx < 0) idx = 0;
+        if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
+        Logger::console("Clearing CAN%i ID filter list", idx);
+        idFilter.clear(idx);
     } else if (cmdString.startsWith("CANSEND")) {
         int idx = cmdString[cmdString.length() - 1] - '0';
         if (idx < 0) idx = 0;
@@ -345,6 +385,58 @@ void SerialConsole::handleConfigCmd()
         Logger::console("Setting LAWICEL Mode to %i", newValue);
         settings.enableLawicel = newValue;
         writeEEPROM = true;        
+    } else if (cmdString == String("BENCH")) {
+        Benchmark::run(newString);
+    } else if (cmdString == String("EXACTLOAD")) {
+        if (newValue < 0) newValue = 0;
+        if (newValue > 1) newValue = 1;
+        Logger::console("Setting exact bus load calculation to %i", newValue);
+        settings.exactBusLoad = newValue;
+        writeEEPROM = true;
+    } else if (cmdString == String("FLUSHMODE")) {
+        if (newValue < FLUSH_FIXED) newValue = FLUSH_FIXED;
+        if (newValue > FLUSH_ADAPTIVE) newValue = FLUSH_ADAPTIVE;
+        Logger::console("Setting flush mode to %i", newValue);
+        settings.flushMode = newValue;
+        writeEEPROM = true;
+    } else if (cmdString == String("CHANGEONLY")) {
+        if (newValue < 0) newValue = 0;
+        if (newValue > 1) newValue = 1;
+        Logger::console("Setting change only forwarding to %i", newValue);
+        if (newValue && !settings.changeOnly) changeFilter.reset(); //start from a clean cache so every ID gets sent once
+        settings.changeOnly = newValue;
+        writeEEPROM = true;
+    } else if (cmdString == String("CHANGEHEARTBEAT")) {
+        if (newValue >= 0 && newValue <= 65535) {
+            Logger::console("Setting change only heartbeat to %i ms", newValue);
+            settings.changeHeartbeat = newValue;
+            writeEEPROM = true;
+        } else Logger::console("Invalid setting! Enter a value 0 - 65535");
+    } else if (cmdString == String("CHANGEIDS")) {
+        if (newValue >= 0 && newValue < SysSettings.numBuses) changeFilter.printIDs(newValue);
+        else Logger::console("Invalid bus! Enter a value 0 - %i", SysSettings.numBuses - 1);
+    } else if (cmdString == String("IDSTATS")) {
+        if (newValue >= 0 && newValue < SysSettings.numBuses) canManager.getIDStats().print(newValue);
+        else Logger::console("Invalid bus! Enter a value 0 - %i", SysSettings.numBuses - 1);
+    } else if (cmdString == String("IDSTATSCLEAR")) {
+        Logger::console("Clearing per ID statistics");
+        canManager.getIDStats().reset();
+    } else if (cmdString == String("TRAFFIC")) {
+        if (!handleTrafficStart(newString)) Logger::console("Could not start traffic test. Check the values, that the bus is enabled and no test is running");
+    } else if (cmdString == String("TRAFFICSTOP")) {
+        trafficGen.stop();
+    } else if (cmdString == String("THREADED")) {
+        if (newValue < 0) newValue = 0;
+        if (newValue > 1) newValue = 1;
+        Logger::console("Setting Threaded Mode to %i. Reboot for this to take effect", newValue);
+        settings.threadedMode = newValue;
+        writeEEPROM = true;
+    } else if (cmdString == String("UDPSTREAM")) {
+        if (newValue < 0) newValue = 0;
+        if (newValue > 1) newValue = 1;
+        Logger::console("Setting UDP Streaming to %i. Reboot for this to take effect", newValue);
+        settings.udpStream = newValue;
+        writeEEPROM = true;
     } else if (cmdString == String("WIFIMODE")) {
         if (newValue < 0) newValue = 0;
         if (newValue > 2) newValue = 2;
@@ -427,11 +519,21 @@ void SerialConsole::handleConfigCmd()
             nvPrefs.putUInt(buff, settings.canSettings[i].fdSpeed);
             sprintf(buff, "can%i-fdmode", i);
             nvPrefs.putBool(buff, settings.canSettings[i].fdMode);
+            sprintf(buff, "can%i-weight", i);
+            nvPrefs.putUChar(buff, settings.canSettings[i].weight);
+            sprintf(buff, "can%i-filters", i);
+            nvPrefs.putBytes(buff, settings.canSettings[i].filters, sizeof(settings.canSettings[i].filters));
         }
         
         nvPrefs.putBool("binarycomm", settings.useBinarySerialComm);
         nvPrefs.putBool("enable-bt", settings.enableBT);
         nvPrefs.putBool("enableLawicel", settings.enableLawicel);
+        nvPrefs.putBool("threaded", settings.threadedMode);
+        nvPrefs.putBool("udpstream", settings.udpStream);
+        nvPrefs.putBool("exactload", settings.exactBusLoad);
+        nvPrefs.putUChar("flushmode", settings.flushMode);
+        nvPrefs.putBool("changeonly", settings.changeOnly);
+        nvPrefs.putUShort("changehb", settings.changeHeartbeat);
         nvPrefs.putUChar("loglevel", settings.logLevel);
         nvPrefs.putUChar("systype", settings.systemType);
         nvPrefs.putUChar("wifiMode", settings.wifiMode);
@@ -445,8 +547,8 @@ void SerialConsole::handleConfigCmd()
 //CAN0FILTER%i=%%i,%%i,%%i,%%i (ID, Mask, Extended, Enabled)", i);
 bool SerialConsole::handleFilterSet(uint8_t bus, uint8_t filter, char *values)
 {
-    if (filter < 0 || filter > 7) return false;
-    if (bus < 0 || bus > 1) return false;
+    if (filter >= FILTERS_PER_BUS) return false;
+    if (bus >= SysSettings.numBuses) return false;
 
     //there should be four tokens
     char *idTok = strtok(values, ",");
@@ -466,20 +568,57 @@ bool SerialConsole::handleFilterSet(uint8_t bus, uint8_t filter, char *values)
 
     Logger::console("Setting CAN%iFILTER%i to ID 0x%x Mask 0x%x Extended %i Enabled %i", bus, filter, idVal, maskVal, extVal, enVal);
 
-    if (bus == 0) {
-        //settings.CAN0Filters[filter].id = idVal;
-        //settings.CAN0Filters[filter].mask = maskVal;
-        //settings.CAN0Filters[filter].extended = extVal;
-        //settings.CAN0Filters[filter].enabled = enVal;
-        //CAN0.setRXFilter(filter, idVal, maskVal, extVal);
-    } else if (bus == 1) {
-        //settings.CAN1Filters[filter].id = idVal;
-        //settings.CAN1Filters[filter].mask = maskVal;
-        //settings.CAN1Filters[filter].extended = extVal;
-        //settings.CAN1Filters[filter].enabled = enVal;
-        //CAN1.setRXFilter(filter, idVal, maskVal, extVal);
+    return filterManager.setFilter(bus, filter, idVal, maskVal, extVal, enVal);
+}
+
+//IDADD%i=ID,EXT,EVERY,MS and IDDEL%i=ID,EXT. Anything after the ID can be left off
+bool SerialConsole::handleIDFilterSet(uint8_t bus, char *values, bool add)
+{
+    char *idTok = strtok(values, ",");
+    char *extTok = strtok(NULL, ",");
+    char *everyTok = strtok(NULL, ",");
+    char *msTok = strtok(NULL, ",");
+
+    if (!idTok) return false;
+
+    uint32_t idVal = strtoul(idTok, NULL, 0);
+    int extVal = extTok ? strtol(extTok, NULL, 0) : (idVal > 0x7FF);
+    int everyVal = everyTok ? strtol(everyTok, NULL, 0) : 1;
+    int msVal = msTok ? strtol(msTok, NULL, 0) : 0;
+    if (everyVal < 1 || everyVal > 0xFFFF || msVal < 0 || msVal > 0xFFFF) return false;
+
+    if (!add)
+    {
+        Logger::console("Removing ID 0x%x Extended %i from CAN%i ID filter", idVal, extVal, bus);
+        return idFilter.removeID(bus, idVal, extVal);
     }
+    Logger::console("Setting CAN%i ID filter for ID 0x%x Extended %i to 1 in %i frames, at most 1 per %i ms", bus, idVal, extVal, everyVal, msVal);
+    return idFilter.addID(bus, idVal, extVal, everyVal, msVal);
+}
 
+//TRAFFIC=BUS,RATE,DLC,IDS,RANDOM,SECONDS. Everything after RATE can be left off
+bool SerialConsole::handleTrafficStart(char *values)
+{
+    char *busTok = strtok(values, ",");
+    char *rateTok = strtok(NULL, ",");
+    char *dlcTok = strtok(NULL, ",");
+    char *idsTok = strtok(NULL, ",");
+    char *randomTok = strtok(NULL, ",");
+    char *secondsTok = strtok(NULL, ",");
+
+    if (!busTok) return false;
+    if (!rateTok) return false;
+
+    int busVal = strtol(busTok, NULL, 0);
+    int rateVal = strtol(rateTok, NULL, 0);
+    int dlcVal = dlcTok ? strtol(dlcTok, NULL, 0) : 8;
+    int idsVal = idsTok ? strtol(idsTok, NULL, 0) : 1;
+    int randomVal = randomTok ? strtol(randomTok, NULL, 0) : 0;
+    int secondsVal = secondsTok ? strtol(secondsTok, NULL, 0) : 10;
+    if (rateVal < 0 || secondsVal < 0) return false;
+
+    if (!trafficGen.start(busVal, rateVal, dlcVal, idsVal, randomVal, secondsVal)) return false;
+    Logger::console("Sending %i frames/sec on CAN%i for %i seconds, DLC %i, %i IDs from 0x%x", rateVal, busVal, secondsVal, dlcVal, idsVal, TRAFFIC_BASE_ID);
     return true;
 }
 
@@ -516,6 +655,41 @@ bool SerialConsole::handleCANSend(CAN_COMMON &port, char *inputString)
     return true;
 }
 
+void SerialConsole::printBufferStats(const char *name, CommBuffer &buffer)
+{
+    Logger::console("%s buffer: %i bytes queued, peak %i of %i, %i writes dropped (%i bytes)", name, buffer.numAvailableBytes(), 
+                    buffer.getPeakBytes(), WIFI_BUFF_SIZE, buffer.getOverflowCount(), buffer.getDroppedBytes());
+}
+
+void SerialConsole::printStats()
+{
+    printBufferStats("Serial", serialGVRET);
+    printBufferStats("WiFi", wifiGVRET);
+    Logger::console("GVRET input errors: Serial %i framing %i checksum, WiFi %i framing %i checksum", serialGVRET.getFramingErrors(),
+                    serialGVRET.getChecksumErrors(), wifiGVRET.getFramingErrors(), wifiGVRET.getChecksumErrors());
+    serialFlush.printStats("Serial");
+    if (SysSettings.isWifiActive) wifiFlush.printStats("WiFi");
+    if (SysSettings.isWifiActive) wifiManager.printClientStats();
+    udpStreamer.printStats();
+    filterManager.printStats();
+    idFilter.printStats();
+    changeFilter.printStats();
+    Logger::console("Per ID statistics: %i IDs tracked, %u frames untracked", canManager.getIDStats().getCount(), canManager.getIDStats().getUntracked());
+    for (int i = 0; i < SysSettings.numBuses; i++)
+    {
+        if (!settings.canSettings[i].enabled) continue;
+        BUSLOAD &load = canManager.getBusLoad(i);
+        RXSCHED &sched = canManager.getRxSched(i);
+        Logger::console("CAN%i: %i%% bus load, %i frames/sec, %i payload bytes/sec", i, load.busloadPercentage, load.framesPerSec, load.bytesPerSec);
+        Logger::console("      %i frames read, max %i waiting in driver, max wait %i us, %i driver drops", sched.framesRead, 
+                        sched.maxQueueDepth, sched.maxWait, sched.driverDrops);
+    }
+    canManager.resetRxSched(); //starvation counters cover the time since the last time they were shown
+    if (SysSettings.isCANTaskActive) Logger::console("Threaded mode: CAN RX task on core %i (%u of %i bytes of stack never used), comm task on core %i",
+                                                     CAN_TASK_CORE, canManager.getTaskStackFree(), CAN_TASK_STACK, COMM_TASK_CORE);
+    else Logger::console("Single threaded mode");
+}
+
 void SerialConsole::printBusName(int bus) {
     switch (bus) {
     case 0:
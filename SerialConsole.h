@@ -31,6 +31,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "sys_io.h"
 #include "ESP32RET.h"
 #include "esp32_can.h"
+#include "commbuffer.h"
 
 class SerialConsole {
 public:
@@ -38,6 +39,7 @@ public:
     void printMenu();
     void rcvCharacter(uint8_t chr);
     void printBusName(int bus);
+    void printStats();
 
 protected:
     enum CONSOLE_STATE {
@@ -45,8 +47,9 @@ protected:
     };
 
 private:
-    char cmdBuffer[80];    
+    char cmdBuffer[CONSOLE_LINE_SIZE];
     int ptrBuffer;
+    bool lineTooLong; //the line being received didn't fit and gets dropped when it ends
     int state;
 
     void init();
@@ -54,8 +57,11 @@ private:
     void handleShortCmd();
     void handleConfigCmd();
     bool handleFilterSet(uint8_t bus, uint8_t filter, char *values);
+    bool handleIDFilterSet(uint8_t bus, char *values, bool add);
     bool handleCANSend(CAN_COMMON &port, char *inputString);
+    bool handleTrafficStart(char *values);
     bool handleSWCANSend(char *inputString);
+    void printBufferStats(const char *name, CommBuffer &buffer);
 };
 
 #endif /* SERIALCONSOLE_H_ */
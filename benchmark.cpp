@@ -0,0 +1,335 @@
+#include "benchmark.h"
+#include "config.h"
+#include "Logger.h"
+#include "commbuffer.h"
+#include "busload.h"
+#include "lz4_block.h"
+#include "gvret_comm.h"
+#include "id_filter.h"
+
+#define BENCH_ITERATIONS    2000
+
+static CommBuffer benchBuffer; //scratch buffer so the benchmarks never touch the live output streams
+
+void Benchmark::run(char *which)
+{
+    if (!strcasecmp(which, "ENCODE")) encode();
+    else if (!strcasecmp(which, "BUSLOAD")) busLoad();
+    else if (!strcasecmp(which, "COMPRESS")) compress();
+    else if (!strcasecmp(which, "PARSE")) parse();
+    else if (!strcasecmp(which, "IDFILTER")) idFilter();
+    else Logger::console("Unknown benchmark. Options: ENCODE, BUSLOAD, COMPRESS, PARSE, IDFILTER");
+}
+
+/*
+Cost of CommBuffer::sendFrameToBuffer for both output formats across the full range of frame sizes
+*/
+void Benchmark::encode()
+{
+    static const int fdLengths[] = {0, 8, 12, 16, 20, 24, 32, 48, 64};
+
+    Logger::console("Encode benchmark, %i frames per case", BENCH_ITERATIONS);
+    for (int binary = 1; binary >= 0; binary--)
+    {
+        for (int extended = 0; extended < 2; extended++)
+        {
+            for (int len = 0; len <= 8; len++) encodeCase(binary, extended, false, len);
+            for (int i = 0; i < 9; i++) encodeCase(binary, extended, true, fdLengths[i]);
+        }
+    }
+}
+
+void Benchmark::encodeCase(bool binary, bool extended, bool fd, int length)
+{
+    CAN_FRAME frame;
+    CAN_FRAME_FD fdFrame;
+    uint32_t startTime, elapsed;
+    size_t bytesPerFrame;
+
+    frame.id = extended ? 0x18DAF110 : 0x7E8;
+    frame.extended = extended;
+    frame.rtr = 0;
+    frame.length = (length > 8) ? 8 : length;
+    fdFrame.id = frame.id;
+    fdFrame.extended = extended;
+    fdFrame.length = length;
+    for (int i = 0; i < 64; i++) fdFrame.data.uint8[i] = (uint8_t)(i * 37 + 11);
+    for (int i = 0; i < 8; i++) frame.data.uint8[i] = fdFrame.data.uint8[i];
+
+    benchBuffer.clearBufferedBytes();
+    if (fd) benchBuffer.sendFrameToBuffer(fdFrame, 1, binary);
+    else benchBuffer.sendFrameToBuffer(frame, 1, binary);
+    bytesPerFrame = benchBuffer.numAvailableBytes();
+
+    startTime = micros();
+    for (int i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        benchBuffer.clearBufferedBytes();
+        if (fd) benchBuffer.sendFrameToBuffer(fdFrame, 1, binary);
+        else benchBuffer.sendFrameToBuffer(frame, 1, binary);
+    }
+    elapsed = micros() - startTime;
+
+    Logger::console("%s %s %s len %i: %i ns/frame %i bytes/frame", binary ? "BIN" : "TXT", fd ? "FD " : "CAN", 
+                    extended ? "EXT" : "STD", length, (elapsed * 1000) / BENCH_ITERATIONS, (int)bytesPerFrame);
+}
+
+/*
+Cost of the worst case and exact frame length calculations. One of them runs on every frame received so
+they have to stay well under the time between frames on a full bus (~50us for 8 byte frames at 1Mbit)
+*/
+void Benchmark::busLoad()
+{
+    static const int fdLengths[] = {0, 8, 12, 16, 20, 24, 32, 48, 64};
+
+    Logger::console("Bus load benchmark, %i frames per case", BENCH_ITERATIONS);
+    for (int extended = 0; extended < 2; extended++)
+    {
+        for (int len = 0; len <= 8; len += 4) busLoadCase(extended, false, len);
+        for (int i = 0; i < 9; i++) busLoadCase(extended, true, fdLengths[i]);
+    }
+}
+
+void Benchmark::busLoadCase(bool extended, bool fd, int length)
+{
+    CAN_FRAME frame;
+    CAN_FRAME_FD fdFrame;
+    FRAME_BITS worst, exact;
+    uint32_t startTime, worstTime, exactTime;
+    volatile uint32_t sink = 0; //keeps the compiler from throwing the calls away
+
+    frame.id = extended ? 0x18DAF110 : 0x7E8;
+    frame.extended = extended;
+    frame.rtr = 0;
+    frame.length = (length > 8) ? 8 : length;
+    fdFrame.id = frame.id;
+    fdFrame.extended = extended;
+    fdFrame.fdMode = 1;
+    fdFrame.length = length;
+    for (int i = 0; i < 64; i++) fdFrame.data.uint8[i] = (uint8_t)(i * 37 + 11);
+    for (int i = 0; i < 8; i++) frame.data.uint8[i] = fdFrame.data.uint8[i];
+
+    worst = fd ? BusLoad::worstCaseBits(fdFrame) : BusLoad::worstCaseBits(frame);
+    exact = fd ? BusLoad::exactBits(fdFrame) : BusLoad::exactBits(frame);
+
+    startTime = micros();
+    for (int i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        FRAME_BITS bits = fd ? BusLoad::worstCaseBits(fdFrame) : BusLoad::worstCaseBits(frame);
+        sink += bits.nominalBits;
+    }
+    worstTime = micros() - startTime;
+
+    startTime = micros();
+    for (int i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        FRAME_BITS bits = fd ? BusLoad::exactBits(fdFrame) : BusLoad::exactBits(frame);
+        sink += bits.nominalBits;
+    }
+    exactTime = micros() - startTime;
+
+    Logger::console("%s %s len %i: worst %i+%i bits %i ns  exact %i+%i bits %i ns", fd ? "FD " : "CAN", 
+                    extended ? "EXT" : "STD", length, worst.nominalBits, worst.dataBits, (worstTime * 1000) / BENCH_ITERATIONS,
+                    exact.nominalBits, exact.dataBits, (exactTime * 1000) / BENCH_ITERATIONS);
+}
+
+/*
+LZ4 on a buffer of typical capture traffic: a set of IDs repeating at fixed periods with a counter byte and
+slowly changing signals. Done for both the legacy and compact frame formats since the two stack. The compressed
+blocks are unpacked again and checked against the original so this doubles as a round trip test.
+*/
+void Benchmark::compress()
+{
+    Logger::console("Compression benchmark, %i blocks per case", BENCH_ITERATIONS / 20);
+    compressCase(false);
+    compressCase(true);
+}
+
+void Benchmark::compressCase(bool compact)
+{
+    static LZ4Block compressor;
+    static uint8_t raw[WIFI_BUFF_SIZE];
+    static uint8_t packed[LZ4_BOUND(WIFI_BUFF_SIZE)];
+    static uint8_t unpacked[WIFI_BUFF_SIZE];
+    static const uint32_t ids[] = {0x0C9, 0x0F1, 0x1E5, 0x1F5, 0x2C3, 0x3C1, 0x3E9, 0x4C1, 0x4D1, 0x52A, 0x5C5, 0x771};
+    const int numIds = sizeof(ids) / sizeof(ids[0]);
+    CAN_FRAME frame;
+    uint32_t startTime, compressTime, decompressTime;
+    size_t rawLength, packedLength = 0;
+    int frames = 0, unpackedLength = 0;
+    const int blocks = BENCH_ITERATIONS / 20;
+
+    benchBuffer.clearBufferedBytes();
+    benchBuffer.setCompact(compact);
+    frame.extended = false;
+    frame.rtr = 0;
+    frame.length = 8;
+    //fill to about one flush worth
+    while (benchBuffer.numAvailableBytes() + benchBuffer.numStagedBytes() < WIFI_FLUSH_BATCH)
+    {
+        frame.id = ids[frames % numIds];
+        frame.timestamp = 1000000 + frames * 250;
+        for (int i = 0; i < 8; i++) frame.data.uint8[i] = (uint8_t)(frame.id * (i + 1));
+        frame.data.uint8[0] = (uint8_t)(frames / numIds); //rolling counter
+        frame.data.uint8[3] = (uint8_t)((frames / numIds) >> 4); //slow signal
+        benchBuffer.sendFrameToBuffer(frame, frames & 1, true);
+        frames++;
+    }
+    benchBuffer.closeBatch();
+    benchBuffer.setCompact(false);
+    rawLength = benchBuffer.numAvailableBytes();
+    for (size_t i = 0; i < rawLength; i++)
+    {
+        uint8_t *byt;
+        benchBuffer.peekBytes(i, &byt);
+        raw[i] = *byt;
+    }
+
+    startTime = micros();
+    for (int i = 0; i < blocks; i++) packedLength = compressor.compress(raw, rawLength, packed, sizeof(packed));
+    compressTime = micros() - startTime;
+
+    startTime = micros();
+    for (int i = 0; i < blocks; i++) unpackedLength = LZ4Block::decompress(packed, packedLength, unpacked, sizeof(unpacked));
+    decompressTime = micros() - startTime;
+
+    bool good = (unpackedLength == (int)rawLength) && !memcmp(raw, unpacked, rawLength);
+    Logger::console("%s: %i frames, %i bytes -> %i bytes (%i%%), compress %i us (%i KB/s), decompress %i us, round trip %s",
+                    compact ? "Compact" : "Legacy ", frames, rawLength, packedLength, (int)((packedLength * 100) / rawLength),
+                    compressTime / blocks, compressTime ? (int)(((uint64_t)rawLength * blocks * 1000) / (compressTime * 1024ull)) : 0,
+                    decompressTime / blocks, good ? "OK" : "FAILED");
+}
+
+/*
+Incoming GVRET parsing, whole buffers at a time versus a byte at a time. The stream alternates PROTO_SET_EXT_BUSES
+messages with PROTO_BUILD_CAN_FRAME messages that carry a bad checksum. Neither does anything to the hardware but
+between them they cover copying whole messages, checksum checks and resyncing. Every frame has to be caught as
+a checksum error and nothing else may be flagged.
+*/
+void Benchmark::parse()
+{
+    static GVRET_Comm_Handler parser;
+    static uint8_t stream[1024];
+    size_t length = 0;
+    int badFrames = 0;
+    uint32_t startTime, bulkTime, byteTime;
+    const int passes = BENCH_ITERATIONS / 20;
+
+    while (length + 31 <= sizeof(stream))
+    {
+        stream[length++] = 0xF1;
+        stream[length++] = PROTO_SET_EXT_BUSES;
+        for (int i = 0; i < 12; i++) stream[length++] = 0;
+        uint8_t frameMsg[17] = {0xF1, PROTO_BUILD_CAN_FRAME, 0x10, 0x02, 0, 0, 0, 8, 1, 2, 3, 4, 5, 6, 7, (uint8_t)badFrames, 0};
+        uint8_t checksum = 0;
+        for (int i = 0; i < 16; i++) checksum ^= frameMsg[i];
+        frameMsg[16] = checksum ^ 0x5A; //never matches and never 0
+        memcpy(&stream[length], frameMsg, sizeof(frameMsg));
+        length += sizeof(frameMsg);
+        badFrames++;
+    }
+
+    uint32_t checksumBefore = parser.getChecksumErrors();
+    uint32_t framingBefore = parser.getFramingErrors();
+    startTime = micros();
+    for (int i = 0; i < passes; i++) parser.processIncomingBytes(stream, length);
+    bulkTime = micros() - startTime;
+
+    startTime = micros();
+    for (int i = 0; i < passes; i++)
+    {
+        for (size_t b = 0; b < length; b++) parser.processIncomingByte(stream[b]);
+    }
+    byteTime = micros() - startTime;
+
+    uint32_t checksumErrors = parser.getChecksumErrors() - checksumBefore;
+    uint32_t framingErrors = parser.getFramingErrors() - framingBefore;
+    bool good = (checksumErrors == (uint32_t)(badFrames * passes * 2)) && (framingErrors == 0);
+    Logger::console("Parse benchmark, %i passes over %i bytes", passes, length);
+    Logger::console("Buffer: %i us/pass (%i KB/s)  Byte at a time: %i us/pass (%i KB/s)  Errors: %i checksum %i framing %s",
+                    bulkTime / passes, bulkTime ? (int)(((uint64_t)length * passes * 1000) / (bulkTime * 1024ull)) : 0,
+                    byteTime / passes, byteTime ? (int)(((uint64_t)length * passes * 1000) / (byteTime * 1024ull)) : 0,
+                    checksumErrors, framingErrors, good ? "OK" : "FAILED");
+}
+
+/*
+Cost per frame of the software ID filter as its list grows. Half the listed IDs are standard and half extended
+and every fourth one is decimated. The frames looked up are a mix of listed and unlisted IDs of both kinds.
+The time per frame should stay flat from the smallest list to the largest. Then the hash table is filled right up
+with extended IDs and the probes per lookup counted, which should stay at one or two for hits and misses alike.
+*/
+void Benchmark::idFilter()
+{
+    static const int sizes[] = {2, 16, 64, 256, ID_FILTER_MAX_IDS};
+
+    Logger::console("ID filter benchmark, %i frames per case", BENCH_ITERATIONS);
+    for (int i = 0; i < 5; i++) idFilterCase(sizes[i]);
+    idFilterProbes();
+}
+
+void Benchmark::idFilterCase(int listSize)
+{
+    static IDFilter filter; //scratch copy so the live filter isn't touched
+    uint32_t startTime, elapsed;
+    int accepted = 0;
+
+    filter.clear(0);
+    filter.setMode(0, IDFILTER_PASS_LISTED);
+    for (int i = 0; i < listSize; i++)
+    {
+        bool extended = i & 1;
+        uint32_t id = extended ? (0x18DA0000 + i * 0x101) : ((i * 5) & 0x7FF);
+        filter.addID(0, id, extended, (i % 4 == 0) ? 10 : 1, 0);
+    }
+
+    startTime = micros();
+    for (int i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        int n = i % (listSize * 2); //every other lookup misses
+        bool extended = (n >> 1) & 1;
+        uint32_t id;
+        if (n & 1) id = extended ? (0x0CF00000 + n) : ((n * 5 + 1) & 0x7FF);
+        else id = extended ? (0x18DA0000 + (n >> 1) * 0x101) : (((n >> 1) * 5) & 0x7FF);
+        if (filter.accepts(0, id, extended, i * 100)) accepted++;
+    }
+    elapsed = micros() - startTime;
+
+    Logger::console("%i IDs listed: %i ns/frame, %i of %i frames passed", listSize, (elapsed * 1000) / BENCH_ITERATIONS, accepted, BENCH_ITERATIONS);
+}
+
+//Half ISO-TP style runs and half J1939 style PGNs from a few sources
+static uint32_t probeID(int i)
+{
+    return (i & 1) ? (0x18FE0000 + (i >> 1) * 0x100 + (i & 0xF)) : (0x18DA0000 + i * 0x101);
+}
+
+//Probe counts with the table holding as many IDs as it ever will
+void Benchmark::idFilterProbes()
+{
+    static IDFilter filter;
+    int hitTotal = 0, hitMax = 0, missTotal = 0, missMax = 0;
+    const int misses = 4096;
+
+    filter.clear(0);
+    for (int i = 0; i < ID_FILTER_MAX_IDS; i++) filter.addID(0, probeID(i), true, 1, 0);
+    for (int i = 0; i < ID_FILTER_MAX_IDS; i++)
+    {
+        int probes = filter.probeCount(0, probeID(i), true);
+        hitTotal += probes;
+        if (probes > hitMax) hitMax = probes;
+    }
+    for (int i = 0; i < misses; i++)
+    {
+        int probes = filter.probeCount(0, 0x0CF00000 + i * 7, true);
+        missTotal += probes;
+        if (probes > missMax) missMax = probes;
+    }
+
+    hitTotal = (hitTotal * 100) / ID_FILTER_MAX_IDS;
+    missTotal = (missTotal * 100) / misses;
+    //Logger has no field widths so the two decimals go out a digit at a time
+    Logger::console("Full table, %i IDs in %i slots: hits %i.%i%i probes (max %i), misses %i.%i%i probes (max %i)", filter.getCount(0),
+                    1 << ID_FILTER_BITS, hitTotal / 100, (hitTotal / 10) % 10, hitTotal % 10, hitMax, missTotal / 100,
+                    (missTotal / 10) % 10, missTotal % 10, missMax);
+    filter.clear(0);
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <Arduino.h>
+
+/*
+On device micro benchmarks. These run inline from the console so they take over the CPU for a moment and
+whatever else is going on (WiFi, CAN interrupts) adds noise. Run them a few times and look at the best numbers.
+*/
+class Benchmark
+{
+public:
+    static void run(char *which);
+    static void encode();
+    static void busLoad();
+    static void compress();
+    static void parse();
+    static void idFilter();
+
+private:
+    static void encodeCase(bool binary, bool extended, bool fd, int length);
+    static void busLoadCase(bool extended, bool fd, int length);
+    static void compressCase(bool compact);
+    static void idFilterCase(int listSize);
+    static void idFilterProbes();
+};
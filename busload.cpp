@@ -0,0 +1,162 @@
+#include "busload.h"
+#include "utility.h"
+
+//CRC delimiter, ACK slot, ACK delimiter, EOF and intermission. Never stuffed and always at the nominal rate
+#define FRAME_TAIL_BITS     13
+
+#define CRC15_POLY          0x4599
+
+//Running state of the dynamic stuffing rule (a complementary bit after five equal ones) plus the classic CRC
+struct STUFF_STATE
+{
+    uint8_t lastBit;
+    uint8_t run;
+    uint16_t stuffBits;
+    uint16_t crc;
+};
+
+//Push count bits of value, MSB first, through the stuffing rule. Also runs them through CRC-15 if doCRC is set
+static inline void stuffBits(STUFF_STATE &state, uint32_t value, int count, bool doCRC)
+{
+    for (int i = count - 1; i >= 0; i--)
+    {
+        uint8_t bit = (value >> i) & 1;
+        if (doCRC)
+        {
+            uint16_t feedback = ((state.crc >> 14) ^ bit) & 1;
+            state.crc = (state.crc << 1) & 0x7FFF;
+            if (feedback) state.crc ^= CRC15_POLY;
+        }
+        if (bit == state.lastBit)
+        {
+            if (++state.run == 5)
+            {
+                state.stuffBits++;
+                state.lastBit = !bit; //the stuff bit starts the next run
+                state.run = 1;
+            }
+        }
+        else
+        {
+            state.lastBit = bit;
+            state.run = 1;
+        }
+    }
+}
+
+//SOF then the identifier and the bits between the ID and the control field that classic and FD frames share
+static inline void stuffHeader(STUFF_STATE &state, uint32_t id, bool extended)
+{
+    state.lastBit = 1; //bus idle is recessive so SOF always starts a new run
+    state.run = 0;
+    state.stuffBits = 0;
+    state.crc = 0;
+    stuffBits(state, 0, 1, true); //SOF
+    if (extended)
+    {
+        stuffBits(state, id >> 18, 11, true);
+        stuffBits(state, 3, 2, true); //SRR and IDE both recessive
+        stuffBits(state, id & 0x3FFFF, 18, true);
+    }
+    else stuffBits(state, id & 0x7FF, 11, true);
+}
+
+static FRAME_BITS classicWorstCase(bool extended, int dataBytes)
+{
+    FRAME_BITS bits;
+    int stuffed = (extended ? 54 : 34) + dataBytes * 8;
+    bits.nominalBits = stuffed + ((stuffed - 1) / 4) + FRAME_TAIL_BITS;
+    bits.dataBits = 0;
+    return bits;
+}
+
+static FRAME_BITS classicExact(uint32_t id, bool extended, bool rtr, uint8_t length, const uint8_t *data)
+{
+    FRAME_BITS bits;
+    STUFF_STATE state;
+    int dataBytes = rtr ? 0 : length;
+
+    stuffHeader(state, id, extended);
+    stuffBits(state, rtr ? 4 : 0, 3, true); //RTR, IDE, r0 for standard IDs. RTR, r1, r0 for extended
+    stuffBits(state, length, 4, true);
+    for (int i = 0; i < dataBytes; i++) stuffBits(state, data[i], 8, true);
+    stuffBits(state, state.crc, 15, false); //the CRC is stuffed but obviously not part of its own calculation
+
+    bits.nominalBits = (extended ? 54 : 34) + dataBytes * 8 + state.stuffBits + FRAME_TAIL_BITS;
+    bits.dataBits = 0;
+    return bits;
+}
+
+/*
+Classic frame. The stuffed region runs from SOF through the CRC: 34 bits of overhead for standard IDs and 54
+for extended plus the data. Worst case is one stuff bit after the first five bits then one every four after that.
+*/
+FRAME_BITS BusLoad::worstCaseBits(CAN_FRAME &frame)
+{
+    return classicWorstCase(frame.extended, frame.rtr ? 0 : frame.length); //remote frames carry a DLC but no data
+}
+
+/*
+FD frame. Without bit rate switching it's all nominal rate. With it the arbitration field up to and including
+BRS goes at the nominal rate (17 bits standard, 36 extended) and ESI, DLC and data go at the data rate with
+normal stuffing. Then come the stuff count and CRC (17 bits up to 16 data bytes, 21 above that) which use fixed
+stuff bits, one before the stuff count and then one after every four bits. The CRC delimiter onward is nominal.
+*/
+FRAME_BITS BusLoad::worstCaseBits(CAN_FRAME_FD &frame)
+{
+    FRAME_BITS bits;
+    if (!frame.fdMode) return classicWorstCase(frame.extended, frame.length); //classic frame on an FD capable bus
+
+    int arbBits = frame.extended ? 36 : 17;
+    int wireBytes = Utility::fdDLCToLength(Utility::fdLengthToDLC(frame.length)); //padded up to the next DLC size
+    int crcBits = (wireBytes > 16) ? 21 : 17;
+    int payloadBits = 5 + wireBytes * 8;
+    int fixedBits = 4 + crcBits;
+    int fixedStuff = 1 + (fixedBits / 4);
+
+    //the dynamic stuffing chain continues across the bit rate switch so count it over the whole run then split it
+    int dynamicStuff = (arbBits + payloadBits - 1) / 4;
+    int arbStuff = (arbBits - 1) / 4;
+    bits.nominalBits = arbBits + arbStuff + FRAME_TAIL_BITS;
+    bits.dataBits = payloadBits + (dynamicStuff - arbStuff) + fixedBits + fixedStuff;
+    return bits;
+}
+
+/*
+Exact classic frame length. The real bit stream gets built from the ID, control field, data and CRC-15 and
+every stuff bit that would actually be sent is counted.
+*/
+FRAME_BITS BusLoad::exactBits(CAN_FRAME &frame)
+{
+    return classicExact(frame.id, frame.extended, frame.rtr, frame.length, frame.data.uint8);
+}
+
+/*
+Exact FD frame length. Only SOF through the data is dynamically stuffed. The stuff count and CRC use a fixed
+number of stuff bits no matter their value, so unlike classic frames the CRC doesn't have to be calculated.
+Stuff bits before the bit rate switch are counted at the nominal rate, the rest at the data rate.
+*/
+FRAME_BITS BusLoad::exactBits(CAN_FRAME_FD &frame)
+{
+    FRAME_BITS bits;
+    STUFF_STATE state;
+    if (!frame.fdMode) return classicExact(frame.id, frame.extended, false, frame.length, frame.data.uint8);
+
+    uint8_t dlc = Utility::fdLengthToDLC(frame.length);
+    int wireBytes = Utility::fdDLCToLength(dlc);
+    int crcBits = (wireBytes > 16) ? 21 : 17;
+    int fixedBits = 4 + crcBits;
+    int arbBits = frame.extended ? 36 : 17;
+
+    stuffHeader(state, frame.id, frame.extended);
+    //RRS, IDE, FDF, res, BRS for standard IDs. Extended already sent IDE so it's RRS, FDF, res, BRS
+    stuffBits(state, 0x5, frame.extended ? 4 : 5, false);
+    uint16_t arbStuff = state.stuffBits;
+    stuffBits(state, dlc, 5, false); //ESI (dominant) then DLC
+    //padding up to the DLC size is whatever the sender picked. 0xCC is a common choice
+    for (int i = 0; i < wireBytes; i++) stuffBits(state, (i < frame.length) ? frame.data.uint8[i] : 0xCC, 8, false);
+
+    bits.nominalBits = arbBits + arbStuff + FRAME_TAIL_BITS;
+    bits.dataBits = 5 + wireBytes * 8 + (state.stuffBits - arbStuff) + fixedBits + 1 + (fixedBits / 4);
+    return bits;
+}
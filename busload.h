@@ -0,0 +1,26 @@
+#pragma once
+#include <Arduino.h>
+#include "esp32_can.h"
+
+//How long a frame occupies the bus, split into the bits sent at the nominal (arbitration) bit rate and the bits
+//sent at the data rate. Only FD frames have a data phase, everything else is all nominal bits.
+struct FRAME_BITS
+{
+    uint16_t nominalBits;
+    uint16_t dataBits;
+};
+
+/*
+Frame length calculations for bus load accounting. Everything from SOF through the end of intermission is counted,
+so back to back frames add up to the real bus time. The worst case versions assume the maximum number of stuff
+bits for the frame format which is nearly free to work out. The exact versions run the real ID, data and CRC bits
+through the stuffing rule, which costs a bit per frame but doesn't overstate the load of typical traffic.
+*/
+class BusLoad
+{
+public:
+    static FRAME_BITS worstCaseBits(CAN_FRAME &frame);
+    static FRAME_BITS worstCaseBits(CAN_FRAME_FD &frame);
+    static FRAME_BITS exactBits(CAN_FRAME &frame);
+    static FRAME_BITS exactBits(CAN_FRAME_FD &frame);
+};
@@ -6,6 +6,18 @@
 #include "gvret_comm.h"
 #include "lawicel.h"
 #include "ELM327_Emulator.h"
+#include "udp_stream.h"
+#include <esp_timer.h>
+#include "busload.h"
+#include "filter_manager.h"
+#include "id_filter.h"
+#include "change_filter.h"
+#include "traffic_gen.h"
+#include <driver/twai.h>
+
+//Largest any single frame can get once encoded, in any of the output formats
+#define MAX_ENCODED_FRAME       64
+#define MAX_ENCODED_FD_FRAME    224
 
 
 //twai alerts copied here for ease of access. Look up alerts right here:
@@ -33,7 +45,17 @@
 
 CANManager::CANManager()
 {
-
+    rxTask = NULL;
+    rxLock = NULL;
+    nextBus = 0;
+    memset(rxSched, 0, sizeof(rxSched));
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        txBits[i].nominalBits = 0;
+        txBits[i].dataBits = 0;
+        txBits[i].frames = 0;
+        txBits[i].bytes = 0;
+    }
 }
 
 void CANManager::setup()
@@ -75,7 +97,7 @@ void CANManager::setup()
             {
                 canBuses[i]->setListenOnlyMode(false);
             }
-            canBuses[i]->watchFor();
+            filterManager.apply(i);
         } 
         else
         {
@@ -101,45 +123,166 @@ void CANManager::setup()
 
     for (int j = 0; j < NUM_BUSES; j++)
     {
-        busLoad[j].bitsPerQuarter = settings.canSettings[j].nomSpeed / 4;
-        busLoad[j].bitsSoFar = 0;
-        busLoad[j].busloadPercentage = 0;
-        if (busLoad[j].bitsPerQuarter == 0) busLoad[j].bitsPerQuarter = 125000;
+        memset(&busLoad[j], 0, sizeof(BUSLOAD));
+        updateBitTimes(j);
     }
 
     busLoadTimer = millis();
 }
 
+/*
+Start running reception and encoding from a dedicated task pinned to CAN_TASK_CORE. From here on the
+Arduino loop no longer calls loop() and the outgoing buffers get written from two tasks.
+*/
+void CANManager::startTask()
+{
+    if (rxTask) return;
+    rxLock = xSemaphoreCreateRecursiveMutex();
+    if (!rxLock)
+    {
+        Serial.println("Could not start CAN RX task, staying single threaded");
+        return;
+    }
+    serialGVRET.setMultiProducer(true);
+    wifiGVRET.setMultiProducer(true);
+    SysSettings.isCANTaskActive = true;
+    if (xTaskCreatePinnedToCore(rxTaskLoop, "CAN_RX", CAN_TASK_STACK, this, CAN_TASK_PRIORITY, &rxTask, CAN_TASK_CORE) != pdPASS)
+    {
+        Serial.println("Could not start CAN RX task, staying single threaded");
+        SysSettings.isCANTaskActive = false;
+        rxTask = NULL;
+    }
+}
+
+void CANManager::rxTaskLoop(void *param)
+{
+    CANManager *mgr = (CANManager *)param;
+    for (;;)
+    {
+        xSemaphoreTakeRecursive(mgr->rxLock, portMAX_DELAY);
+        bool busy = mgr->loop();
+        xSemaphoreGiveRecursive(mgr->rxLock);
+        //only sleep once the drivers have been emptied. Driver queues easily cover one tick after that
+        if (!busy) vTaskDelay(1);
+    }
+}
+
+/*
+Keeps the RX task out of the drivers and the bus settings until resumeRx(). Anything on the comm side that
+starts, stops or retunes a bus or its filters has to go through here first. It waits for the current pass
+to finish, which is one batch per bus at most. Calls can nest. Does nothing single threaded.
+*/
+void CANManager::pauseRx()
+{
+    if (rxLock) xSemaphoreTakeRecursive(rxLock, portMAX_DELAY);
+}
+
+void CANManager::resumeRx()
+{
+    if (rxLock) xSemaphoreGiveRecursive(rxLock);
+}
+
+//Smallest amount of stack the RX task has had left, in bytes. 0 if there is no task
+UBaseType_t CANManager::getTaskStackFree()
+{
+    if (!rxTask) return 0;
+    return uxTaskGetStackHighWaterMark(rxTask);
+}
+
+//Bit times in ns for a bus. Redone every window since the speeds can be changed on the fly
+void CANManager::updateBitTimes(int bus)
+{
+    uint32_t nomSpeed = settings.canSettings[bus].nomSpeed;
+    uint32_t dataSpeed = settings.canSettings[bus].fdSpeed;
+    if (nomSpeed == 0) nomSpeed = 500000;
+    if (dataSpeed == 0 || !settings.canSettings[bus].fdMode) dataSpeed = nomSpeed;
+    busLoad[bus].nsPerNominalBit = 1000000000ul / nomSpeed;
+    busLoad[bus].nsPerDataBit = 1000000000ul / dataSpeed;
+}
+
 void CANManager::addBits(int offset, CAN_FRAME &frame)
 {
     if (offset < 0) return;
     if (offset >= NUM_BUSES) return;
-    busLoad[offset].bitsSoFar += 41 + (frame.length * 9);
-    if (frame.extended) busLoad[offset].bitsSoFar += 18;
+    FRAME_BITS bits = settings.exactBusLoad ? BusLoad::exactBits(frame) : BusLoad::worstCaseBits(frame);
+    busLoad[offset].busyNanos += bits.nominalBits * busLoad[offset].nsPerNominalBit;
+    busLoad[offset].framesSoFar++;
+    busLoad[offset].bytesSoFar += frame.length;
 }
 
 void CANManager::addBits(int offset, CAN_FRAME_FD &frame)
 {
     if (offset < 0) return;
     if (offset >= NUM_BUSES) return;
-    busLoad[offset].bitsSoFar += 41 + (frame.length * 9);
-    if (frame.extended) busLoad[offset].bitsSoFar += 18;
+    FRAME_BITS bits = settings.exactBusLoad ? BusLoad::exactBits(frame) : BusLoad::worstCaseBits(frame);
+    busLoad[offset].busyNanos += bits.nominalBits * busLoad[offset].nsPerNominalBit + bits.dataBits * busLoad[offset].nsPerDataBit;
+    busLoad[offset].framesSoFar++;
+    busLoad[offset].bytesSoFar += frame.length;
+}
+
+//Sending runs on the comm side, which in threaded mode isn't the task that owns busLoad
+void CANManager::addTxBits(int bus, FRAME_BITS bits, int length)
+{
+    if (bus < 0 || bus >= NUM_BUSES) return;
+    txBits[bus].nominalBits += bits.nominalBits;
+    txBits[bus].dataBits += bits.dataBits;
+    txBits[bus].frames++;
+    txBits[bus].bytes += length;
+}
+
+BUSLOAD &CANManager::getBusLoad(int bus)
+{
+    return busLoad[bus];
 }
 
-void CANManager::sendFrame(CAN_COMMON *bus, CAN_FRAME &frame)
+/*
+Roll the current window over for every bus. The load percentage is smoothed the same way it always was,
+3/4 of the old value plus 1/4 of the new one. Frame and byte rates are straight from the last window.
+*/
+void CANManager::updateBusLoad()
+{
+    uint32_t elapsed = millis() - busLoadTimer;
+    busLoadTimer = millis();
+    if (elapsed == 0) return;
+
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        BUSLOAD &load = busLoad[i];
+        TXBITS &tx = txBits[i];
+        load.busyNanos += tx.nominalBits.exchange(0) * load.nsPerNominalBit + tx.dataBits.exchange(0) * load.nsPerDataBit;
+        load.framesSoFar += tx.frames.exchange(0);
+        load.bytesSoFar += tx.bytes.exchange(0);
+        uint32_t percent = load.busyNanos / (elapsed * 10000ul); //elapsed ms * 1,000,000 ns / 100%
+        if (percent > 100) percent = 100;
+        load.busloadPercentage = ((load.busloadPercentage * 3) + percent) / 4;
+        //Force busload percentage to be at least 1% if any traffic exists at all. This forces the LED to light up for any traffic.
+        if (load.busloadPercentage == 0 && load.framesSoFar > 0) load.busloadPercentage = 1;
+        load.framesPerSec = (load.framesSoFar * 1000ul) / elapsed;
+        load.bytesPerSec = (load.bytesSoFar * 1000ul) / elapsed;
+        load.busyNanos = 0;
+        load.framesSoFar = 0;
+        load.bytesSoFar = 0;
+        updateBitTimes(i);
+    }
+}
+
+//False if the driver had no room for the frame
+bool CANManager::sendFrame(CAN_COMMON *bus, CAN_FRAME &frame)
 {
     int whichBus = 0;
     for (int i = 0; i < NUM_BUSES; i++) if (canBuses[i] == bus) whichBus = i;
-    bus->sendFrame(frame);
-    addBits(whichBus, frame);
+    if (!bus->sendFrame(frame)) return false;
+    addTxBits(whichBus, settings.exactBusLoad ? BusLoad::exactBits(frame) : BusLoad::worstCaseBits(frame), frame.length);
+    return true;
 }
 
-void CANManager::sendFrame(CAN_COMMON *bus, CAN_FRAME_FD &frame)
+bool CANManager::sendFrame(CAN_COMMON *bus, CAN_FRAME_FD &frame)
 {
     int whichBus = 0;
     for (int i = 0; i < NUM_BUSES; i++) if (canBuses[i] == bus) whichBus = i;
-    bus->sendFrameFD(frame);
-    addBits(whichBus, frame);
+    if (!bus->sendFrameFD(frame)) return false;
+    addTxBits(whichBus, settings.exactBusLoad ? BusLoad::exactBits(frame) : BusLoad::worstCaseBits(frame), frame.length);
+    return true;
 }
 
 
@@ -153,6 +296,7 @@ void CANManager::displayFrame(CAN_FRAME &frame, int whichBus)
     {
         if (SysSettings.isWifiActive) wifiGVRET.sendFrameToBuffer(frame, whichBus);
         else serialGVRET.sendFrameToBuffer(frame, whichBus);
+        if (udpStreamer.isStreaming()) udpStreamer.sendFrame(frame, whichBus);
     }
 }
 
@@ -160,31 +304,25 @@ void CANManager::displayFrame(CAN_FRAME_FD &frame, int whichBus)
 {
     if (settings.enableLawicel && SysSettings.lawicelMode) 
     {
-        //lawicel.sendFrameToBuffer(frame, whichBus);
+        lawicel.sendFrameToBuffer(frame, whichBus);
     } 
     else 
     {
         if (SysSettings.isWifiActive) wifiGVRET.sendFrameToBuffer(frame, whichBus);
         else serialGVRET.sendFrameToBuffer(frame, whichBus);
+        if (udpStreamer.isStreaming()) udpStreamer.sendFrame(frame, whichBus);
     }
 }
 
-void CANManager::loop()
+/*
+Takes frames from every bus with some waiting. Round after round is run until the drivers are empty, the output
+is full or CAN_DRR_MAX_ROUNDS have gone by. True if frames may still be left in a driver.
+*/
+bool CANManager::loop()
 {
-    CAN_FRAME incoming;
-    CAN_FRAME_FD inFD;
-    
-    size_t wifiLength = wifiGVRET.numAvailableBytes();
-    size_t serialLength = serialGVRET.numAvailableBytes();
-    size_t maxLength = (wifiLength > serialLength) ? wifiLength : serialLength;
-
-    if (millis() > (busLoadTimer + 250)) {
-        busLoadTimer = millis();
-        busLoad[0].busloadPercentage = ((busLoad[0].busloadPercentage * 3) + (((busLoad[0].bitsSoFar * 1000) / busLoad[0].bitsPerQuarter) / 10)) / 4;
-        //Force busload percentage to be at least 1% if any traffic exists at all. This forces the LED to light up for any traffic.
-        if (busLoad[0].busloadPercentage == 0 && busLoad[0].bitsSoFar > 0) busLoad[0].busloadPercentage = 1;
-        busLoad[0].bitsPerQuarter = settings.canSettings[0].nomSpeed / 4;
-        busLoad[0].bitsSoFar = 0;
+    if ((millis() - busLoadTimer) >= BUSLOAD_INTERVAL) {
+        updateBusLoad();
+        updateDriverDrops();
         if(busLoad[0].busloadPercentage > busLoad[1].busloadPercentage){
             //updateBusloadLED(busLoad[0].busloadPercentage);
         } else{
@@ -192,30 +330,171 @@ void CANManager::loop()
         }
     }
 
-    for (int i = 0; i < SysSettings.numBuses; i++)
+    //Each pass starts one bus further along so when the output budget runs out partway through
+    //it isn't always the same buses that miss out
+    int start = nextBus;
+    if (++nextBus >= SysSettings.numBuses) nextBus = 0;
+    int waiting[NUM_BUSES];
+    for (int round = 0; round < CAN_DRR_MAX_ROUNDS; round++)
     {
-        if (!canBuses[i]) continue;
-        if (!settings.canSettings[i].enabled) continue;
-        while ( (canBuses[i]->available() > 0) && (maxLength < (WIFI_BUFF_SIZE - 80)))
+        int competing = 0;
+        for (int i = 0; i < SysSettings.numBuses; i++)
         {
-            if (settings.canSettings[i].fdMode == 0)
-            {
-                canBuses[i]->read(incoming);
-                addBits(i, incoming);
-                displayFrame(incoming, i);
-            }
+            waiting[i] = 0;
+            if (!canBuses[i] || !settings.canSettings[i].enabled) continue;
+            RXSCHED &sched = rxSched[i];
+            waiting[i] = canBuses[i]->available();
+            if (waiting[i] > sched.maxQueueDepth) sched.maxQueueDepth = waiting[i];
+            if (waiting[i] > 0) competing++;
             else
             {
-                canBuses[i]->readFD(inFD);
-                addBits(i, inFD);
-                displayFrame(inFD, i);
+                sched.deficit = 0; //credit is forfeited when the bus runs dry so an idle bus can't save up for a burst
+                sched.waitStart = 0;
             }
-            
-            toggleRXLED();
-            if ( (incoming.id > 0x7DF && incoming.id < 0x7F0) || elmEmulator.getMonitorMode() ) elmEmulator.processCANReply(incoming);
-            wifiLength = wifiGVRET.numAvailableBytes();
-            serialLength = serialGVRET.numAvailableBytes();
-            maxLength = (wifiLength > serialLength) ? wifiLength:serialLength;
+        }
+        if (!competing) return false;
+
+        //only split the batch when more than one bus actually has frames waiting
+        int taken = 0;
+        for (int n = 0; n < SysSettings.numBuses; n++)
+        {
+            int i = (start + n) % SysSettings.numBuses;
+            if (waiting[i] > 0) taken += drainBus(i, waiting[i], competing > 1);
+        }
+        if (!taken) break; //no room left for output
+    }
+    return true;
+}
+
+/*
+How many frames can be taken from a driver this pass. When running from our own task keep draining the driver
+no matter what. The ring buffers are the bounded queue between the tasks and anything that doesn't fit there is
+dropped and counted instead of silently overflowing the driver queue. Single threaded we only take what is sure
+to fit under the high watermark so the flush in loop() gets a chance to run.
+*/
+int CANManager::frameBudget(bool fd)
+{
+    if (SysSettings.isCANTaskActive) return CAN_BATCH_SIZE;
+    if (wifiGVRET.isAboveHighWater() || serialGVRET.isAboveHighWater()) return 0;
+    size_t wifiUsed = wifiGVRET.numAvailableBytes();
+    size_t serialUsed = serialGVRET.numAvailableBytes();
+    size_t used = (wifiUsed > serialUsed) ? wifiUsed : serialUsed;
+    if (used >= COMM_BUFF_HIGH_WATER) return 0;
+    int budget = (COMM_BUFF_HIGH_WATER - used) / (fd ? MAX_ENCODED_FD_FRAME : MAX_ENCODED_FRAME);
+    if (budget > CAN_BATCH_SIZE) budget = CAN_BATCH_SIZE;
+    return budget;
+}
+
+/*
+Pull one batch of frames out of a bus driver and then encode the lot. The driver is asked how much it has and
+the output space is checked once per batch instead of once per frame. The drivers only hand out one frame
+per read() so that part can't be batched.
+When other buses have frames waiting too (shared) the batch size comes from deficit round robin: each round
+the bus gets its weight in credit and can take that many frames. A bus with the receive side to itself takes
+a full batch. Returns how many frames were read.
+*/
+int CANManager::drainBus(int bus, int waiting, bool shared)
+{
+    RXSCHED &sched = rxSched[bus];
+    bool fd = settings.canSettings[bus].fdMode;
+
+    if (shared)
+    {
+        int weight = settings.canSettings[bus].weight;
+        if (weight < 1) weight = 1;
+        sched.deficit += weight * CAN_DRR_QUANTUM;
+        if (sched.deficit > CAN_BATCH_SIZE) sched.deficit = CAN_BATCH_SIZE;
+    }
+    else sched.deficit = CAN_BATCH_SIZE;
+
+    int count = waiting;
+    int budget = frameBudget(fd);
+    if (count > sched.deficit) count = sched.deficit;
+    if (count > budget) count = budget;
+
+    uint32_t now = micros();
+    if (count > 0 && sched.waitStart)
+    {
+        uint32_t waited = now - sched.waitStart;
+        if (waited > sched.maxWait) sched.maxWait = waited;
+        sched.waitStart = 0;
+    }
+    if (count < waiting && !sched.waitStart) sched.waitStart = now | 1; //never 0, that means nothing is waiting
+    if (count <= 0) return 0;
+
+    sched.deficit -= count;
+    sched.framesRead += count;
+
+    if (!fd)
+    {
+        for (int f = 0; f < count; f++)
+        {
+            canBuses[bus]->read(rxBatch[f]);
+#if !USE_DRIVER_TIMESTAMPS
+            rxBatch[f].timestamp = (uint32_t)esp_timer_get_time();
+#endif
+        }
+        for (int f = 0; f < count; f++)
+        {
+            CAN_FRAME &frame = rxBatch[f];
+            addBits(bus, frame);
+            idStats.addFrame(bus, frame);
+            trafficGen.frameReceived(bus, frame);
+            if (!filterManager.accepts(bus, frame.id, frame.extended)) continue;
+            if (!idFilter.accepts(bus, frame.id, frame.extended, frame.timestamp)) continue;
+            if (!settings.changeOnly || changeFilter.changed(bus, frame)) displayFrame(frame, bus);
+            if ( (frame.id > 0x7DF && frame.id < 0x7F0) || elmEmulator.getMonitorMode() ) elmEmulator.processCANReply(frame);
+        }
+    }
+    else
+    {
+        for (int f = 0; f < count; f++)
+        {
+            canBuses[bus]->readFD(rxBatchFD[f]);
+#if !USE_DRIVER_TIMESTAMPS
+            rxBatchFD[f].timestamp = (uint32_t)esp_timer_get_time();
+#endif
+        }
+        for (int f = 0; f < count; f++)
+        {
+            addBits(bus, rxBatchFD[f]);
+            idStats.addFrame(bus, rxBatchFD[f]);
+            trafficGen.frameReceived(bus, rxBatchFD[f]);
+            if (!filterManager.accepts(bus, rxBatchFD[f].id, rxBatchFD[f].extended)) continue;
+            if (!idFilter.accepts(bus, rxBatchFD[f].id, rxBatchFD[f].extended, rxBatchFD[f].timestamp)) continue;
+            if (!settings.changeOnly || changeFilter.changed(bus, rxBatchFD[f])) displayFrame(rxBatchFD[f], bus);
         }
     }
+    toggleRXLED();
+    return count;
+}
+
+RXSCHED &CANManager::getRxSched(int bus)
+{
+    return rxSched[bus];
+}
+
+IDStats &CANManager::getIDStats()
+{
+    return idStats;
+}
+
+//Clears the per bus counters and peaks. The scheduling state and the driver drop totals are left alone
+void CANManager::resetRxSched()
+{
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        rxSched[i].framesRead = 0;
+        rxSched[i].maxQueueDepth = 0;
+        rxSched[i].maxWait = 0;
+    }
+}
+
+//The built in TWAI driver keeps count of frames it missed or lost to a full queue. The MCP2517FD driver
+//doesn't expose its overflow status so those buses can't report this.
+void CANManager::updateDriverDrops()
+{
+    twai_status_info_t status;
+    if (canBuses[0] != &CAN0 || !settings.canSettings[0].enabled) return;
+    if (twai_get_status_info(&status) == ESP_OK) rxSched[0].driverDrops = status.rx_missed_count + status.rx_overrun_count;
 }
@@ -1,15 +1,41 @@
 #pragma once
+#include <atomic>
 #include "config.h"
+#include "esp32_can.h"
+#include "id_stats.h"
+#include "busload.h"
 
 typedef struct {
-    uint32_t bitsPerQuarter;
-    uint32_t bitsSoFar;
+    uint32_t nsPerNominalBit;
+    uint32_t nsPerDataBit;
+    uint32_t busyNanos; //bus time taken up by frames so far in this window
+    uint32_t framesSoFar;
+    uint32_t bytesSoFar;
+    uint32_t framesPerSec; //rates over the last complete window
+    uint32_t bytesPerSec;
     uint8_t busloadPercentage;
 } BUSLOAD;
 
+//Bits sent from the comm side since the last window rolled over. busLoad is only ever written by the receiving
+//side so these are kept apart and folded in by updateBusLoad()
+typedef struct {
+    std::atomic<uint32_t> nominalBits;
+    std::atomic<uint32_t> dataBits;
+    std::atomic<uint32_t> frames;
+    std::atomic<uint32_t> bytes;
+} TXBITS;
+
+//Receive scheduling state and starvation counters for one bus
+typedef struct {
+    int32_t deficit; //frames this bus may still take this round
+    uint32_t framesRead;
+    uint16_t maxQueueDepth; //most frames seen waiting in the driver at once
+    uint32_t waitStart; //micros() when frames were last left waiting in the driver, 0 if none were
+    uint32_t maxWait; //longest time in us frames sat in the driver waiting for their turn
+    uint32_t driverDrops; //frames the driver reports it had to throw away. Only the built in TWAI can tell us
+} RXSCHED;
+
 class CAN_COMMON;
-class CAN_FRAME;
-class CAN_FRAME_FD;
 
 class CANManager
 {
@@ -17,14 +43,38 @@ public:
     CANManager();
     void addBits(int offset, CAN_FRAME &frame);
     void addBits(int offset, CAN_FRAME_FD &frame);    
-    void sendFrame(CAN_COMMON *bus, CAN_FRAME &frame);
-    void sendFrame(CAN_COMMON *bus, CAN_FRAME_FD &frame);
+    bool sendFrame(CAN_COMMON *bus, CAN_FRAME &frame);
+    bool sendFrame(CAN_COMMON *bus, CAN_FRAME_FD &frame);
     void displayFrame(CAN_FRAME &frame, int whichBus);
     void displayFrame(CAN_FRAME_FD &frame, int whichBus);
-    void loop();
+    bool loop();
     void setup();
+    void startTask();
+    void pauseRx();
+    void resumeRx();
+    UBaseType_t getTaskStackFree();
+    BUSLOAD &getBusLoad(int bus);
+    RXSCHED &getRxSched(int bus);
+    IDStats &getIDStats();
+    void resetRxSched();
 
 private:
     BUSLOAD busLoad[NUM_BUSES];
+    TXBITS txBits[NUM_BUSES];
     uint32_t busLoadTimer;
+    TaskHandle_t rxTask;
+    SemaphoreHandle_t rxLock; //held by the RX task for each pass and by anything reconfiguring a bus
+    RXSCHED rxSched[NUM_BUSES];
+    IDStats idStats;
+    int nextBus;
+    CAN_FRAME rxBatch[CAN_BATCH_SIZE];
+    CAN_FRAME_FD rxBatchFD[CAN_BATCH_SIZE];
+
+    static void rxTaskLoop(void *param);
+    void updateBitTimes(int bus);
+    void updateBusLoad();
+    void addTxBits(int bus, FRAME_BITS bits, int length);
+    int frameBudget(bool fd);
+    int drainBus(int bus, int waiting, bool shared);
+    void updateDriverDrops();
 };
@@ -0,0 +1,114 @@
+#include "change_filter.h"
+#include "Logger.h"
+
+#define CACHE_MASK  ((1 << CHANGE_CACHE_BITS) - 1)
+
+ChangeFilter::ChangeFilter()
+{
+    clearCache();
+}
+
+void ChangeFilter::clearCache()
+{
+    for (int i = 0; i <= CACHE_MASK; i++) cache[i].bus = CHANGE_EMPTY;
+    numIDs = 0;
+    forwarded = 0;
+    suppressed = 0;
+    uncached = 0;
+    resetPending = false;
+}
+
+void ChangeFilter::reset()
+{
+    resetPending = true;
+}
+
+/*
+Looks up the bus and ID and decides whether this frame goes out. The cache only ever grows between resets
+so there's no removal to worry about.
+*/
+bool ChangeFilter::check(int bus, uint32_t key, uint8_t length, const uint8_t *data, uint32_t timestamp)
+{
+    if (resetPending) clearCache();
+    int dataLength = (length & 0x80) ? 0 : ((length > 8) ? 8 : length);
+
+    uint32_t slot = (uint32_t)((key ^ ((uint32_t)bus << 24)) * 2654435761u) >> (32 - CHANGE_CACHE_BITS);
+    while (cache[slot].bus != CHANGE_EMPTY)
+    {
+        if (cache[slot].key == key && cache[slot].bus == bus) break;
+        slot = (slot + 1) & CACHE_MASK;
+    }
+
+    CHANGE_ENTRY &entry = cache[slot];
+    if (entry.bus == CHANGE_EMPTY)
+    {
+        if (numIDs >= CHANGE_CACHE_MAX_IDS)
+        {
+            uncached++;
+            forwarded++;
+            return true;
+        }
+        entry.key = key;
+        entry.suppressed = 0;
+        entry.bus = bus;
+        numIDs++;
+    }
+    else if (entry.length == length && !memcmp(entry.data, data, dataLength))
+    {
+        uint32_t heartbeat = (uint32_t)settings.changeHeartbeat * 1000;
+        if (!heartbeat || (timestamp - entry.lastSent) < heartbeat)
+        {
+            entry.suppressed++;
+            suppressed++;
+            return false;
+        }
+    }
+
+    entry.length = length;
+    memcpy(entry.data, data, dataLength);
+    entry.lastSent = timestamp;
+    forwarded++;
+    return true;
+}
+
+bool ChangeFilter::changed(int bus, CAN_FRAME &frame)
+{
+    uint32_t key = frame.extended ? (frame.id | 0x80000000ul) : frame.id;
+    uint8_t length = frame.rtr ? (0x80 | frame.length) : frame.length; //remote requests have no data to compare
+    return check(bus, key, length, frame.data.uint8, frame.timestamp);
+}
+
+bool ChangeFilter::changed(int bus, CAN_FRAME_FD &frame)
+{
+    uint32_t key = frame.extended ? (frame.id | 0x80000000ul) : frame.id;
+    if (frame.length <= 8) return check(bus, key, frame.length, frame.data.uint8, frame.timestamp);
+
+    //too long to keep so compare a 64 bit FNV-1a hash of the payload instead
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (int i = 0; i < frame.length; i++) hash = (hash ^ frame.data.uint8[i]) * 0x100000001B3ull;
+    uint8_t hashBytes[8];
+    for (int i = 0; i < 8; i++) hashBytes[i] = (uint8_t)(hash >> (8 * i));
+    return check(bus, key, frame.length, hashBytes, frame.timestamp);
+}
+
+void ChangeFilter::printStats()
+{
+    if (!settings.changeOnly) return;
+    uint32_t total = forwarded + suppressed;
+    Logger::console("Change only: %i IDs cached, %u frames forwarded, %u suppressed (%i%%), %u forwarded uncached", numIDs,
+                    forwarded, suppressed, total ? (int)(((uint64_t)suppressed * 100) / total) : 0, uncached);
+}
+
+void ChangeFilter::printIDs(int bus)
+{
+    int count = 0;
+    Logger::console("Change only suppression for CAN%i:", bus);
+    for (int i = 0; i <= CACHE_MASK; i++)
+    {
+        CHANGE_ENTRY &entry = cache[i];
+        if (entry.bus != bus) continue;
+        Logger::console("  0x%x%s: %u suppressed", entry.key & 0x1FFFFFFF, (entry.key & 0x80000000ul) ? " ext" : "", entry.suppressed);
+        count++;
+    }
+    Logger::console("%i IDs", count);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+#include "esp32_can.h"
+
+#define CHANGE_EMPTY    0xFF //bus value of an unused cache slot
+
+//Last frame forwarded for one bus and ID. The key has the extended flag in the top bit
+struct CHANGE_ENTRY
+{
+    uint32_t key;
+    uint8_t bus;
+    uint8_t length;
+    uint8_t data[8];      //payload, or a hash of it for FD frames longer than 8 bytes
+    uint32_t lastSent;    //timestamp (us) of the last frame forwarded
+    uint32_t suppressed;  //frames held back because nothing changed
+};
+
+/*
+Change only forwarding. Most traffic is periodic frames repeating the same payload so with this turned on
+(settings.changeOnly) a frame is only passed on to the host when its length or data differs from the last one
+sent for that bus and ID, or when settings.changeHeartbeat ms have gone by since then so the host still sees
+the ID is alive. The cache is an open addressed hash table of 2^CHANGE_CACHE_BITS slots holding up to
+CHANGE_CACHE_MAX_IDS IDs. Frames of IDs that don't fit are always forwarded.
+Only the CAN receive side calls changed(). reset() just asks it to start over so it can be called from anywhere.
+*/
+class ChangeFilter
+{
+public:
+    ChangeFilter();
+    bool changed(int bus, CAN_FRAME &frame);
+    bool changed(int bus, CAN_FRAME_FD &frame);
+    void reset();
+    void printStats();
+    void printIDs(int bus);
+
+private:
+    CHANGE_ENTRY cache[1 << CHANGE_CACHE_BITS];
+    uint16_t numIDs;
+    volatile bool resetPending;
+    uint32_t forwarded;
+    uint32_t suppressed;
+    uint32_t uncached; //forwarded because the cache was full
+
+    bool check(int bus, uint32_t key, uint8_t length, const uint8_t *data, uint32_t timestamp);
+    void clearCache();
+};
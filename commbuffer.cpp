@@ -1,37 +1,194 @@
 #include "commbuffer.h"
 #include "Logger.h"
 #include "gvret_comm.h"
+#include "textformat.h"
+#include "utility.h"
+
+#define BUFF_MASK   (WIFI_BUFF_SIZE - 1)
+
+static_assert((WIFI_BUFF_SIZE & BUFF_MASK) == 0, "WIFI_BUFF_SIZE must be a power of two");
 
 CommBuffer::CommBuffer()
 {
-    transmitBufferLength = 0;
+    writeIndex.store(0);
+    readIndex.store(0);
+    throttled = false;
+    multiProducer = false;
+    timestamp64 = false;
+    compactMode = false;
+    compact = NULL;
+    compressed = false;
+    resetStats();
+}
+
+void CommBuffer::setMultiProducer(bool enable)
+{
+    multiProducer = enable;
 }
 
 size_t CommBuffer::numAvailableBytes()
 {
-    return transmitBufferLength;
+    return writeIndex.load(std::memory_order_acquire) - readIndex.load(std::memory_order_acquire);
 }
 
-void CommBuffer::clearBufferedBytes()
+//how many bytes can be read in one go before hitting the end of the ring
+size_t CommBuffer::numContiguousBytes()
 {
-    transmitBufferLength = 0;
+    uint32_t rd = readIndex.load(std::memory_order_relaxed);
+    size_t avail = writeIndex.load(std::memory_order_acquire) - rd;
+    size_t toEnd = WIFI_BUFF_SIZE - (rd & BUFF_MASK);
+    return (avail < toEnd) ? avail : toEnd;
+}
+
+size_t CommBuffer::numFreeBytes()
+{
+    return WIFI_BUFF_SIZE - numAvailableBytes();
 }
 
 uint8_t* CommBuffer::getBufferedBytes()
 {
-    return transmitBuffer;
+    return &transmitBuffer[readIndex.load(std::memory_order_relaxed) & BUFF_MASK];
+}
+
+//Contiguous view of the buffered data starting offset bytes past the read position. Returns how many bytes
+//are readable from *bytes before hitting either the end of the data or the end of the ring.
+size_t CommBuffer::peekBytes(size_t offset, uint8_t **bytes)
+{
+    uint32_t rd = readIndex.load(std::memory_order_relaxed) + offset;
+    int32_t avail = (int32_t)(writeIndex.load(std::memory_order_acquire) - rd);
+    if (avail <= 0) return 0;
+    size_t toEnd = WIFI_BUFF_SIZE - (rd & BUFF_MASK);
+    *bytes = &transmitBuffer[rd & BUFF_MASK];
+    return ((size_t)avail < toEnd) ? avail : toEnd;
+}
+
+void CommBuffer::consumeBytes(size_t length)
+{
+    size_t avail = numAvailableBytes();
+    if (length > avail) length = avail;
+    readIndex.store(readIndex.load(std::memory_order_relaxed) + length, std::memory_order_release);
+}
+
+void CommBuffer::clearBufferedBytes()
+{
+    readIndex.store(writeIndex.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+//Push everything buffered out to the given stream. The wrap at the end of the ring means this takes
+//at most two writes. Returns the number of bytes that actually left the buffer.
+size_t CommBuffer::writeToStream(Print &stream)
+{
+    size_t total = 0;
+    size_t length;
+    while ((length = numContiguousBytes()) > 0)
+    {
+        size_t written = stream.write(getBufferedBytes(), length);
+        consumeBytes(written);
+        total += written;
+        if (written < length) break; //stream is backed up, leave the rest for next time
+    }
+    return total;
+}
+
+//Producer side check used to back off before the buffer overflows. Once the high watermark is hit this keeps
+//returning true until the consumer has drained things below the low watermark.
+bool CommBuffer::isAboveHighWater()
+{
+    size_t used = numAvailableBytes();
+    if (used >= COMM_BUFF_HIGH_WATER) throttled = true;
+    else if (used <= COMM_BUFF_LOW_WATER) throttled = false;
+    return throttled;
+}
+
+uint32_t CommBuffer::getOverflowCount()
+{
+    return overflowCount;
+}
+
+uint32_t CommBuffer::getDroppedBytes()
+{
+    return droppedBytes;
+}
+
+size_t CommBuffer::getPeakBytes()
+{
+    return peakBytes;
+}
+
+//For consumers that decide on their own to throw data away rather than queue it
+void CommBuffer::recordDrop(size_t length)
+{
+    overflowCount++;
+    droppedBytes += length;
+}
+
+void CommBuffer::resetStats()
+{
+    overflowCount = 0;
+    droppedBytes = 0;
+    peakBytes = 0;
+}
+
+//a bit faster version that blasts through the copy more efficiently. Either everything fits or nothing is written.
+bool CommBuffer::sendBytesToBuffer(const uint8_t *bytes, size_t length)
+{
+    if (multiProducer) portENTER_CRITICAL(&producerLock);
+    bool ret = writeBytes(bytes, length);
+    if (multiProducer) portEXIT_CRITICAL(&producerLock);
+    return ret;
+}
+
+//The actual copy into the ring. In multi producer mode the caller must already hold producerLock.
+bool CommBuffer::writeBytes(const uint8_t *bytes, size_t length)
+{
+    uint32_t wr = writeIndex.load(std::memory_order_relaxed);
+    size_t used = wr - readIndex.load(std::memory_order_acquire);
+    if (length > (WIFI_BUFF_SIZE - used))
+    {
+        overflowCount++;
+        droppedBytes += length;
+        return false;
+    }
+    size_t pos = wr & BUFF_MASK;
+    size_t firstPart = WIFI_BUFF_SIZE - pos;
+    if (firstPart > length) firstPart = length;
+    memcpy(&transmitBuffer[pos], bytes, firstPart);
+    if (firstPart < length) memcpy(&transmitBuffer[0], bytes + firstPart, length - firstPart);
+    writeIndex.store(wr + length, std::memory_order_release);
+    used += length;
+    if (used > peakBytes) peakBytes = used;
+    return true;
+}
+
+/*
+Zero copy writes. reserveBytes hands out a pointer straight into the ring if there are at least length free bytes
+before the end of the ring, otherwise NULL and the caller should build the data elsewhere and use sendBytesToBuffer.
+After a successful reserve the caller writes up to length bytes and must then call commitBytes with how many it
+actually wrote. Only a single producer can do this: with more than one the slot would have to stay locked for the
+whole encode, so in multi producer mode this always says no and frames are built on the stack and copied in under
+the lock instead.
+*/
+uint8_t *CommBuffer::reserveBytes(size_t length)
+{
+    if (multiProducer) return NULL;
+    uint32_t wr = writeIndex.load(std::memory_order_relaxed);
+    size_t used = wr - readIndex.load(std::memory_order_acquire);
+    size_t pos = wr & BUFF_MASK;
+    if (length > (WIFI_BUFF_SIZE - used) || length > (WIFI_BUFF_SIZE - pos)) return NULL;
+    return &transmitBuffer[pos];
 }
 
-//a bit faster version that blasts through the copy more efficiently.
-void CommBuffer::sendBytesToBuffer(uint8_t *bytes, size_t length)
+void CommBuffer::commitBytes(size_t length)
 {
-    memcpy(&transmitBuffer[transmitBufferLength], bytes, length);
-    transmitBufferLength += length;
+    uint32_t wr = writeIndex.load(std::memory_order_relaxed) + length;
+    writeIndex.store(wr, std::memory_order_release);
+    size_t used = wr - readIndex.load(std::memory_order_acquire);
+    if (used > peakBytes) peakBytes = used;
 }
 
-void CommBuffer::sendByteToBuffer(uint8_t byt)
+bool CommBuffer::sendByteToBuffer(uint8_t byt)
 {
-    transmitBuffer[transmitBufferLength++] = byt;
+    return sendBytesToBuffer(&byt, 1);
 }
 
 void CommBuffer::sendString(String str)
@@ -43,98 +200,220 @@ void CommBuffer::sendString(String str)
 
 void CommBuffer::sendCharString(char *str)
 {
-    char *p = str;
-    int i = 0;
-    while (*p)
+    size_t len = strlen(str);
+    sendBytesToBuffer((uint8_t *)str, len);
+    Logger::debug("Queued %i bytes", len);
+}
+
+//Binary GVRET encoding of a frame. buff needs room for 17 + frame.length bytes. Returns the encoded length.
+//ts64 selects the PROTO_CAN_FRAME_TS64 variant with the full 64 bit receive time instead of the low 32 bits.
+size_t CommBuffer::encodeBinaryFrame(CAN_FRAME &frame, int whichBus, uint8_t *buff, bool ts64)
+{
+    size_t len = 0;
+    uint32_t id = frame.id;
+    if (frame.extended) id |= 1ul << 31;
+    uint64_t rxTime = Utility::frameTime64(frame.timestamp);
+    buff[len++] = 0xF1;
+    buff[len++] = ts64 ? PROTO_CAN_FRAME_TS64 : 0; //0 = canbus frame sending
+    for (int b = 0; b < (ts64 ? 8 : 4); b++) buff[len++] = (uint8_t)(rxTime >> (8 * b));
+    buff[len++] = (uint8_t)(id & 0xFF);
+    buff[len++] = (uint8_t)(id >> 8);
+    buff[len++] = (uint8_t)(id >> 16);
+    buff[len++] = (uint8_t)(id >> 24);
+    buff[len++] = frame.length + (uint8_t)(whichBus << 4);
+    for (int c = 0; c < frame.length; c++) {
+        buff[len++] = frame.data.uint8[c];
+    }
+    buff[len++] = 0; //checksum, never actually calculated
+    return len;
+}
+
+//Same for FD frames. buff needs room for 18 + frame.length bytes.
+size_t CommBuffer::encodeBinaryFrame(CAN_FRAME_FD &frame, int whichBus, uint8_t *buff, bool ts64)
+{
+    size_t len = 0;
+    uint32_t id = frame.id;
+    if (frame.extended) id |= 1ul << 31;
+    uint64_t rxTime = Utility::frameTime64(frame.timestamp);
+    buff[len++] = 0xF1;
+    buff[len++] = ts64 ? PROTO_FD_FRAME_TS64 : PROTO_BUILD_FD_FRAME;
+    for (int b = 0; b < (ts64 ? 8 : 4); b++) buff[len++] = (uint8_t)(rxTime >> (8 * b));
+    buff[len++] = (uint8_t)(id & 0xFF);
+    buff[len++] = (uint8_t)(id >> 8);
+    buff[len++] = (uint8_t)(id >> 16);
+    buff[len++] = (uint8_t)(id >> 24);
+    buff[len++] = frame.length;
+    buff[len++] = (uint8_t)(whichBus);
+    for (int c = 0; c < frame.length; c++) {
+        buff[len++] = frame.data.uint8[c];
+    }
+    buff[len++] = 0; //checksum, never actually calculated
+    return len;
+}
+
+void CommBuffer::setTimestamp64(bool enable)
+{
+    timestamp64 = enable;
+}
+
+bool CommBuffer::isTimestamp64()
+{
+    return timestamp64;
+}
+
+//Switching on always starts the receiver off with a reset batch. Switching off pushes out whatever is staged
+//first so it can't end up behind the legacy frames that follow.
+void CommBuffer::setCompact(bool enable)
+{
+    if (enable && !compact) compact = new CompactEncoder(); //only looked at by producers once compactMode is set
+    if (!compact) return;
+    if (multiProducer) portENTER_CRITICAL(&producerLock);
+    if (enable) compact->reset();
+    else closeBatchLocked();
+    compactMode = enable;
+    if (multiProducer) portEXIT_CRITICAL(&producerLock);
+}
+
+bool CommBuffer::isCompact()
+{
+    return compactMode;
+}
+
+void CommBuffer::setCompressed(bool enable)
+{
+    compressed = enable;
+}
+
+bool CommBuffer::isCompressed()
+{
+    return compressed;
+}
+
+//Back to what a host gets before it negotiates anything. A compact batch still being filled was meant for
+//whoever asked for that format so it is thrown away rather than sent to the next host.
+void CommBuffer::resetFormats()
+{
+    if (multiProducer) portENTER_CRITICAL(&producerLock);
+    if (compact)
     {
-        sendByteToBuffer(*p++);
-        i++;
+        if (compact->pendingBytes() > 0) compact->batchDone(false);
+        compact->reset();
     }
-    Logger::debug("Queued %i bytes", i);
+    compactMode = false;
+    timestamp64 = false;
+    compressed = false;
+    if (multiProducer) portEXIT_CRITICAL(&producerLock);
+}
+
+//Frame records waiting in the open compact batch that aren't in the ring yet
+size_t CommBuffer::numStagedBytes()
+{
+    return compact ? compact->pendingBytes() : 0;
+}
+
+//Move the open compact batch into the ring. The consumer calls this right before it flushes.
+void CommBuffer::closeBatch()
+{
+    if (!compact) return;
+    if (multiProducer) portENTER_CRITICAL(&producerLock);
+    closeBatchLocked();
+    if (multiProducer) portEXIT_CRITICAL(&producerLock);
+}
+
+void CommBuffer::closeBatchLocked()
+{
+    uint8_t *data;
+    size_t len = compact->finishBatch(&data);
+    if (len) compact->batchDone(writeBytes(data, len));
 }
 
 void CommBuffer::sendFrameToBuffer(CAN_FRAME &frame, int whichBus)
 {
-    uint8_t temp;
-    size_t writtenBytes;
-    if (settings.useBinarySerialComm) {
-        if (frame.extended) frame.id |= 1 << 31;
-        transmitBuffer[transmitBufferLength++] = 0xF1;
-        transmitBuffer[transmitBufferLength++] = 0; //0 = canbus frame sending
-        uint32_t now = micros();
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(now & 0xFF);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(now >> 8);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(now >> 16);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(now >> 24);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(frame.id & 0xFF);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(frame.id >> 8);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(frame.id >> 16);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(frame.id >> 24);
-        transmitBuffer[transmitBufferLength++] = frame.length + (uint8_t)(whichBus << 4);
-        for (int c = 0; c < frame.length; c++) {
-            transmitBuffer[transmitBufferLength++] = frame.data.uint8[c];
+    sendFrameToBuffer(frame, whichBus, settings.useBinarySerialComm);
+}
+
+//Same but with the output format given rather than taken from settings
+void CommBuffer::sendFrameToBuffer(CAN_FRAME &frame, int whichBus, bool binary)
+{
+    if (compactMode && binary)
+    {
+        if (multiProducer) portENTER_CRITICAL(&producerLock);
+        if (!compact->addFrame(frame, whichBus))
+        {
+            closeBatchLocked();
+            compact->addFrame(frame, whichBus);
         }
-        //temp = checksumCalc(buff, 11 + frame.length);
-        temp = 0;
-        transmitBuffer[transmitBufferLength++] = temp;
-        //Serial.write(buff, 12 + frame.length);
+        if (multiProducer) portEXIT_CRITICAL(&producerLock);
+        return;
+    }
+    uint8_t localBuff[80];
+    uint8_t *buff = reserveBytes(sizeof(localBuff)); //encode right into the ring when there's room
+    size_t len = 0;
+    if (!buff) buff = localBuff;
+    if (binary) {
+        len = encodeBinaryFrame(frame, whichBus, buff, timestamp64);
     } else {
-        writtenBytes = sprintf((char *)&transmitBuffer[transmitBufferLength], "%d - %x", micros(), frame.id);
-        transmitBufferLength += writtenBytes;
-        if (frame.extended) sprintf((char *)&transmitBuffer[transmitBufferLength], " X ");
-        else sprintf((char *)&transmitBuffer[transmitBufferLength], " S ");
-        transmitBufferLength += 3;
-        writtenBytes = sprintf((char *)&transmitBuffer[transmitBufferLength], "%i %i", whichBus, frame.length);
-        transmitBufferLength += writtenBytes;
+        //same output as "%d - %x", " X " or " S ", "%i %i", " %x" per byte then CRLF, just a lot cheaper than sprintf
+        char *out = (char *)buff;
+        len += TextFormat::intDec(out + len, (int32_t)Utility::frameTime64(frame.timestamp));
+        len += TextFormat::str(out + len, " - ");
+        len += TextFormat::hex(out + len, frame.id, 1, false);
+        len += TextFormat::str(out + len, frame.extended ? " X " : " S ");
+        len += TextFormat::intDec(out + len, whichBus);
+        out[len++] = ' ';
+        len += TextFormat::uintDec(out + len, frame.length);
         for (int c = 0; c < frame.length; c++) {
-            writtenBytes = sprintf((char *)&transmitBuffer[transmitBufferLength], " %x", frame.data.uint8[c]);
-            transmitBufferLength += writtenBytes;
+            out[len++] = ' ';
+            len += TextFormat::hexByte(out + len, frame.data.uint8[c], false);
         }
-        sprintf((char *)&transmitBuffer[transmitBufferLength], "\r\n");
-        transmitBufferLength += 2;
+        out[len++] = '\r';
+        out[len++] = '\n';
     }
+    if (buff == localBuff) sendBytesToBuffer(buff, len);
+    else commitBytes(len);
 }
 
 void CommBuffer::sendFrameToBuffer(CAN_FRAME_FD &frame, int whichBus)
 {
-    uint8_t temp;
-    size_t writtenBytes;
-    if (settings.useBinarySerialComm) {
-        if (frame.extended) frame.id |= 1 << 31;
-        transmitBuffer[transmitBufferLength++] = 0xF1;
-        transmitBuffer[transmitBufferLength++] = PROTO_BUILD_FD_FRAME;
-        uint32_t now = micros();
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(now & 0xFF);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(now >> 8);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(now >> 16);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(now >> 24);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(frame.id & 0xFF);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(frame.id >> 8);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(frame.id >> 16);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(frame.id >> 24);
-        transmitBuffer[transmitBufferLength++] = frame.length;
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(whichBus);
-        for (int c = 0; c < frame.length; c++) {
-            transmitBuffer[transmitBufferLength++] = frame.data.uint8[c];
+    sendFrameToBuffer(frame, whichBus, settings.useBinarySerialComm);
+}
+
+//Same but with the output format given rather than taken from settings
+void CommBuffer::sendFrameToBuffer(CAN_FRAME_FD &frame, int whichBus, bool binary)
+{
+    if (compactMode && binary)
+    {
+        if (multiProducer) portENTER_CRITICAL(&producerLock);
+        if (!compact->addFrame(frame, whichBus))
+        {
+            closeBatchLocked();
+            compact->addFrame(frame, whichBus);
         }
-        //temp = checksumCalc(buff, 11 + frame.length);
-        temp = 0;
-        transmitBuffer[transmitBufferLength++] = temp;
-        //Serial.write(buff, 12 + frame.length);
+        if (multiProducer) portEXIT_CRITICAL(&producerLock);
+        return;
+    }
+    uint8_t localBuff[240];
+    uint8_t *buff = reserveBytes(sizeof(localBuff)); //encode right into the ring when there's room
+    size_t len = 0;
+    if (!buff) buff = localBuff;
+    if (binary) {
+        len = encodeBinaryFrame(frame, whichBus, buff, timestamp64);
     } else {
-        writtenBytes = sprintf((char *)&transmitBuffer[transmitBufferLength], "%d - %x", micros(), frame.id);
-        transmitBufferLength += writtenBytes;
-        if (frame.extended) sprintf((char *)&transmitBuffer[transmitBufferLength], " X ");
-        else sprintf((char *)&transmitBuffer[transmitBufferLength], " S ");
-        transmitBufferLength += 3;
-        writtenBytes = sprintf((char *)&transmitBuffer[transmitBufferLength], "%i %i", whichBus, frame.length);
-        transmitBufferLength += writtenBytes;
+        char *out = (char *)buff;
+        len += TextFormat::intDec(out + len, (int32_t)Utility::frameTime64(frame.timestamp));
+        len += TextFormat::str(out + len, " - ");
+        len += TextFormat::hex(out + len, frame.id, 1, false);
+        len += TextFormat::str(out + len, frame.extended ? " X " : " S ");
+        len += TextFormat::intDec(out + len, whichBus);
+        out[len++] = ' ';
+        len += TextFormat::uintDec(out + len, frame.length);
         for (int c = 0; c < frame.length; c++) {
-            writtenBytes = sprintf((char *)&transmitBuffer[transmitBufferLength], " %x", frame.data.uint8[c]);
-            transmitBufferLength += writtenBytes;
+            out[len++] = ' ';
+            len += TextFormat::hexByte(out + len, frame.data.uint8[c], false);
         }
-        sprintf((char *)&transmitBuffer[transmitBufferLength], "\r\n");
-        transmitBufferLength += 2;
+        out[len++] = '\r';
+        out[len++] = '\n';
     }
+    if (buff == localBuff) sendBytesToBuffer(buff, len);
+    else commitBytes(len);
 }
-
@@ -1,23 +1,75 @@
 #pragma once
 #include <Arduino.h>
+#include <atomic>
 #include "config.h"
 #include "esp32_can.h"
+#include "compact_encoder.h"
 
+/*
+Ring buffer for outgoing traffic. With one producer (the default) it is lock free: the producer side (frame
+encoding) only ever moves writeIndex and the consumer side (USB / WiFi drain) only ever moves readIndex so the
+two can live in different tasks without a lock. Both indices are free running and get masked on access which is
+why WIFI_BUFF_SIZE has to be a power of two. Writes are all or nothing so a frame is never split by an overflow.
+If more than one task produces into the same buffer (threaded mode) then setMultiProducer makes the writers
+serialize on producerLock, so writes are no longer lock free on that side. The consumer side stays lock free
+either way.
+*/
 class CommBuffer
 {
 public:
     CommBuffer();
     size_t numAvailableBytes();
+    size_t numContiguousBytes();
+    size_t numFreeBytes();
     uint8_t* getBufferedBytes();
+    size_t peekBytes(size_t offset, uint8_t **bytes);
+    void consumeBytes(size_t length);
     void clearBufferedBytes();
+    size_t writeToStream(Print &stream);
+    bool isAboveHighWater();
+    uint32_t getOverflowCount();
+    uint32_t getDroppedBytes();
+    size_t getPeakBytes();
+    void resetStats();
+    void recordDrop(size_t length);
+    void setMultiProducer(bool enable);
     void sendFrameToBuffer(CAN_FRAME &frame, int whichBus);
     void sendFrameToBuffer(CAN_FRAME_FD &frame, int whichBus);
-    void sendBytesToBuffer(uint8_t *bytes, size_t length);
-    void sendByteToBuffer(uint8_t byt);
+    void sendFrameToBuffer(CAN_FRAME &frame, int whichBus, bool binary);
+    void sendFrameToBuffer(CAN_FRAME_FD &frame, int whichBus, bool binary);
+    static size_t encodeBinaryFrame(CAN_FRAME &frame, int whichBus, uint8_t *buff, bool ts64 = false);
+    static size_t encodeBinaryFrame(CAN_FRAME_FD &frame, int whichBus, uint8_t *buff, bool ts64 = false);
+    void setTimestamp64(bool enable);
+    bool isTimestamp64();
+    void setCompact(bool enable);
+    bool isCompact();
+    size_t numStagedBytes();
+    void closeBatch();
+    void setCompressed(bool enable);
+    bool isCompressed();
+    void resetFormats();
+    bool sendBytesToBuffer(const uint8_t *bytes, size_t length);
+    uint8_t *reserveBytes(size_t length);
+    void commitBytes(size_t length);
+    bool sendByteToBuffer(uint8_t byt);
     void sendString(String str);
     void sendCharString(char *str);
 
 protected:
     byte transmitBuffer[WIFI_BUFF_SIZE];
-    int transmitBufferLength; //not creating a ring buffer. The buffer should be large enough to never overflow
-};
\ No newline at end of file
+    std::atomic<uint32_t> writeIndex;
+    std::atomic<uint32_t> readIndex;
+    bool multiProducer; //more than one task writes to this buffer so writers have to take producerLock
+    portMUX_TYPE producerLock = portMUX_INITIALIZER_UNLOCKED;
+    bool timestamp64; //binary frames carry the full 64 bit receive time (negotiated by the host)
+    bool compactMode; //binary frames go out as compact batches (negotiated by the host)
+    CompactEncoder *compact; //allocated the first time compact mode is turned on and kept from then on
+    bool compressed; //the link compresses what it sends (negotiated by the host, only WiFi supports it)
+    bool throttled; //producer side hysteresis between the high and low watermarks
+    uint32_t overflowCount; //# of writes thrown away because they would not fit
+    uint32_t droppedBytes;
+    size_t peakBytes; //highest fill level seen since the stats were last reset
+
+    bool writeBytes(const uint8_t *bytes, size_t length);
+    void closeBatchLocked();
+};
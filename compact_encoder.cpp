@@ -0,0 +1,125 @@
+#include "compact_encoder.h"
+#include "gvret_comm.h"
+#include "utility.h"
+
+CompactEncoder::CompactEncoder()
+{
+    batchLength = 0;
+    sequence = 0;
+    batchFlags = 0;
+    batchesSinceReset = 0;
+    reset();
+}
+
+//The next batch starts from scratch and tells the receiver to do the same
+void CompactEncoder::reset()
+{
+    needReset = true;
+}
+
+size_t CompactEncoder::pendingBytes()
+{
+    return batchLength;
+}
+
+bool CompactEncoder::addFrame(CAN_FRAME &frame, int whichBus)
+{
+    return addRecord(frame.id, frame.extended, false, whichBus, frame.length, frame.data.uint8, frame.length, frame.timestamp);
+}
+
+bool CompactEncoder::addFrame(CAN_FRAME_FD &frame, int whichBus)
+{
+    uint8_t dlc = Utility::fdLengthToDLC(frame.length);
+    return addRecord(frame.id, frame.extended, true, whichBus, dlc, frame.data.uint8, frame.length, frame.timestamp);
+}
+
+//Append one frame record to the open batch. Returns false if it won't fit, in which case nothing was changed.
+bool CompactEncoder::addRecord(uint32_t id, bool extended, bool fd, int whichBus, uint8_t dlc, const uint8_t *data, int dataLength, uint32_t stamp)
+{
+    uint8_t record[96];
+    size_t len = 0;
+    int wireLength = fd ? Utility::fdDLCToLength(dlc) : dataLength;
+
+    if (batchLength == 0) //opening a new batch
+    {
+        if (needReset || batchesSinceReset >= COMPACT_RESET_BATCHES)
+        {
+            memset(dictionary, 0, sizeof(dictionary));
+            lastTime = 0;
+            batchFlags = COMPACT_BATCH_FLAG_RESET;
+            batchesSinceReset = 0;
+            needReset = false;
+        }
+        else batchFlags = 0;
+        batchLength = COMPACT_HEADER_SIZE;
+    }
+
+    uint8_t info = 0x80 | (extended ? 0x40 : 0) | (fd ? 0x20 : 0) | (whichBus & 7);
+    uint8_t slot = (id ^ (id >> 7) ^ (id >> 14) ^ ((whichBus & 7) << 4)) & 0x7F;
+    bool hit = (dictionary[slot].info == info) && (dictionary[slot].id == id);
+
+    if (hit) record[len++] = 0x80 | slot;
+    else record[len++] = info & 0x67;
+
+    uint64_t rxTime = Utility::frameTime64(stamp);
+    int64_t delta = (int64_t)(rxTime - lastTime);
+    uint64_t zigzag = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+    do
+    {
+        uint8_t byt = zigzag & 0x7F;
+        zigzag >>= 7;
+        if (zigzag) byt |= 0x80;
+        record[len++] = byt;
+    } while (zigzag);
+
+    if (!hit)
+    {
+        record[len++] = (uint8_t)id;
+        record[len++] = (uint8_t)(id >> 8);
+        if (extended)
+        {
+            record[len++] = (uint8_t)(id >> 16);
+            record[len++] = (uint8_t)(id >> 24);
+        }
+    }
+    record[len++] = dlc & 0xF;
+    for (int c = 0; c < wireLength; c++) record[len++] = (c < dataLength) ? data[c] : 0;
+
+    //the largest record is well under COMPACT_BATCH_SIZE so this never fails on a fresh batch
+    if (batchLength + len > COMPACT_BATCH_SIZE) return false;
+
+    memcpy(&batch[batchLength], record, len);
+    batchLength += len;
+    lastTime = rxTime;
+    if (!hit)
+    {
+        dictionary[slot].id = id;
+        dictionary[slot].info = info;
+    }
+    return true;
+}
+
+//Fill in the header of the open batch. Returns its full length or 0 if there's nothing to send
+size_t CompactEncoder::finishBatch(uint8_t **data)
+{
+    if (batchLength <= COMPACT_HEADER_SIZE) return 0;
+    size_t recordBytes = batchLength - COMPACT_HEADER_SIZE;
+    batch[0] = 0xF1;
+    batch[1] = PROTO_COMPACT_BATCH;
+    batch[2] = sequence;
+    batch[3] = batchFlags;
+    batch[4] = (uint8_t)(recordBytes & 0xFF);
+    batch[5] = (uint8_t)(recordBytes >> 8);
+    *data = batch;
+    return batchLength;
+}
+
+//Called once the finished batch has been queued, or thrown away if accepted is false. A dropped batch leaves
+//the receiver's dictionary out of step with ours so the next batch has to be a reset one.
+void CompactEncoder::batchDone(bool accepted)
+{
+    if (!accepted) needReset = true;
+    else batchesSinceReset++;
+    sequence++;
+    batchLength = 0;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+#include "esp32_can.h"
+
+#define COMPACT_HEADER_SIZE     6
+#define COMPACT_DICT_SIZE       128
+#define COMPACT_BATCH_FLAG_RESET    1
+
+/*
+Compact GVRET frame stream. Only used once a host asks for it with PROTO_SET_COMPACT. Frames are packed into batches:
+
+F1 PROTO_COMPACT_BATCH seq flags lenLo lenHi <len bytes of frame records>
+
+seq goes up by one per batch. If flags has COMPACT_BATCH_FLAG_RESET set the receiver must clear its ID dictionary
+and previous timestamp before decoding the batch. That happens for the first batch, every COMPACT_RESET_BATCHES
+batches, and after a batch had to be dropped. So a receiver that sees a gap in seq throws batches away until the
+next reset one.
+
+Each record starts with a byte that says which kind it is:
+1xxxxxxx - ID dictionary hit, the low 7 bits are the slot. Then the timestamp delta, DLC byte and data.
+0EFxxBBB - new ID. E = extended, F = FD frame, BBB = bus. Then the timestamp delta, the ID (2 bytes LSB first
+           for standard, 4 for extended), DLC byte and data. Both sides then store ID, bus and flags in slot
+           (id ^ (id >> 7) ^ (id >> 14) ^ (bus << 4)) & 0x7F.
+The timestamp delta is the 64 bit microsecond RX time minus that of the previous record as a zigzag varint
+(7 bits per byte, low bits first, high bit set on all but the last byte). After a reset the previous time is 0.
+The DLC byte holds the DLC in the low nibble. Classic frames have DLC bytes of data, FD frames the FD length for that DLC.
+*/
+class CompactEncoder
+{
+public:
+    CompactEncoder();
+    bool addFrame(CAN_FRAME &frame, int whichBus);
+    bool addFrame(CAN_FRAME_FD &frame, int whichBus);
+    size_t finishBatch(uint8_t **data);
+    void batchDone(bool accepted);
+    size_t pendingBytes();
+    void reset();
+
+private:
+    struct DICT_ENTRY
+    {
+        uint32_t id;
+        uint8_t info; //bus in the low 3 bits, 0x20 FD, 0x40 extended, 0x80 slot in use
+    };
+
+    uint8_t batch[COMPACT_BATCH_SIZE];
+    size_t batchLength;
+    uint8_t sequence;
+    uint8_t batchFlags;
+    uint8_t batchesSinceReset;
+    bool needReset;
+    uint64_t lastTime;
+    DICT_ENTRY dictionary[COMPACT_DICT_SIZE];
+
+    bool addRecord(uint32_t id, bool extended, bool fd, int whichBus, uint8_t dlc, const uint8_t *data, int dataLength, uint32_t stamp);
+};
@@ -39,16 +39,74 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 //size to use for buffering writes to USB. On the ESP32 we're actually talking TTL serial to a TTL<->USB chip
 #define SER_BUFF_SIZE       1024
 
+//Size of the serial driver's receive buffer. Big enough to ride out a few passes of the main loop with a host
+//sending thousands of frames a second
+#define SER_RX_BUFF_SIZE    1024
+
+//Most bytes of GVRET input read from the serial port or a telnet client in one pass. They're read in one call
+//and handed to the parser together.
+#define GVRET_INPUT_CHUNK   256
+
 //Buffer for CAN frames when sending over wifi. This allows us to build up a multi-frame packet that goes
 //over the air all at once. This is much more efficient than trying to send a new TCP/IP packet for each and every
 //frame. It delays frames from getting to the other side a bit but that's life.
 //Probably don't set this over 2048 as the default packet size for wifi is 2312 including all overhead.
+//This is also the size of the ring buffers in CommBuffer so it must be a power of two.
 #define WIFI_BUFF_SIZE      2048
 
+//Fill levels for the outgoing ring buffers. Frame producers back off and a flush is forced once the high
+//watermark is reached. Producers only resume after the buffer has been drained below the low watermark.
+#define COMM_BUFF_HIGH_WATER    (WIFI_BUFF_SIZE - 80)
+#define COMM_BUFF_LOW_WATER     (WIFI_BUFF_SIZE / 2)
+
 //Number of microseconds between hard flushes of the serial buffer (if not in wifi mode) or the wifi buffer (if in wifi mode)
 //This keeps the latency more consistent. Otherwise the buffer could partially fill and never send.
 #define SER_BUFF_FLUSH_INTERVAL 20000
 
+//Limits for the other flush modes (see FLUSHMODE in flush_policy.h). Data never waits less than
+//FLUSH_MIN_INTERVAL microseconds between flushes in latency mode nor longer than FLUSH_MAX_INTERVAL
+//in the batching modes. Below FLUSH_IDLE_RATE bytes per second adaptive mode sends everything right away.
+#define FLUSH_MIN_INTERVAL      1000
+#define FLUSH_MAX_INTERVAL      20000
+#define FLUSH_IDLE_RATE         2000
+
+//A full batch for WiFi is one TCP segment worth of data
+#define WIFI_FLUSH_BATCH        1460
+
+//Largest compact batch (see compact_encoder.h) including its header. A batch is closed early when it fills up.
+//Every COMPACT_RESET_BATCHES batches the ID dictionary starts over so a receiver that lost data can pick back up.
+#define COMPACT_BATCH_SIZE      512
+#define COMPACT_RESET_BATCHES   32
+
+//Most frames pulled from one bus per round in CANManager::loop. They're read into a local batch and then
+//encoded together. Keeps one busy bus from hogging the loop.
+#define CAN_BATCH_SIZE          32
+
+//Frames of scheduling credit a bus gets per round for each unit of its weight when other buses have frames
+//waiting too. Weight 4 is a full batch. A bus with nothing competing always gets a full batch.
+#define CAN_DRR_QUANTUM         (CAN_BATCH_SIZE / 4)
+
+//Most rounds per call to CANManager::loop. Rounds stop early once the drivers are empty. The threaded RX task
+//calls loop() again right away while frames are left and only sleeps a tick once they're all read.
+#define CAN_DRR_MAX_ROUNDS      4
+
+//Milliseconds a partly received GVRET command may sit waiting for the rest of its bytes before it's thrown away
+#define GVRET_MSG_TIMEOUT       100
+
+//Milliseconds per bus load measurement window
+#define BUSLOAD_INTERVAL        250
+
+//Set to 1 if the CAN drivers in use fill in frame.timestamp from micros() when the frame arrives. Otherwise
+//frames are stamped by CANManager as soon as they are pulled out of the driver.
+#define USE_DRIVER_TIMESTAMPS   0
+
+//UDP streaming mode. Receivers subscribe by sending anything to this port and must repeat that at least
+//every UDP_SUBSCRIBE_TIMEOUT milliseconds. Datagrams are kept to UDP_STREAM_MTU bytes which is the most
+//that fits in one 1500 byte ethernet/wifi MTU after the IP and UDP headers so nothing gets fragmented.
+#define UDP_STREAM_PORT         17223
+#define UDP_STREAM_MTU          1472
+#define UDP_SUBSCRIBE_TIMEOUT   10000
+
 #define CFG_BUILD_NUM   618
 #define CFG_VERSION "Alpha Nov 29 2020"
 #define PREF_NAME   "ESP32RET"
@@ -78,8 +136,52 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define SW_MODE0  26
 #define SW_MODE1  27
 
+//Threaded mode runs CAN reception and GVRET encoding in a task pinned to one core while WiFi, OTA and the
+//console run in another task on the core the WiFi stack lives on. The two share the CommBuffer rings and anything
+//that reconfigures a bus from the comm side does it between canManager.pauseRx() and resumeRx().
+#define CAN_TASK_CORE       1
+#define CAN_TASK_PRIORITY   5
+#define CAN_TASK_STACK      8192 //the ELM327 and LAWICEL replies built on this task go through String and printf. STATS shows what's left
+#define COMM_TASK_CORE      0
+#define COMM_TASK_PRIORITY  2
+#define COMM_TASK_STACK     8192
+
+//Longest console or LAWICEL line accepted, including its terminating null. A LAWICEL 64 byte FD frame with an
+//extended ID is 138 characters. Longer lines are thrown away whole instead of being cut short
+#define CONSOLE_LINE_SIZE   160
+
 //How many devices to allow to connect to our WiFi telnet port?
-#define MAX_CLIENTS 1
+#define MAX_CLIENTS 4
+
+//Acceptance filters per bus (CANnFILTERm in the console) and how many ID/mask pairs each controller can hold.
+//See FilterManager
+#define FILTERS_PER_BUS         8
+#define TWAI_FILTER_SLOTS       1
+#define MCP2517FD_FILTER_SLOTS  32
+
+//Software ID filter lists (see IDFilter). Most IDs listed across all buses and the log2 of the hash table size
+//holding them. Keep the table well under full so lookups stay one or two probes: 384 in 1024 slots is 3/8 full at
+//most. Unlisted IDs are lookups that miss and those get slow fast past half full (BENCH IDFILTER shows the probes)
+#define ID_FILTER_MAX_IDS       384
+#define ID_FILTER_BITS          10
+
+//Change only forwarding cache (see ChangeFilter). Most bus/ID pairs remembered and the log2 of the table size
+#define CHANGE_CACHE_MAX_IDS    768
+#define CHANGE_CACHE_BITS       10
+
+//Per ID receive statistics (see IDStats). Most bus/ID pairs tracked and the log2 of the table size. Entries are
+//56 bytes so the table stays at 512 slots and holds half that: any fuller and frames of the IDs left untracked
+//once it fills, which miss on every lookup, take several probes each
+#define ID_STATS_MAX_IDS        256
+#define ID_STATS_BITS           9
+
+//Traffic generator (see TrafficGenerator). IDs sent start at TRAFFIC_BASE_ID. At most TRAFFIC_BURST frames are
+//queued per pass and the report waits TRAFFIC_SETTLE_MS after the last one for stragglers
+#define TRAFFIC_BASE_ID         0x600
+#define TRAFFIC_MAX_IDS         256
+#define TRAFFIC_MAX_RATE        20000
+#define TRAFFIC_BURST           16
+#define TRAFFIC_SETTLE_MS       200
 
 struct FILTER {  //should be 10 bytes
     uint32_t id;
@@ -94,6 +196,8 @@ struct CANFDSettings {
     boolean enabled;
     boolean listenOnly;
     boolean fdMode;
+    uint8_t weight; //share of receive processing this bus gets when several buses have frames waiting (1 - 4)
+    FILTER filters[FILTERS_PER_BUS];
 };
 
 struct EEPROMSettings {
@@ -109,6 +213,13 @@ struct EEPROMSettings {
 
     boolean enableLawicel;
 
+    boolean threadedMode; //run CAN reception in its own task pinned away from WiFi? Takes effect on reboot
+    boolean udpStream; //stream received frames as UDP datagrams to a subscriber?
+    boolean exactBusLoad; //count the real stuff bits of each frame for bus load instead of the worst case
+    uint8_t flushMode; //when buffered output gets sent. One of FLUSHMODE
+    boolean changeOnly; //only forward frames whose data changed since the last one sent for that ID?
+    uint16_t changeHeartbeat; //ms after which an unchanged frame goes out anyway when changeOnly is on. 0 = never
+
     //if we're using WiFi then output to serial is disabled (it's far too slow to keep up)  
     uint8_t wifiMode; //0 = don't use wifi, 1 = connect to an AP, 2 = Create an AP
     char SSID[32];     //null terminated string for the SSID
@@ -135,6 +246,7 @@ struct SystemSettings {
     WiFiClient wifiOBDClients[MAX_CLIENTS];
     boolean isWifiConnected;
     boolean isWifiActive;
+    boolean isCANTaskActive; //true once the dedicated CAN RX task has been started
 };
 
 class GVRET_Comm_Handler;
@@ -142,6 +254,13 @@ class SerialConsole;
 class CANManager;
 class LAWICELHandler;
 class ELM327Emu;
+class WiFiManager;
+class UDPStreamer;
+class FlushPolicy;
+class FilterManager;
+class IDFilter;
+class ChangeFilter;
+class TrafficGenerator;
 
 extern EEPROMSettings settings;
 extern SystemSettings SysSettings;
@@ -152,6 +271,15 @@ extern SerialConsole console;
 extern CANManager canManager;
 extern LAWICELHandler lawicel;
 extern ELM327Emu elmEmulator;
+extern WiFiManager wifiManager;
+extern UDPStreamer udpStreamer;
+extern FlushPolicy serialFlush;
+extern FlushPolicy wifiFlush;
+extern FlushPolicy udpFlush;
+extern FilterManager filterManager;
+extern IDFilter idFilter;
+extern ChangeFilter changeFilter;
+extern TrafficGenerator trafficGen;
 extern char deviceName[20];
 extern char otaHost[40];
 extern char otaFilename[100];
@@ -0,0 +1,215 @@
+#include "filter_manager.h"
+#include "Logger.h"
+#include "can_manager.h"
+
+FilterManager::FilterManager()
+{
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        numHwFilters[i] = 0;
+        slotsUsed[i] = 2; //watchFor() sets up the first two
+        softCheck[i] = false;
+        softRejected[i] = 0;
+    }
+}
+
+//true if a lets through every ID that b does
+static bool covers(const HW_FILTER &a, const HW_FILTER &b)
+{
+    return ((a.mask & ~b.mask) == 0) && ((b.id & a.mask) == a.id);
+}
+
+int FilterManager::hardwareSlots(int bus)
+{
+    int slots = (canBuses[bus] == &CAN0) ? TWAI_FILTER_SLOTS : MCP2517FD_FILTER_SLOTS;
+    return (slots > FILTERS_PER_BUS) ? FILTERS_PER_BUS : slots;
+}
+
+/*
+Boil the enabled standard or extended filters of a table down to at most slots hardware filters in out.
+Returns how many there are. exact is cleared if any had to be merged.
+*/
+int FilterManager::compile(const FILTER *table, bool extended, int slots, HW_FILTER *out, bool &exact)
+{
+    uint32_t idMask = extended ? 0x1FFFFFFF : 0x7FF;
+    int idBits = extended ? 29 : 11;
+    int count = 0;
+
+    if (slots <= 0) return 0;
+    for (int i = 0; i < FILTERS_PER_BUS; i++)
+    {
+        if (!table[i].enabled || (table[i].extended ? true : false) != extended) continue;
+        HW_FILTER filt;
+        filt.mask = table[i].mask & idMask;
+        filt.id = table[i].id & filt.mask;
+        filt.extended = extended;
+
+        bool redundant = false;
+        for (int j = 0; j < count; j++) if (covers(out[j], filt)) redundant = true;
+        if (redundant) continue;
+        int kept = 0;
+        for (int j = 0; j < count; j++) if (!covers(filt, out[j])) out[kept++] = out[j];
+        count = kept;
+        out[count++] = filt;
+    }
+
+    while (count > slots)
+    {
+        //merge the pair whose combination lets the fewest IDs through. Bits that differ between them become don't cares
+        int bestA = 0, bestB = 1, bestBits = idBits + 1;
+        uint32_t bestMask = 0;
+        for (int a = 0; a < count; a++)
+        {
+            for (int b = a + 1; b < count; b++)
+            {
+                uint32_t mask = out[a].mask & out[b].mask & ~(out[a].id ^ out[b].id);
+                int freeBits = idBits - __builtin_popcount(mask);
+                if (freeBits < bestBits)
+                {
+                    bestBits = freeBits;
+                    bestA = a;
+                    bestB = b;
+                    bestMask = mask;
+                }
+            }
+        }
+        out[bestA].mask = bestMask;
+        out[bestA].id &= bestMask;
+        out[bestB] = out[--count];
+        int kept = 0;
+        for (int j = 0; j < count; j++) if (j == bestA || !covers(out[bestA], out[j])) out[kept++] = out[j];
+        count = kept;
+        exact = false;
+    }
+    return count;
+}
+
+/*
+Program a bus with its filter table. Call this anywhere the bus gets (re)started, it takes the place of the
+catch all watchFor().
+*/
+void FilterManager::apply(int bus)
+{
+    if (!canBuses[bus]) return;
+    FILTER table[FILTERS_PER_BUS];
+    bool haveStd = false, haveExt = false;
+
+    //check everything in software until the controller holds the new filters
+    portENTER_CRITICAL(&lock);
+    memcpy(table, settings.canSettings[bus].filters, sizeof(table));
+    softCheck[bus] = true;
+    portEXIT_CRITICAL(&lock);
+
+    for (int i = 0; i < FILTERS_PER_BUS; i++)
+    {
+        if (!table[i].enabled) continue;
+        if (table[i].extended) haveExt = true;
+        else haveStd = true;
+    }
+
+    int slots = hardwareSlots(bus);
+    numHwFilters[bus] = 0;
+    canManager.pauseRx(); //the RX task talks to the same controller
+    if (!haveStd && !haveExt)
+    {
+        canBuses[bus]->watchFor(); //the catch all in the first slot makes whatever is in the others irrelevant
+        canManager.resumeRx();
+        setSoftCheck(bus, false);
+        return;
+    }
+    if (haveStd && haveExt && slots < 2) //no way to keep both kinds in hardware so it's all done here
+    {
+        canBuses[bus]->watchFor();
+        canManager.resumeRx();
+        return;
+    }
+
+    bool exact = true;
+    HW_FILTER *hw = hwFilters[bus];
+    int count = compile(table, false, haveExt ? slots - 1 : slots, hw, exact);
+    count += compile(table, true, slots - count, hw + count, exact);
+    for (int i = 0; i < count; i++) canBuses[bus]->setRXFilter(i, hw[i].id, hw[i].mask, hw[i].extended);
+    //Slots written before (including the catch alls watchFor() leaves in the first two) still let their old IDs
+    //through. Any not used above get the last filter again
+    for (int i = count; i < slotsUsed[bus]; i++) canBuses[bus]->setRXFilter(i, hw[count - 1].id, hw[count - 1].mask, hw[count - 1].extended);
+    canManager.resumeRx();
+    if (count > slotsUsed[bus]) slotsUsed[bus] = count;
+    numHwFilters[bus] = count;
+    setSoftCheck(bus, !exact);
+}
+
+void FilterManager::setSoftCheck(int bus, bool check)
+{
+    portENTER_CRITICAL(&lock);
+    softCheck[bus] = check;
+    portEXIT_CRITICAL(&lock);
+}
+
+bool FilterManager::setFilter(int bus, int slot, uint32_t id, uint32_t mask, bool extended, bool enabled)
+{
+    if (bus < 0 || bus >= NUM_BUSES) return false;
+    if (slot < 0 || slot >= FILTERS_PER_BUS) return false;
+    FILTER &filt = settings.canSettings[bus].filters[slot];
+    portENTER_CRITICAL(&lock);
+    filt.id = id;
+    filt.mask = mask;
+    filt.extended = extended;
+    filt.enabled = enabled;
+    portEXIT_CRITICAL(&lock);
+    if (settings.canSettings[bus].enabled) apply(bus);
+    return true;
+}
+
+//Put a filter in the first free slot unless the same one is already there. False if the table is full.
+bool FilterManager::addFilter(int bus, uint32_t id, uint32_t mask, bool extended)
+{
+    if (bus < 0 || bus >= NUM_BUSES) return false;
+    int freeSlot = -1;
+    for (int i = 0; i < FILTERS_PER_BUS; i++)
+    {
+        FILTER &filt = settings.canSettings[bus].filters[i];
+        if (!filt.enabled)
+        {
+            if (freeSlot < 0) freeSlot = i;
+        }
+        else if (filt.id == id && filt.mask == mask && (filt.extended ? true : false) == extended) return true;
+    }
+    if (freeSlot < 0) return false;
+    return setFilter(bus, freeSlot, id, mask, extended, true);
+}
+
+//Called for every received frame so it gets out quick when the hardware already did all the work
+bool FilterManager::accepts(int bus, uint32_t id, bool extended)
+{
+    if (!softCheck[bus]) return true;
+    const FILTER *table = settings.canSettings[bus].filters;
+    bool accept = false;
+    portENTER_CRITICAL(&lock);
+    if (softCheck[bus])
+    {
+        for (int i = 0; i < FILTERS_PER_BUS && !accept; i++)
+        {
+            if (!table[i].enabled || (table[i].extended ? true : false) != extended) continue;
+            if ((id & table[i].mask) == (table[i].id & table[i].mask)) accept = true;
+        }
+        if (!accept) softRejected[bus]++;
+    }
+    else accept = true;
+    portEXIT_CRITICAL(&lock);
+    return accept;
+}
+
+void FilterManager::printStats()
+{
+    for (int i = 0; i < SysSettings.numBuses; i++)
+    {
+        if (!settings.canSettings[i].enabled) continue;
+        if (!numHwFilters[i] && !softCheck[i]) continue;
+        Logger::console("CAN%i filters: %i in hardware, %s, %u rejected in software", i, numHwFilters[i],
+                        softCheck[i] ? "checked in software too" : "exact", softRejected[i]);
+        for (int f = 0; f < numHwFilters[i]; f++)
+        {
+            Logger::console("      ID 0x%x mask 0x%x %s", hwFilters[i][f].id, hwFilters[i][f].mask, hwFilters[i][f].extended ? "ext" : "std");
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+
+//One ID/mask pair as programmed into a CAN controller. A frame passes if (id & mask) == filter id.
+struct HW_FILTER
+{
+    uint32_t id;
+    uint32_t mask;
+    bool extended;
+};
+
+/*
+Acceptance filtering for the receive side. Each bus has a table of FILTERS_PER_BUS filters in its settings
+that gets compiled down to what its controller can hold: TWAI_FILTER_SLOTS for the built in TWAI and
+MCP2517FD_FILTER_SLOTS for the MCP2517FD. Filters that cover one another collapse into one and if there are
+still too many the two that cost the least to combine get merged, over and over, until they fit. Merged
+filters let through more than was asked for so in that case frames get checked against the table in software
+as well. The same goes for a controller that can't hold both a standard and an extended filter.
+No enabled filters means everything is received.
+Filters are changed from the console and protocol handlers while accepts() runs on the CAN receive side so the
+table and softCheck are only touched under lock.
+*/
+class FilterManager
+{
+public:
+    FilterManager();
+    void apply(int bus);
+    bool setFilter(int bus, int slot, uint32_t id, uint32_t mask, bool extended, bool enabled);
+    bool addFilter(int bus, uint32_t id, uint32_t mask, bool extended);
+    bool accepts(int bus, uint32_t id, bool extended);
+    void printStats();
+
+private:
+    HW_FILTER hwFilters[NUM_BUSES][FILTERS_PER_BUS];
+    uint8_t numHwFilters[NUM_BUSES]; //0 means the controller accepts everything
+    uint8_t slotsUsed[NUM_BUSES]; //highest number of controller slots ever written so stale ones can be overwritten
+    bool softCheck[NUM_BUSES]; //the controller lets through more than the table asks for
+    uint32_t softRejected[NUM_BUSES];
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+    int hardwareSlots(int bus);
+    void setSoftCheck(int bus, bool check);
+    int compile(const FILTER *table, bool extended, int slots, HW_FILTER *out, bool &exact);
+};
@@ -0,0 +1,85 @@
+#include "flush_policy.h"
+#include "config.h"
+#include "Logger.h"
+
+FlushPolicy::FlushPolicy(size_t batchSize)
+{
+    this->batchSize = batchSize;
+    lastFlush = 0;
+    pendingSince = 0;
+    inRate = 0;
+    drainRate = 0;
+    interval = 0;
+    flushCount = 0;
+    flushBytes = 0;
+}
+
+bool FlushPolicy::shouldFlush(size_t buffered)
+{
+    uint32_t now = micros();
+
+    if (buffered == 0)
+    {
+        pendingSince = 0;
+        return false;
+    }
+    if (!pendingSince) pendingSince = now | 1; //never 0, that means nothing is waiting
+    //whatever the mode, once producers are being held back it's time to go
+    if (buffered >= COMM_BUFF_HIGH_WATER) return true;
+
+    uint32_t age = now - pendingSince;
+    switch (settings.flushMode)
+    {
+    case FLUSH_LATENCY:
+        return (now - lastFlush) >= FLUSH_MIN_INTERVAL;
+    case FLUSH_THROUGHPUT:
+        return (buffered >= batchSize) || (age >= FLUSH_MAX_INTERVAL);
+    case FLUSH_ADAPTIVE:
+        return (buffered >= batchSize) || (age >= interval);
+    default:
+        return (now - lastFlush) > SER_BUFF_FLUSH_INTERVAL;
+    }
+}
+
+//bytes is how much went out and duration how long in microseconds the link took to accept it
+void FlushPolicy::flushed(size_t bytes, uint32_t duration)
+{
+    uint32_t now = micros();
+    uint32_t elapsed = now - lastFlush;
+
+    if (elapsed > 0) inRate = ((inRate * 3ull) + ((uint64_t)bytes * 1000000ull / elapsed)) / 4;
+    //writes that are tiny or return instantly say nothing about how fast the link is
+    if (bytes >= 64 && duration > 0) drainRate = ((drainRate * 3ull) + ((uint64_t)bytes * 1000000ull / duration)) / 4;
+
+    lastFlush = now;
+    pendingSince = 0;
+    flushCount++;
+    flushBytes += bytes;
+    interval = adaptiveInterval();
+}
+
+/*
+Light traffic gets sent right away since there's nothing worth waiting to batch it with. Otherwise data waits
+about as long as it takes to fill a batch at the current rate, kept between the min and max intervals. If the
+link is draining barely faster than data arrives, batches are made as big as possible to cut per-packet overhead.
+*/
+uint32_t FlushPolicy::adaptiveInterval()
+{
+    if (inRate < FLUSH_IDLE_RATE) return 0;
+    if (drainRate && drainRate < inRate + (inRate / 2)) return FLUSH_MAX_INTERVAL;
+    uint32_t fillTime = (uint32_t)(((uint64_t)batchSize * 1000000ull) / inRate);
+    if (fillTime < FLUSH_MIN_INTERVAL) return FLUSH_MIN_INTERVAL;
+    if (fillTime > FLUSH_MAX_INTERVAL) return FLUSH_MAX_INTERVAL;
+    return fillTime;
+}
+
+uint32_t FlushPolicy::getBytesFlushed()
+{
+    return flushBytes;
+}
+
+void FlushPolicy::printStats(const char *name)
+{
+    Logger::console("%s flush: %i flushes, avg %i bytes, in %i bytes/sec, drain %i bytes/sec, interval %i us", name, flushCount,
+                    flushCount ? (flushBytes / flushCount) : 0, inRate, drainRate, interval);
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <Arduino.h>
+
+enum FLUSHMODE
+{
+    FLUSH_FIXED = 0,        //the original policy: every SER_BUFF_FLUSH_INTERVAL or when near full
+    FLUSH_LATENCY = 1,      //send as soon as there's anything, at most once per FLUSH_MIN_INTERVAL
+    FLUSH_THROUGHPUT = 2,   //wait for a full batch unless data has been waiting FLUSH_MAX_INTERVAL
+    FLUSH_ADAPTIVE = 3      //latency when traffic is light, batches sized from the traffic rate when it isn't
+};
+
+/*
+Decides when an outgoing buffer should be written to its link. One of these per link. The caller asks
+shouldFlush() every pass with how much is buffered and reports each flush back through flushed() which
+is how the incoming traffic rate and the rate the link drains at are learned.
+*/
+class FlushPolicy
+{
+public:
+    FlushPolicy(size_t batchSize);
+    bool shouldFlush(size_t buffered);
+    void flushed(size_t bytes, uint32_t duration);
+    void printStats(const char *name);
+    uint32_t getBytesFlushed();
+
+private:
+    size_t batchSize; //what counts as a full batch for this link. About one packet worth
+    uint32_t lastFlush;
+    uint32_t pendingSince; //micros() when data showed up in an empty buffer
+    uint32_t inRate; //bytes per second coming in, smoothed
+    uint32_t drainRate; //bytes per second the link has been taking them, smoothed
+    uint32_t interval; //how long data may wait before it's sent in adaptive mode
+    uint32_t flushCount;
+    uint32_t flushBytes;
+
+    uint32_t adaptiveInterval();
+};
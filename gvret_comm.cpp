@@ -6,484 +6,464 @@ Implements handling of the GVRET comm protocol, both sending and receiving
 #include "SerialConsole.h"
 #include "config.h"
 #include "can_manager.h"
+#include "filter_manager.h"
+#include "id_filter.h"
+#include "wifi_manager.h"
+#include <esp_timer.h>
 
 GVRET_Comm_Handler::GVRET_Comm_Handler()
 {
-    step = 0;
-    state = IDLE;
+    input = &serialInput;
+    input->msgLength = 0;
+    input->msgStart = 0;
+    framingErrors = 0;
+    checksumErrors = 0;
+}
+
+uint32_t GVRET_Comm_Handler::getFramingErrors()
+{
+    return framingErrors;
+}
+
+uint32_t GVRET_Comm_Handler::getChecksumErrors()
+{
+    return checksumErrors;
 }
 
 void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
 {
-    uint32_t busSpeed = 0;
-    uint32_t now = micros();
+    processIncomingBytes(&in_byte, 1);
+}
 
-    uint8_t temp8;
-    uint16_t temp16;
+//Input from one of several sources that each need their own message in progress, like the telnet clients
+void GVRET_Comm_Handler::processIncomingBytes(const uint8_t *bytes, size_t length, GVRET_INPUT &from)
+{
+    GVRET_INPUT *previous = input;
+    input = &from;
+    processIncomingBytes(bytes, length);
+    input = previous;
+}
 
-    switch (state) {
-    case IDLE:
-        if(in_byte == 0xF1)
-        {
-            state = GET_COMMAND;
-        }
-        else if(in_byte == 0xE7)
-        {
-            settings.useBinarySerialComm = true;
-            SysSettings.lawicelMode = false;
-            //setPromiscuousMode(); //going into binary comm will set promisc. mode too.
-        } 
-        else
+/*
+Outside of a message every byte but 0xF1 (start of a message) and 0xE7 (switch to binary mode) goes to the console.
+Inside one the bytes still missing are copied over in one go so a buffer full of frames doesn't have to
+go through a per byte state machine.
+*/
+void GVRET_Comm_Handler::processIncomingBytes(const uint8_t *bytes, size_t length)
+{
+    size_t pos = 0;
+
+    if (input->msgLength > 0 && length > 0 && (millis() - input->msgStart) > GVRET_MSG_TIMEOUT)
+    {
+        framingErrors++;
+        resync();
+    }
+
+    while (pos < length)
+    {
+        if (input->msgLength == 0)
         {
-            console.rcvCharacter((uint8_t) in_byte);
+            uint8_t in_byte = bytes[pos++];
+            if (in_byte == 0xF1)
+            {
+                input->msg[input->msgLength++] = in_byte;
+                input->msgStart = millis();
+            }
+            else if (in_byte == 0xE7)
+            {
+                settings.useBinarySerialComm = true;
+                SysSettings.lawicelMode = false;
+                //setPromiscuousMode(); //going into binary comm will set promisc. mode too.
+            }
+            else console.rcvCharacter(in_byte);
+            continue;
         }
-        break;
-    case GET_COMMAND:
-        switch(in_byte)
+
+        size_t take = messageLength() - input->msgLength;
+        if (take > length - pos) take = length - pos;
+        memcpy(&input->msg[input->msgLength], &bytes[pos], take);
+        input->msgLength += take;
+        pos += take;
+
+        int needed = messageLength();
+        if (needed < 0) //not a command we know so this 0xF1 wasn't really the start of a message
         {
-        case PROTO_BUILD_CAN_FRAME:
-            state = BUILD_CAN_FRAME;
-            buff[0] = 0xF1;
-            step = 0;
-            break;
-        case PROTO_TIME_SYNC:
-            state = TIME_SYNC;
-            step = 0;
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 1; //time sync
-            transmitBuffer[transmitBufferLength++] = (uint8_t) (now & 0xFF);
-            transmitBuffer[transmitBufferLength++] = (uint8_t) (now >> 8);
-            transmitBuffer[transmitBufferLength++] = (uint8_t) (now >> 16);
-            transmitBuffer[transmitBufferLength++] = (uint8_t) (now >> 24);
-            break;
-        case PROTO_DIG_INPUTS:
-            //immediately return the data for digital inputs
-            temp8 = 0; //getDigital(0) + (getDigital(1) << 1) + (getDigital(2) << 2) + (getDigital(3) << 3) + (getDigital(4) << 4) + (getDigital(5) << 5);
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 2; //digital inputs
-            transmitBuffer[transmitBufferLength++] = temp8;
-            temp8 = checksumCalc(buff, 2);
-            transmitBuffer[transmitBufferLength++]  = temp8;
-            state = IDLE;
-            break;
-        case PROTO_ANA_INPUTS:
-            //immediately return data on analog inputs
-            temp16 = 0;// getAnalog(0);  // Analogue input 1
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 3;
-            transmitBuffer[transmitBufferLength++] = temp16 & 0xFF;
-            transmitBuffer[transmitBufferLength++] = uint8_t(temp16 >> 8);
-            temp16 = 0;//getAnalog(1);  // Analogue input 2
-            transmitBuffer[transmitBufferLength++] = temp16 & 0xFF;
-            transmitBuffer[transmitBufferLength++] = uint8_t(temp16 >> 8);
-            temp16 = 0;//getAnalog(2);  // Analogue input 3
-            transmitBuffer[transmitBufferLength++] = temp16 & 0xFF;
-            transmitBuffer[transmitBufferLength++] = uint8_t(temp16 >> 8);
-            temp16 = 0;//getAnalog(3);  // Analogue input 4
-            transmitBuffer[transmitBufferLength++] = temp16 & 0xFF;
-            transmitBuffer[transmitBufferLength++] = uint8_t(temp16 >> 8);
-            temp16 = 0;//getAnalog(4);  // Analogue input 5
-            transmitBuffer[transmitBufferLength++] = temp16 & 0xFF;
-            transmitBuffer[transmitBufferLength++] = uint8_t(temp16 >> 8);
-            temp16 = 0;//getAnalog(5);  // Analogue input 6
-            transmitBuffer[transmitBufferLength++] = temp16 & 0xFF;
-            transmitBuffer[transmitBufferLength++] = uint8_t(temp16 >> 8);
-            temp16 = 0;//getAnalog(6);  // Vehicle Volts
-            transmitBuffer[transmitBufferLength++] = temp16 & 0xFF;
-            transmitBuffer[transmitBufferLength++] = uint8_t(temp16 >> 8);
-            temp8 = checksumCalc(buff, 9);
-            transmitBuffer[transmitBufferLength++] = temp8;
-            state = IDLE;
-            break;
-        case PROTO_SET_DIG_OUT:
-            state = SET_DIG_OUTPUTS;
-            buff[0] = 0xF1;
-            break;
-        case PROTO_SETUP_CANBUS:
-            state = SETUP_CANBUS;
-            step = 0;
-            buff[0] = 0xF1;
-            break;
-        case PROTO_GET_CANBUS_PARAMS:
-            //immediately return data on canbus params
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 6;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[0].enabled + ((unsigned char) settings.canSettings[0].listenOnly << 4);
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[0].nomSpeed;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[0].nomSpeed >> 8;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[0].nomSpeed >> 16;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[0].nomSpeed >> 24;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[1].enabled + ((unsigned char) settings.canSettings[1].listenOnly << 4);
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[1].nomSpeed;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[1].nomSpeed >> 8;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[1].nomSpeed >> 16;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[1].nomSpeed >> 24;
-            state = IDLE;
-            break;
-        case PROTO_GET_DEV_INFO:
-            //immediately return device information
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 7;
-            transmitBuffer[transmitBufferLength++] = CFG_BUILD_NUM & 0xFF;
-            transmitBuffer[transmitBufferLength++] = (CFG_BUILD_NUM >> 8);
-            transmitBuffer[transmitBufferLength++] = 0x20;
-            transmitBuffer[transmitBufferLength++] = 0;
-            transmitBuffer[transmitBufferLength++] = 0;
-            transmitBuffer[transmitBufferLength++] = 0; //was single wire mode. Should be rethought for this board.
-            state = IDLE;
-            break;
-        case PROTO_SET_SW_MODE:
-            buff[0] = 0xF1;
-            state = SET_SINGLEWIRE_MODE;
-            step = 0;
-            break;
-        case PROTO_KEEPALIVE:
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 0x09;
-            transmitBuffer[transmitBufferLength++] = 0xDE;
-            transmitBuffer[transmitBufferLength++] = 0xAD;
-            state = IDLE;
-            break;
-        case PROTO_SET_SYSTYPE:
-            buff[0] = 0xF1;
-            state = SET_SYSTYPE;
-            step = 0;
-            break;
-        case PROTO_ECHO_CAN_FRAME:
-            state = ECHO_CAN_FRAME;
-            buff[0] = 0xF1;
-            step = 0;
-            break;
-        case PROTO_GET_NUMBUSES:
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 12;
-            transmitBuffer[transmitBufferLength++] = SysSettings.numBuses;
-            state = IDLE;
-            break;
-        case PROTO_GET_EXT_BUSES:
-            transmitBuffer[transmitBufferLength++]  = 0xF1;
-            transmitBuffer[transmitBufferLength++]  = 13;
-            for (int u = 2; u < 17; u++) transmitBuffer[transmitBufferLength++] = 0;
-            step = 0;
-            state = IDLE;
-            break;
-        case PROTO_SET_EXT_BUSES:
-            state = SETUP_EXT_BUSES;
-            step = 0;
-            buff[0] = 0xF1;
-            break;
+            framingErrors++;
+            resync();
         }
-        break;
-    case BUILD_CAN_FRAME:
-        buff[1 + step] = in_byte;
-        switch(step)
+        else if (input->msgLength == (size_t)needed)
         {
-        case 0:
-            build_out_frame.id = in_byte;
-            break;
-        case 1:
-            build_out_frame.id |= in_byte << 8;
-            break;
-        case 2:
-            build_out_frame.id |= in_byte << 16;
-            break;
-        case 3:
-            build_out_frame.id |= in_byte << 24;
-            if(build_out_frame.id & 1 << 31)
-            {
-                build_out_frame.id &= 0x7FFFFFFF;
-                build_out_frame.extended = true;
-            } else build_out_frame.extended = false;
-            break;
-        case 4:
-            out_bus = in_byte & 3;
-            break;
-        case 5:
-            build_out_frame.length = in_byte & 0xF;
-            if(build_out_frame.length > 8) 
+            uint8_t checksum = input->msg[input->msgLength - 1];
+            if ((input->msg[1] == PROTO_BUILD_CAN_FRAME || input->msg[1] == PROTO_ECHO_CAN_FRAME) && checksum != 0
+                && checksum != checksumCalc(input->msg, input->msgLength - 1))
             {
-                build_out_frame.length = 8;
+                checksumErrors++;
+                resync();
             }
-            break;
-        default:
-            if(step < build_out_frame.length + 6)
-            {
-                build_out_frame.data.uint8[step - 6] = in_byte;
-            } 
             else
             {
-                state = IDLE;
-                //this would be the checksum byte. Compute and compare.
-                //temp8 = checksumCalc(buff, step);
-                build_out_frame.rtr = 0;
-                if (out_bus < NUM_BUSES) canManager.sendFrame(canBuses[out_bus], build_out_frame);
+                handleMessage();
+                input->msgLength = 0;
             }
-            break;
         }
-        step++;
-        break;
-        case TIME_SYNC:
-            state = IDLE;
-            break;
-        case GET_DIG_INPUTS:
-            // nothing to do
-            break;
-        case GET_ANALOG_INPUTS:
-            // nothing to do
-            break;
-        case SET_DIG_OUTPUTS: //todo: validate the XOR byte
-            buff[1] = in_byte;
-            //temp8 = checksumCalc(buff, 2);
-            for(int c = 0; c < 8; c++){
-                if(in_byte & (1 << c)) setOutput(c, true);
-                else setOutput(c, false);
-            }
-            state = IDLE;
-            break;
-        case SETUP_CANBUS: //todo: validate checksum
-            switch(step)
-            {
-            case 0:
-                build_int = in_byte;
-                break;
-            case 1:
-                build_int |= in_byte << 8;
-                break;
-            case 2:
-                build_int |= in_byte << 16;
-                break;
-            case 3:
-                build_int |= in_byte << 24;
-                busSpeed = build_int & 0xFFFFF;
-                if(busSpeed > 1000000) busSpeed = 1000000;
+    }
+}
 
-                if(build_int > 0)
-                {
-                    if(build_int & 0x80000000ul) //signals that enabled and listen only status are also being passed
-                    {
-                        if(build_int & 0x40000000ul)
-                        {
-                            settings.canSettings[0].enabled = true;
-                        } else 
-                        {
-                            settings.canSettings[0].enabled = false;
-                        }
-                        if(build_int & 0x20000000ul)
-                        {
-                            settings.canSettings[0].listenOnly = true;
-                        } else 
-                        {
-                            settings.canSettings[0].listenOnly = false;
-                        }
-                    } else 
-                    {
-                        //if not using extended status mode then just default to enabling - this was old behavior
-                        settings.canSettings[0].enabled = true;
-                    }
-                    //CAN0.set_baudrate(build_int);
-                    settings.canSettings[0].nomSpeed = busSpeed;
+/*
+Full length of the message being gathered as far as can be told from what's in so far. Until the command
+byte is in that's 2 and frames read as their 8 byte header until the length byte shows up. -1 for unknown commands.
+*/
+int GVRET_Comm_Handler::messageLength()
+{
+    if (input->msgLength < 2) return 2;
+    switch (input->msg[1])
+    {
+    case PROTO_BUILD_CAN_FRAME:
+    case PROTO_ECHO_CAN_FRAME:
+        if (input->msgLength < 8) return 8;
+        return 8 + (((input->msg[7] & 0xF) > 8) ? 8 : (input->msg[7] & 0xF)) + 1; //data and checksum
+    case PROTO_DIG_INPUTS:
+    case PROTO_ANA_INPUTS:
+    case PROTO_GET_CANBUS_PARAMS:
+    case PROTO_GET_DEV_INFO:
+    case PROTO_KEEPALIVE:
+    case PROTO_GET_NUMBUSES:
+    case PROTO_GET_EXT_BUSES:
+    case PROTO_GET_BUSLOAD:
+        return 2;
+    case PROTO_TIME_SYNC: //one byte after the command has always been swallowed here, hosts send it
+    case PROTO_SET_DIG_OUT:
+    case PROTO_SET_SW_MODE:
+    case PROTO_SET_SYSTYPE:
+    case PROTO_SET_TIMESTAMP_64:
+    case PROTO_SET_COMPACT:
+    case PROTO_SET_COMPRESSION:
+        return 3;
+    case PROTO_GET_ID_STATS:
+        return 5;
+    case PROTO_SETUP_CANBUS:
+        return 10;
+    case PROTO_SET_ID_FILTER:
+        return 12;
+    case PROTO_SET_EXT_BUSES:
+        return 14;
+    }
+    return -1;
+}
 
-                } else { //disable first canbus
-                    settings.canSettings[0].enabled = false;
-                }
+//Throw out the 0xF1 the current message started with and run whatever came after it back through from
+//the next 0xF1 on. Anything before that is garbage from the broken message so it doesn't go to the console.
+void GVRET_Comm_Handler::resync()
+{
+    uint8_t replay[GVRET_MAX_MSG];
+    size_t start = 1;
 
-                if (settings.canSettings[0].enabled)
-                {
-                    canBuses[0]->begin(settings.canSettings[0].nomSpeed, 255);
-                    if (settings.canSettings[0].listenOnly) canBuses[0]->setListenOnlyMode(true);
-                    else canBuses[0]->setListenOnlyMode(false);
-                    canBuses[0]->watchFor();
-                }
-                else canBuses[0]->disable();
-                break;
-            case 4:
-                build_int = in_byte;
-                break;
-            case 5:
-                build_int |= in_byte << 8;
-                break;
-            case 6:
-                build_int |= in_byte << 16;
-                break;
-            case 7:
-                build_int |= in_byte << 24;
-                busSpeed = build_int & 0xFFFFF;
-                if(busSpeed > 1000000) busSpeed = 1000000;
+    while (start < input->msgLength && input->msg[start] != 0xF1) start++;
+    size_t replayLength = input->msgLength - start;
+    memcpy(replay, &input->msg[start], replayLength);
+    input->msgLength = 0;
+    if (replayLength > 0) processIncomingBytes(replay, replayLength); //always shorter so this can't go deep
+}
 
-                if(build_int > 0 && SysSettings.numBuses > 1)
-                {
-                    if(build_int & 0x80000000ul) //signals that enabled and listen only status are also being passed
-                    {
-                        if(build_int & 0x40000000ul)
-                        {
-                            settings.canSettings[1].enabled = true;
-                        } else 
-                        {
-                            settings.canSettings[1].enabled = false;
-                        }
-                        if(build_int & 0x20000000ul)
-                        {
-                            settings.canSettings[1].listenOnly = true;
-                        } else 
-                        {
-                            settings.canSettings[1].listenOnly = false;
-                        }
-                    } else 
-                    {
-                        //if not using extended status mode then just default to enabling - this was old behavior
-                        settings.canSettings[1].enabled = true;
-                    }
-                    //CAN1.set_baudrate(build_int);
-                    settings.canSettings[1].nomSpeed = busSpeed;
-                } else { //disable first canbus
-                    settings.canSettings[1].enabled = false;
-                }
+//The output formats are set for the whole link. With more than one telnet client on WiFi one of them can't go
+//changing what the others get, so the request is refused and the reply carries the format still in use
+bool GVRET_Comm_Handler::canNegotiate()
+{
+    return (this != &wifiGVRET) || (wifiManager.numClients() <= 1);
+}
 
-                if (settings.canSettings[1].enabled)
-                {
-                    canBuses[1]->begin(settings.canSettings[1].nomSpeed, 255);
-                    if (settings.canSettings[1].listenOnly) canBuses[1]->setListenOnlyMode(true);
-                    else canBuses[1]->setListenOnlyMode(false);
-                    canBuses[1]->watchFor();
-                }
-                else canBuses[1]->disable();
+//4 byte ID with the extended flag in the top bit, bus, length and data as sent by the host
+void GVRET_Comm_Handler::readFrame(const uint8_t *data, CAN_FRAME &frame)
+{
+    frame.id = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+    if (frame.id & 1ul << 31)
+    {
+        frame.id &= 0x7FFFFFFF;
+        frame.extended = true;
+    } else frame.extended = false;
+    frame.length = data[5] & 0xF;
+    if (frame.length > 8) frame.length = 8;
+    for (int c = 0; c < frame.length; c++) frame.data.uint8[c] = data[6 + c];
+    frame.rtr = 0;
+}
 
-                state = IDLE;
-                //now, write out the new canbus settings to EEPROM
-                //EEPROM.writeBytes(0, &settings, sizeof(settings));
-                //EEPROM.commit();
-                //setPromiscuousMode();
-                break;
-            }
-            step++;
-            break;
-        case GET_CANBUS_PARAMS:
-            // nothing to do
-            break;
-        case GET_DEVICE_INFO:
-            // nothing to do
-            break;
-        case SET_SINGLEWIRE_MODE:
-            if(in_byte == 0x10){
-            } else {
-            }
-            //EEPROM.writeBytes(0, &settings, sizeof(settings));
-            //EEPROM.commit();
-            state = IDLE;
-            break;
-        case SET_SYSTYPE:
-            settings.systemType = in_byte;
-            //EEPROM.writeBytes(0, &settings, sizeof(settings));
-            //EEPROM.commit();
-            //loadSettings();
-            state = IDLE;
-            break;
-        case ECHO_CAN_FRAME:
-            buff[1 + step] = in_byte;
-            switch(step)
-            {
-            case 0:
-                build_out_frame.id = in_byte;
-                break;
-            case 1:
-                build_out_frame.id |= in_byte << 8;
-                break;
-            case 2:
-                build_out_frame.id |= in_byte << 16;
-                break;
-            case 3:
-                build_out_frame.id |= in_byte << 24;
-                if(build_out_frame.id & 1 << 31) {
-                    build_out_frame.id &= 0x7FFFFFFF;
-                    build_out_frame.extended = true;
-                } else build_out_frame.extended = false;
-                break;
-            case 4:
-                out_bus = in_byte & 1;
-                break;
-            case 5:
-                build_out_frame.length = in_byte & 0xF;
-                if(build_out_frame.length > 8) build_out_frame.length = 8;
-                break;
-            default:
-                if(step < build_out_frame.length + 6) 
-                {
-                    build_out_frame.data.bytes[step - 6] = in_byte;
-                } 
-                else 
-                {
-                    state = IDLE;
-                    //this would be the checksum byte. Compute and compare.
-                    //temp8 = checksumCalc(buff, step);
-                    //if (temp8 == in_byte)
-                    //{
-                    toggleRXLED();
-                    //if(isConnected) {
-                    canManager.displayFrame(build_out_frame, 0);
-                    //}
-                    //}
-                }
-                break;
-            }
-            step++;
-            break;
-        case SETUP_EXT_BUSES: //setup enable/listenonly/speed for SWCAN, Enable/Speed for LIN1, LIN2
-            switch(step)
+void GVRET_Comm_Handler::handleMessage()
+{
+    const uint8_t *data = &input->msg[2]; //everything after F1 and the command
+    uint32_t now = micros();
+    CAN_FRAME frame;
+    int out_bus;
+    uint8_t temp8;
+    uint16_t temp16;
+    uint8_t reply[64]; //replies are built here then queued in one go so they can't be split by an overflow
+    int replyLen = 0;
+
+    switch (input->msg[1])
+    {
+    case PROTO_BUILD_CAN_FRAME:
+        readFrame(data, frame);
+        out_bus = data[4] & 3;
+        if (out_bus < NUM_BUSES) canManager.sendFrame(canBuses[out_bus], frame);
+        break;
+    case PROTO_TIME_SYNC:
+        reply[replyLen++] = 0xF1;
+        reply[replyLen++] = 1; //time sync
+        if (timestamp64) //full 64 bit clock if the host asked for 64 bit timestamps
+        {
+            uint64_t now64 = esp_timer_get_time();
+            for (int b = 0; b < 8; b++) reply[replyLen++] = (uint8_t) (now64 >> (8 * b));
+        }
+        else
+        {
+            reply[replyLen++] = (uint8_t) (now & 0xFF);
+            reply[replyLen++] = (uint8_t) (now >> 8);
+            reply[replyLen++] = (uint8_t) (now >> 16);
+            reply[replyLen++] = (uint8_t) (now >> 24);
+        }
+        break;
+    case PROTO_DIG_INPUTS:
+        //immediately return the data for digital inputs
+        temp8 = 0; //getDigital(0) + (getDigital(1) << 1) + (getDigital(2) << 2) + (getDigital(3) << 3) + (getDigital(4) << 4) + (getDigital(5) << 5);
+        reply[replyLen++] = 0xF1;
+        reply[replyLen++] = 2; //digital inputs
+        reply[replyLen++] = temp8;
+        temp8 = checksumCalc(reply, replyLen);
+        reply[replyLen++] = temp8;
+        break;
+    case PROTO_ANA_INPUTS:
+        //immediately return data on analog inputs
+        reply[replyLen++] = 0xF1;
+        reply[replyLen++] = 3;
+        for (int i = 0; i < 7; i++) //analog inputs 1 - 6 then vehicle volts
+        {
+            temp16 = 0; //getAnalog(i);
+            reply[replyLen++] = temp16 & 0xFF;
+            reply[replyLen++] = uint8_t(temp16 >> 8);
+        }
+        temp8 = checksumCalc(reply, replyLen);
+        reply[replyLen++] = temp8;
+        break;
+    case PROTO_SET_DIG_OUT:
+        for(int c = 0; c < 8; c++){
+            if(data[0] & (1 << c)) setOutput(c, true);
+            else setOutput(c, false);
+        }
+        break;
+    case PROTO_SETUP_CANBUS:
+        setupBus(0, data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24));
+        setupBus(1, data[4] | (data[5] << 8) | (data[6] << 16) | ((uint32_t)data[7] << 24));
+        //now, write out the new canbus settings to EEPROM
+        //EEPROM.writeBytes(0, &settings, sizeof(settings));
+        //EEPROM.commit();
+        //setPromiscuousMode();
+        break;
+    case PROTO_GET_CANBUS_PARAMS:
+        //immediately return data on canbus params
+        reply[replyLen++] = 0xF1;
+        reply[replyLen++] = 6;
+        reply[replyLen++] = settings.canSettings[0].enabled + ((unsigned char) settings.canSettings[0].listenOnly << 4);
+        reply[replyLen++] = settings.canSettings[0].nomSpeed;
+        reply[replyLen++] = settings.canSettings[0].nomSpeed >> 8;
+        reply[replyLen++] = settings.canSettings[0].nomSpeed >> 16;
+        reply[replyLen++] = settings.canSettings[0].nomSpeed >> 24;
+        reply[replyLen++] = settings.canSettings[1].enabled + ((unsigned char) settings.canSettings[1].listenOnly << 4);
+        reply[replyLen++] = settings.canSettings[1].nomSpeed;
+        reply[replyLen++] = settings.canSettings[1].nomSpeed >> 8;
+        reply[replyLen++] = settings.canSettings[1].nomSpeed >> 16;
+        reply[replyLen++] = settings.canSettings[1].nomSpeed >> 24;
+        break;
+    case PROTO_GET_DEV_INFO:
+        //immediately return device information
+        reply[replyLen++] = 0xF1;
+        reply[replyLen++] = 7;
+        reply[replyLen++] = CFG_BUILD_NUM & 0xFF;
+        reply[replyLen++] = (CFG_BUILD_NUM >> 8);
+        reply[replyLen++] = 0x20;
+        reply[replyLen++] = 0;
+        reply[replyLen++] = 0;
+        reply[replyLen++] = 0; //was single wire mode. Should be rethought for this board.
+        break;
+    case PROTO_SET_SW_MODE:
+        //single wire mode doesn't exist on this hardware
+        //EEPROM.writeBytes(0, &settings, sizeof(settings));
+        //EEPROM.commit();
+        break;
+    case PROTO_KEEPALIVE:
+        reply[replyLen++] = 0xF1;
+        reply[replyLen++] = 0x09;
+        reply[replyLen++] = 0xDE;
+        reply[replyLen++] = 0xAD;
+        break;
+    case PROTO_SET_SYSTYPE:
+        settings.systemType = data[0];
+        //EEPROM.writeBytes(0, &settings, sizeof(settings));
+        //EEPROM.commit();
+        //loadSettings();
+        break;
+    case PROTO_ECHO_CAN_FRAME:
+        readFrame(data, frame);
+        toggleRXLED();
+        frame.timestamp = 0; //echoed frames get stamped when they're encoded
+        canManager.displayFrame(frame, 0);
+        break;
+    case PROTO_GET_NUMBUSES:
+        reply[replyLen++] = 0xF1;
+        reply[replyLen++] = 12;
+        reply[replyLen++] = SysSettings.numBuses;
+        break;
+    case PROTO_GET_EXT_BUSES:
+        reply[replyLen++] = 0xF1;
+        reply[replyLen++] = 13;
+        for (int u = 2; u < 17; u++) reply[replyLen++] = 0;
+        break;
+    case PROTO_SET_EXT_BUSES:
+        //enable/listenonly/speed for SWCAN, Enable/Speed for LIN1, LIN2. None of those exist on this hardware
+        break;
+    case PROTO_SET_TIMESTAMP_64: //1 = send frames with 64 bit timestamps from now on, 0 = back to the classic 32 bit ones
+        if (canNegotiate()) setTimestamp64(data[0] & 1);
+        reply[replyLen++] = 0xF1;
+        reply[replyLen++] = PROTO_SET_TIMESTAMP_64;
+        reply[replyLen++] = isTimestamp64() ? 1 : 0;
+        break;
+    case PROTO_GET_BUSLOAD:
+        //number of buses then for each one: load %, frames/sec (2 bytes) and payload bytes/sec (4 bytes)
+        reply[replyLen++] = 0xF1;
+        reply[replyLen++] = PROTO_GET_BUSLOAD;
+        reply[replyLen++] = SysSettings.numBuses;
+        for (int b = 0; b < SysSettings.numBuses; b++)
+        {
+            BUSLOAD &load = canManager.getBusLoad(b);
+            uint16_t fps = (load.framesPerSec > 0xFFFF) ? 0xFFFF : load.framesPerSec;
+            reply[replyLen++] = load.busloadPercentage;
+            reply[replyLen++] = (uint8_t)(fps & 0xFF);
+            reply[replyLen++] = (uint8_t)(fps >> 8);
+            reply[replyLen++] = (uint8_t)(load.bytesPerSec & 0xFF);
+            reply[replyLen++] = (uint8_t)(load.bytesPerSec >> 8);
+            reply[replyLen++] = (uint8_t)(load.bytesPerSec >> 16);
+            reply[replyLen++] = (uint8_t)(load.bytesPerSec >> 24);
+        }
+        break;
+    case PROTO_SET_COMPACT: //1 = send frames as compact batches (see compact_encoder.h) from now on, 0 = back to one message per frame
+        if (canNegotiate()) setCompact(data[0] & 1);
+        reply[replyLen++] = 0xF1;
+        reply[replyLen++] = PROTO_SET_COMPACT;
+        reply[replyLen++] = isCompact() ? 1 : 0;
+        break;
+    case PROTO_SET_COMPRESSION: //1 = LZ4 compress everything sent from now on. Only WiFi does this so serial always answers 0
+        if (canNegotiate()) setCompressed((data[0] & 1) && (this == &wifiGVRET));
+        reply[replyLen++] = 0xF1;
+        reply[replyLen++] = PROTO_SET_COMPRESSION;
+        reply[replyLen++] = isCompressed() ? 1 : 0;
+        break;
+    case PROTO_GET_ID_STATS:
+    {
+        /*
+        Asks with bus and the slot (2 bytes) to carry on from, 0 to start. The answer is bus, count, the slot to ask
+        for next (0xFFFF when that was the last of them) then count records of ID (extended flag in the top bit),
+        frames, mean, min and max period and jitter in us (4 bytes each), length and 8 data bytes. All LSB first.
+        */
+        static uint8_t statsReply[6 + GVRET_ID_STATS_PER_REPLY * 33];
+        IDStats &stats = canManager.getIDStats();
+        int slot = data[1] | (data[2] << 8);
+        int statsLen = 6;
+        int count = 0;
+        ID_STATS_ENTRY *entry;
+        while (count < GVRET_ID_STATS_PER_REPLY && data[0] < NUM_BUSES && (entry = stats.next(data[0], slot)) != nullptr)
+        {
+            uint32_t values[6] = {entry->key, entry->count, stats.meanPeriod(*entry), (entry->count > 1) ? entry->minPeriod : 0,
+                                  entry->maxPeriod, entry->jitter16 >> 4};
+            for (int v = 0; v < 6; v++)
             {
-            case 0:
-                build_int = in_byte;
-                break;
-            case 1:
-                build_int |= in_byte << 8;
-                break;
-            case 2:
-                build_int |= in_byte << 16;
-                break;
-            case 3:
-                build_int |= in_byte << 24;
-                break;
-            case 4:
-                build_int = in_byte;
-                break;
-            case 5:
-                build_int |= in_byte << 8;
-                break;
-            case 6:
-                build_int |= in_byte << 16;
-                break;
-            case 7:
-                build_int |= in_byte << 24;
-                break;
-            case 8:
-                build_int = in_byte;
-                break;
-            case 9:
-                build_int |= in_byte << 8;
-                break;
-            case 10:
-                build_int |= in_byte << 16;
-                break;
-            case 11:
-                build_int |= in_byte << 24;
-                state = IDLE;
-                //now, write out the new canbus settings to EEPROM
-                //EEPROM.writeBytes(0, &settings, sizeof(settings));
-                //EEPROM.commit();
-                //setPromiscuousMode();
-                break;
+                for (int b = 0; b < 4; b++) statsReply[statsLen++] = (uint8_t)(values[v] >> (8 * b));
             }
-        step++;
+            statsReply[statsLen++] = entry->length;
+            for (int b = 0; b < 8; b++) statsReply[statsLen++] = (b < entry->length) ? entry->data[b] : 0;
+            count++;
+        }
+        if (count < GVRET_ID_STATS_PER_REPLY) slot = 0xFFFF;
+        statsReply[0] = 0xF1;
+        statsReply[1] = PROTO_GET_ID_STATS;
+        statsReply[2] = data[0];
+        statsReply[3] = count;
+        statsReply[4] = (uint8_t)(slot & 0xFF);
+        statsReply[5] = (uint8_t)(slot >> 8);
+        sendBytesToBuffer(statsReply, statsLen);
+        break;
+    }
+    case PROTO_SET_ID_FILTER:
+        /*
+        op, bus, ID (4 bytes with the extended flag in the top bit), every (2 bytes), ms (2 bytes). All LSB first.
+        op 0 = remove the ID, 1 = list it forwarding 1 in every frames and at most one per ms, 2 = clear the bus list,
+        0x10 + mode = set the bus mode (see IDFILTER_MODE). Answers with 1 or 0 for success and the number of IDs listed.
+        */
+        frame.id = data[2] | (data[3] << 8) | (data[4] << 16) | ((uint32_t)data[5] << 24);
+        frame.extended = (frame.id & 1ul << 31) ? true : false;
+        temp16 = data[6] | (data[7] << 8);
+        if (data[0] == 0) temp8 = idFilter.removeID(data[1], frame.id, frame.extended);
+        else if (data[0] == 1) temp8 = idFilter.addID(data[1], frame.id, frame.extended, temp16, data[8] | (data[9] << 8));
+        else if (data[0] == 2 && data[1] < NUM_BUSES)
+        {
+            idFilter.clear(data[1]);
+            temp8 = 1;
+        }
+        else if ((data[0] & 0xF0) == 0x10) temp8 = idFilter.setMode(data[1], data[0] & 0xF);
+        else temp8 = 0;
+        reply[replyLen++] = 0xF1;
+        reply[replyLen++] = PROTO_SET_ID_FILTER;
+        reply[replyLen++] = temp8;
+        temp16 = (data[1] < NUM_BUSES) ? idFilter.getCount(data[1]) : 0;
+        reply[replyLen++] = (uint8_t)(temp16 & 0xFF);
+        reply[replyLen++] = (uint8_t)(temp16 >> 8);
         break;
     }
+
+    if (replyLen > 0) sendBytesToBuffer(reply, replyLen);
+}
+
+/*
+One bus worth of PROTO_SETUP_CANBUS. The low 20 bits are the speed. If the top bit is set then bit 30 is
+enabled and bit 29 listen only, otherwise any non zero value just enables the bus. 0 disables it.
+*/
+void GVRET_Comm_Handler::setupBus(int bus, uint32_t value)
+{
+    uint32_t busSpeed = value & 0xFFFFF;
+    if(busSpeed > 1000000) busSpeed = 1000000;
+
+    if(value > 0 && (bus == 0 || SysSettings.numBuses > bus))
+    {
+        if(value & 0x80000000ul) //signals that enabled and listen only status are also being passed
+        {
+            settings.canSettings[bus].enabled = (value & 0x40000000ul) ? true : false;
+            settings.canSettings[bus].listenOnly = (value & 0x20000000ul) ? true : false;
+        } else
+        {
+            //if not using extended status mode then just default to enabling - this was old behavior
+            settings.canSettings[bus].enabled = true;
+        }
+        settings.canSettings[bus].nomSpeed = busSpeed;
+    } else {
+        settings.canSettings[bus].enabled = false;
+    }
+
+    canManager.pauseRx();
+    if (settings.canSettings[bus].enabled)
+    {
+        canBuses[bus]->begin(settings.canSettings[bus].nomSpeed, 255);
+        if (settings.canSettings[bus].listenOnly) canBuses[bus]->setListenOnlyMode(true);
+        else canBuses[bus]->setListenOnlyMode(false);
+        filterManager.apply(bus);
+    }
+    else canBuses[bus]->disable();
+    canManager.resumeRx();
 }
 
 //Get the value of XOR'ing all the bytes together. This creates a reasonable checksum that can be used
 //to make sure nothing too stupid has happened on the comm.
-uint8_t GVRET_Comm_Handler::checksumCalc(uint8_t *buffer, int length)
+uint8_t GVRET_Comm_Handler::checksumCalc(const uint8_t *buffer, int length)
 {
     uint8_t valu = 0;
     for (int c = 0; c < length; c++) {
         valu ^= buffer[c];
     }
     return valu;
-}
\ No newline at end of file
+}
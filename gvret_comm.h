@@ -4,22 +4,11 @@
 #include "esp32_can.h"
 #include "commbuffer.h"
 
-enum STATE {
-    IDLE,
-    GET_COMMAND,
-    BUILD_CAN_FRAME,
-    TIME_SYNC,
-    GET_DIG_INPUTS,
-    GET_ANALOG_INPUTS,
-    SET_DIG_OUTPUTS,
-    SETUP_CANBUS,
-    GET_CANBUS_PARAMS,
-    GET_DEVICE_INFO,
-    SET_SINGLEWIRE_MODE,
-    SET_SYSTYPE,
-    ECHO_CAN_FRAME,
-    SETUP_EXT_BUSES
-};
+//Longest message a host sends: F1, command, 4 byte ID, bus, length, 8 data bytes and the checksum
+#define GVRET_MAX_MSG   17
+
+//Most IDs sent back in one PROTO_GET_ID_STATS reply. Each one takes 33 bytes
+#define GVRET_ID_STATS_PER_REPLY    8
 
 enum GVRET_PROTOCOL
 {
@@ -41,22 +30,55 @@ enum GVRET_PROTOCOL
     PROTO_BUILD_FD_FRAME = 20,
     PROTO_SETUP_FD = 21,
     PROTO_GET_FD = 22,
+    PROTO_UDP_BATCH = 23,
+    PROTO_SET_TIMESTAMP_64 = 24,
+    PROTO_CAN_FRAME_TS64 = 25,
+    PROTO_FD_FRAME_TS64 = 26,
+    PROTO_GET_BUSLOAD = 27,
+    PROTO_SET_COMPACT = 28,
+    PROTO_COMPACT_BATCH = 29,
+    PROTO_SET_COMPRESSION = 30,
+    PROTO_COMPRESSED_BLOCK = 31,
+    PROTO_SET_ID_FILTER = 32,
+    PROTO_GET_ID_STATS = 33,
 };
 
+//A message being gathered from one source
+struct GVRET_INPUT
+{
+    uint8_t msg[GVRET_MAX_MSG]; //starting with its 0xF1
+    size_t msgLength;
+    uint32_t msgStart; //millis() when the 0xF1 came in
+};
+
+/*
+Incoming bytes are gathered into whole messages before anything is done with them. Frame messages
+(PROTO_BUILD_CAN_FRAME and PROTO_ECHO_CAN_FRAME) end with the XOR of all the bytes before it and are thrown
+away if that doesn't match. A checksum of 0 is taken to mean the host didn't compute one since that's what
+SavvyCAN sends. After a bad checksum, an unknown command or a message that stalled for GVRET_MSG_TIMEOUT ms
+the parser picks back up at the next 0xF1 it sees instead of eating the commands that follow.
+*/
 class GVRET_Comm_Handler: public CommBuffer
 {
 public:
     GVRET_Comm_Handler();
     void processIncomingByte(uint8_t in_byte);
-    
+    void processIncomingBytes(const uint8_t *bytes, size_t length);
+    void processIncomingBytes(const uint8_t *bytes, size_t length, GVRET_INPUT &from);
+    uint32_t getFramingErrors();
+    uint32_t getChecksumErrors();
+
 private:
-    CAN_FRAME build_out_frame;
-    CAN_FRAME_FD build_out_fd_frame;
-    int out_bus;
-    uint8_t buff[20];
-    int step;
-    STATE state;
-    uint32_t build_int;
+    GVRET_INPUT serialInput; //used unless the bytes come with their own
+    GVRET_INPUT *input; //where the current bytes are being gathered
+    uint32_t framingErrors; //unknown commands and messages that stalled part way through
+    uint32_t checksumErrors;
 
-    uint8_t checksumCalc(uint8_t *buffer, int length);
-};
\ No newline at end of file
+    int messageLength();
+    void resync();
+    bool canNegotiate();
+    void handleMessage();
+    void setupBus(int bus, uint32_t value);
+    void readFrame(const uint8_t *data, CAN_FRAME &frame);
+    uint8_t checksumCalc(const uint8_t *buffer, int length);
+};
@@ -0,0 +1,232 @@
+#include "id_filter.h"
+#include "Logger.h"
+
+#define TABLE_MASK  ((1 << ID_FILTER_BITS) - 1)
+
+static inline uint32_t makeKey(uint32_t id, bool extended)
+{
+    return extended ? ((id & 0x1FFFFFFF) | 0x80000000ul) : (id & 0x7FF);
+}
+
+IDFilter::IDFilter()
+{
+    for (int i = 0; i <= TABLE_MASK; i++) table[i].bus = IDFILTER_EMPTY;
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        memset(stdListed[i], 0, sizeof(stdListed[i]));
+        memset(stdRules[i], 0, sizeof(stdRules[i]));
+        mode[i] = IDFILTER_PASS_ALL;
+        numIDs[i] = 0;
+        passed[i] = 0;
+        filtered[i] = 0;
+        throttled[i] = 0;
+    }
+    totalIDs = 0;
+}
+
+//Fibonacci hashing spreads runs of neighbouring IDs over the whole table
+uint32_t IDFilter::home(int bus, uint32_t key)
+{
+    return (uint32_t)((key ^ ((uint32_t)bus << 24)) * 2654435761u) >> (32 - ID_FILTER_BITS);
+}
+
+int IDFilter::find(int bus, uint32_t key)
+{
+    for (uint32_t slot = home(bus, key); ; slot = (slot + 1) & TABLE_MASK)
+    {
+        if (table[slot].bus == IDFILTER_EMPTY) return -1; //the table is never full so this always ends
+        if (table[slot].key == key && table[slot].bus == bus) return slot;
+    }
+}
+
+//Linear probing without tombstones: entries after the hole that could live there are moved back into it
+void IDFilter::removeSlot(int slot)
+{
+    int hole = slot;
+    for (int next = (slot + 1) & TABLE_MASK; table[next].bus != IDFILTER_EMPTY; next = (next + 1) & TABLE_MASK)
+    {
+        int wanted = home(table[next].bus, table[next].key);
+        if (((next - wanted) & TABLE_MASK) >= ((next - hole) & TABLE_MASK))
+        {
+            table[hole] = table[next];
+            hole = next;
+        }
+    }
+    table[hole].bus = IDFILTER_EMPTY;
+}
+
+bool IDFilter::throttle(IDFILTER_ENTRY &entry, uint32_t timestamp)
+{
+    if (entry.decimate > 1)
+    {
+        uint16_t count = entry.counter;
+        entry.counter = (count + 1 >= entry.decimate) ? 0 : count + 1;
+        if (count != 0) return true;
+    }
+    if (entry.interval)
+    {
+        if ((entry.flags & IDFILTER_PRIMED) && (timestamp - entry.lastForward) < (uint32_t)entry.interval * 1000) return true;
+        entry.lastForward = timestamp;
+        entry.flags |= IDFILTER_PRIMED;
+    }
+    return false;
+}
+
+//Called for every received frame. Timestamp is in microseconds and only used for the rate limit
+bool IDFilter::accepts(int bus, uint32_t id, bool extended, uint32_t timestamp)
+{
+    if (mode[bus] == IDFILTER_PASS_ALL && numIDs[bus] == 0) return true;
+
+    bool listed, accept;
+    portENTER_CRITICAL(&lock);
+    int slot = -1;
+    if (!extended)
+    {
+        id &= 0x7FF;
+        uint32_t bit = 1ul << (id & 31);
+        listed = stdListed[bus][id >> 5] & bit;
+        if (listed && (stdRules[bus][id >> 5] & bit)) slot = find(bus, id);
+    }
+    else
+    {
+        slot = find(bus, makeKey(id, true));
+        listed = (slot >= 0);
+    }
+
+    if (mode[bus] == IDFILTER_BLOCK_LISTED) accept = !listed;
+    else if (mode[bus] == IDFILTER_PASS_LISTED) accept = listed;
+    else accept = true;
+
+    if (!accept) filtered[bus]++;
+    else if (slot >= 0 && throttle(table[slot], timestamp))
+    {
+        throttled[bus]++;
+        accept = false;
+    }
+    else passed[bus]++;
+    portEXIT_CRITICAL(&lock);
+    return accept;
+}
+
+bool IDFilter::setMode(int bus, uint8_t newMode)
+{
+    if (bus < 0 || bus >= NUM_BUSES || newMode > IDFILTER_BLOCK_LISTED) return false;
+    mode[bus] = newMode;
+    return true;
+}
+
+uint8_t IDFilter::getMode(int bus)
+{
+    return mode[bus];
+}
+
+//Adds the ID or changes its decimation and rate limit if it's already listed. False if the table is full
+bool IDFilter::addID(int bus, uint32_t id, bool extended, uint16_t decimate, uint16_t interval)
+{
+    if (bus < 0 || bus >= NUM_BUSES) return false;
+    uint32_t key = makeKey(id, extended);
+    bool result = true;
+
+    portENTER_CRITICAL(&lock);
+    int slot = find(bus, key);
+    if (slot < 0)
+    {
+        if (totalIDs >= ID_FILTER_MAX_IDS) result = false;
+        else
+        {
+            for (slot = home(bus, key); table[slot].bus != IDFILTER_EMPTY; slot = (slot + 1) & TABLE_MASK) ;
+            table[slot].key = key;
+            table[slot].bus = bus;
+            numIDs[bus]++;
+            totalIDs++;
+        }
+    }
+    if (result)
+    {
+        IDFILTER_ENTRY &entry = table[slot];
+        entry.decimate = decimate;
+        entry.interval = interval;
+        entry.counter = 0;
+        entry.flags = 0;
+        if (!extended)
+        {
+            uint32_t bit = 1ul << (key & 31);
+            stdListed[bus][key >> 5] |= bit;
+            if (decimate > 1 || interval) stdRules[bus][key >> 5] |= bit;
+            else stdRules[bus][key >> 5] &= ~bit;
+        }
+    }
+    portEXIT_CRITICAL(&lock);
+    return result;
+}
+
+bool IDFilter::removeID(int bus, uint32_t id, bool extended)
+{
+    if (bus < 0 || bus >= NUM_BUSES) return false;
+    uint32_t key = makeKey(id, extended);
+
+    portENTER_CRITICAL(&lock);
+    int slot = find(bus, key);
+    if (slot >= 0)
+    {
+        removeSlot(slot);
+        if (!extended)
+        {
+            stdListed[bus][key >> 5] &= ~(1ul << (key & 31));
+            stdRules[bus][key >> 5] &= ~(1ul << (key & 31));
+        }
+        numIDs[bus]--;
+        totalIDs--;
+    }
+    portEXIT_CRITICAL(&lock);
+    return slot >= 0;
+}
+
+//Drops every listed ID of the bus. Its mode stays as it was
+void IDFilter::clear(int bus)
+{
+    if (bus < 0 || bus >= NUM_BUSES) return;
+    portENTER_CRITICAL(&lock);
+    for (int slot = 0; slot <= TABLE_MASK; )
+    {
+        //removing shifts a later entry into this slot so only move on once it holds something else
+        if (table[slot].bus == bus)
+        {
+            removeSlot(slot);
+            totalIDs--;
+        }
+        else slot++;
+    }
+    numIDs[bus] = 0;
+    memset(stdListed[bus], 0, sizeof(stdListed[bus]));
+    memset(stdRules[bus], 0, sizeof(stdRules[bus]));
+    portEXIT_CRITICAL(&lock);
+}
+
+int IDFilter::getCount(int bus)
+{
+    return numIDs[bus];
+}
+
+//How many table slots a lookup of this ID looks at, whether it is listed or not. For the benchmark
+int IDFilter::probeCount(int bus, uint32_t id, bool extended)
+{
+    uint32_t key = makeKey(id, extended);
+    int probes = 1;
+    for (uint32_t slot = home(bus, key); table[slot].bus != IDFILTER_EMPTY; slot = (slot + 1) & TABLE_MASK, probes++)
+    {
+        if (table[slot].key == key && table[slot].bus == bus) break;
+    }
+    return probes;
+}
+
+void IDFilter::printStats()
+{
+    static const char *modeNames[] = {"pass all", "pass listed", "block listed"};
+    for (int i = 0; i < SysSettings.numBuses; i++)
+    {
+        if (mode[i] == IDFILTER_PASS_ALL && numIDs[i] == 0) continue;
+        Logger::console("CAN%i ID filter: %s, %i IDs, %u passed, %u filtered, %u decimated or rate limited", i, modeNames[mode[i]],
+                        numIDs[i], passed[i], filtered[i], throttled[i]);
+    }
+}
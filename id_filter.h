@@ -0,0 +1,65 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+
+enum IDFILTER_MODE
+{
+    IDFILTER_PASS_ALL = 0,      //everything goes through, listed IDs only get their decimation and rate limit
+    IDFILTER_PASS_LISTED = 1,   //only listed IDs go through
+    IDFILTER_BLOCK_LISTED = 2,  //listed IDs are dropped
+};
+
+#define IDFILTER_EMPTY      0xFF //bus value of an unused table slot
+#define IDFILTER_PRIMED     1    //lastForward holds a real time
+
+//One listed ID. The key has the extended flag in the top bit the same as GVRET frame messages
+struct IDFILTER_ENTRY
+{
+    uint32_t key;
+    uint8_t bus;
+    uint8_t flags;
+    uint16_t decimate;      //forward one frame in this many. 0 and 1 forward them all
+    uint16_t counter;
+    uint16_t interval;      //forward at most one frame per this many ms. 0 for no limit
+    uint32_t lastForward;   //timestamp (us) of the last frame that went through the rate limit
+};
+
+/*
+Software ID filter that runs on every received frame after the hardware acceptance filters. Each bus has its own
+list of IDs and a mode saying what the list means. A listed ID can also be decimated (1 in N frames forwarded)
+and rate limited (at most one frame per so many ms). Standard IDs are looked up in a per bus 2048 bit map and
+extended ones in an open addressed hash table shared by all buses that holds ID_FILTER_MAX_IDS entries in
+2^ID_FILTER_BITS slots, so the cost per frame is the same for a list of 2 IDs or 300.
+The lists live in RAM only. Hosts are expected to set them up again when they connect.
+*/
+class IDFilter
+{
+public:
+    IDFilter();
+    bool accepts(int bus, uint32_t id, bool extended, uint32_t timestamp);
+    bool setMode(int bus, uint8_t mode);
+    uint8_t getMode(int bus);
+    bool addID(int bus, uint32_t id, bool extended, uint16_t decimate, uint16_t interval);
+    bool removeID(int bus, uint32_t id, bool extended);
+    void clear(int bus);
+    int getCount(int bus);
+    int probeCount(int bus, uint32_t id, bool extended);
+    void printStats();
+
+private:
+    uint32_t stdListed[NUM_BUSES][64]; //bit per standard ID
+    uint32_t stdRules[NUM_BUSES][64];  //the standard ID has a decimation or rate limit so it needs the table entry
+    IDFILTER_ENTRY table[1 << ID_FILTER_BITS];
+    uint8_t mode[NUM_BUSES];
+    uint16_t numIDs[NUM_BUSES];
+    uint16_t totalIDs;
+    uint32_t passed[NUM_BUSES];
+    uint32_t filtered[NUM_BUSES];  //dropped by the mode
+    uint32_t throttled[NUM_BUSES]; //dropped by decimation or the rate limit
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+    static uint32_t home(int bus, uint32_t key);
+    int find(int bus, uint32_t key);
+    void removeSlot(int slot);
+    bool throttle(IDFILTER_ENTRY &entry, uint32_t timestamp);
+};
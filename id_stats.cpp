@@ -0,0 +1,134 @@
+#include "id_stats.h"
+#include "Logger.h"
+
+#define TABLE_MASK  ((1 << ID_STATS_BITS) - 1)
+
+IDStats::IDStats()
+{
+    clearTable();
+}
+
+void IDStats::clearTable()
+{
+    for (int i = 0; i <= TABLE_MASK; i++) table[i].bus = ID_STATS_EMPTY;
+    numIDs = 0;
+    untracked = 0;
+    resetPending = false;
+}
+
+//Forget everything. Takes effect with the next frame received so it's safe to call from anywhere
+void IDStats::reset()
+{
+    resetPending = true;
+}
+
+void IDStats::update(int bus, uint32_t key, uint8_t length, const uint8_t *data, uint32_t timestamp)
+{
+    if (resetPending) clearTable();
+
+    uint32_t slot = (uint32_t)((key ^ ((uint32_t)bus << 24)) * 2654435761u) >> (32 - ID_STATS_BITS);
+    while (table[slot].bus != ID_STATS_EMPTY)
+    {
+        if (table[slot].key == key && table[slot].bus == bus) break;
+        slot = (slot + 1) & TABLE_MASK;
+    }
+
+    ID_STATS_ENTRY &entry = table[slot];
+    if (entry.bus == ID_STATS_EMPTY)
+    {
+        if (numIDs >= ID_STATS_MAX_IDS)
+        {
+            untracked++;
+            return;
+        }
+        entry.key = key;
+        entry.count = 0;
+        entry.lastPeriod = 0;
+        entry.minPeriod = 0xFFFFFFFF;
+        entry.maxPeriod = 0;
+        entry.totalPeriod = 0;
+        entry.jitter16 = 0;
+        entry.bus = bus;
+        numIDs++;
+    }
+    else
+    {
+        uint32_t period = timestamp - entry.lastTime;
+        if (period < entry.minPeriod) entry.minPeriod = period;
+        if (period > entry.maxPeriod) entry.maxPeriod = period;
+        entry.totalPeriod += period;
+        if (entry.count > 1)
+        {
+            int32_t change = (int32_t)(period - entry.lastPeriod);
+            if (change < 0) change = -change;
+            entry.jitter16 += change - (entry.jitter16 >> 4); //J += (|D| - J) / 16 kept in units of 1/16 us
+        }
+        entry.lastPeriod = period;
+    }
+
+    entry.count++;
+    entry.lastTime = timestamp;
+    entry.length = length;
+    memcpy(entry.data, data, (length > 8) ? 8 : length);
+}
+
+void IDStats::addFrame(int bus, CAN_FRAME &frame)
+{
+    update(bus, frame.extended ? (frame.id | 0x80000000ul) : frame.id, frame.length, frame.data.uint8, frame.timestamp);
+}
+
+void IDStats::addFrame(int bus, CAN_FRAME_FD &frame)
+{
+    update(bus, frame.extended ? (frame.id | 0x80000000ul) : frame.id, frame.length, frame.data.uint8, frame.timestamp);
+}
+
+/*
+Walks the entries of one bus. Start with slot 0 and keep passing the same slot back in. Returns null once
+there are no more. New IDs showing up part way through don't move the entries already seen.
+*/
+ID_STATS_ENTRY *IDStats::next(int bus, int &slot)
+{
+    while (slot <= TABLE_MASK)
+    {
+        ID_STATS_ENTRY &entry = table[slot++];
+        if (entry.bus == bus) return &entry;
+    }
+    return nullptr;
+}
+
+uint32_t IDStats::meanPeriod(ID_STATS_ENTRY &entry)
+{
+    if (entry.count < 2) return 0;
+    return (uint32_t)(entry.totalPeriod / (entry.count - 1));
+}
+
+int IDStats::getCount()
+{
+    return numIDs;
+}
+
+uint32_t IDStats::getUntracked()
+{
+    return untracked;
+}
+
+void IDStats::print(int bus)
+{
+    int slot = 0;
+    int count = 0;
+    ID_STATS_ENTRY *entry;
+
+    Logger::console("CAN%i IDs seen (periods in us):", bus);
+    while ((entry = next(bus, slot)) != nullptr)
+    {
+        char dataStr[3 * 8 + 1];
+        int dataLen = (entry->length > 8) ? 8 : entry->length;
+        for (int i = 0; i < dataLen; i++) sprintf(&dataStr[i * 3], "%02X ", entry->data[i]);
+        dataStr[dataLen * 3] = 0;
+        Logger::console("  0x%x%s: %u frames, period mean %u min %u max %u jitter %u, len %i: %s", entry->key & 0x1FFFFFFF,
+                        (entry->key & 0x80000000ul) ? " ext" : "", entry->count, meanPeriod(*entry),
+                        (entry->count > 1) ? entry->minPeriod : 0, entry->maxPeriod, entry->jitter16 >> 4, entry->length, dataStr);
+        count++;
+    }
+    Logger::console("%i IDs, %u frames from IDs that didn't fit in the table", count, untracked);
+}
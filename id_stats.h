@@ -0,0 +1,52 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+#include "esp32_can.h"
+
+#define ID_STATS_EMPTY  0xFF //bus value of an unused table slot
+
+//What's been seen of one bus and ID. Periods are in microseconds. The key has the extended flag in the top bit
+struct ID_STATS_ENTRY
+{
+    uint32_t key;
+    uint8_t bus;
+    uint8_t length;        //of the last frame. FD frames only keep their first 8 bytes of data
+    uint8_t data[8];
+    uint32_t count;
+    uint32_t lastTime;
+    uint32_t lastPeriod;
+    uint32_t minPeriod;
+    uint32_t maxPeriod;
+    uint64_t totalPeriod;  //sum of all periods so the mean is totalPeriod / (count - 1)
+    uint32_t jitter16;     //smoothed change between successive periods the way RFC 3550 does it, times 16
+};
+
+/*
+Per ID statistics of everything received, kept so a host can find out which IDs are on a bus and how often they
+come without having to take the whole stream. Entries live in an open addressed table of 2^ID_STATS_BITS slots
+holding up to ID_STATS_MAX_IDS bus/ID pairs and each frame costs one lookup and a handful of adds. IDs seen once
+the table is full are counted but not tracked.
+Only the CAN receive side calls addFrame(). Readers just see a snapshot that may be a frame behind.
+*/
+class IDStats
+{
+public:
+    IDStats();
+    void addFrame(int bus, CAN_FRAME &frame);
+    void addFrame(int bus, CAN_FRAME_FD &frame);
+    ID_STATS_ENTRY *next(int bus, int &slot);
+    uint32_t meanPeriod(ID_STATS_ENTRY &entry);
+    void reset();
+    int getCount();
+    uint32_t getUntracked();
+    void print(int bus);
+
+private:
+    ID_STATS_ENTRY table[1 << ID_STATS_BITS];
+    uint16_t numIDs;
+    uint32_t untracked;
+    volatile bool resetPending;
+
+    void update(int bus, uint32_t key, uint8_t length, const uint8_t *data, uint32_t timestamp);
+    void clearTable();
+};
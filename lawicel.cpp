@@ -6,63 +6,93 @@ Implements the lawicel protocol.
 #include "config.h"
 #include <esp32_can.h>
 #include "utility.h"
+#include "textformat.h"
+#include "gvret_comm.h"
+#include "can_manager.h"
+#include "filter_manager.h"
+
+/*
+All LAWICEL output is queued in the same buffers GVRET uses and goes out with the timed flush in loop().
+Whichever link was last active gets it which means slcan works over the WiFi telnet port too.
+*/
+CommBuffer &LAWICELHandler::outputBuffer()
+{
+    if (SysSettings.isWifiActive) return wifiGVRET;
+    return serialGVRET;
+}
+
+void LAWICELHandler::sendByte(uint8_t byt)
+{
+    outputBuffer().sendByteToBuffer(byt);
+}
+
+void LAWICELHandler::sendString(const char *str)
+{
+    outputBuffer().sendBytesToBuffer((const uint8_t *)str, strlen(str));
+}
 
 void LAWICELHandler::handleShortCmd(char cmd)
 {
     switch (cmd)
     {
     case 'O': //LAWICEL open canbus port
+        canManager.pauseRx();
         CAN0.setListenOnlyMode(false);
         CAN0.begin(settings.canSettings[0].nomSpeed, 255);
         CAN0.enable();
-        Serial.write(13); //send CR to mean "ok"
+        canManager.resumeRx();
+        sendByte(13); //send CR to mean "ok"
         SysSettings.lawicelMode = true;
         break;
     case 'C': //LAWICEL close canbus port (First one)
+        canManager.pauseRx();
         CAN0.disable();
-        Serial.write(13); //send CR to mean "ok"
+        canManager.resumeRx();
+        sendByte(13); //send CR to mean "ok"
         break;
     case 'L': //LAWICEL open canbus port in listen only mode
+        canManager.pauseRx();
         CAN0.setListenOnlyMode(true);
         CAN0.begin(settings.canSettings[0].nomSpeed, 255); 
         CAN0.enable();
-        Serial.write(13); //send CR to mean "ok"
+        canManager.resumeRx();
+        sendByte(13); //send CR to mean "ok"
         SysSettings.lawicelMode = true;
         break;
     case 'P': //LAWICEL - poll for one waiting frame. Or, just CR if no frames
         if (CAN0.available()) SysSettings.lawicelPollCounter = 1;
-        else Serial.write(13); //no waiting frames
+        else sendByte(13); //no waiting frames
         break;
     case 'A': //LAWICEL - poll for all waiting frames - CR if no frames
         SysSettings.lawicelPollCounter = CAN0.available();
-        if (SysSettings.lawicelPollCounter == 0) Serial.write(13);
+        if (SysSettings.lawicelPollCounter == 0) sendByte(13);
         break;
     case 'F': //LAWICEL - read status bits
-        Serial.print("F00"); //bit 0 = RX Fifo Full, 1 = TX Fifo Full, 2 = Error warning, 3 = Data overrun, 5= Error passive, 6 = Arb. Lost, 7 = Bus Error
-        Serial.write(13);
+        sendString("F00"); //bit 0 = RX Fifo Full, 1 = TX Fifo Full, 2 = Error warning, 3 = Data overrun, 5= Error passive, 6 = Arb. Lost, 7 = Bus Error
+        sendByte(13);
         break;
     case 'V': //LAWICEL - get version number
-        Serial.print("V1013\n");
+        sendString("V1013\n");
         SysSettings.lawicelMode = true;
         break;
     case 'N': //LAWICEL - get serial number
-        Serial.print("ESP32RET\n");
+        sendString("ESP32RET\n");
         SysSettings.lawicelMode = true;
         break;
     case 'x':
         SysSettings.lawicellExtendedMode = !SysSettings.lawicellExtendedMode;
         if (SysSettings.lawicellExtendedMode) {
-            Serial.print("V2\n");
+            sendString("V2\n");
         }
         else {
-            Serial.print("LAWICEL\n");
+            sendString("LAWICEL\n");
         }            
         break;
     case 'B': //LAWICEL V2 - Output list of supported buses
         if (SysSettings.lawicellExtendedMode) {
             for (int i = 0; i < NUM_BUSES; i++) {
                 printBusName(i);
-                Serial.print("\n");
+                sendString("\n");
             }
         }
         break;
@@ -76,7 +106,6 @@ void LAWICELHandler::handleShortCmd(char cmd)
 void LAWICELHandler::handleLongCmd(char *buffer)
 {
     CAN_FRAME outFrame;
-    char buff[80];
     int val;
     
     tokenizeCmdString(buffer);
@@ -84,27 +113,40 @@ void LAWICELHandler::handleLongCmd(char *buffer)
     switch (buffer[0]) {
     case 't': //transmit standard frame
         outFrame.id = Utility::parseHexString(buffer + 1, 3);
-        outFrame.length = buffer[4] - '0';
+        val = buffer[4] - '0'; //length is unsigned so check the range before it goes in
+        if (val < 0) val = 0;
+        if (val > 8) val = 8;
+        outFrame.length = val;
         outFrame.extended = false;
-        if (outFrame.length < 0) outFrame.length = 0;
-        if (outFrame.length > 8) outFrame.length = 8;
         for (int data = 0; data < outFrame.length; data++) {
             outFrame.data.bytes[data] = Utility::parseHexString(buffer + 5 + (2 * data), 2);
         }
         CAN0.sendFrame(outFrame);
-        if (SysSettings.lawicelAutoPoll) Serial.print("z");
+        if (SysSettings.lawicelAutoPoll) sendString("z");
         break;
     case 'T': //transmit extended frame
         outFrame.id = Utility::parseHexString(buffer + 1, 8);
-        outFrame.length = buffer[9] - '0';
+        val = buffer[9] - '0';
+        if (val < 0) val = 0;
+        if (val > 8) val = 8;
+        outFrame.length = val;
         outFrame.extended = false;
-        if (outFrame.length < 0) outFrame.length = 0;
-        if (outFrame.length > 8) outFrame.length = 8;
         for (int data = 0; data < outFrame.length; data++) {
             outFrame.data.bytes[data] = Utility::parseHexString(buffer + 10 + (2 * data), 2);
         }
         CAN0.sendFrame(outFrame);
-        if (SysSettings.lawicelAutoPoll) Serial.print("Z");
+        if (SysSettings.lawicelAutoPoll) sendString("Z");
+        break;
+    case 'd': //transmit standard FD frame
+    case 'D': //transmit extended FD frame
+    case 'b': //transmit standard FD frame with bit rate switch
+    case 'B': //transmit extended FD frame with bit rate switch
+        if (!sendFDCmd(buffer))
+        {
+            sendByte(7); //BELL means error
+            return;
+        }
+        if (SysSettings.lawicelAutoPoll) sendString((buffer[0] == 'd' || buffer[0] == 'b') ? "z" : "Z");
         break;
     case 'S': 
         if (!SysSettings.lawicellExtendedMode) {
@@ -193,16 +235,9 @@ void LAWICELHandler::handleLongCmd(char *buffer)
         if (SysSettings.lawicellExtendedMode) { //Lawicel V2 - Set filter mask - M <busid> <Mask> <FilterID> <Ext?>
             int mask = strtol(tokens[2], nullptr, 16);
             int filt = strtol(tokens[3], nullptr, 16);
-            if (!strcasecmp(tokens[1], "CAN0")) 
-            {
-                if (!strcasecmp(tokens[4], "X")) CAN0.setRXFilter(0, filt, mask, true);
-                    else CAN0.setRXFilter(0, filt, mask, false);
-            }
-            if (!strcasecmp(tokens[1], "CAN1"))
-            {
-                if (!strcasecmp(tokens[4], "X")) CAN1.setRXFilter(0, filt, mask, true);
-                    else CAN1.setRXFilter(0, filt, mask, false);
-            }
+            bool ext = !strcasecmp(tokens[4], "X");
+            if (!strcasecmp(tokens[1], "CAN0")) filterManager.addFilter(0, filt, mask, ext);
+            if (!strcasecmp(tokens[1], "CAN1")) filterManager.addFilter(1, filt, mask, ext);
         }
         else { //Lawicel V1 - set acceptance code
         }        
@@ -225,16 +260,24 @@ void LAWICELHandler::handleLongCmd(char *buffer)
         if (SysSettings.lawicellExtendedMode) {
             //at least two parameters separated by spaces. First BUS ID (CAN0, CAN1, SWCAN, etc) then speed (or more params separated by #'s)
             int speed = atoi(tokens[2]);
+            canManager.pauseRx();
             if (!strcasecmp(tokens[1], "CAN0")) {
                 CAN0.begin(speed, 255);
             }
             if (!strcasecmp(tokens[1], "CAN1")) {
                 CAN1.begin(speed, 255);
             }            
+            canManager.resumeRx();
         }
         break;
     }
-    Serial.write(13);
+    sendByte(13);
+}
+
+//Answer a command that couldn't be handled
+void LAWICELHandler::rejectCmd()
+{
+    sendByte(7); //BELL means error
 }
 
 //Tokenize cmdBuffer on space boundaries - up to 10 tokens supported
@@ -242,15 +285,16 @@ void LAWICELHandler::tokenizeCmdString(char *buff) {
    int idx = 0;
    char *tok;
    
-   for (int i = 0; i < 13; i++) tokens[i][0] = 0;
+   memset(tokens, 0, sizeof(tokens)); //strncpy doesn't terminate tokens that get cut short
    
+   //tokens longer than fit (like the data of a frame command) are cut short, those commands read the line itself
    tok = strtok(buff, " ");
-   if (tok != nullptr) strcpy(tokens[idx], tok);
+   if (tok != nullptr) strncpy(tokens[idx], tok, sizeof(tokens[idx]) - 1);
        else tokens[idx][0] = 0;
-   while (tokens[idx] != nullptr && idx < 13) {
+   while (tokens[idx][0] != 0 && idx < 13) {
        idx++;
        tok = strtok(nullptr, " ");
-       if (tok != nullptr) strcpy(tokens[idx], tok);
+       if (tok != nullptr) strncpy(tokens[idx], tok, sizeof(tokens[idx]) - 1);
             else tokens[idx][0] = 0;
    }
 }
@@ -265,26 +309,60 @@ void LAWICELHandler::uppercaseToken(char *token) {
 }
 
 void LAWICELHandler::printBusName(int bus) {
-    switch (bus) {
-    case 0:
-        Serial.print("CAN0");
-        break;
-    case 1:
-        Serial.print("CAN1");
-        break;
-    default:
-        Serial.print("UNKNOWN");
-        break;
+    sendString(getBusName(bus));
+}
+
+const char *LAWICELHandler::getBusName(int bus) {
+    static const char *names[NUM_BUSES] = {"CAN0", "CAN1", "CAN2", "CAN3", "CAN4"};
+    if (bus < 0 || bus >= NUM_BUSES) return "UNKNOWN";
+    return names[bus];
+}
+
+/*
+slcan FD frame commands. d/b are standard IDs (3 hex digits), D/B are extended (8 hex digits). Then a single
+DLC character 0-F and 2 hex digits per data byte. The frame goes out of the first bus currently running in FD mode.
+CAN_FRAME_FD has no bit rate switch flag, so whether the data phase switches is up to the driver and the bus setup.
+The d and b forms put the same frame on the bus.
+*/
+bool LAWICELHandler::sendFDCmd(char *buffer)
+{
+    CAN_FRAME_FD outFrame;
+    bool extended = (buffer[0] == 'D' || buffer[0] == 'B');
+    int idDigits = extended ? 8 : 3;
+    int fdBus = -1;
+
+    for (int i = 0; i < SysSettings.numBuses; i++)
+    {
+        if (canBuses[i] && settings.canSettings[i].enabled && settings.canSettings[i].fdMode && canBuses[i]->supportsFDMode())
+        {
+            fdBus = i;
+            break;
+        }
     }
+    if (fdBus == -1) return false;
+
+    size_t cmdLen = strlen(buffer);
+    if (cmdLen < (size_t)(idDigits + 2)) return false;
+    outFrame.id = Utility::parseHexString(buffer + 1, idDigits);
+    outFrame.extended = extended;
+    outFrame.length = Utility::fdDLCToLength(Utility::parseHexCharacter(buffer[1 + idDigits]));
+    if (cmdLen < (size_t)(idDigits + 2 + (2 * outFrame.length))) return false;
+    outFrame.fdMode = 1;
+    outFrame.rrs = 0;
+    for (int data = 0; data < outFrame.length; data++) {
+        outFrame.data.bytes[data] = Utility::parseHexString(buffer + idDigits + 2 + (2 * data), 2);
+    }
+    canManager.sendFrame(canBuses[fdBus], outFrame);
+    return true;
 }
 
 //Expecting to find ID in tokens[2] then zero or more data bytes
 bool LAWICELHandler::parseLawicelCANCmd(CAN_FRAME &frame) {
-    if (tokens[2] == nullptr) return false;
+    if (tokens[2][0] == 0) return false;
     frame.id = strtol(tokens[2], nullptr, 16);
     int idx = 3;
     int dataLen = 0;
-    while (tokens[idx] != nullptr) {
+    while (idx < 14 && tokens[idx][0] != 0 && dataLen < 8) {
         frame.data.bytes[dataLen++] = strtol(tokens[idx], nullptr, 16);
         idx++;
     }
@@ -295,52 +373,94 @@ bool LAWICELHandler::parseLawicelCANCmd(CAN_FRAME &frame) {
 
 void LAWICELHandler::sendFrameToBuffer(CAN_FRAME &frame, int whichBus)
 {
-    uint8_t buff[40];
-    uint8_t writtenBytes;
-    uint8_t temp;
-    uint32_t now = micros();
-    
+    char buff[80];
+    int len = 0;
+
+    //the whole line is formatted locally then queued with a single call
     if (SysSettings.lawicellExtendedMode) 
     {
-        Serial.print(micros());
-        Serial.print(" - ");
-        Serial.print(frame.id, HEX);            
-        if (frame.extended) Serial.print(" X ");
-        else Serial.print(" S ");
-        
-        printBusName(whichBus);
+        len += TextFormat::uintDec(buff + len, (uint32_t)Utility::frameTime64(frame.timestamp));
+        len += TextFormat::str(buff + len, " - ");
+        len += TextFormat::hex(buff + len, frame.id, 1, true);
+        len += TextFormat::str(buff + len, frame.extended ? " X " : " S ");
+        len += TextFormat::str(buff + len, getBusName(whichBus));
+        for (int d = 0; d < frame.length; d++) 
+        {
+            buff[len++] = ' ';
+            len += TextFormat::hexByte(buff + len, frame.data.uint8[d], true);
+        }
+    }
+    else 
+    {
+        if (frame.extended) 
+        {
+            buff[len++] = 'T';
+            len += TextFormat::hex(buff + len, frame.id, 8, false);
+        } 
+        else 
+        {
+            buff[len++] = 't';
+            len += TextFormat::hex(buff + len, frame.id, 3, false);
+        }
+        len += TextFormat::uintDec(buff + len, frame.length);
+        for (int i = 0; i < frame.length; i++) 
+        {
+            len += TextFormat::hexByte2(buff + len, frame.data.uint8[i], false);
+        }
+        if (SysSettings.lawicelTimestamping) 
+        {
+            uint16_t timestamp = (uint16_t)millis();
+            len += TextFormat::hex(buff + len, timestamp, 4, false);
+        }
+    }
+    buff[len++] = 13;
+    outputBuffer().sendBytesToBuffer((uint8_t *)buff, len);
+}
+
+void LAWICELHandler::sendFrameToBuffer(CAN_FRAME_FD &frame, int whichBus)
+{
+    char buff[240];
+    int len = 0;
+
+    if (SysSettings.lawicellExtendedMode) 
+    {
+        len += TextFormat::uintDec(buff + len, (uint32_t)Utility::frameTime64(frame.timestamp));
+        len += TextFormat::str(buff + len, " - ");
+        len += TextFormat::hex(buff + len, frame.id, 1, true);
+        len += TextFormat::str(buff + len, frame.extended ? " X " : " S ");
+        len += TextFormat::str(buff + len, getBusName(whichBus));
         for (int d = 0; d < frame.length; d++) 
         {
-            Serial.print(" ");
-            Serial.print(frame.data.uint8[d], HEX);
+            buff[len++] = ' ';
+            len += TextFormat::hexByte(buff + len, frame.data.uint8[d], true);
         }
     }
     else 
     {
+        //buses in FD mode hand back classic frames through this path too. Those keep the classic t/T format.
+        //The driver doesn't say whether a received frame switched bit rate, so FD frames are d/D (no BRS claimed)
+        bool isFD = frame.fdMode || (frame.length > 8);
         if (frame.extended) 
         {
-            Serial.print("T");
-            sprintf((char *)buff, "%08x", frame.id);
-            Serial.print((char *)buff);
+            buff[len++] = isFD ? 'D' : 'T';
+            len += TextFormat::hex(buff + len, frame.id, 8, false);
         } 
         else 
         {
-            Serial.print("t");
-            sprintf((char *)buff, "%03x", frame.id);
-            Serial.print((char *)buff);
+            buff[len++] = isFD ? 'd' : 't';
+            len += TextFormat::hex(buff + len, frame.id, 3, false);
         }
-        Serial.print(frame.length);
+        len += TextFormat::hexByte(buff + len, Utility::fdLengthToDLC(frame.length), true);
         for (int i = 0; i < frame.length; i++) 
         {
-            sprintf((char *)buff, "%02x", frame.data.uint8[i]);
-            Serial.print((char *)buff);
+            len += TextFormat::hexByte2(buff + len, frame.data.uint8[i], false);
         }
         if (SysSettings.lawicelTimestamping) 
         {
             uint16_t timestamp = (uint16_t)millis();
-            sprintf((char *)buff, "%04x", timestamp);
-            Serial.print((char *)buff);
+            len += TextFormat::hex(buff + len, timestamp, 4, false);
         }
     }
-    Serial.write(13);
-}
\ No newline at end of file
+    buff[len++] = 13;
+    outputBuffer().sendBytesToBuffer((uint8_t *)buff, len);
+}
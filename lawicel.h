@@ -1,6 +1,10 @@
 #pragma once
 
+#include <Arduino.h>
+
 class CAN_FRAME;
+class CAN_FRAME_FD;
+class CommBuffer;
 
 class LAWICELHandler
 {
@@ -8,12 +12,19 @@ public:
     void handleLongCmd(char *buffer);
     void handleShortCmd(char cmd);
     void sendFrameToBuffer(CAN_FRAME &frame, int whichBus);
+    void sendFrameToBuffer(CAN_FRAME_FD &frame, int whichBus);
+    void rejectCmd();
 
 private:
     char tokens[14][10];
 
     void tokenizeCmdString(char *buff);
     void uppercaseToken(char *token);
+    CommBuffer &outputBuffer();
+    void sendByte(uint8_t byt);
+    void sendString(const char *str);
     void printBusName(int bus);
+    const char *getBusName(int bus);
     bool parseLawicelCANCmd(CAN_FRAME &frame);
+    bool sendFDCmd(char *buffer);
 };
\ No newline at end of file
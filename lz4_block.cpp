@@ -0,0 +1,143 @@
+#include "lz4_block.h"
+#include <string.h>
+
+#define LZ4_MIN_MATCH       4
+#define LZ4_LAST_LITERALS   5   //the format requires a block to end with at least this many literals
+#define LZ4_MF_LIMIT        12  //and the last match to start at least this far from the end
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t val;
+    memcpy(&val, p, 4);
+    return val;
+}
+
+static inline uint32_t hashSequence(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+//Lengths of 15 and up spill into extra bytes of 255 each plus a final byte with the remainder
+static inline size_t writeLength(uint8_t *dst, size_t length)
+{
+    size_t len = 0;
+    while (length >= 255)
+    {
+        dst[len++] = 255;
+        length -= 255;
+    }
+    dst[len++] = (uint8_t)length;
+    return len;
+}
+
+/*
+Compress length bytes (at most LZ4_MAX_INPUT) of src into dst. Returns the compressed length or 0 if it
+won't fit in capacity bytes. Passing LZ4_BOUND(length) for capacity means it always fits.
+*/
+size_t LZ4Block::compress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity)
+{
+    size_t ip = 0, anchor = 0, op = 0;
+
+    if (length > LZ4_MAX_INPUT) return 0;
+    memset(hashTable, 0, sizeof(hashTable));
+
+    if (length > LZ4_MF_LIMIT)
+    {
+        size_t matchLimit = length - LZ4_LAST_LITERALS;
+        while (ip < length - LZ4_MF_LIMIT)
+        {
+            uint32_t sequence = read32(src + ip);
+            uint32_t hash = hashSequence(sequence);
+            size_t ref = hashTable[hash];
+            hashTable[hash] = (uint16_t)ip;
+            if (ref >= ip || read32(src + ref) != sequence)
+            {
+                ip++;
+                continue;
+            }
+
+            //a match can usually be stretched back over a few of the pending literals
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1])
+            {
+                ip--;
+                ref--;
+            }
+            size_t matchEnd = ip + LZ4_MIN_MATCH;
+            while (matchEnd < matchLimit && src[matchEnd] == src[ref + (matchEnd - ip)]) matchEnd++;
+
+            size_t literals = ip - anchor;
+            size_t matchLength = matchEnd - ip - LZ4_MIN_MATCH;
+            if (op + 1 + literals + (literals / 255) + 1 + 2 + (matchLength / 255) + 1 > capacity) return 0;
+
+            uint8_t *token = &dst[op++];
+            *token = (uint8_t)(((literals >= 15) ? 15 : literals) << 4) | ((matchLength >= 15) ? 15 : matchLength);
+            if (literals >= 15) op += writeLength(&dst[op], literals - 15);
+            memcpy(&dst[op], &src[anchor], literals);
+            op += literals;
+            size_t offset = ip - ref;
+            dst[op++] = (uint8_t)(offset & 0xFF);
+            dst[op++] = (uint8_t)(offset >> 8);
+            if (matchLength >= 15) op += writeLength(&dst[op], matchLength - 15);
+
+            //remember a spot near the end of the match too so the next frame can find it
+            if (matchEnd - 2 < length - LZ4_MF_LIMIT) hashTable[hashSequence(read32(src + matchEnd - 2))] = (uint16_t)(matchEnd - 2);
+            ip = anchor = matchEnd;
+        }
+    }
+
+    //whatever is left goes out as a final run of literals
+    size_t literals = length - anchor;
+    if (op + 1 + literals + (literals / 255) + 1 > capacity) return 0;
+    dst[op++] = (uint8_t)(((literals >= 15) ? 15 : literals) << 4);
+    if (literals >= 15) op += writeLength(&dst[op], literals - 15);
+    memcpy(&dst[op], &src[anchor], literals);
+    op += literals;
+    return op;
+}
+
+//Unpack one block. Returns the decompressed length or -1 if the block is malformed or won't fit in capacity.
+int LZ4Block::decompress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity)
+{
+    size_t ip = 0, op = 0;
+    uint8_t byt;
+
+    while (ip < length)
+    {
+        uint8_t token = src[ip++];
+        size_t literals = token >> 4;
+        if (literals == 15)
+        {
+            do
+            {
+                if (ip >= length) return -1;
+                byt = src[ip++];
+                literals += byt;
+            } while (byt == 255);
+        }
+        if (ip + literals > length || op + literals > capacity) return -1;
+        memcpy(&dst[op], &src[ip], literals);
+        ip += literals;
+        op += literals;
+        if (ip == length) break; //the last sequence has no match part
+
+        if (ip + 2 > length) return -1;
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) return -1;
+        size_t matchLength = token & 0xF;
+        if (matchLength == 15)
+        {
+            do
+            {
+                if (ip >= length) return -1;
+                byt = src[ip++];
+                matchLength += byt;
+            } while (byt == 255);
+        }
+        matchLength += LZ4_MIN_MATCH;
+        if (op + matchLength > capacity) return -1;
+        //byte at a time since the match may overlap what it's producing
+        for (size_t i = 0; i < matchLength; i++, op++) dst[op] = dst[op - offset];
+    }
+    return (int)op;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define LZ4_HASH_BITS       10
+#define LZ4_MAX_INPUT       65535
+//Room compress() may need for length bytes of input that don't compress at all
+#define LZ4_BOUND(length)   ((length) + ((length) / 255) + 16)
+
+/*
+Compressor for the standard LZ4 block format so the host side can unpack it with any LZ4 library
+(LZ4_decompress_safe and friends) or with decompress() below. Plain C++ with no Arduino dependencies so
+host tools can build this file as is. Every block stands on its own, nothing is carried over from the
+previous one. That costs some ratio but a client that misses a block can still read the next.
+The hash table only holds one candidate per slot which keeps it fast and small. CAN traffic repeats
+the same IDs and mostly the same payloads over and over so that still finds most of the matches.
+*/
+class LZ4Block
+{
+public:
+    size_t compress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity);
+    static int decompress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity);
+
+private:
+    uint16_t hashTable[1 << LZ4_HASH_BITS]; //last position each 4 byte sequence hash was seen at
+};
@@ -0,0 +1,90 @@
+/*
+CommBuffer throughput. One thread writes GVRET sized records into the ring as fast as it will take them and
+another drains it the way loop() does, through writeToStream(). Either side yields when there's nothing for it to
+do, like the real tasks would, so this also works on a single core. Reports bytes/sec and records/sec through the
+ring plus how often the producer found it full. Numbers are for this machine, not an ESP32, so compare them with
+each other and not with the real thing.
+*/
+#include <Arduino.h>
+#include <thread>
+#include <atomic>
+#include <unistd.h>
+#include "commbuffer.h"
+
+//Where the drained bytes go. Throws them away but looks at them so the copy can't be skipped
+class NullStream : public Print
+{
+public:
+    uint64_t bytes = 0;
+    uint8_t check = 0;
+
+    size_t write(uint8_t byt) override
+    {
+        return write(&byt, 1);
+    }
+
+    size_t write(const uint8_t *buffer, size_t size) override
+    {
+        check ^= buffer[0] ^ buffer[size - 1];
+        bytes += size;
+        return size;
+    }
+};
+
+static CommBuffer ring;
+
+int main(int argc, char **argv)
+{
+    float seconds = 2.0f;
+    int recordSize = 20; //a binary GVRET frame with 8 data bytes
+    int opt;
+    while ((opt = getopt(argc, argv, "s:l:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 's': seconds = atof(optarg); break;
+        case 'l': recordSize = atoi(optarg); break;
+        default:
+            printf("Usage: bench_commbuffer [-s seconds] [-l record length]\n");
+            return 1;
+        }
+    }
+    if (recordSize < 1 || recordSize > 200) recordSize = 20;
+
+    std::atomic<bool> running(true);
+    uint64_t records = 0, waits = 0;
+    std::thread producer([&]()
+    {
+        uint8_t record[200];
+        for (int i = 0; i < recordSize; i++) record[i] = (uint8_t)i;
+        while (running.load(std::memory_order_relaxed))
+        {
+            if (ring.numFreeBytes() < (size_t)recordSize)
+            {
+                waits++;
+                std::this_thread::yield();
+                continue;
+            }
+            record[1] = (uint8_t)records;
+            if (ring.sendBytesToBuffer(record, recordSize)) records++;
+        }
+    });
+
+    NullStream out;
+    uint64_t start = micros();
+    uint64_t end = start + (uint64_t)(seconds * 1000000.0f);
+    while (micros() < end)
+    {
+        if (!ring.writeToStream(out)) std::this_thread::yield();
+    }
+    running = false;
+    producer.join();
+    ring.writeToStream(out);
+    double elapsed = (micros() - start) / 1000000.0;
+
+    printf("%i byte records for %.2f s: %.1f MB/s, %.0f records/s, producer found the ring full %llu times, peak %u bytes\n",
+           recordSize, elapsed, out.bytes / elapsed / 1000000.0, records / elapsed, (unsigned long long)waits,
+           (unsigned int)ring.getPeakBytes());
+    //nothing may be lost or made up on the way through
+    return (out.bytes == records * recordSize && !ring.getOverflowCount()) ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+/*
+Runs the whole sketch on the host with virtual CAN buses feeding it and the serial port going to a counter
+instead of a USB host. Good for frames/sec and encode cost comparisons between builds without hardware.
+Numbers are for this machine, not an ESP32, so compare them with each other and not with the real thing.
+
+In binary mode the GVRET output is parsed as it is written so the time from a frame being received to it
+being written out the serial port can be measured as well.
+*/
+#include <Arduino.h>
+#include <Preferences.h>
+#include <esp32_can.h>
+#include <unistd.h>
+#include "config.h"
+#include "gvret_comm.h"
+
+void setup();
+void loop();
+
+//Takes the place of the USB host. Counts what the sketch writes and picks the GVRET frames out of it
+class SerialSink : public Print
+{
+public:
+    bool echo = false;
+    uint64_t frames = 0;
+    uint64_t latencyTotal = 0;
+    uint32_t latencyMax = 0;
+
+    size_t write(uint8_t byt) override
+    {
+        return write(&byt, 1);
+    }
+
+    size_t write(const uint8_t *buffer, size_t size) override
+    {
+        if (echo) fwrite(buffer, 1, size, stdout);
+        uint32_t now = micros();
+        for (size_t i = 0; i < size; i++) parse(buffer[i], now);
+        return size;
+    }
+
+private:
+    uint8_t msg[32];
+    size_t msgLength = 0;
+    size_t msgExpected = 0;
+
+    //only legacy PROTO_BUILD_CAN_FRAME messages are looked for: F1 00, 4 byte time, 4 byte ID, length/bus, data, 0
+    void parse(uint8_t byt, uint32_t now)
+    {
+        if (msgLength == 0)
+        {
+            if (byt == 0xF1) msg[msgLength++] = byt;
+            return;
+        }
+        if (msgLength == 1 && byt != 0)
+        {
+            msgLength = (byt == 0xF1) ? 1 : 0;
+            return;
+        }
+        msg[msgLength++] = byt;
+        if (msgLength == 11) msgExpected = 11 + (byt & 0xF) + 1;
+        if (msgLength >= 11 && msgLength == msgExpected)
+        {
+            uint32_t stamp = msg[2] | (msg[3] << 8) | (msg[4] << 16) | ((uint32_t)msg[5] << 24);
+            uint32_t latency = now - stamp;
+            frames++;
+            latencyTotal += latency;
+            if (latency > latencyMax) latencyMax = latency;
+            msgLength = 0;
+        }
+    }
+};
+
+static void usage()
+{
+    printf("Usage: esp32ret_sim [options]\n"
+           "  -r <frames/sec>  synthetic traffic rate on CAN0 (default 2000)\n"
+           "  -l <bytes>       synthetic frame length, 0-8 (default 8)\n"
+           "  -i <ids>         number of synthetic IDs (default 16)\n"
+           "  -f <file>        replay a candump log on CAN0 instead of synthetic traffic\n"
+           "  -x <speed>       replay speed, 0 plays it as fast as it is taken (default 1)\n"
+           "  -s <seconds>     how long to run (default 5)\n"
+           "  -q <frames>      driver receive queue depth (default %i)\n"
+           "  -y <type>        board type as for SYSTYPE (default 0, Macchina A0)\n"
+           "  -b               binary GVRET output instead of text. Needed for the latency figures\n"
+           "  -t               threaded mode\n"
+           "  -e               echo what the sketch writes to stdout\n", SIM_RX_QUEUE);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t rate = 2000;
+    int length = 8, ids = 16, queue = SIM_RX_QUEUE, sysType = 0;
+    const char *replayFile = nullptr;
+    float replaySpeed = 1.0f, seconds = 5.0f;
+    bool binary = false, threaded = false;
+    SerialSink sink;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:l:i:f:x:s:q:y:bteh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r': rate = strtoul(optarg, nullptr, 10); break;
+        case 'l': length = atoi(optarg); break;
+        case 'i': ids = atoi(optarg); break;
+        case 'f': replayFile = optarg; break;
+        case 'x': replaySpeed = atof(optarg); break;
+        case 's': seconds = atof(optarg); break;
+        case 'q': queue = atoi(optarg); break;
+        case 'y': sysType = atoi(optarg); break;
+        case 'b': binary = true; break;
+        case 't': threaded = true; break;
+        case 'e': sink.echo = true; break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    //loadSettings() picks these up
+    Preferences prefs;
+    prefs.begin(PREF_NAME, false);
+    prefs.putBool("binarycomm", binary);
+    prefs.putBool("threaded", threaded);
+    prefs.putUChar("systype", sysType);
+    prefs.putUChar("wifiMode", 0);
+    prefs.end();
+
+    Serial.setSink(&sink);
+    setup();
+
+    CAN0.setQueueSize(queue);
+    if (replayFile)
+    {
+        if (!CAN0.replay(replayFile, replaySpeed))
+        {
+            fprintf(stderr, "Could not read any frames from %s\n", replayFile);
+            return 1;
+        }
+    }
+    else CAN0.generate(rate, length, ids);
+
+    uint64_t bytesStart = Serial.getBytesWritten();
+    uint64_t start = esp_timer_get_time();
+    uint64_t end = start + (uint64_t)(seconds * 1000000.0f);
+    while ((uint64_t)esp_timer_get_time() < end && !(replayFile && CAN0.trafficDone() && !CAN0.available()))
+    {
+        if (SysSettings.isCANTaskActive) delay(10);
+        else loop();
+    }
+    CAN0.stopTraffic();
+    double elapsed = (esp_timer_get_time() - start) / 1000000.0;
+    if (!SysSettings.isCANTaskActive) loop(); //last flush
+    else delay(50);
+
+    uint64_t framesRead = CAN0.getReceived();
+    uint64_t bytes = Serial.getBytesWritten() - bytesStart;
+
+    Serial.setSink(nullptr);
+    printf("\nRan %.2f s, %s mode, %s output\n", elapsed, SysSettings.isCANTaskActive ? "threaded" : "single threaded",
+           binary ? "binary" : "text");
+    printf("CAN0: %llu frames came in, %u lost to a full receive queue\n", (unsigned long long)CAN0.getGenerated(), CAN0.getMissed());
+    printf("Sketch read %llu frames (%.0f frames/s)\n", (unsigned long long)framesRead, framesRead / elapsed);
+    printf("Serial: %llu bytes (%.0f bytes/s), GVRET dropped %u bytes\n", (unsigned long long)bytes, bytes / elapsed,
+           serialGVRET.getDroppedBytes());
+    if (binary && sink.frames)
+    {
+        printf("Receive to serial write: %llu frames, mean %llu us, max %u us\n", (unsigned long long)sink.frames,
+               (unsigned long long)(sink.latencyTotal / sink.frames), sink.latencyMax);
+    }
+    fflush(stdout);
+    //the sketch's tasks never end, so don't run static destructors underneath them
+    _exit(0);
+}
@@ -0,0 +1,180 @@
+#pragma once
+/*
+Just enough of the Arduino-ESP32 core for the sketch to build and run on a Linux host. Time comes from the host's
+monotonic clock, Serial is an in memory stream the simulator and tests feed and read, and the FreeRTOS calls
+the sketch makes run on std::thread. Nothing here tries to model the ESP32's timing.
+*/
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <strings.h>
+#include <string>
+#include <deque>
+#include <mutex>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HEX 16
+#define DEC 10
+#define OUTPUT 1
+#define INPUT 0
+#define HIGH 1
+#define LOW 0
+#define NUM_ANALOG_INPUTS 6
+
+unsigned long micros();
+unsigned long millis();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+int digitalRead(int pin);
+int analogRead(int pin);
+uint32_t esp_get_free_heap_size();
+int64_t esp_timer_get_time();
+
+class String
+{
+public:
+    String();
+    String(const char *str);
+    String(char c);
+    String(int value);
+    String(unsigned int value);
+    String(long value);
+    String(unsigned long value);
+    void concat(const String &str);
+    void concat(const char *str);
+    void toCharArray(char *buff, unsigned int size) const;
+    unsigned int length() const;
+    char operator[](unsigned int index) const;
+    void toUpperCase();
+    bool startsWith(const char *prefix) const;
+    bool startsWith(const String &prefix) const;
+    bool operator==(const String &other) const;
+    String operator+(const String &other) const;
+    String operator+(const char *other) const;
+    friend String operator+(const char *left, const String &right);
+    String &operator+=(const String &other);
+    String &operator+=(const char *other);
+    String &operator+=(char c);
+    const char *c_str() const;
+    void trim();
+    int indexOf(const char *str) const;
+    String substring(unsigned int from) const;
+    String substring(unsigned int from, unsigned int to) const;
+
+private:
+    std::string str;
+};
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t byt) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *str);
+    size_t print(const char *str);
+    size_t print(const String &str);
+    size_t print(char c);
+    size_t print(int value, int base = DEC);
+    size_t print(unsigned int value, int base = DEC);
+    size_t print(long value, int base = DEC);
+    size_t print(unsigned long value, int base = DEC);
+    size_t print(unsigned char value, int base = DEC);
+    size_t println(const char *str);
+    size_t println(const String &str);
+    size_t println(int value, int base = DEC);
+    size_t println(unsigned int value, int base = DEC);
+    size_t println(long value, int base = DEC);
+    size_t println(unsigned long value, int base = DEC);
+    size_t println();
+    size_t printf(const char *format, ...);
+    virtual int availableForWrite();
+
+private:
+    size_t printNumber(unsigned long value, bool negative, int base);
+};
+
+class Stream : public Print
+{
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    size_t readBytes(uint8_t *buffer, size_t length);
+    size_t readBytes(char *buffer, size_t length);
+    String readStringUntil(char terminator);
+    void setTimeout(unsigned long timeout);
+};
+
+/*
+USB serial port. What the sketch writes is handed to the sink if there is one, otherwise it's kept until
+takeOutput() collects it. feedInput() queues bytes for the sketch to read as if they came from the host.
+*/
+class HardwareSerial : public Stream
+{
+public:
+    HardwareSerial();
+    void begin(unsigned long baud);
+    int available() override;
+    int read() override;
+    size_t read(uint8_t *buffer, size_t length);
+    size_t write(uint8_t byt) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+    void setTxTimeoutMs(uint32_t timeout);
+    operator bool() const;
+    void flush();
+    size_t setRxBufferSize(size_t size);
+
+    //simulation side
+    void feedInput(const uint8_t *bytes, size_t length);
+    void feedInput(const char *str);
+    std::string takeOutput();
+    void setSink(Print *sink);
+    uint64_t getBytesWritten();
+
+private:
+    std::mutex lock;
+    std::deque<uint8_t> input;
+    std::string output;
+    Print *sink;
+    uint64_t bytesWritten;
+};
+
+extern HardwareSerial Serial;
+
+class IPAddress
+{
+public:
+    IPAddress();
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d);
+    operator uint32_t() const;
+    String toString() const;
+
+private:
+    uint8_t octets[4];
+};
+
+size_t operator<<(Print &stream, const IPAddress &addr);
+
+class EspClass
+{
+public:
+    uint8_t getChipRevision();
+    uint32_t getCycleCount();
+    void restart();
+    uint32_t getCpuFreqMHz();
+};
+
+extern EspClass ESP;
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
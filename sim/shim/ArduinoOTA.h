@@ -0,0 +1,28 @@
+#pragma once
+#include <Arduino.h>
+#include <functional>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+typedef int ota_error_t;
+enum { OTA_AUTH_ERROR, OTA_BEGIN_ERROR, OTA_CONNECT_ERROR, OTA_RECEIVE_ERROR, OTA_END_ERROR };
+#define U_FLASH 0
+
+class ArduinoOTAClass
+{
+public:
+    ArduinoOTAClass &setPort(uint16_t port) { return *this; }
+    ArduinoOTAClass &setHostname(const char *name) { return *this; }
+    ArduinoOTAClass &onStart(std::function<void()> fn) { return *this; }
+    ArduinoOTAClass &onEnd(std::function<void()> fn) { return *this; }
+    ArduinoOTAClass &onProgress(std::function<void(unsigned int, unsigned int)> fn) { return *this; }
+    ArduinoOTAClass &onError(std::function<void(ota_error_t)> fn) { return *this; }
+    void begin() {}
+    void handle() {}
+    int getCommand() { return U_FLASH; }
+};
+
+extern ArduinoOTAClass ArduinoOTA;
+
+#pragma GCC diagnostic pop
@@ -0,0 +1,16 @@
+#pragma once
+#include <WiFi.h>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+class MDNSResponder
+{
+public:
+    bool begin(const char *name) { return true; }
+    void addService(const char *service, const char *proto, uint16_t port) {}
+};
+
+extern MDNSResponder MDNS;
+
+#pragma GCC diagnostic pop
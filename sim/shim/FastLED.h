@@ -0,0 +1,37 @@
+#pragma once
+#include <Arduino.h>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+struct CRGB
+{
+    enum Colors { Red, Green, Blue, Purple, White, Black };
+    CRGB() {}
+    CRGB(Colors color) {}
+    CRGB &operator=(Colors color) { return *this; }
+};
+
+#define WS2812B 0
+#define GRB 0
+#define TypicalLEDStrip 0
+
+struct CLEDController
+{
+    CLEDController &setCorrection(int correction) { return *this; }
+};
+
+class CFastLED
+{
+public:
+    template<int TYPE, int PIN, int ORDER> CLEDController &addLeds(CRGB *leds, int count) { return controller; }
+    void setBrightness(int brightness) {}
+    void show() {}
+
+private:
+    CLEDController controller;
+};
+
+extern CFastLED FastLED;
+
+#pragma GCC diagnostic pop
@@ -0,0 +1,33 @@
+#pragma once
+#include <Arduino.h>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+/*
+NVS preferences kept in memory for the life of the program. Namespaces share one store, ESP32RET only uses one.
+Anything put before setup() runs is what loadSettings() finds, which is how the simulator and tests pick settings.
+*/
+class Preferences
+{
+public:
+    bool begin(const char *name, bool readOnly = false) { return true; }
+    void end() {}
+    bool clear();
+    bool remove(const char *key);
+    bool getBool(const char *key, bool defaultValue = false);
+    uint8_t getUChar(const char *key, uint8_t defaultValue = 0);
+    uint16_t getUShort(const char *key, uint16_t defaultValue = 0);
+    uint32_t getUInt(const char *key, uint32_t defaultValue = 0);
+    size_t getString(const char *key, char *value, size_t maxLength);
+    size_t getBytes(const char *key, void *buffer, size_t maxLength);
+    size_t getBytesLength(const char *key);
+    size_t putBool(const char *key, bool value);
+    size_t putUChar(const char *key, uint8_t value);
+    size_t putUShort(const char *key, uint16_t value);
+    size_t putUInt(const char *key, uint32_t value);
+    size_t putString(const char *key, const char *value);
+    size_t putBytes(const char *key, const void *value, size_t length);
+};
+
+#pragma GCC diagnostic pop
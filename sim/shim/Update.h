@@ -0,0 +1,22 @@
+#pragma once
+#include <Arduino.h>
+#include <functional>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+//Firmware updates always fail on the host
+class UpdateClass
+{
+public:
+    void onProgress(std::function<void(size_t, size_t)> fn) {}
+    bool begin(size_t size) { return false; }
+    size_t writeStream(Stream &stream) { return 0; }
+    bool end() { return false; }
+    bool isFinished() { return false; }
+    int getError() { return 1; }
+};
+
+extern UpdateClass Update;
+
+#pragma GCC diagnostic pop
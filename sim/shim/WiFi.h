@@ -0,0 +1,96 @@
+#pragma once
+#include <Arduino.h>
+#include <functional>
+#include <memory>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+/*
+There is no network on the host. A telnet client is one end of a local socket pair and simConnect() hands the
+other end to the test, which then plays the PC on the far side. The socket is shared between copies the same way
+it is on the ESP32, and stop() closes it for all of them.
+*/
+class WiFiClient : public Stream
+{
+public:
+    WiFiClient() {}
+    explicit WiFiClient(int fd);
+    int available() override;
+    int read() override;
+    int read(uint8_t *buffer, size_t length);
+    size_t write(uint8_t byt) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+    uint8_t connected();
+    void stop();
+    operator bool() { return (bool)sock; }
+    IPAddress remoteIP() { return sock ? IPAddress(127, 0, 0, 1) : IPAddress(); }
+    int fd() const { return sock ? sock->fd : -1; }
+    int connect(const char *host, uint16_t port) { return 0; }
+    void flush() {}
+    int setNoDelay(bool noDelay) { return 0; }
+
+private:
+    struct Socket
+    {
+        int fd;
+        ~Socket();
+    };
+    std::shared_ptr<Socket> sock;
+};
+
+//Clients made by simConnect() wait here until the sketch's server on that port takes them
+class WiFiServer
+{
+public:
+    void begin(uint16_t port = 0) { this->port = port; }
+    void setNoDelay(bool noDelay) {}
+    bool hasClient();
+    WiFiClient available();
+
+private:
+    uint16_t port = 0;
+};
+
+//Connects to the sketch's server on port and returns the host end of the connection. The caller closes it
+int simConnect(uint16_t port);
+
+typedef int WiFiEvent_t;
+typedef struct
+{
+    struct
+    {
+        int reason;
+    } wifi_sta_disconnected;
+} WiFiEventInfo_t;
+typedef int WiFiEventId_t;
+
+#define ARDUINO_EVENT_WIFI_STA_DISCONNECTED 1
+#define WIFI_STA 1
+#define WIFI_AP 2
+#define WL_CONNECTED 3
+#define WL_DISCONNECTED 6
+
+class WiFiClass
+{
+public:
+    void mode(int mode) {}
+    void setSleep(bool sleep) {}
+    void begin(const char *ssid, const char *password) {}
+    WiFiEventId_t onEvent(std::function<void(WiFiEvent_t, WiFiEventInfo_t)> handler, int event) { return 0; }
+    bool isConnected() { return false; }
+    IPAddress localIP() { return IPAddress(); }
+    IPAddress softAPIP() { return IPAddress(192, 168, 4, 1); }
+    int RSSI() { return 0; }
+    bool softAP(const char *ssid, const char *password) { return true; }
+    int status() { return WL_DISCONNECTED; }
+    String SSID() { return String(); }
+};
+
+extern WiFiClass WiFi;
+
+static inline void esp_sleep_enable_timer_wakeup(uint64_t us) {}
+static inline void esp_deep_sleep_start() {}
+
+#pragma GCC diagnostic pop
@@ -0,0 +1,26 @@
+#pragma once
+#include <WiFi.h>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+//Datagrams go nowhere. endPacket() still reports success so the sender's accounting carries on as normal
+class WiFiUDP : public Stream
+{
+public:
+    uint8_t begin(uint16_t port) { return 1; }
+    int beginPacket(IPAddress ip, uint16_t port) { return 1; }
+    int endPacket() { return 1; }
+    size_t write(uint8_t byt) override { return 1; }
+    size_t write(const uint8_t *buffer, size_t size) override { return size; }
+    using Print::write;
+    int parsePacket() { return 0; }
+    IPAddress remoteIP() { return IPAddress(); }
+    uint16_t remotePort() { return 0; }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int read(uint8_t *buffer, size_t length) { return -1; }
+    void flush() {}
+};
+
+#pragma GCC diagnostic pop
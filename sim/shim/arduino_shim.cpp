@@ -0,0 +1,641 @@
+#include <Arduino.h>
+#include <Preferences.h>
+#include <WiFi.h>
+#include <ArduinoOTA.h>
+#include <ESPmDNS.h>
+#include <Update.h>
+#include <FastLED.h>
+#include <esp_timer.h>
+#include <chrono>
+#include <thread>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <unistd.h>
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+ArduinoOTAClass ArduinoOTA;
+MDNSResponder MDNS;
+UpdateClass Update;
+CFastLED FastLED;
+
+static const auto startTime = std::chrono::steady_clock::now();
+
+int64_t esp_timer_get_time()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+unsigned long micros()
+{
+    return (uint32_t)esp_timer_get_time();
+}
+
+unsigned long millis()
+{
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+void delay(unsigned long ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+void pinMode(int pin, int mode) {}
+void digitalWrite(int pin, int value) {}
+int digitalRead(int pin) { return LOW; }
+int analogRead(int pin) { return 0; }
+
+uint32_t esp_get_free_heap_size()
+{
+    return 200000;
+}
+
+/*
+String
+*/
+String::String() {}
+String::String(const char *s) : str(s ? s : "") {}
+String::String(char c) : str(1, c) {}
+String::String(int value) : str(std::to_string(value)) {}
+String::String(unsigned int value) : str(std::to_string(value)) {}
+String::String(long value) : str(std::to_string(value)) {}
+String::String(unsigned long value) : str(std::to_string(value)) {}
+
+void String::concat(const String &other) { str += other.str; }
+void String::concat(const char *other) { str += other; }
+unsigned int String::length() const { return str.length(); }
+char String::operator[](unsigned int index) const { return (index < str.length()) ? str[index] : 0; }
+const char *String::c_str() const { return str.c_str(); }
+bool String::startsWith(const char *prefix) const { return str.compare(0, strlen(prefix), prefix) == 0; }
+bool String::startsWith(const String &prefix) const { return startsWith(prefix.c_str()); }
+bool String::operator==(const String &other) const { return str == other.str; }
+String String::operator+(const String &other) const { String out(*this); out.str += other.str; return out; }
+String String::operator+(const char *other) const { String out(*this); out.str += other; return out; }
+String operator+(const char *left, const String &right) { return String(left) + right; }
+String &String::operator+=(const String &other) { str += other.str; return *this; }
+String &String::operator+=(const char *other) { str += other; return *this; }
+String &String::operator+=(char c) { str += c; return *this; }
+
+void String::toCharArray(char *buff, unsigned int size) const
+{
+    if (!size) return;
+    size_t len = (str.length() < size - 1) ? str.length() : size - 1;
+    memcpy(buff, str.c_str(), len);
+    buff[len] = 0;
+}
+
+void String::toUpperCase()
+{
+    for (auto &c : str) c = toupper((unsigned char)c);
+}
+
+void String::trim()
+{
+    size_t first = str.find_first_not_of(" \t\r\n");
+    if (first == std::string::npos)
+    {
+        str.clear();
+        return;
+    }
+    size_t last = str.find_last_not_of(" \t\r\n");
+    str = str.substr(first, last - first + 1);
+}
+
+int String::indexOf(const char *other) const
+{
+    size_t pos = str.find(other);
+    return (pos == std::string::npos) ? -1 : (int)pos;
+}
+
+String String::substring(unsigned int from) const
+{
+    return substring(from, str.length());
+}
+
+String String::substring(unsigned int from, unsigned int to) const
+{
+    String out;
+    if (to > str.length()) to = str.length();
+    if (from < to) out.str = str.substr(from, to - from);
+    return out;
+}
+
+/*
+Print and Stream
+*/
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+    size_t n = 0;
+    while (size--) n += write(*buffer++);
+    return n;
+}
+
+size_t Print::write(const char *str)
+{
+    return write((const uint8_t *)str, strlen(str));
+}
+
+size_t Print::printNumber(unsigned long value, bool negative, int base)
+{
+    char buff[40];
+    int pos = sizeof(buff);
+    if (base < 2) base = 10;
+    do
+    {
+        int digit = value % base;
+        buff[--pos] = (digit < 10) ? ('0' + digit) : ('A' + digit - 10);
+        value /= base;
+    } while (value);
+    if (negative) buff[--pos] = '-';
+    return write((const uint8_t *)&buff[pos], sizeof(buff) - pos);
+}
+
+size_t Print::print(const char *str) { return write(str); }
+size_t Print::print(const String &str) { return write(str.c_str()); }
+size_t Print::print(char c) { return write((uint8_t)c); }
+size_t Print::print(unsigned char value, int base) { return printNumber(value, false, base); }
+size_t Print::print(unsigned int value, int base) { return printNumber(value, false, base); }
+size_t Print::print(unsigned long value, int base) { return printNumber(value, false, base); }
+
+size_t Print::print(int value, int base)
+{
+    return print((long)value, base);
+}
+
+size_t Print::print(long value, int base)
+{
+    if (base == DEC && value < 0) return printNumber(-(unsigned long)value, true, base);
+    return printNumber((unsigned long)value, false, base);
+}
+
+size_t Print::println() { return write("\r\n"); }
+size_t Print::println(const char *str) { return print(str) + println(); }
+size_t Print::println(const String &str) { return print(str) + println(); }
+size_t Print::println(int value, int base) { return print(value, base) + println(); }
+size_t Print::println(unsigned int value, int base) { return print(value, base) + println(); }
+size_t Print::println(long value, int base) { return print(value, base) + println(); }
+size_t Print::println(unsigned long value, int base) { return print(value, base) + println(); }
+
+size_t Print::printf(const char *format, ...)
+{
+    char buff[512];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buff, sizeof(buff), format, args);
+    va_end(args);
+    if (len < 0) return 0;
+    if (len >= (int)sizeof(buff)) len = sizeof(buff) - 1;
+    return write((const uint8_t *)buff, len);
+}
+
+int Print::availableForWrite()
+{
+    return 4096;
+}
+
+size_t Stream::readBytes(uint8_t *buffer, size_t length)
+{
+    size_t count = 0;
+    int c;
+    while (count < length && (c = read()) >= 0) buffer[count++] = (uint8_t)c;
+    return count;
+}
+
+size_t Stream::readBytes(char *buffer, size_t length)
+{
+    return readBytes((uint8_t *)buffer, length);
+}
+
+String Stream::readStringUntil(char terminator)
+{
+    String out;
+    int c;
+    while ((c = read()) >= 0 && c != terminator) out += (char)c;
+    return out;
+}
+
+void Stream::setTimeout(unsigned long timeout) {}
+
+/*
+HardwareSerial
+*/
+HardwareSerial::HardwareSerial()
+{
+    sink = nullptr;
+    bytesWritten = 0;
+}
+
+void HardwareSerial::begin(unsigned long baud) {}
+void HardwareSerial::setTxTimeoutMs(uint32_t timeout) {}
+HardwareSerial::operator bool() const { return true; }
+void HardwareSerial::flush() {}
+size_t HardwareSerial::setRxBufferSize(size_t size) { return size; }
+
+int HardwareSerial::available()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return input.size();
+}
+
+int HardwareSerial::read()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (input.empty()) return -1;
+    uint8_t byt = input.front();
+    input.pop_front();
+    return byt;
+}
+
+size_t HardwareSerial::read(uint8_t *buffer, size_t length)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    size_t count = 0;
+    while (count < length && !input.empty())
+    {
+        buffer[count++] = input.front();
+        input.pop_front();
+    }
+    return count;
+}
+
+size_t HardwareSerial::write(uint8_t byt)
+{
+    return write(&byt, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    bytesWritten += size;
+    if (sink) sink->write(buffer, size);
+    else output.append((const char *)buffer, size);
+    return size;
+}
+
+void HardwareSerial::feedInput(const uint8_t *bytes, size_t length)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    input.insert(input.end(), bytes, bytes + length);
+}
+
+void HardwareSerial::feedInput(const char *str)
+{
+    feedInput((const uint8_t *)str, strlen(str));
+}
+
+std::string HardwareSerial::takeOutput()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::string out;
+    out.swap(output);
+    return out;
+}
+
+void HardwareSerial::setSink(Print *newSink)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    sink = newSink;
+}
+
+uint64_t HardwareSerial::getBytesWritten()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return bytesWritten;
+}
+
+/*
+IPAddress and ESP
+*/
+IPAddress::IPAddress()
+{
+    memset(octets, 0, sizeof(octets));
+}
+
+IPAddress::IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+    octets[0] = a;
+    octets[1] = b;
+    octets[2] = c;
+    octets[3] = d;
+}
+
+IPAddress::operator uint32_t() const
+{
+    return octets[0] | (octets[1] << 8) | (octets[2] << 16) | ((uint32_t)octets[3] << 24);
+}
+
+String IPAddress::toString() const
+{
+    char buff[16];
+    snprintf(buff, sizeof(buff), "%u.%u.%u.%u", octets[0], octets[1], octets[2], octets[3]);
+    return String(buff);
+}
+
+size_t operator<<(Print &stream, const IPAddress &addr)
+{
+    return stream.print(addr.toString());
+}
+
+uint8_t EspClass::getChipRevision() { return 3; }
+uint32_t EspClass::getCycleCount() { return (uint32_t)(esp_timer_get_time() * 240); }
+uint32_t EspClass::getCpuFreqMHz() { return 240; }
+
+void EspClass::restart()
+{
+    fprintf(stderr, "ESP.restart() called\n");
+    exit(0);
+}
+
+/*
+WiFi clients on local socket pairs
+*/
+static std::mutex pendingLock;
+static std::map<uint16_t, std::deque<int>> pendingClients; //sketch ends waiting for the server on each port
+
+WiFiClient::WiFiClient(int fd) : sock(std::make_shared<Socket>())
+{
+    sock->fd = fd;
+}
+
+WiFiClient::Socket::~Socket()
+{
+    close(fd);
+}
+
+int WiFiClient::available()
+{
+    int waiting = 0;
+    if (!sock || ioctl(sock->fd, FIONREAD, &waiting) < 0) return 0;
+    return waiting;
+}
+
+int WiFiClient::read()
+{
+    uint8_t byt;
+    return (read(&byt, 1) == 1) ? byt : -1;
+}
+
+int WiFiClient::read(uint8_t *buffer, size_t length)
+{
+    if (!sock) return -1;
+    int got = recv(sock->fd, buffer, length, MSG_DONTWAIT);
+    return (got > 0) ? got : -1;
+}
+
+size_t WiFiClient::write(uint8_t byt)
+{
+    return write(&byt, 1);
+}
+
+size_t WiFiClient::write(const uint8_t *buffer, size_t size)
+{
+    if (!sock) return 0;
+    int sent = send(sock->fd, buffer, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    return (sent > 0) ? sent : 0;
+}
+
+//Still connected until the far end closes, and whatever it sent before that can still be read
+uint8_t WiFiClient::connected()
+{
+    if (!sock) return 0;
+    uint8_t byt;
+    int got = recv(sock->fd, &byt, 1, MSG_PEEK | MSG_DONTWAIT);
+    return (got > 0 || (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))) ? 1 : 0;
+}
+
+void WiFiClient::stop()
+{
+    if (sock) shutdown(sock->fd, SHUT_RDWR);
+    sock.reset();
+}
+
+bool WiFiServer::hasClient()
+{
+    std::lock_guard<std::mutex> guard(pendingLock);
+    return !pendingClients[port].empty();
+}
+
+WiFiClient WiFiServer::available()
+{
+    std::lock_guard<std::mutex> guard(pendingLock);
+    std::deque<int> &pending = pendingClients[port];
+    if (pending.empty()) return WiFiClient();
+    WiFiClient client(pending.front());
+    pending.pop_front();
+    return client;
+}
+
+int simConnect(uint16_t port)
+{
+    int ends[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, ends) < 0) return -1;
+    std::lock_guard<std::mutex> guard(pendingLock);
+    pendingClients[port].push_back(ends[0]);
+    return ends[1];
+}
+
+/*
+FreeRTOS on host threads
+*/
+struct SIM_TASK
+{
+    uint32_t stackSize;
+};
+
+static int threadNumber()
+{
+    static std::atomic<int> nextNumber(1);
+    thread_local int number = nextNumber++;
+    return number;
+}
+
+void simEnterCritical(portMUX_TYPE *mux)
+{
+    int self = threadNumber();
+    if (mux->owner.load(std::memory_order_acquire) == self)
+    {
+        mux->count++;
+        return;
+    }
+    int expected = 0;
+    while (!mux->owner.compare_exchange_weak(expected, self, std::memory_order_acquire))
+    {
+        expected = 0;
+        std::this_thread::yield();
+    }
+    mux->count = 1;
+}
+
+void simExitCritical(portMUX_TYPE *mux)
+{
+    if (--mux->count == 0) mux->owner.store(0, std::memory_order_release);
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stackSize, void *param,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+    SIM_TASK *simTask = new SIM_TASK;
+    simTask->stackSize = stackSize;
+    if (handle) *handle = simTask;
+    std::thread(task, param).detach();
+    return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks * 1000 / configTICK_RATE_HZ));
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    //only ever used by a task on itself, which on the host means the thread just keeps sleeping
+    if (!task) for (;;) std::this_thread::sleep_for(std::chrono::seconds(1));
+}
+
+void taskYIELD()
+{
+    std::this_thread::yield();
+}
+
+BaseType_t xPortGetCoreID()
+{
+    return 0;
+}
+
+//Host threads get megabytes of stack and nobody measures it. Report the whole task stack as unused
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+    return task ? ((SIM_TASK *)task)->stackSize : 0;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+    return new std::recursive_timed_mutex;
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex()
+{
+    return new std::recursive_timed_mutex;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    std::recursive_timed_mutex *mutex = (std::recursive_timed_mutex *)sem;
+    if (ticks == portMAX_DELAY)
+    {
+        mutex->lock();
+        return pdTRUE;
+    }
+    return mutex->try_lock_for(std::chrono::milliseconds(ticks)) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t sem)
+{
+    ((std::recursive_timed_mutex *)sem)->unlock();
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    return xSemaphoreTakeRecursive(sem, ticks);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    return xSemaphoreGiveRecursive(sem);
+}
+
+/*
+Preferences
+*/
+static std::map<std::string, std::vector<uint8_t>> &prefStore()
+{
+    static std::map<std::string, std::vector<uint8_t>> store;
+    return store;
+}
+
+template<typename T> static T getPref(const char *key, T defaultValue)
+{
+    auto it = prefStore().find(key);
+    if (it == prefStore().end() || it->second.size() != sizeof(T)) return defaultValue;
+    T value;
+    memcpy(&value, it->second.data(), sizeof(T));
+    return value;
+}
+
+template<typename T> static size_t putPref(const char *key, T value)
+{
+    const uint8_t *bytes = (const uint8_t *)&value;
+    prefStore()[key] = std::vector<uint8_t>(bytes, bytes + sizeof(T));
+    return sizeof(T);
+}
+
+bool Preferences::clear()
+{
+    prefStore().clear();
+    return true;
+}
+
+bool Preferences::remove(const char *key)
+{
+    return prefStore().erase(key) > 0;
+}
+
+bool Preferences::getBool(const char *key, bool defaultValue) { return getPref<uint8_t>(key, defaultValue) != 0; }
+uint8_t Preferences::getUChar(const char *key, uint8_t defaultValue) { return getPref<uint8_t>(key, defaultValue); }
+uint16_t Preferences::getUShort(const char *key, uint16_t defaultValue) { return getPref<uint16_t>(key, defaultValue); }
+uint32_t Preferences::getUInt(const char *key, uint32_t defaultValue) { return getPref<uint32_t>(key, defaultValue); }
+size_t Preferences::putBool(const char *key, bool value) { return putPref<uint8_t>(key, value ? 1 : 0); }
+size_t Preferences::putUChar(const char *key, uint8_t value) { return putPref<uint8_t>(key, value); }
+size_t Preferences::putUShort(const char *key, uint16_t value) { return putPref<uint16_t>(key, value); }
+size_t Preferences::putUInt(const char *key, uint32_t value) { return putPref<uint32_t>(key, value); }
+
+size_t Preferences::getString(const char *key, char *value, size_t maxLength)
+{
+    auto it = prefStore().find(key);
+    if (it == prefStore().end() || !maxLength) return 0;
+    size_t len = it->second.size();
+    if (len > maxLength - 1) len = maxLength - 1;
+    memcpy(value, it->second.data(), len);
+    value[len] = 0;
+    return len + 1;
+}
+
+size_t Preferences::putString(const char *key, const char *value)
+{
+    prefStore()[key] = std::vector<uint8_t>(value, value + strlen(value));
+    return strlen(value);
+}
+
+size_t Preferences::getBytes(const char *key, void *buffer, size_t maxLength)
+{
+    auto it = prefStore().find(key);
+    if (it == prefStore().end() || it->second.size() > maxLength) return 0;
+    memcpy(buffer, it->second.data(), it->second.size());
+    return it->second.size();
+}
+
+size_t Preferences::getBytesLength(const char *key)
+{
+    auto it = prefStore().find(key);
+    return (it == prefStore().end()) ? 0 : it->second.size();
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)value;
+    prefStore()[key] = std::vector<uint8_t>(bytes, bytes + length);
+    return length;
+}
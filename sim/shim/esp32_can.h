@@ -0,0 +1,200 @@
+#pragma once
+#include <Arduino.h>
+#include <vector>
+
+typedef union
+{
+    uint64_t value;
+    uint32_t uint32[2];
+    uint16_t uint16[4];
+    uint8_t uint8[8];
+    uint8_t bytes[8];
+    uint8_t byte[8];
+} BytesUnion;
+
+typedef union
+{
+    uint64_t uint64[8];
+    uint32_t uint32[16];
+    uint16_t uint16[32];
+    uint8_t uint8[64];
+    uint8_t bytes[64];
+    uint8_t byte[64];
+} BytesUnion_FD;
+
+class CAN_FRAME
+{
+public:
+    CAN_FRAME();
+    BytesUnion data;
+    uint32_t id;
+    uint32_t fid;
+    uint8_t rtr;
+    uint8_t priority;
+    uint8_t extended;
+    uint32_t timestamp;
+    uint8_t length;
+};
+
+class CAN_FRAME_FD
+{
+public:
+    CAN_FRAME_FD();
+    BytesUnion_FD data;
+    uint32_t id;
+    uint32_t fid;
+    uint8_t rrs;
+    uint8_t priority;
+    uint8_t extended;
+    uint8_t fdMode;
+    uint32_t timestamp;
+    uint8_t length;
+};
+
+//A frame as the virtual controller keeps it. Classic frames have fd clear and at most 8 bytes
+struct SIM_FRAME
+{
+    CAN_FRAME_FD frame;
+    bool fd;
+    bool rtr;
+};
+
+#define SIM_MAX_FILTERS     32
+#define SIM_RX_QUEUE        64      //default receive queue depth, about what the real drivers buffer
+#define SIM_SENT_LOG        65536   //most sent frames kept for sentFrame(). The count goes on past that
+#define SIM_TRAFFIC_BASE_ID 0x100   //synthetic traffic uses IDs from here up
+
+/*
+Stands in for the CAN_COMMON driver base of esp32_can with a virtual controller. The sketch side API is the
+subset ESP32RET uses. Received frames come from one of three places:
+- inject() pushes a frame in right away
+- generate() makes synthetic traffic at a fixed rate. IDs go round from SIM_TRAFFIC_BASE_ID and frames of 4 or
+  more bytes carry a sequence number in their first 4 bytes (LSB first)
+- replay() plays a candump log file (from candump -l) back with its original timing, scaled by speed.
+  Speed 0 plays it as fast as the receive queue is emptied
+Traffic is produced lazily whenever the sketch asks available() or reads, so frames that came due while the
+queue was full count as missed the same way a real controller overflows. Frames sent go into a log and on to a
+peer bus when one is connected, which can be the bus itself for self reception.
+Acceptance filters are honoured. begin() clears them and with none set everything is received.
+*/
+class CAN_COMMON
+{
+public:
+    CAN_COMMON(bool fdCapable);
+    virtual ~CAN_COMMON();
+
+    //driver side, as called by the sketch
+    uint32_t begin(uint32_t baudrate = 500000, uint8_t enablePin = 255);
+    uint32_t beginFD(uint32_t nominalRate, uint32_t dataRate);
+    void enable();
+    void disable();
+    void setListenOnlyMode(bool state);
+    bool supportsFDMode();
+    bool sendFrame(CAN_FRAME &frame);
+    bool sendFrameFD(CAN_FRAME_FD &frame);
+    uint16_t available();
+    uint32_t read(CAN_FRAME &frame);
+    uint32_t readFD(CAN_FRAME_FD &frame);
+    int watchFor();
+    int watchFor(uint32_t id);
+    int watchFor(uint32_t id, uint32_t mask);
+    int setRXFilter(uint8_t mailbox, uint32_t id, uint32_t mask, bool extended);
+    int setRXFilter(uint32_t id, uint32_t mask, bool extended);
+    void setDebuggingMode(bool state);
+
+    //simulation side
+    void setQueueSize(size_t frames);
+    bool inject(CAN_FRAME &frame);
+    bool inject(CAN_FRAME_FD &frame);
+    void generate(uint32_t rate, int length, int numIDs, bool fd = false);
+    bool replay(const char *path, float speed);
+    void stopTraffic();
+    bool trafficDone();
+    void connect(CAN_COMMON *peer);
+    bool isEnabled();
+    bool isListenOnly();
+    uint32_t getSpeed();
+    uint32_t getDataSpeed();
+    uint64_t getGenerated();
+    uint64_t getReceived();
+    uint32_t getMissed();
+    uint64_t getSentCount();
+    size_t numSentLogged();
+    SIM_FRAME sentFrame(size_t index);
+    void clearSent();
+
+private:
+    struct FILTER_SLOT
+    {
+        uint32_t id;
+        uint32_t mask;
+        bool extended;
+        bool used;
+    };
+    struct REPLAY_FRAME
+    {
+        uint64_t time; //us after the first frame in the file
+        SIM_FRAME frame;
+    };
+    enum { SOURCE_NONE, SOURCE_SYNTHETIC, SOURCE_REPLAY };
+
+    std::recursive_mutex lock;
+    bool fdCapable;
+    bool enabled;
+    bool listenOnly;
+    bool fdMode;
+    uint32_t nomSpeed;
+    uint32_t dataSpeed;
+    FILTER_SLOT filters[SIM_MAX_FILTERS];
+    std::deque<SIM_FRAME> rxQueue;
+    size_t queueSize;
+    uint32_t missed;
+    uint64_t generated;
+    uint64_t received; //frames the sketch has read, all time
+    std::vector<SIM_FRAME> sentLog;
+    uint64_t sentCount;
+    CAN_COMMON *peer;
+
+    int source;
+    uint64_t sourceStart; //esp_timer_get_time() traffic started at
+    uint32_t rate;
+    int length;
+    int numIDs;
+    bool synthFD;
+    std::vector<REPLAY_FRAME> replayFrames;
+    size_t replayNext;
+    float replaySpeed;
+
+    void pump();
+    bool accepts(const SIM_FRAME &frame);
+    bool receive(const SIM_FRAME &frame);
+    void makeSynthetic(uint64_t seq, SIM_FRAME &out);
+    bool transmit(const SIM_FRAME &frame);
+    static bool parseCandump(const char *line, REPLAY_FRAME &out);
+};
+
+class ESP32CAN : public CAN_COMMON
+{
+public:
+    ESP32CAN();
+    void setCANPins(int rxPin, int txPin);
+};
+
+class MCP2517FD : public CAN_COMMON
+{
+public:
+    MCP2517FD(uint8_t csPin, uint8_t intPin);
+    uint8_t Read8(uint16_t address);
+    void Write8(uint16_t address, uint8_t value);
+    void setINTPin(uint8_t pin);
+    void setCSPin(uint8_t pin);
+
+private:
+    uint8_t registers[0x1000];
+};
+
+#define GPIO_NUM_4 4
+#define GPIO_NUM_5 5
+
+extern ESP32CAN CAN0;
+extern MCP2517FD CAN1; //on the S3 the sketch defines this one with the pins of its board
@@ -0,0 +1,5 @@
+#pragma once
+#include <stdint.h>
+
+//Microseconds since the program started
+int64_t esp_timer_get_time();
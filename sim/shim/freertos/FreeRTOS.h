@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef void *TaskHandle_t;
+typedef void *QueueHandle_t;
+typedef void *SemaphoreHandle_t;
+
+//ESP-IDF spinlock. On the host it's a real spinlock so code that relies on it between tasks is still exercised.
+//The owning thread can take it again, same as on the ESP32
+typedef struct
+{
+    std::atomic<int> owner;
+    int count;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {0, 0}
+#define portENTER_CRITICAL(mux) simEnterCritical(mux)
+#define portEXIT_CRITICAL(mux) simExitCritical(mux)
+#define portENTER_CRITICAL_ISR(mux) simEnterCritical(mux)
+#define portEXIT_CRITICAL_ISR(mux) simExitCritical(mux)
+
+void simEnterCritical(portMUX_TYPE *mux);
+void simExitCritical(portMUX_TYPE *mux);
+static inline void spinlock_initialize(portMUX_TYPE *mux)
+{
+    mux->owner = 0;
+    mux->count = 0;
+}
+
+#define pdPASS 1
+#define pdFAIL 0
+#define pdTRUE 1
+#define pdFALSE 0
+#define configTICK_RATE_HZ 1000
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define portMAX_DELAY 0xFFFFFFFF
+#define tskNO_AFFINITY 0x7FFFFFFF
+#define configMAX_PRIORITIES 25
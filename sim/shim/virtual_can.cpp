@@ -0,0 +1,506 @@
+#include <esp32_can.h>
+#include <esp_timer.h>
+#include <driver/twai.h>
+
+ESP32CAN CAN0;
+#ifndef CONFIG_IDF_TARGET_ESP32S3
+MCP2517FD CAN1(5, 26);
+#endif
+
+CAN_FRAME::CAN_FRAME()
+{
+    data.value = 0;
+    id = 0;
+    fid = 0;
+    rtr = 0;
+    priority = 15;
+    extended = false;
+    timestamp = 0;
+    length = 0;
+}
+
+CAN_FRAME_FD::CAN_FRAME_FD()
+{
+    memset(data.uint8, 0, sizeof(data.uint8));
+    id = 0;
+    fid = 0;
+    rrs = 0;
+    priority = 15;
+    extended = false;
+    fdMode = 0;
+    timestamp = 0;
+    length = 0;
+}
+
+CAN_COMMON::CAN_COMMON(bool canFD)
+{
+    fdCapable = canFD;
+    enabled = false;
+    listenOnly = false;
+    fdMode = false;
+    nomSpeed = 500000;
+    dataSpeed = 0;
+    memset(filters, 0, sizeof(filters));
+    queueSize = SIM_RX_QUEUE;
+    missed = 0;
+    generated = 0;
+    received = 0;
+    sentCount = 0;
+    peer = nullptr;
+    source = SOURCE_NONE;
+    sourceStart = 0;
+    rate = 0;
+    length = 0;
+    numIDs = 1;
+    synthFD = false;
+    replayNext = 0;
+    replaySpeed = 1.0f;
+}
+
+CAN_COMMON::~CAN_COMMON() {}
+
+uint32_t CAN_COMMON::begin(uint32_t baudrate, uint8_t enablePin)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    nomSpeed = baudrate;
+    dataSpeed = 0;
+    fdMode = false;
+    enabled = true;
+    memset(filters, 0, sizeof(filters));
+    rxQueue.clear();
+    return baudrate;
+}
+
+uint32_t CAN_COMMON::beginFD(uint32_t nominalRate, uint32_t dataRate)
+{
+    if (!fdCapable) return 0;
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    begin(nominalRate);
+    dataSpeed = dataRate;
+    fdMode = true;
+    return nominalRate;
+}
+
+void CAN_COMMON::enable()
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    enabled = true;
+}
+
+void CAN_COMMON::disable()
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    enabled = false;
+    rxQueue.clear();
+}
+
+void CAN_COMMON::setListenOnlyMode(bool state)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    listenOnly = state;
+}
+
+bool CAN_COMMON::supportsFDMode()
+{
+    return fdCapable;
+}
+
+void CAN_COMMON::setDebuggingMode(bool state) {}
+
+int CAN_COMMON::setRXFilter(uint8_t mailbox, uint32_t id, uint32_t mask, bool extended)
+{
+    if (mailbox >= SIM_MAX_FILTERS) return -1;
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    filters[mailbox].id = id;
+    filters[mailbox].mask = mask;
+    filters[mailbox].extended = extended;
+    filters[mailbox].used = true;
+    return mailbox;
+}
+
+int CAN_COMMON::setRXFilter(uint32_t id, uint32_t mask, bool extended)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    for (int i = 0; i < SIM_MAX_FILTERS; i++)
+    {
+        if (!filters[i].used) return setRXFilter(i, id, mask, extended);
+    }
+    return -1;
+}
+
+//Same as esp32_can: a catch all for standard frames in the first slot and one for extended in the second
+int CAN_COMMON::watchFor()
+{
+    setRXFilter(0, 0, 0, false);
+    setRXFilter(1, 0, 0, true);
+    return 0;
+}
+
+int CAN_COMMON::watchFor(uint32_t id)
+{
+    bool extended = id > 0x7FF;
+    return setRXFilter(id, extended ? 0x1FFFFFFF : 0x7FF, extended);
+}
+
+int CAN_COMMON::watchFor(uint32_t id, uint32_t mask)
+{
+    return setRXFilter(id, mask, id > 0x7FF);
+}
+
+bool CAN_COMMON::accepts(const SIM_FRAME &frame)
+{
+    bool anySet = false;
+    for (int i = 0; i < SIM_MAX_FILTERS; i++)
+    {
+        const FILTER_SLOT &filt = filters[i];
+        if (!filt.used) continue;
+        anySet = true;
+        if ((filt.extended ? true : false) != (frame.frame.extended ? true : false)) continue;
+        if ((frame.frame.id & filt.mask) == (filt.id & filt.mask)) return true;
+    }
+    return !anySet;
+}
+
+//Into the receive queue, or counted as missed when it's full. Filtered frames just disappear
+bool CAN_COMMON::receive(const SIM_FRAME &frame)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (!enabled) return false;
+    if (frame.fd && !fdMode) return false; //a classic controller only sees error frames
+    if (!accepts(frame)) return false;
+    if (rxQueue.size() >= queueSize)
+    {
+        missed++;
+        return false;
+    }
+    rxQueue.push_back(frame);
+    rxQueue.back().frame.timestamp = (uint32_t)esp_timer_get_time();
+    return true;
+}
+
+bool CAN_COMMON::transmit(const SIM_FRAME &frame)
+{
+    CAN_COMMON *to;
+    {
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        if (!enabled || listenOnly) return false;
+        if (frame.fd && !fdMode) return false;
+        if (sentLog.size() < SIM_SENT_LOG) sentLog.push_back(frame);
+        sentCount++;
+        to = peer;
+    }
+    if (to) to->receive(frame);
+    return true;
+}
+
+bool CAN_COMMON::sendFrame(CAN_FRAME &frame)
+{
+    SIM_FRAME out;
+    out.frame.id = frame.id;
+    out.frame.extended = frame.extended;
+    out.frame.length = (frame.length > 8) ? 8 : frame.length;
+    memcpy(out.frame.data.uint8, frame.data.uint8, 8);
+    out.fd = false;
+    out.rtr = frame.rtr ? true : false;
+    return transmit(out);
+}
+
+bool CAN_COMMON::sendFrameFD(CAN_FRAME_FD &frame)
+{
+    SIM_FRAME out;
+    out.frame = frame;
+    if (out.frame.length > 64) out.frame.length = 64;
+    out.fd = true;
+    out.rtr = false;
+    return transmit(out);
+}
+
+//Works out what traffic has come due since the last call and queues it up
+void CAN_COMMON::pump()
+{
+    if (source == SOURCE_NONE || !enabled) return;
+    uint64_t elapsed = esp_timer_get_time() - sourceStart;
+    if (source == SOURCE_SYNTHETIC)
+    {
+        uint64_t due = (rate * elapsed) / 1000000ull;
+        while (generated < due)
+        {
+            if (rxQueue.size() >= queueSize)
+            {
+                //everything else that came due was lost, no need to build the frames
+                missed += due - generated;
+                generated = due;
+                break;
+            }
+            SIM_FRAME frame;
+            makeSynthetic(generated++, frame);
+            receive(frame);
+        }
+    }
+    else
+    {
+        while (replayNext < replayFrames.size())
+        {
+            REPLAY_FRAME &next = replayFrames[replayNext];
+            if (replaySpeed > 0.0f)
+            {
+                if ((uint64_t)(next.time / replaySpeed) > elapsed) break;
+            }
+            else if (rxQueue.size() >= queueSize) break; //as fast as it gets read
+            replayNext++;
+            generated++;
+            receive(next.frame);
+        }
+    }
+}
+
+void CAN_COMMON::makeSynthetic(uint64_t seq, SIM_FRAME &out)
+{
+    out.fd = synthFD;
+    out.rtr = false;
+    out.frame.id = SIM_TRAFFIC_BASE_ID + (uint32_t)(seq % numIDs);
+    out.frame.extended = false;
+    out.frame.fdMode = synthFD;
+    out.frame.length = length;
+    for (int i = 0; i < length; i++) out.frame.data.uint8[i] = (i < 4) ? (uint8_t)(seq >> (8 * i)) : (uint8_t)(out.frame.id + i);
+}
+
+uint16_t CAN_COMMON::available()
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    pump();
+    return rxQueue.size();
+}
+
+uint32_t CAN_COMMON::read(CAN_FRAME &frame)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    pump();
+    if (rxQueue.empty()) return 0;
+    SIM_FRAME &in = rxQueue.front();
+    frame.id = in.frame.id;
+    frame.extended = in.frame.extended;
+    frame.rtr = in.rtr;
+    frame.length = (in.frame.length > 8) ? 8 : in.frame.length;
+    frame.timestamp = in.frame.timestamp;
+    memcpy(frame.data.uint8, in.frame.data.uint8, 8);
+    rxQueue.pop_front();
+    received++;
+    return 1;
+}
+
+uint32_t CAN_COMMON::readFD(CAN_FRAME_FD &frame)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    pump();
+    if (rxQueue.empty()) return 0;
+    frame = rxQueue.front().frame;
+    frame.fdMode = rxQueue.front().fd;
+    rxQueue.pop_front();
+    received++;
+    return 1;
+}
+
+void CAN_COMMON::setQueueSize(size_t frames)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    queueSize = frames;
+}
+
+bool CAN_COMMON::inject(CAN_FRAME &frame)
+{
+    SIM_FRAME in;
+    in.frame.id = frame.id;
+    in.frame.extended = frame.extended;
+    in.frame.length = (frame.length > 8) ? 8 : frame.length;
+    memcpy(in.frame.data.uint8, frame.data.uint8, 8);
+    in.fd = false;
+    in.rtr = frame.rtr ? true : false;
+    return receive(in);
+}
+
+bool CAN_COMMON::inject(CAN_FRAME_FD &frame)
+{
+    SIM_FRAME in;
+    in.frame = frame;
+    in.fd = true;
+    in.rtr = false;
+    return receive(in);
+}
+
+void CAN_COMMON::generate(uint32_t frameRate, int frameLength, int ids, bool fd)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    rate = frameRate;
+    length = (frameLength < 0) ? 0 : ((frameLength > (fd ? 64 : 8)) ? (fd ? 64 : 8) : frameLength);
+    numIDs = (ids < 1) ? 1 : ids;
+    synthFD = fd;
+    generated = 0;
+    sourceStart = esp_timer_get_time();
+    source = SOURCE_SYNTHETIC;
+}
+
+/*
+candump -l lines look like "(1436509052.249713) can0 123#DEADBEEF". Extended IDs have 8 digits, "123#R" is a
+remote request and FD frames are "123##<flags><data>".
+*/
+bool CAN_COMMON::parseCandump(const char *line, REPLAY_FRAME &out)
+{
+    unsigned long sec, usec;
+    char iface[32], body[300];
+    if (sscanf(line, " (%lu.%lu) %31s %299s", &sec, &usec, iface, body) != 4) return false;
+    char *hash = strchr(body, '#');
+    if (!hash) return false;
+    size_t idDigits = hash - body;
+    out.time = (uint64_t)sec * 1000000ull + usec;
+    out.frame.frame.id = strtoul(body, nullptr, 16);
+    out.frame.frame.extended = idDigits > 3;
+    out.frame.rtr = false;
+    out.frame.fd = false;
+    char *data = hash + 1;
+    if (*data == '#')
+    {
+        out.frame.fd = true;
+        data += 2; //flags nibble
+    }
+    else if (*data == 'R' || *data == 'r')
+    {
+        out.frame.rtr = true;
+        out.frame.frame.length = 0;
+        return true;
+    }
+    int len = 0;
+    while (isxdigit((unsigned char)data[0]) && isxdigit((unsigned char)data[1]) && len < (out.frame.fd ? 64 : 8))
+    {
+        char hex[3] = {data[0], data[1], 0};
+        out.frame.frame.data.uint8[len++] = (uint8_t)strtoul(hex, nullptr, 16);
+        data += 2;
+        if (*data == '.') data++;
+    }
+    out.frame.frame.length = len;
+    out.frame.frame.fdMode = out.frame.fd;
+    return true;
+}
+
+bool CAN_COMMON::replay(const char *path, float speed)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) return false;
+    std::vector<REPLAY_FRAME> frames;
+    char line[400];
+    while (fgets(line, sizeof(line), file))
+    {
+        REPLAY_FRAME frame;
+        if (parseCandump(line, frame)) frames.push_back(frame);
+    }
+    fclose(file);
+    if (frames.empty()) return false;
+    uint64_t first = frames[0].time;
+    for (auto &frame : frames) frame.time -= first;
+
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    replayFrames.swap(frames);
+    replayNext = 0;
+    replaySpeed = speed;
+    generated = 0;
+    sourceStart = esp_timer_get_time();
+    source = SOURCE_REPLAY;
+    return true;
+}
+
+void CAN_COMMON::stopTraffic()
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    pump(); //whatever came due before now still arrives
+    source = SOURCE_NONE;
+}
+
+bool CAN_COMMON::trafficDone()
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (source == SOURCE_REPLAY) return replayNext >= replayFrames.size();
+    return source == SOURCE_NONE;
+}
+
+void CAN_COMMON::connect(CAN_COMMON *other)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    peer = other;
+}
+
+bool CAN_COMMON::isEnabled() { return enabled; }
+bool CAN_COMMON::isListenOnly() { return listenOnly; }
+uint32_t CAN_COMMON::getSpeed() { return nomSpeed; }
+uint32_t CAN_COMMON::getDataSpeed() { return dataSpeed; }
+
+uint64_t CAN_COMMON::getGenerated()
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return generated;
+}
+
+uint64_t CAN_COMMON::getReceived()
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return received;
+}
+
+uint32_t CAN_COMMON::getMissed()
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return missed;
+}
+
+uint64_t CAN_COMMON::getSentCount()
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return sentCount;
+}
+
+size_t CAN_COMMON::numSentLogged()
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return sentLog.size();
+}
+
+SIM_FRAME CAN_COMMON::sentFrame(size_t index)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return sentLog.at(index);
+}
+
+void CAN_COMMON::clearSent()
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    sentLog.clear();
+    sentCount = 0;
+}
+
+ESP32CAN::ESP32CAN() : CAN_COMMON(false) {}
+void ESP32CAN::setCANPins(int rxPin, int txPin) {}
+
+MCP2517FD::MCP2517FD(uint8_t csPin, uint8_t intPin) : CAN_COMMON(true)
+{
+    memset(registers, 0, sizeof(registers));
+}
+
+uint8_t MCP2517FD::Read8(uint16_t address)
+{
+    return registers[address & 0xFFF];
+}
+
+void MCP2517FD::Write8(uint16_t address, uint8_t value)
+{
+    registers[address & 0xFFF] = value;
+}
+
+void MCP2517FD::setINTPin(uint8_t pin) {}
+void MCP2517FD::setCSPin(uint8_t pin) {}
+
+esp_err_t twai_get_status_info(twai_status_info_t *status)
+{
+    memset(status, 0, sizeof(*status));
+    status->msgs_to_rx = CAN0.available();
+    status->rx_missed_count = CAN0.getMissed();
+    return ESP_OK;
+}
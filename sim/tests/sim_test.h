@@ -0,0 +1,19 @@
+#pragma once
+/*
+Bare bones checks for the host tests. A failed CHECK prints where it was and the test carries on so one run shows
+everything that's wrong. Every test ends with return testResult().
+*/
+#include <stdio.h>
+
+static int testFailures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); testFailures++; } } while (0)
+#define CHECK_EQ(a, b) do { long long va = (long long)(a), vb = (long long)(b); if (va != vb) { \
+    fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, #a, #b, va, vb); testFailures++; } } while (0)
+
+static inline int testResult()
+{
+    if (testFailures) fprintf(stderr, "%i checks failed\n", testFailures);
+    else printf("All checks passed\n");
+    return testFailures ? 1 : 0;
+}
@@ -0,0 +1,210 @@
+/*
+Bus load bit counts. The exact calculation is checked against a plain reference that builds the whole
+bit stream as a vector and stuffs it one bit at a time, and the worst case must never come in under the exact count.
+BENCH=BUSLOAD runs at the end so its timings show up in the test log.
+*/
+#include <string>
+#include <vector>
+#include "sim_test.h"
+#include "busload.h"
+#include "benchmark.h"
+#include "utility.h"
+
+#define TAIL_BITS 13 //CRC delimiter, ACK slot and delimiter, EOF, intermission
+
+static void pushBits(std::vector<int> &bits, uint32_t value, int count)
+{
+    for (int i = count - 1; i >= 0; i--) bits.push_back((value >> i) & 1);
+}
+
+//How many stuff bits land in the stream, and how many of those come in before bit position split
+static int stuffCount(const std::vector<int> &bits, size_t split, int *beforeSplit)
+{
+    int stuffed = 0, run = 0, last = -1;
+    if (beforeSplit) *beforeSplit = 0;
+    for (size_t i = 0; i < bits.size(); i++)
+    {
+        if (bits[i] == last) run++;
+        else
+        {
+            last = bits[i];
+            run = 1;
+        }
+        if (run == 5)
+        {
+            stuffed++;
+            if (beforeSplit && i < split) (*beforeSplit)++;
+            last = !last;
+            run = 1;
+        }
+    }
+    return stuffed;
+}
+
+static void pushHeader(std::vector<int> &bits, uint32_t id, bool extended)
+{
+    bits.push_back(0); //SOF
+    if (extended)
+    {
+        pushBits(bits, id >> 18, 11);
+        pushBits(bits, 3, 2);
+        pushBits(bits, id & 0x3FFFF, 18);
+    }
+    else pushBits(bits, id, 11);
+}
+
+static int referenceClassic(CAN_FRAME &frame)
+{
+    std::vector<int> bits;
+    pushHeader(bits, frame.id, frame.extended);
+    bits.push_back(frame.rtr ? 1 : 0);
+    pushBits(bits, 0, 2); //IDE and r0, or r1 and r0
+    pushBits(bits, frame.length, 4);
+    if (!frame.rtr) for (int i = 0; i < frame.length; i++) pushBits(bits, frame.data.uint8[i], 8);
+    uint16_t crc = 0;
+    for (int bit : bits)
+    {
+        int next = bit ^ ((crc >> 14) & 1);
+        crc = (crc << 1) & 0x7FFF;
+        if (next) crc ^= 0x4599;
+    }
+    pushBits(bits, crc, 15);
+    return bits.size() + stuffCount(bits, 0, nullptr) + TAIL_BITS;
+}
+
+static FRAME_BITS referenceFD(CAN_FRAME_FD &frame)
+{
+    std::vector<int> bits;
+    FRAME_BITS result;
+    uint8_t dlc = Utility::fdLengthToDLC(frame.length);
+    int wireBytes = Utility::fdDLCToLength(dlc);
+    int fixedBits = 4 + ((wireBytes > 16) ? 21 : 17);
+
+    pushHeader(bits, frame.id, frame.extended);
+    if (frame.extended) pushBits(bits, 0x5, 4); //RRS, FDF, res, BRS
+    else pushBits(bits, 0x5, 5); //RRS, IDE, FDF, res, BRS
+    size_t arbBits = bits.size();
+    bits.push_back(0); //ESI
+    pushBits(bits, dlc, 4);
+    for (int i = 0; i < wireBytes; i++) pushBits(bits, (i < frame.length) ? frame.data.uint8[i] : 0xCC, 8);
+
+    int arbStuff;
+    int stuffed = stuffCount(bits, arbBits, &arbStuff);
+    result.nominalBits = arbBits + arbStuff + TAIL_BITS;
+    //stuff count and CRC get one fixed stuff bit up front then one every four bits
+    result.dataBits = (bits.size() - arbBits) + (stuffed - arbStuff) + fixedBits + 1 + fixedBits / 4;
+    return result;
+}
+
+static void fillData(uint8_t *data, int length, int pattern)
+{
+    for (int i = 0; i < length; i++)
+    {
+        switch (pattern)
+        {
+        case 0: data[i] = rand(); break;
+        case 1: data[i] = 0; break;    //long dominant runs, the most stuffing
+        case 2: data[i] = 0xFF; break;
+        default: data[i] = 0x55; break; //alternating, no stuffing at all
+        }
+    }
+}
+
+static void testClassic()
+{
+    srand(12);
+    for (int i = 0; i < 50000; i++)
+    {
+        CAN_FRAME frame;
+        frame.extended = rand() & 1;
+        frame.id = frame.extended ? (rand() & 0x1FFFFFFF) : (rand() & 0x7FF);
+        if (i % 7 == 0) frame.id = 0; //all dominant ID
+        frame.rtr = (i % 11 == 0);
+        frame.length = rand() % 9;
+        fillData(frame.data.uint8, 8, rand() % 4);
+
+        FRAME_BITS exact = BusLoad::exactBits(frame);
+        FRAME_BITS worst = BusLoad::worstCaseBits(frame);
+        int reference = referenceClassic(frame);
+        if (exact.nominalBits != reference || exact.dataBits != 0 || worst.nominalBits < exact.nominalBits)
+        {
+            fprintf(stderr, "id %x ext %i rtr %i len %i: exact %i reference %i worst %i\n", frame.id, frame.extended, frame.rtr,
+                    frame.length, exact.nominalBits, reference, worst.nominalBits);
+            testFailures++;
+            break;
+        }
+    }
+
+    //the textbook worst case for a standard 8 byte frame is 135 bits
+    CAN_FRAME frame;
+    frame.id = 0x555;
+    frame.extended = false;
+    frame.rtr = 0;
+    frame.length = 8;
+    CHECK_EQ(BusLoad::worstCaseBits(frame).nominalBits, 34 + 64 + 24 + TAIL_BITS);
+}
+
+static void testFD()
+{
+    srand(120);
+    for (int i = 0; i < 50000; i++)
+    {
+        CAN_FRAME_FD frame;
+        frame.extended = rand() & 1;
+        frame.id = frame.extended ? (rand() & 0x1FFFFFFF) : (rand() & 0x7FF);
+        frame.fdMode = 1;
+        frame.length = rand() % 65; //odd lengths are padded up to the next DLC
+        fillData(frame.data.uint8, 64, rand() % 4);
+
+        FRAME_BITS exact = BusLoad::exactBits(frame);
+        FRAME_BITS worst = BusLoad::worstCaseBits(frame);
+        FRAME_BITS reference = referenceFD(frame);
+        if (exact.nominalBits != reference.nominalBits || exact.dataBits != reference.dataBits ||
+            worst.nominalBits + worst.dataBits < exact.nominalBits + exact.dataBits || worst.dataBits < exact.dataBits)
+        {
+            fprintf(stderr, "id %x ext %i len %i: exact %i+%i reference %i+%i worst %i+%i\n", frame.id, frame.extended, frame.length,
+                    exact.nominalBits, exact.dataBits, reference.nominalBits, reference.dataBits, worst.nominalBits, worst.dataBits);
+            testFailures++;
+            break;
+        }
+    }
+
+    //classic frames on an FD bus go through the classic calculation
+    CAN_FRAME_FD fdFrame;
+    CAN_FRAME frame;
+    fdFrame.id = frame.id = 0x7E8;
+    fdFrame.extended = frame.extended = false;
+    fdFrame.fdMode = 0;
+    frame.rtr = 0;
+    fdFrame.length = frame.length = 8;
+    for (int i = 0; i < 8; i++) fdFrame.data.uint8[i] = frame.data.uint8[i] = (uint8_t)(i * 17);
+    CHECK_EQ(BusLoad::exactBits(fdFrame).nominalBits, BusLoad::exactBits(frame).nominalBits);
+    CHECK_EQ(BusLoad::exactBits(fdFrame).dataBits, 0);
+}
+
+static void testBenchmark()
+{
+    char which[] = "BUSLOAD";
+    Serial.takeOutput();
+    Benchmark::run(which);
+    std::string out = Serial.takeOutput();
+    int lines = 0, numbered = 0;
+    for (size_t pos = 0; (pos = out.find("len ", pos)) != std::string::npos; pos++)
+    {
+        int length, worstNom, worstData, worstNs, exactNom, exactData, exactNs;
+        lines++;
+        if (sscanf(out.c_str() + pos, "len %d: worst %d+%d bits %d ns  exact %d+%d bits %d ns", &length, &worstNom, &worstData,
+                   &worstNs, &exactNom, &exactData, &exactNs) == 7) numbered++;
+    }
+    CHECK(lines > 0);
+    CHECK_EQ(numbered, lines);
+    fputs(out.c_str(), stdout);
+}
+
+int main()
+{
+    testClassic();
+    testFD();
+    testBenchmark();
+    return testResult();
+}
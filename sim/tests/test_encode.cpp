@@ -0,0 +1,153 @@
+//Frame encoding: GVRET binary layout, text output against sprintf, and the encode benchmark on the host leaving
+//the live output format alone
+#include <string>
+#include <vector>
+#include "sim_test.h"
+#include "config.h"
+#include "commbuffer.h"
+#include "benchmark.h"
+#include "gvret_comm.h"
+#include "utility.h"
+
+static std::vector<uint8_t> takeAll(CommBuffer &buff)
+{
+    std::vector<uint8_t> out;
+    uint8_t *bytes;
+    size_t len;
+    while ((len = buff.peekBytes(0, &bytes)) > 0)
+    {
+        out.insert(out.end(), bytes, bytes + len);
+        buff.consumeBytes(len);
+    }
+    return out;
+}
+
+static void testBinaryLayout()
+{
+    uint8_t out[96];
+    CAN_FRAME frame;
+    frame.id = 0x18DAF110;
+    frame.extended = true;
+    frame.rtr = 0;
+    frame.length = 3;
+    frame.timestamp = 1000;
+    frame.data.uint8[0] = 0x11;
+    frame.data.uint8[1] = 0x22;
+    frame.data.uint8[2] = 0x33;
+
+    size_t len = CommBuffer::encodeBinaryFrame(frame, 1, out);
+    const uint8_t expected[] = {0xF1, 0, 0xE8, 0x03, 0, 0, 0x10, 0xF1, 0xDA, 0x98, 0x13, 0x11, 0x22, 0x33, 0};
+    CHECK_EQ(len, sizeof(expected));
+    CHECK(!memcmp(out, expected, sizeof(expected)));
+
+    frame.extended = false;
+    frame.id = 0x7E8;
+    frame.length = 0;
+    len = CommBuffer::encodeBinaryFrame(frame, 0, out, true);
+    const uint8_t expected64[] = {0xF1, PROTO_CAN_FRAME_TS64, 0xE8, 0x03, 0, 0, 0, 0, 0, 0, 0xE8, 0x07, 0, 0, 0, 0};
+    CHECK_EQ(len, sizeof(expected64));
+    CHECK(!memcmp(out, expected64, sizeof(expected64)));
+
+    CAN_FRAME_FD fdFrame;
+    fdFrame.id = 0x123;
+    fdFrame.extended = false;
+    fdFrame.length = 64;
+    fdFrame.timestamp = 1000;
+    for (int i = 0; i < 64; i++) fdFrame.data.uint8[i] = (uint8_t)(i * 3);
+    len = CommBuffer::encodeBinaryFrame(fdFrame, 1, out);
+    CHECK_EQ(len, 13 + 64); //F1, command, time, ID, length, bus, data, checksum
+    CHECK_EQ(out[1], PROTO_BUILD_FD_FRAME);
+    CHECK(out[6] == 0x23 && out[7] == 0x01 && out[8] == 0 && out[9] == 0);
+    CHECK_EQ(out[10], 64);
+    CHECK_EQ(out[11], 1);
+    CHECK(!memcmp(&out[12], fdFrame.data.uint8, 64));
+    CHECK_EQ(out[len - 1], 0);
+}
+
+//Text output has to be byte for byte what the old sprintf version wrote
+static void testTextMatchesSprintf()
+{
+    static CommBuffer buff;
+    char ref[400];
+    settings.useBinarySerialComm = true; //the format passed in wins
+    srand(4);
+
+    for (int i = 0; i < 20000; i++)
+    {
+        bool fd = rand() & 1;
+        bool extended = rand() & 1;
+        int bus = rand() % 3;
+        uint32_t id = extended ? (rand() & 0x1FFFFFFF) : (rand() & 0x7FF);
+        uint32_t stamp = 1 + rand() % 1000; //has to be in the past to come back unchanged from frameTime64
+        int length = fd ? Utility::fdDLCToLength(rand() % 16) : rand() % 9;
+        uint8_t data[64];
+        for (int b = 0; b < length; b++) data[b] = rand();
+
+        int refLen = sprintf(ref, "%d - %x %s %d %d", (int)stamp, id, extended ? "X" : "S", bus, length);
+        for (int b = 0; b < length; b++) refLen += sprintf(ref + refLen, " %x", data[b]);
+        refLen += sprintf(ref + refLen, "\r\n");
+
+        if (fd)
+        {
+            CAN_FRAME_FD frame;
+            frame.id = id;
+            frame.extended = extended;
+            frame.length = length;
+            frame.timestamp = stamp;
+            memcpy(frame.data.uint8, data, length);
+            buff.sendFrameToBuffer(frame, bus, false);
+        }
+        else
+        {
+            CAN_FRAME frame;
+            frame.id = id;
+            frame.extended = extended;
+            frame.rtr = 0;
+            frame.length = length;
+            frame.timestamp = stamp;
+            memcpy(frame.data.uint8, data, length);
+            buff.sendFrameToBuffer(frame, bus, false);
+        }
+        std::vector<uint8_t> out = takeAll(buff);
+        if (out.size() != (size_t)refLen || memcmp(out.data(), ref, refLen))
+        {
+            fprintf(stderr, "expected \"%.*s\" got \"%.*s\"\n", refLen - 2, ref, (int)out.size() - 2, (const char *)out.data());
+            testFailures++;
+            break;
+        }
+    }
+}
+
+//Runs the benchmark so its numbers show up in the test log. It encodes both formats itself and the live output
+//format must be the same after as before
+static void testBenchmark()
+{
+    char which[] = "ENCODE";
+    for (int binary = 0; binary < 2; binary++)
+    {
+        settings.useBinarySerialComm = binary;
+        Serial.takeOutput();
+        Benchmark::run(which);
+        CHECK_EQ(settings.useBinarySerialComm, binary);
+        std::string out = Serial.takeOutput();
+        int lines = 0, numbered = 0;
+        for (size_t pos = 0; (pos = out.find("len ", pos)) != std::string::npos; pos++)
+        {
+            int length, ns, bytes;
+            lines++;
+            if (sscanf(out.c_str() + pos, "len %d: %d ns/frame %d bytes/frame", &length, &ns, &bytes) == 3) numbered++;
+        }
+        CHECK_EQ(lines, 2 * 2 * 18); //both formats, both ID kinds, classic 0-8 and nine FD lengths
+        CHECK_EQ(numbered, lines); //Logger has to understand every conversion or the numbers come out as letters
+        if (binary) fputs(out.c_str(), stdout);
+    }
+}
+
+int main()
+{
+    delay(2); //timestamps of 1000us have to be in the past
+    testBinaryLayout();
+    testTextMatchesSprintf();
+    testBenchmark();
+    return testResult();
+}
@@ -0,0 +1,211 @@
+/*
+GVRET input parsing. A clean stream gets exactly the frames and errors it should, a stalled message
+times out, and any stream at all (garbage included, which is what the sanitizer build is for) gives the same
+frames, replies and error counts whether it comes in whole buffers, random chunks or a byte at a time.
+*/
+#include <vector>
+#include "sim_test.h"
+#include "config.h"
+#include "gvret_comm.h"
+
+struct PARSE_RESULT
+{
+    std::vector<uint32_t> sentIDs;
+    std::vector<uint8_t> replies;
+    uint32_t framingErrors;
+    uint32_t checksumErrors;
+};
+
+static void setupBuses()
+{
+    SysSettings.numBuses = 1;
+    for (int i = 0; i < NUM_BUSES; i++) canBuses[i] = &CAN0; //frames can name any of the four buses
+    settings.canSettings[0].enabled = true;
+    settings.canSettings[0].listenOnly = false;
+    CAN0.begin(500000, 255);
+    CAN0.setListenOnlyMode(false);
+}
+
+//chunk 0 means the whole stream at once, -1 random sized pieces, anything else pieces of that size
+static PARSE_RESULT parse(const std::vector<uint8_t> &stream, int chunk)
+{
+    GVRET_Comm_Handler *parser = new GVRET_Comm_Handler();
+    PARSE_RESULT result;
+    setupBuses(); //garbage can hold a PROTO_SETUP_CANBUS that turns the bus off or makes it listen only
+    CAN0.clearSent();
+    size_t pos = 0;
+    while (pos < stream.size())
+    {
+        size_t take = (chunk == 0) ? stream.size() : ((chunk < 0) ? 1 + rand() % 40 : chunk);
+        if (take > stream.size() - pos) take = stream.size() - pos;
+        if (chunk == 1) parser->processIncomingByte(stream[pos]);
+        else parser->processIncomingBytes(&stream[pos], take);
+        pos += take;
+
+        uint8_t *bytes;
+        size_t len;
+        while ((len = parser->peekBytes(0, &bytes)) > 0)
+        {
+            result.replies.insert(result.replies.end(), bytes, bytes + len);
+            parser->consumeBytes(len);
+        }
+    }
+    for (size_t i = 0; i < CAN0.numSentLogged(); i++) result.sentIDs.push_back(CAN0.sentFrame(i).frame.id);
+    result.framingErrors = parser->getFramingErrors();
+    result.checksumErrors = parser->getChecksumErrors();
+    delete parser;
+    return result;
+}
+
+static void addFrame(std::vector<uint8_t> &stream, uint32_t id, int length, int checksum)
+{
+    size_t start = stream.size();
+    stream.push_back(0xF1);
+    stream.push_back(PROTO_BUILD_CAN_FRAME);
+    for (int b = 0; b < 4; b++) stream.push_back((uint8_t)(id >> (8 * b)));
+    stream.push_back(0); //bus
+    stream.push_back(length);
+    for (int b = 0; b < length; b++) stream.push_back((uint8_t)((id + b) & 0x7F));
+    uint8_t xorSum = 0;
+    for (size_t b = start; b < stream.size(); b++) xorSum ^= stream[b];
+    //0 = good checksum, 1 = none sent, 2 = wrong. A wrong one can't be 0 since that reads as none sent, or 0xF1
+    //since the parser would pick back up there
+    uint8_t wrong = xorSum ^ 0x81;
+    if (wrong == 0 || wrong == 0xF1) wrong = xorSum ^ 0x03;
+    if (checksum == 0) stream.push_back(xorSum);
+    else if (checksum == 1) stream.push_back(0);
+    else stream.push_back(wrong);
+}
+
+static bool sameResult(const PARSE_RESULT &a, const PARSE_RESULT &b)
+{
+    return a.sentIDs == b.sentIDs && a.replies == b.replies && a.framingErrors == b.framingErrors && a.checksumErrors == b.checksumErrors;
+}
+
+static void testCleanStream()
+{
+    std::vector<uint8_t> stream;
+    std::vector<uint32_t> goodIDs;
+    int bad = 0, keepAlives = 0;
+    srand(19);
+    //no 0xF1 anywhere in the frames. After a bad checksum the parser starts over from the next one it finds
+    for (int i = 0; i < 1500; i++) //keep the replies under what the parser's output buffer holds
+    {
+        uint32_t id = (0x100 + i % 0x600) & 0x77F;
+        int kind = rand() % 5;
+        if (kind < 2)
+        {
+            addFrame(stream, id, rand() % 9, kind);
+            goodIDs.push_back(id);
+        }
+        else if (kind == 2)
+        {
+            addFrame(stream, id, rand() % 9, 2);
+            bad++;
+        }
+        else if (kind == 3)
+        {
+            stream.push_back(0xF1);
+            stream.push_back(PROTO_KEEPALIVE);
+            keepAlives++;
+        }
+        else
+        {
+            //one PROTO_SET_EXT_BUSES worth of bytes with 0xF1 in the middle, like a frame payload would have
+            stream.push_back(0xF1);
+            stream.push_back(PROTO_SET_EXT_BUSES);
+            for (int b = 0; b < 12; b++) stream.push_back((b == 5) ? 0xF1 : 0);
+        }
+    }
+
+    PARSE_RESULT whole = parse(stream, 0);
+    CHECK(whole.sentIDs == goodIDs);
+    CHECK_EQ(whole.checksumErrors, bad);
+    CHECK_EQ(whole.framingErrors, 0);
+    CHECK_EQ(whole.replies.size(), keepAlives * 4);
+    CHECK(sameResult(whole, parse(stream, 1)));
+    CHECK(sameResult(whole, parse(stream, -1)));
+}
+
+//The rest of a message that stalled is dropped and the next one still gets through
+static void testTimeout()
+{
+    GVRET_Comm_Handler parser;
+    std::vector<uint8_t> stream;
+    setupBuses();
+    CAN0.clearSent();
+    const uint8_t partial[] = {0xF1, PROTO_BUILD_CAN_FRAME, 0x23, 0x01};
+    parser.processIncomingBytes(partial, sizeof(partial));
+    delay(GVRET_MSG_TIMEOUT + 20);
+    addFrame(stream, 0x321, 2, 0);
+    parser.processIncomingBytes(stream.data(), stream.size());
+    CHECK_EQ(parser.getFramingErrors(), 1);
+    CHECK_EQ(CAN0.numSentLogged(), 1);
+    CHECK_EQ(CAN0.sentFrame(0).frame.id, 0x321);
+}
+
+//PROTO_TIME_SYNC takes one byte after the command, whatever it is, before the next message starts
+static void testTimeSync()
+{
+    const uint8_t stream[] = {0xF1, PROTO_TIME_SYNC, 0xF1, 0xF1, PROTO_KEEPALIVE};
+    PARSE_RESULT whole = parse(std::vector<uint8_t>(stream, stream + sizeof(stream)), 0);
+    CHECK_EQ(whole.framingErrors, 0);
+    CHECK_EQ(whole.replies.size(), 6 + 4);
+    if (whole.replies.size() == 10)
+    {
+        CHECK(whole.replies[0] == 0xF1 && whole.replies[1] == PROTO_TIME_SYNC);
+        CHECK(whole.replies[6] == 0xF1 && whole.replies[7] == PROTO_KEEPALIVE);
+    }
+    PARSE_RESULT single = parse(std::vector<uint8_t>(stream, stream + sizeof(stream)), 1); //replies carry the time so can't match
+    CHECK_EQ(single.framingErrors, 0);
+    CHECK_EQ(single.replies.size(), 6 + 4);
+}
+
+//Random bytes and bits of messages. CR, LF and 0xE7 are left out so nothing runs as a console command
+//or flips the output mode part way through
+static void testGarbage()
+{
+    static const uint8_t known[] = {PROTO_BUILD_CAN_FRAME, PROTO_KEEPALIVE, PROTO_GET_NUMBUSES, PROTO_SET_EXT_BUSES, PROTO_SET_DIG_OUT, 0x7F};
+    srand(190);
+    for (int run = 0; run < 300; run++)
+    {
+        std::vector<uint8_t> stream;
+        while (stream.size() < 4000)
+        {
+            int kind = rand() % 4;
+            if (kind == 0) addFrame(stream, rand() & 0x7FF, rand() % 16, rand() % 3);
+            else if (kind == 1)
+            {
+                stream.push_back(0xF1);
+                stream.push_back(known[rand() % sizeof(known)]);
+            }
+            else
+            {
+                uint8_t byt = rand();
+                if (byt == '\r' || byt == '\n' || byt == 0xE7) byt = 0xF1;
+                stream.push_back(byt);
+            }
+        }
+        //chop a few bytes out so messages get cut short
+        for (int cut = 0; cut < 20; cut++) stream.erase(stream.begin() + rand() % stream.size());
+        //the time sync reply has the time in it so it would never match between runs
+        for (size_t b = 0; b + 1 < stream.size(); b++) if (stream[b] == 0xF1 && stream[b + 1] == PROTO_TIME_SYNC) stream[b + 1] = PROTO_KEEPALIVE;
+
+        PARSE_RESULT whole = parse(stream, 0);
+        if (!sameResult(whole, parse(stream, 1)) || !sameResult(whole, parse(stream, -1)))
+        {
+            fprintf(stderr, "run %i: whole buffer and smaller pieces parsed differently\n", run);
+            testFailures++;
+            break;
+        }
+    }
+}
+
+int main()
+{
+    testCleanStream();
+    testTimeout();
+    testTimeSync();
+    testGarbage();
+    return testResult();
+}
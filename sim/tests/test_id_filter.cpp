@@ -0,0 +1,158 @@
+/*
+Software ID filter. Random adds, removes and clears checked against a std::set for every bus and both
+ID kinds, including a table full of extended IDs that all land near each other, then the three modes, decimation
+and the rate limit. BENCH=IDFILTER runs at the end so its timings show up in the test log.
+*/
+#include <set>
+#include <string>
+#include <tuple>
+#include "sim_test.h"
+#include "id_filter.h"
+#include "benchmark.h"
+
+typedef std::tuple<int, uint32_t, bool> LISTED_ID;
+
+static void testAgainstSet()
+{
+    static IDFilter filter;
+    std::set<LISTED_ID> model;
+    int bad = 0;
+    srand(22);
+
+    for (int bus = 0; bus < NUM_BUSES; bus++) filter.setMode(bus, IDFILTER_PASS_LISTED);
+    for (int i = 0; i < 200000; i++)
+    {
+        int bus = rand() % NUM_BUSES;
+        bool extended = rand() & 1;
+        //a few hundred extended IDs spread a prime apart so plenty of them share hash slots
+        uint32_t id = extended ? ((rand() % 600) * 7919) & 0x1FFFFFFF : rand() % 0x800;
+        LISTED_ID key(bus, id, extended);
+        int op = rand() % 10;
+
+        if (op < 4)
+        {
+            bool added = filter.addID(bus, id, extended, 1, 0);
+            if (added) model.insert(key);
+            else if (model.size() < ID_FILTER_MAX_IDS || model.count(key)) bad++; //only a full table may say no
+        }
+        else if (op < 8)
+        {
+            if (filter.removeID(bus, id, extended) != (model.erase(key) > 0)) bad++;
+        }
+        else if (rand() % 2000 == 0)
+        {
+            filter.clear(bus);
+            filter.setMode(bus, IDFILTER_PASS_LISTED);
+            for (auto it = model.begin(); it != model.end();)
+            {
+                if (std::get<0>(*it) == bus) it = model.erase(it);
+                else ++it;
+            }
+        }
+
+        if (filter.accepts(bus, id, extended, 0) != (model.count(key) > 0)) bad++;
+        int count = 0;
+        for (const LISTED_ID &listed : model) if (std::get<0>(listed) == bus) count++;
+        if (count != filter.getCount(bus)) bad++;
+    }
+    CHECK_EQ(bad, 0);
+
+    //everything still listed at the end is still found
+    for (const LISTED_ID &listed : model)
+    {
+        if (!filter.accepts(std::get<0>(listed), std::get<1>(listed), std::get<2>(listed), 0)) bad++;
+    }
+    CHECK_EQ(bad, 0);
+}
+
+static void testModes()
+{
+    static IDFilter filter;
+    filter.addID(0, 0x123, false, 1, 0);
+    filter.addID(0, 0x18DAF110, true, 1, 0);
+
+    CHECK_EQ(filter.getMode(0), IDFILTER_PASS_ALL);
+    CHECK(filter.accepts(0, 0x124, false, 0));
+    CHECK(filter.setMode(0, IDFILTER_PASS_LISTED));
+    CHECK(filter.accepts(0, 0x123, false, 0));
+    CHECK(filter.accepts(0, 0x18DAF110, true, 0));
+    CHECK(!filter.accepts(0, 0x124, false, 0));
+    CHECK(!filter.accepts(0, 0x123, true, 0)); //same number as an extended ID is a different ID
+    CHECK(filter.accepts(1, 0x124, false, 0)); //other buses keep their own mode
+    CHECK(filter.setMode(0, IDFILTER_BLOCK_LISTED));
+    CHECK(!filter.accepts(0, 0x123, false, 0));
+    CHECK(filter.accepts(0, 0x124, false, 0));
+    CHECK(!filter.setMode(0, 7));
+}
+
+static void testThrottling()
+{
+    static IDFilter filter;
+    int passed = 0;
+
+    //1 in 10, any timing
+    filter.addID(0, 0x3E8, false, 10, 0);
+    for (int i = 0; i < 100; i++) passed += filter.accepts(0, 0x3E8, false, i);
+    CHECK_EQ(passed, 10);
+
+    //one per 5 ms with a frame every ms, timestamps in us
+    passed = 0;
+    filter.addID(0, 0x100, false, 1, 5);
+    for (int i = 0; i < 100; i++) passed += filter.accepts(0, 0x100, false, i * 1000);
+    CHECK_EQ(passed, 20);
+
+    //extended IDs get the same treatment, and the limit still works when the microsecond clock wraps
+    passed = 0;
+    filter.addID(2, 0x1FFFFFFF, true, 1, 10);
+    for (int i = 0; i < 100; i++) passed += filter.accepts(2, 0x1FFFFFFF, true, 0xFFFC0000u + i * 1000);
+    CHECK_EQ(passed, 10);
+
+    //listing an ID again replaces its rules
+    passed = 0;
+    filter.addID(0, 0x3E8, false, 1, 0);
+    for (int i = 0; i < 100; i++) passed += filter.accepts(0, 0x3E8, false, i);
+    CHECK_EQ(passed, 100);
+}
+
+static void testBenchmark()
+{
+    char which[] = "IDFILTER";
+    Serial.takeOutput();
+    Benchmark::run(which);
+    std::string out = Serial.takeOutput();
+    int lines = 0, numbered = 0;
+    for (size_t pos = 0; (pos = out.find("IDs listed", pos)) != std::string::npos; pos++)
+    {
+        size_t start = out.rfind('\n', pos);
+        start = (start == std::string::npos) ? 0 : start + 1;
+        int listed, ns, accepted, total;
+        lines++;
+        if (sscanf(out.c_str() + start, "%d IDs listed: %d ns/frame, %d of %d frames passed", &listed, &ns, &accepted, &total) == 4 &&
+            accepted <= total) numbered++;
+    }
+    CHECK(lines > 0);
+    CHECK_EQ(numbered, lines);
+
+    //a full table still finds or rules out an ID in one or two probes on average
+    int ids, slots, hitWhole, hitFrac, hitMax, missWhole, missFrac, missMax;
+    size_t pos = out.find("Full table");
+    CHECK(pos != std::string::npos);
+    if (pos != std::string::npos && sscanf(out.c_str() + pos, "Full table, %d IDs in %d slots: hits %d.%d probes (max %d), misses %d.%d probes (max %d)",
+                                           &ids, &slots, &hitWhole, &hitFrac, &hitMax, &missWhole, &missFrac, &missMax) == 8)
+    {
+        CHECK_EQ(ids, ID_FILTER_MAX_IDS);
+        CHECK(hitWhole * 100 + hitFrac <= 200);
+        CHECK(missWhole * 100 + missFrac <= 200);
+    }
+    else testFailures++;
+    fputs(out.c_str(), stdout);
+}
+
+int main()
+{
+    testAgainstSet();
+    testModes();
+    testThrottling();
+    testBenchmark();
+    return testResult();
+}
@@ -0,0 +1,205 @@
+//LAWICEL CAN-FD: d/D/b/B transmit commands onto the virtual bus, also through the console line buffer, and
+//d/D lines for received FD frames
+#include <string>
+#include "sim_test.h"
+#include "config.h"
+#include "lawicel.h"
+#include "gvret_comm.h"
+#include "utility.h"
+#include "SerialConsole.h"
+
+static std::string takeOutput()
+{
+    std::string out;
+    size_t len;
+    while ((len = serialGVRET.numContiguousBytes()) > 0)
+    {
+        out.append((const char *)serialGVRET.getBufferedBytes(), len);
+        serialGVRET.consumeBytes(len);
+    }
+    return out;
+}
+
+static void runCmd(const std::string &cmd)
+{
+    char line[200];
+    snprintf(line, sizeof(line), "%s", cmd.c_str());
+    lawicel.handleLongCmd(line);
+}
+
+//CAN0 is a classic only bus, CAN1 the FD capable one
+static void setupBuses(bool fdEnabled)
+{
+    SysSettings.numBuses = 2;
+    canBuses[0] = &CAN0;
+    canBuses[1] = &CAN1;
+    settings.canSettings[0].enabled = true;
+    settings.canSettings[0].fdMode = false;
+    CAN0.begin(500000, 255);
+    settings.canSettings[1].enabled = fdEnabled;
+    settings.canSettings[1].fdMode = true;
+    CAN1.beginFD(500000, 2000000);
+    CAN1.clearSent();
+}
+
+static std::string hexBytes(const uint8_t *data, int length)
+{
+    std::string out;
+    char two[3];
+    for (int i = 0; i < length; i++)
+    {
+        snprintf(two, sizeof(two), "%02x", data[i]);
+        out += two;
+    }
+    return out;
+}
+
+static void testTransmit()
+{
+    uint8_t data[64];
+    for (int i = 0; i < 64; i++) data[i] = (uint8_t)(i * 5 + 1);
+
+    //nothing in FD mode to send on
+    setupBuses(false);
+    runCmd("b1232" + hexBytes(data, 2));
+    CHECK(takeOutput() == "\a");
+    CHECK_EQ(CAN1.getSentCount(), 0);
+
+    setupBuses(true);
+    runCmd("b123F" + hexBytes(data, 64));
+    CHECK(takeOutput() == "\r");
+    runCmd("D18DAF1109" + hexBytes(data, 12));
+    CHECK(takeOutput() == "\r");
+    runCmd("d7DF0");
+    CHECK(takeOutput() == "\r");
+    CHECK_EQ(CAN1.numSentLogged(), 3);
+    CHECK_EQ(CAN0.getSentCount(), 0);
+
+    SIM_FRAME sent = CAN1.sentFrame(0);
+    CHECK(sent.fd && !sent.frame.extended);
+    CHECK_EQ(sent.frame.id, 0x123);
+    CHECK_EQ(sent.frame.length, 64);
+    CHECK(!memcmp(sent.frame.data.uint8, data, 64));
+    sent = CAN1.sentFrame(1);
+    CHECK(sent.fd && sent.frame.extended);
+    CHECK_EQ(sent.frame.id, 0x18DAF110);
+    CHECK_EQ(sent.frame.length, 12);
+    CHECK(!memcmp(sent.frame.data.uint8, data, 12));
+    sent = CAN1.sentFrame(2);
+    CHECK_EQ(sent.frame.id, 0x7DF);
+    CHECK_EQ(sent.frame.length, 0);
+
+    //with no BRS flag in the frame the d and b forms of a command send the same thing
+    CAN1.clearSent();
+    runCmd("d1238" + hexBytes(data, 16));
+    runCmd("b1238" + hexBytes(data, 16));
+    CHECK(takeOutput() == "\r\r");
+    CHECK_EQ(CAN1.numSentLogged(), 2);
+    SIM_FRAME plain = CAN1.sentFrame(0);
+    sent = CAN1.sentFrame(1);
+    CHECK(plain.fd && sent.fd);
+    CHECK(plain.frame.id == sent.frame.id && plain.frame.length == sent.frame.length);
+    CHECK(!memcmp(plain.frame.data.uint8, sent.frame.data.uint8, 16));
+
+    //DLC says 64 bytes but the line stops short
+    runCmd("b123F" + hexBytes(data, 63));
+    CHECK(takeOutput() == "\a");
+    runCmd("B1234");
+    CHECK(takeOutput() == "\a");
+    CHECK_EQ(CAN1.numSentLogged(), 2);
+}
+
+//Every FD length comes out as a d/D line and that line sent back in puts the same frame on the bus
+static void testRoundTrip()
+{
+    static const int lengths[] = {0, 1, 8, 12, 16, 20, 24, 32, 48, 64};
+    setupBuses(true);
+    SysSettings.lawicellExtendedMode = false;
+    SysSettings.lawicelTimestamping = false;
+
+    for (int extended = 0; extended < 2; extended++)
+    {
+        for (int l = 0; l < 10; l++)
+        {
+            CAN_FRAME_FD frame;
+            frame.id = extended ? 0x1ABCDEF0 + l : 0x700 + l;
+            frame.extended = extended;
+            frame.length = lengths[l];
+            frame.fdMode = 1;
+            frame.timestamp = 0;
+            for (int i = 0; i < frame.length; i++) frame.data.uint8[i] = (uint8_t)(rand());
+            lawicel.sendFrameToBuffer(frame, 1);
+
+            std::string line = takeOutput();
+            char expected[200];
+            int len = snprintf(expected, sizeof(expected), extended ? "D%08x%X" : "d%03x%X", frame.id, Utility::fdLengthToDLC(frame.length));
+            snprintf(expected + len, sizeof(expected) - len, "%s\r", hexBytes(frame.data.uint8, frame.length).c_str());
+            if (line != expected)
+            {
+                fprintf(stderr, "expected \"%s\" got \"%s\"\n", expected, line.c_str());
+                testFailures++;
+                continue;
+            }
+
+            CAN1.clearSent();
+            line.pop_back(); //CR
+            runCmd(line);
+            CHECK(takeOutput() == "\r");
+            CHECK_EQ(CAN1.numSentLogged(), 1);
+            SIM_FRAME sent = CAN1.sentFrame(0);
+            CHECK_EQ(sent.frame.id, frame.id);
+            CHECK_EQ(sent.frame.extended, frame.extended);
+            CHECK_EQ(sent.frame.length, frame.length);
+            CHECK(!memcmp(sent.frame.data.uint8, frame.data.uint8, frame.length));
+        }
+    }
+
+    //a classic frame coming in on an FD mode bus stays a t line
+    CAN_FRAME_FD classic;
+    classic.id = 0x7E8;
+    classic.extended = false;
+    classic.length = 3;
+    classic.fdMode = 0;
+    classic.timestamp = 0;
+    classic.data.uint8[0] = 0x02;
+    classic.data.uint8[1] = 0x41;
+    classic.data.uint8[2] = 0x0C;
+    lawicel.sendFrameToBuffer(classic, 1);
+    CHECK(takeOutput() == "t7e8302410c\r");
+}
+
+//The longest FD lines have to make it through the console line buffer. Anything longer is refused whole
+static void testConsoleLines()
+{
+    uint8_t data[64];
+    for (int i = 0; i < 64; i++) data[i] = (uint8_t)(0xFF - i);
+    setupBuses(true);
+    settings.enableLawicel = true;
+    SysSettings.lawicelMode = true;
+
+    std::string line = "B18DAF110F" + hexBytes(data, 64) + "\r";
+    for (char c : line) console.rcvCharacter(c);
+    CHECK(takeOutput() == "\r");
+    CHECK_EQ(CAN1.numSentLogged(), 1);
+    if (CAN1.numSentLogged() == 1)
+    {
+        SIM_FRAME sent = CAN1.sentFrame(0);
+        CHECK_EQ(sent.frame.id, 0x18DAF110);
+        CHECK_EQ(sent.frame.length, 64);
+        CHECK(!memcmp(sent.frame.data.uint8, data, 64));
+    }
+
+    line = "B18DAF110F" + hexBytes(data, 64) + hexBytes(data, 20) + "\r"; //past CONSOLE_LINE_SIZE
+    for (char c : line) console.rcvCharacter(c);
+    CHECK(takeOutput() == "\a");
+    CHECK_EQ(CAN1.numSentLogged(), 1);
+    SysSettings.lawicelMode = false;
+}
+
+int main()
+{
+    testTransmit();
+    testRoundTrip();
+    testConsoleLines();
+    return testResult();
+}
@@ -0,0 +1,164 @@
+/*
+LZ4 block compression. Round trips on random, repetitive and GVRET shaped data, the end of block rules
+other LZ4 decoders depend on, and a decoder that has to survive garbage. Also prints the ratio and speed on
+GVRET traffic, which is the host side of BENCH=COMPRESS.
+*/
+#include <vector>
+#include "sim_test.h"
+#include "lz4_block.h"
+#include "commbuffer.h"
+
+static LZ4Block lz4;
+
+//Walks the sequences of a block and checks the last match starts 12 or more bytes from the end and the
+//block finishes with 5 or more literals, which is what the reference decoder's fast path assumes
+static bool followsEndRules(const uint8_t *block, size_t length, size_t original)
+{
+    size_t ip = 0, op = 0;
+    while (ip < length)
+    {
+        uint8_t token = block[ip++];
+        size_t literals = token >> 4;
+        if (literals == 15)
+        {
+            uint8_t byt;
+            do
+            {
+                byt = block[ip++];
+                literals += byt;
+            } while (byt == 255);
+        }
+        ip += literals;
+        op += literals;
+        if (ip >= length) return original < 13 || literals >= 5;
+        if (op + 12 > original) return false;
+        ip += 2;
+        size_t matchLength = token & 0xF;
+        if (matchLength == 15)
+        {
+            uint8_t byt;
+            do
+            {
+                byt = block[ip++];
+                matchLength += byt;
+            } while (byt == 255);
+        }
+        op += matchLength + 4;
+    }
+    return true;
+}
+
+static void roundTrip(const std::vector<uint8_t> &data, const char *what)
+{
+    std::vector<uint8_t> packed(LZ4_BOUND(data.size()));
+    std::vector<uint8_t> unpacked(data.size() + 1);
+    size_t packedLength = lz4.compress(data.data(), data.size(), packed.data(), packed.size());
+    int unpackedLength = LZ4Block::decompress(packed.data(), packedLength, unpacked.data(), unpacked.size());
+    if (packedLength == 0 || unpackedLength != (int)data.size() || memcmp(unpacked.data(), data.data(), data.size()) ||
+        !followsEndRules(packed.data(), packedLength, data.size()))
+    {
+        fprintf(stderr, "%s, %i bytes: compressed to %i, decompressed to %i\n", what, (int)data.size(), (int)packedLength, unpackedLength);
+        testFailures++;
+    }
+
+    //one byte short of what it needs has to be refused, not overrun
+    if (packedLength > 1)
+    {
+        std::vector<uint8_t> tight(packedLength - 1);
+        CHECK_EQ(lz4.compress(data.data(), data.size(), tight.data(), tight.size()), 0);
+    }
+}
+
+static void testRoundTrips()
+{
+    srand(18);
+    for (int i = 0; i < 2000; i++)
+    {
+        size_t length = (i < 40) ? i + 1 : 1 + rand() % 5000;
+        std::vector<uint8_t> data(length);
+        int pattern = i % 4;
+        for (size_t b = 0; b < length; b++)
+        {
+            if (pattern == 0) data[b] = rand();
+            else if (pattern == 1) data[b] = 'A';
+            else if (pattern == 2) data[b] = (uint8_t)(b % 7);
+            else data[b] = (rand() % 8) ? data[b > 30 ? b - 30 : 0] : rand();
+        }
+        roundTrip(data, "pattern");
+    }
+
+    //what actually goes over WiFi: binary GVRET frames from a handful of IDs with slowly changing payloads
+    std::vector<uint8_t> stream;
+    CAN_FRAME frame;
+    frame.extended = false;
+    frame.rtr = 0;
+    frame.length = 8;
+    for (int i = 0; i < 3000; i++)
+    {
+        frame.id = 0x100 + (i % 12);
+        frame.timestamp = 1000 + i * 250;
+        for (int b = 0; b < 8; b++) frame.data.uint8[b] = (b < 2) ? (uint8_t)(i / 10) : (uint8_t)(frame.id * b);
+        uint8_t encoded[32];
+        size_t len = CommBuffer::encodeBinaryFrame(frame, 0, encoded);
+        stream.insert(stream.end(), encoded, encoded + len);
+    }
+    std::vector<uint8_t> block(stream.begin(), stream.begin() + WIFI_BUFF_SIZE);
+    roundTrip(block, "GVRET frames");
+    std::vector<uint8_t> packed(LZ4_BOUND(block.size()));
+    size_t packedLength = lz4.compress(block.data(), block.size(), packed.data(), packed.size());
+    CHECK(packedLength < block.size() * 3 / 4); //timestamps never repeat so this is about as good as it gets
+
+    std::vector<uint8_t> unpacked(block.size());
+    uint32_t start = micros();
+    for (int i = 0; i < 2000; i++) lz4.compress(block.data(), block.size(), packed.data(), packed.size());
+    uint32_t packTime = micros() - start;
+    start = micros();
+    for (int i = 0; i < 2000; i++) LZ4Block::decompress(packed.data(), packedLength, unpacked.data(), unpacked.size());
+    uint32_t unpackTime = micros() - start;
+    printf("GVRET frames: %u bytes to %u (%.0f%%), compress %.1f MB/s, decompress %.1f MB/s\n", (unsigned int)block.size(),
+           (unsigned int)packedLength, 100.0 * packedLength / block.size(), 2000.0 * block.size() / packTime,
+           2000.0 * block.size() / unpackTime);
+
+    std::vector<uint8_t> largest(LZ4_MAX_INPUT);
+    for (size_t b = 0; b < largest.size(); b++) largest[b] = stream[b % stream.size()];
+    roundTrip(largest, "largest block");
+    CHECK_EQ(lz4.compress(largest.data(), LZ4_MAX_INPUT + 1, packed.data(), packed.size()), 0);
+}
+
+//Corrupted blocks must come back as -1 or a length that fits, never a write past the end
+static void testCorruptBlocks()
+{
+    std::vector<uint8_t> data(1500);
+    for (size_t b = 0; b < data.size(); b++) data[b] = (uint8_t)((b % 40 < 20) ? b % 5 : rand());
+    std::vector<uint8_t> packed(LZ4_BOUND(data.size()));
+    size_t packedLength = lz4.compress(data.data(), data.size(), packed.data(), packed.size());
+    CHECK(packedLength > 0);
+
+    srand(180);
+    std::vector<uint8_t> out(data.size());
+    for (int i = 0; i < 100000; i++)
+    {
+        std::vector<uint8_t> damaged(packed.begin(), packed.begin() + packedLength);
+        int changes = 1 + rand() % 4;
+        for (int c = 0; c < changes; c++) damaged[rand() % damaged.size()] = rand();
+        if (i % 5 == 0) damaged.resize(rand() % damaged.size());
+        int result = LZ4Block::decompress(damaged.data(), damaged.size(), out.data(), out.size());
+        if (result > (int)out.size())
+        {
+            testFailures++;
+            break;
+        }
+    }
+
+    const uint8_t zeroOffset[] = {0x00, 0x00, 0x00};
+    CHECK_EQ(LZ4Block::decompress(zeroOffset, sizeof(zeroOffset), out.data(), out.size()), -1);
+    const uint8_t pastStart[] = {0x10, 'A', 0x05, 0x00, 0x00};
+    CHECK_EQ(LZ4Block::decompress(pastStart, sizeof(pastStart), out.data(), out.size()), -1);
+}
+
+int main()
+{
+    testRoundTrips();
+    testCorruptBlocks();
+    return testResult();
+}
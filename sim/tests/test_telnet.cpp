@@ -0,0 +1,463 @@
+/*
+Telnet clients. First a producer thread writes numbered records into the WiFi buffer while this thread fans it
+out, and the client has to get exactly the bytes that were written. The same again with compression on and GVRET
+frames as the records, where every frame has to come out of the blocks once and the compressor must not have been
+given more than was consumed. Negotiated formats have to go back to the defaults when a client connects or the
+last one leaves, and can't be changed while two clients share the link. Two clients sending commands a piece at
+a time, interleaved with each other, must each have their own commands carried out. Then the same on the threaded sketch with the
+RX task as the producer: the client gets every frame read once and in order, apart from whole frames the buffer
+had no room for.
+*/
+#include <thread>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <Preferences.h>
+#include <WiFi.h>
+#include "sim_test.h"
+#include "config.h"
+#include "gvret_comm.h"
+#include "wifi_manager.h"
+#include "lz4_block.h"
+
+void setup();
+
+#define TELNET_PORT 23
+#define BINARY_FRAME_SIZE 20 //F1 00, time, ID, length and bus, 8 data bytes, checksum
+#define RECORD_SIZE 12
+#define RECORDS 300000
+#define COMPRESSED_FRAMES 100000
+
+static void makeRecord(uint32_t seq, uint8_t *out)
+{
+    memcpy(out, &seq, 4);
+    for (int i = 4; i < RECORD_SIZE; i++) out[i] = (uint8_t)(seq * (i + 1));
+}
+
+/*
+The PC on the far end of a telnet connection. A thread reads everything the sketch sends and pulls the synthetic
+sequence numbers out of the binary frames, unpacking compressed blocks on the way. Any byte that isn't part of a
+frame is counted as junk.
+*/
+class TelnetHost
+{
+public:
+    std::atomic<uint64_t> frames{0};
+    std::atomic<uint64_t> outOfOrder{0};
+    std::atomic<uint64_t> repeats{0};
+    std::atomic<uint64_t> junk{0};
+    std::atomic<uint64_t> gaps{0}; //frames missing between two that came in
+    std::atomic<uint64_t> blocks{0};
+    std::atomic<uint64_t> badBlocks{0};
+    bool raw = false; //check numbered records instead of parsing GVRET
+    std::atomic<uint64_t> records{0};
+    std::atomic<uint64_t> badRecords{0};
+
+    void connect()
+    {
+        fd = simConnect(TELNET_PORT);
+        reader = std::thread(&TelnetHost::readLoop, this);
+    }
+
+    void send(const uint8_t *data, size_t length)
+    {
+        ::send(fd, data, length, MSG_NOSIGNAL);
+    }
+
+    void close()
+    {
+        shutdown(fd, SHUT_RDWR);
+        reader.join();
+        ::close(fd);
+    }
+
+private:
+    int fd = -1;
+    std::thread reader;
+    uint8_t msg[32];
+    size_t msgLength = 0;
+    size_t msgExpected = 0;
+    bool first = true;
+    uint32_t lastSeq = 0;
+    std::vector<uint8_t> block; //a PROTO_COMPRESSED_BLOCK being collected, header included
+
+    void readLoop()
+    {
+        uint8_t buff[4096];
+        int got;
+        while ((got = recv(fd, buff, sizeof(buff), 0)) > 0)
+        {
+            for (int i = 0; i < got; i++)
+            {
+                if (raw) checkRecord(buff[i]);
+                else parse(buff[i]);
+            }
+        }
+    }
+
+    void checkRecord(uint8_t byt)
+    {
+        msg[msgLength++] = byt;
+        if (msgLength < RECORD_SIZE) return;
+        msgLength = 0;
+        uint8_t good[RECORD_SIZE];
+        makeRecord(records++, good);
+        if (memcmp(good, msg, RECORD_SIZE)) badRecords++;
+    }
+
+    void collectBlock(uint8_t byt)
+    {
+        block.push_back(byt);
+        if (block.size() < COMPRESSED_HEADER_SIZE) return;
+        size_t rawLength = block[2] | (block[3] << 8);
+        size_t blockLength = block[4] | (block[5] << 8);
+        if (block.size() < COMPRESSED_HEADER_SIZE + blockLength) return;
+        std::vector<uint8_t> raw(rawLength);
+        int unpacked = LZ4Block::decompress(block.data() + COMPRESSED_HEADER_SIZE, blockLength, raw.data(), raw.size());
+        block.clear();
+        blocks++;
+        if (unpacked != (int)rawLength) badBlocks++;
+        else for (uint8_t b : raw) parse(b);
+    }
+
+    void parse(uint8_t byt)
+    {
+        if (!block.empty())
+        {
+            collectBlock(byt);
+            return;
+        }
+        if (msgLength == 1 && byt == PROTO_COMPRESSED_BLOCK)
+        {
+            msgLength = 0;
+            block.push_back(0xF1);
+            block.push_back(byt);
+            return;
+        }
+        if (msgLength == 0)
+        {
+            if (byt == 0xF1) msg[msgLength++] = byt;
+            else junk++;
+            return;
+        }
+        if (msgLength == 1 && byt != 0)
+        {
+            junk++;
+            msgLength = (byt == 0xF1) ? 1 : 0;
+            return;
+        }
+        msg[msgLength++] = byt;
+        if (msgLength == 11) msgExpected = 11 + (byt & 0xF) + 1;
+        if (msgLength >= 11 && msgLength == msgExpected)
+        {
+            uint32_t seq = msg[11] | (msg[12] << 8) | (msg[13] << 16) | ((uint32_t)msg[14] << 24);
+            if (!first && seq == lastSeq) repeats++;
+            else if (!first && seq < lastSeq) outOfOrder++;
+            else if (!first && seq != lastSeq + 1) gaps++;
+            first = false;
+            lastSeq = seq;
+            frames++;
+            msgLength = 0;
+        }
+    }
+};
+
+//Nothing of the sketch is running yet so this thread is the comm task
+static void testFanOutExact()
+{
+    static TelnetHost host;
+    std::atomic<bool> done(false);
+
+    settings.wifiMode = 2;
+    wifiGVRET.setMultiProducer(true);
+    wifiManager.loop(); //server up
+    host.raw = true;
+    host.connect();
+    wifiManager.loop(); //client taken
+
+    std::thread producer([&]()
+    {
+        uint8_t record[RECORD_SIZE];
+        for (uint32_t seq = 0; seq < RECORDS; seq++)
+        {
+            makeRecord(seq, record);
+            while (!wifiGVRET.sendBytesToBuffer(record, RECORD_SIZE)) std::this_thread::yield();
+        }
+        done = true;
+    });
+    while (!done || wifiGVRET.numAvailableBytes() > 0)
+    {
+        wifiManager.sendBufferedData();
+        std::this_thread::yield();
+    }
+    producer.join();
+    for (int i = 0; i < 100; i++) wifiManager.drainClients(); //anything the socket didn't take right away
+    delay(50);
+    host.close();
+    wifiManager.loop(); //client gone
+
+    CHECK_EQ(host.records.load(), RECORDS);
+    CHECK_EQ(host.badRecords.load(), 0);
+    wifiGVRET.resetStats(); //a full buffer counted the producer's retries as drops
+}
+
+/*
+Compression on, so the comm side runs everything it consumes through compressChunk. The producer waits for room
+so nothing is dropped and every frame has to come out exactly once. What the compressor reports as its input has
+to match what was produced byte for byte.
+*/
+static void testCompressedFanOut()
+{
+    static TelnetHost host;
+    std::atomic<bool> done(false);
+
+    host.connect();
+    wifiManager.loop(); //client taken
+    wifiGVRET.setCompressed(true); //after, a new client puts the link back on the defaults
+
+    std::thread producer([&]()
+    {
+        CAN_FRAME frame;
+        uint8_t encoded[BINARY_FRAME_SIZE];
+        frame.id = 0x100;
+        frame.extended = false;
+        frame.rtr = 0;
+        frame.length = 8;
+        for (uint32_t seq = 0; seq < COMPRESSED_FRAMES; seq++)
+        {
+            frame.timestamp = seq * 100;
+            memcpy(frame.data.uint8, &seq, 4);
+            memset(&frame.data.uint8[4], (uint8_t)(seq >> 6), 4);
+            size_t len = CommBuffer::encodeBinaryFrame(frame, 0, encoded);
+            while (!wifiGVRET.sendBytesToBuffer(encoded, len)) std::this_thread::yield();
+        }
+        done = true;
+    });
+    while (!done || wifiGVRET.numAvailableBytes() > 0)
+    {
+        wifiManager.sendBufferedData();
+        std::this_thread::yield();
+    }
+    producer.join();
+    for (int i = 0; i < 100; i++) wifiManager.drainClients();
+    delay(50);
+
+    host.close();
+    wifiManager.loop(); //client gone
+    wifiGVRET.setCompressed(false);
+
+    //console lines go to telnet clients too, so this waits until there are none
+    Serial.takeOutput();
+    wifiManager.printClientStats();
+    std::string stats = Serial.takeOutput();
+    unsigned int bytesIn = 0, bytesOut = 0;
+    size_t pos = stats.find("WiFi compression: ");
+    CHECK(pos != std::string::npos && sscanf(stats.c_str() + pos, "WiFi compression: %u bytes in, %u out", &bytesIn, &bytesOut) == 2);
+
+    printf("%llu frames in %llu compressed blocks, %u bytes compressed to %u\n", (unsigned long long)host.frames.load(),
+           (unsigned long long)host.blocks.load(), bytesIn, bytesOut);
+    CHECK(host.blocks.load() > 0);
+    CHECK_EQ(host.badBlocks.load(), 0);
+    CHECK_EQ(host.frames.load(), COMPRESSED_FRAMES);
+    CHECK_EQ(host.junk.load(), 0);
+    CHECK_EQ(host.repeats.load() + host.outOfOrder.load() + host.gaps.load(), 0);
+    CHECK_EQ(bytesIn, COMPRESSED_FRAMES * BINARY_FRAME_SIZE);
+    wifiGVRET.resetStats();
+}
+
+static void negotiate(TelnetHost &host, uint8_t command, uint8_t value)
+{
+    const uint8_t msg[] = {0xF1, command, value};
+    host.send(msg, sizeof(msg));
+    delay(5);
+    wifiManager.loop();
+}
+
+static void testNegotiation()
+{
+    static TelnetHost first, second;
+    CAN_FRAME frame;
+    frame.id = 0x7E8;
+    frame.extended = false;
+    frame.rtr = 0;
+    frame.length = 8;
+    frame.timestamp = 0;
+    memset(frame.data.uint8, 0, 8);
+
+    first.connect();
+    wifiManager.loop();
+    negotiate(first, PROTO_SET_COMPACT, 1);
+    negotiate(first, PROTO_SET_TIMESTAMP_64, 1);
+    negotiate(first, PROTO_SET_COMPRESSION, 1);
+    CHECK(wifiGVRET.isCompact() && wifiGVRET.isTimestamp64() && wifiGVRET.isCompressed());
+
+    //a second client starts everybody back on the defaults and then nobody may change them
+    second.connect();
+    wifiManager.loop();
+    CHECK_EQ(wifiManager.numClients(), 2);
+    CHECK(!wifiGVRET.isCompact() && !wifiGVRET.isTimestamp64() && !wifiGVRET.isCompressed());
+    negotiate(first, PROTO_SET_COMPACT, 1);
+    negotiate(second, PROTO_SET_TIMESTAMP_64, 1);
+    CHECK(!wifiGVRET.isCompact() && !wifiGVRET.isTimestamp64());
+
+    //down to one client, it can negotiate again
+    second.close();
+    delay(5);
+    wifiManager.loop();
+    CHECK_EQ(wifiManager.numClients(), 1);
+    negotiate(first, PROTO_SET_COMPACT, 1);
+    CHECK(wifiGVRET.isCompact());
+    wifiGVRET.sendFrameToBuffer(frame, 0, true);
+    CHECK(wifiGVRET.numStagedBytes() > 0);
+
+    //the last one leaving clears the formats and throws away the batch that was being put together for it
+    first.close();
+    delay(5);
+    wifiManager.loop();
+    CHECK_EQ(wifiManager.numClients(), 0);
+    CHECK(!wifiGVRET.isCompact() && !wifiGVRET.isTimestamp64() && !wifiGVRET.isCompressed());
+    CHECK_EQ(wifiGVRET.numStagedBytes(), 0);
+    wifiGVRET.clearBufferedBytes();
+}
+
+//PROTO_BUILD_CAN_FRAME for CAN0 with the checksum filled in
+static size_t buildFrameMsg(uint32_t id, uint8_t *msg)
+{
+    size_t len = 0;
+    msg[len++] = 0xF1;
+    msg[len++] = PROTO_BUILD_CAN_FRAME;
+    for (int b = 0; b < 4; b++) msg[len++] = (uint8_t)(id >> (8 * b));
+    msg[len++] = 0; //bus
+    msg[len++] = 8;
+    for (int b = 0; b < 8; b++) msg[len++] = (uint8_t)(id + b);
+    msg[len] = 0;
+    for (size_t b = 0; b < len; b++) msg[len] ^= msg[b];
+    return len + 1;
+}
+
+static void testInterleavedInput()
+{
+    static TelnetHost first, second;
+    const int frames = 20;
+    uint8_t msgFirst[32], msgSecond[32];
+    uint32_t framingBefore = wifiGVRET.getFramingErrors();
+    uint32_t checksumBefore = wifiGVRET.getChecksumErrors();
+
+    SysSettings.numBuses = 1;
+    canBuses[0] = &CAN0;
+    settings.canSettings[0].enabled = true;
+    CAN0.begin(500000, 255);
+    CAN0.clearSent();
+    first.connect();
+    second.connect();
+    wifiManager.loop();
+
+    //each message goes over in two pieces and the other client's piece comes in between
+    for (int i = 0; i < frames; i++)
+    {
+        size_t lenFirst = buildFrameMsg(0x100 + i, msgFirst);
+        size_t lenSecond = buildFrameMsg(0x200 + i, msgSecond);
+        size_t split = 1 + i % (lenFirst - 1);
+        first.send(msgFirst, split);
+        delay(1);
+        wifiManager.loop();
+        second.send(msgSecond, split);
+        delay(1);
+        wifiManager.loop();
+        first.send(msgFirst + split, lenFirst - split);
+        delay(1);
+        wifiManager.loop();
+        second.send(msgSecond + split, lenSecond - split);
+        delay(1);
+        wifiManager.loop();
+    }
+
+    CHECK_EQ(CAN0.numSentLogged(), frames * 2);
+    int nextFirst = 0, nextSecond = 0;
+    for (size_t i = 0; i < CAN0.numSentLogged(); i++)
+    {
+        SIM_FRAME sent = CAN0.sentFrame(i);
+        if (sent.frame.id == (uint32_t)(0x100 + nextFirst)) nextFirst++;
+        else if (sent.frame.id == (uint32_t)(0x200 + nextSecond)) nextSecond++;
+        else testFailures++;
+        CHECK_EQ(sent.frame.data.uint8[7], (uint8_t)(sent.frame.id + 7));
+    }
+    CHECK_EQ(nextFirst, frames);
+    CHECK_EQ(nextSecond, frames);
+    CHECK_EQ(wifiGVRET.getFramingErrors(), framingBefore);
+    CHECK_EQ(wifiGVRET.getChecksumErrors(), checksumBefore);
+
+    first.close();
+    second.close();
+    delay(5);
+    wifiManager.loop();
+    wifiGVRET.clearBufferedBytes();
+}
+
+static void startSketch()
+{
+    Preferences prefs;
+    prefs.begin(PREF_NAME, false);
+    prefs.putBool("binarycomm", true);
+    prefs.putBool("threaded", true);
+    prefs.putUChar("systype", 0);
+    prefs.putUChar("wifiMode", 2); //be an AP, the server comes up without waiting for a connection
+    prefs.end();
+
+    Serial.takeOutput();
+    setup();
+    CHECK(SysSettings.isCANTaskActive);
+    delay(50);
+}
+
+//Frames go out to WiFi once any input has come from a telnet client
+static void waitForWifi()
+{
+    for (int i = 0; i < 100 && !SysSettings.isWifiActive; i++) delay(10);
+    CHECK(SysSettings.isWifiActive);
+}
+
+static void testFanOut()
+{
+    static TelnetHost host;
+    const uint8_t binaryMode[] = {0xE7, 0xE7};
+
+    host.connect();
+    host.send(binaryMode, sizeof(binaryMode));
+    waitForWifi();
+    uint64_t readBefore = CAN0.getReceived();
+
+    CAN0.generate(20000, 8, 16);
+    delay(1500);
+    CAN0.stopTraffic();
+    delay(200); //last frames drained and flushed
+    host.close();
+
+    uint64_t read = CAN0.getReceived() - readBefore;
+    printf("%llu frames read, %llu sent to the client, %u bytes dropped\n", (unsigned long long)read,
+           (unsigned long long)host.frames.load(), wifiGVRET.getDroppedBytes());
+    CHECK(host.frames.load() > 0);
+    CHECK_EQ(host.junk.load(), 0);
+    CHECK_EQ(host.repeats.load(), 0);
+    CHECK_EQ(host.outOfOrder.load(), 0);
+    CHECK_EQ(wifiGVRET.getDroppedBytes() % BINARY_FRAME_SIZE, 0);
+    CHECK_EQ(host.frames.load() + wifiGVRET.getDroppedBytes() / BINARY_FRAME_SIZE, read);
+}
+
+int main()
+{
+    signal(SIGPIPE, SIG_IGN); //the sketch sends without MSG_NOSIGNAL, lwIP has no signals
+    testFanOutExact();
+    testCompressedFanOut();
+    testNegotiation();
+    testInterleavedInput();
+    startSketch();
+    testFanOut();
+    int result = testResult();
+    fflush(stdout);
+    fflush(stderr);
+    _exit(result); //the sketch's tasks never end
+}
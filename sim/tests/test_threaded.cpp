@@ -0,0 +1,253 @@
+/*
+Threaded mode. Several producers on one ring with setMultiProducer(), then the whole sketch in threaded
+mode with synthetic traffic on CAN0: every frame the RX task read has to come out the serial port once and in
+order or be counted as dropped, pauseRx() has to hold the RX task off, and turning the bus off and on from the
+console while frames are flowing must not upset the stream. Frames sent from the comm side while all that goes on
+must leave the bus load counters to the RX task and still be counted.
+*/
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <unistd.h>
+#include <Preferences.h>
+#include "sim_test.h"
+#include "config.h"
+#include "commbuffer.h"
+#include "can_manager.h"
+#include "gvret_comm.h"
+
+void setup();
+
+#define RECORD_SIZE 12
+#define RECORDS_PER_PRODUCER 200000
+#define BINARY_FRAME_SIZE 20 //F1 00, time, ID, length and bus, 8 data bytes, checksum
+
+//Record: producer number, 4 byte sequence, 6 bytes made from both, XOR of the rest
+static void makeRecord(uint8_t producer, uint32_t seq, uint8_t *out)
+{
+    out[0] = producer;
+    memcpy(&out[1], &seq, 4);
+    for (int i = 5; i < RECORD_SIZE - 1; i++) out[i] = (uint8_t)(seq * (i + 1) + producer);
+    out[RECORD_SIZE - 1] = 0;
+    for (int i = 0; i < RECORD_SIZE - 1; i++) out[RECORD_SIZE - 1] ^= out[i];
+}
+
+static void testMultiProducerRing()
+{
+    static CommBuffer ring;
+    std::atomic<int> producersDone(0);
+    ring.setMultiProducer(true);
+    CHECK(ring.reserveBytes(RECORD_SIZE) == NULL); //no zero copy slots once writers have to share
+
+    auto producer = [&](uint8_t number)
+    {
+        uint8_t record[RECORD_SIZE];
+        for (uint32_t seq = 0; seq < RECORDS_PER_PRODUCER; seq++)
+        {
+            makeRecord(number, seq, record);
+            while (!ring.sendBytesToBuffer(record, RECORD_SIZE)) std::this_thread::yield();
+        }
+        producersDone++;
+    };
+
+    std::thread first(producer, 1);
+    std::thread second(producer, 2);
+    uint32_t expected[3] = {0, 0, 0};
+    int bad = 0;
+    uint8_t record[RECORD_SIZE];
+    size_t have = 0;
+    for (;;)
+    {
+        bool finished = producersDone == 2;
+        size_t len = ring.numContiguousBytes();
+        uint8_t *bytes = ring.getBufferedBytes();
+        if (!len)
+        {
+            if (finished) break;
+            std::this_thread::yield();
+            continue;
+        }
+        for (size_t i = 0; i < len; i++)
+        {
+            record[have++] = bytes[i];
+            if (have < RECORD_SIZE) continue;
+            have = 0;
+            uint8_t check = 0;
+            for (int b = 0; b < RECORD_SIZE - 1; b++) check ^= record[b];
+            uint32_t seq;
+            memcpy(&seq, &record[1], 4);
+            uint8_t good[RECORD_SIZE];
+            if (record[0] < 1 || record[0] > 2) bad++;
+            else
+            {
+                makeRecord(record[0], seq, good);
+                if (check != record[RECORD_SIZE - 1] || memcmp(good, record, RECORD_SIZE) || seq != expected[record[0]]) bad++;
+                expected[record[0]] = seq + 1;
+            }
+        }
+        ring.consumeBytes(len);
+    }
+    first.join();
+    second.join();
+    CHECK_EQ(bad, 0);
+    CHECK_EQ(have, 0);
+    CHECK_EQ(expected[1], RECORDS_PER_PRODUCER);
+    CHECK_EQ(expected[2], RECORDS_PER_PRODUCER);
+}
+
+//The USB host. Pulls the synthetic sequence numbers out of the binary GVRET frames
+class FrameSink : public Print
+{
+public:
+    std::atomic<uint64_t> frames{0};
+    std::atomic<uint64_t> outOfOrder{0};
+    std::atomic<uint64_t> repeats{0};
+
+    size_t write(uint8_t byt) override
+    {
+        return write(&byt, 1);
+    }
+
+    size_t write(const uint8_t *buffer, size_t size) override
+    {
+        for (size_t i = 0; i < size; i++) parse(buffer[i]);
+        return size;
+    }
+
+private:
+    uint8_t msg[32];
+    size_t msgLength = 0;
+    size_t msgExpected = 0;
+    bool first = true;
+    uint32_t lastSeq = 0;
+
+    void parse(uint8_t byt)
+    {
+        if (msgLength == 0)
+        {
+            if (byt == 0xF1) msg[msgLength++] = byt;
+            return;
+        }
+        if (msgLength == 1 && byt != 0)
+        {
+            msgLength = (byt == 0xF1) ? 1 : 0;
+            return;
+        }
+        msg[msgLength++] = byt;
+        if (msgLength == 11) msgExpected = 11 + (byt & 0xF) + 1;
+        if (msgLength >= 11 && msgLength == msgExpected)
+        {
+            uint32_t seq = msg[11] | (msg[12] << 8) | (msg[13] << 16) | ((uint32_t)msg[14] << 24);
+            if (!first && seq == lastSeq) repeats++;
+            else if (!first && seq < lastSeq) outOfOrder++;
+            first = false;
+            lastSeq = seq;
+            frames++;
+            msgLength = 0;
+        }
+    }
+};
+
+static FrameSink sink;
+
+static CAN_FRAME txFrame(uint32_t id)
+{
+    CAN_FRAME frame;
+    frame.id = id;
+    frame.extended = false;
+    frame.rtr = 0;
+    frame.length = 8;
+    memset(frame.data.uint8, 0x55, 8);
+    return frame;
+}
+
+static void testThreadedSketch()
+{
+    Preferences prefs;
+    prefs.begin(PREF_NAME, false);
+    prefs.putBool("binarycomm", true);
+    prefs.putBool("threaded", true);
+    prefs.putUChar("systype", 0);
+    prefs.putUChar("wifiMode", 0);
+    prefs.end();
+
+    Serial.setSink(&sink);
+    setup();
+    CHECK(SysSettings.isCANTaskActive);
+    CAN0.generate(5000, 8, 16);
+    //the comm side sending while the RX task counts what comes in
+    std::atomic<int> txSent(0);
+    std::thread sender([&]()
+    {
+        for (int i = 0; i < 2000; i++)
+        {
+            CAN_FRAME frame = txFrame(0x600 + (i & 0xF));
+            if (canManager.sendFrame(&CAN0, frame)) txSent++;
+            if ((i & 0x3F) == 0) delay(1);
+        }
+    });
+    delay(300);
+    sender.join();
+    CHECK_EQ(txSent.load(), 2000);
+
+    //the RX task has to stay out of the drivers while paused
+    canManager.pauseRx();
+    uint64_t before = CAN0.getReceived();
+    delay(50);
+    CHECK_EQ(CAN0.getReceived(), before);
+    canManager.resumeRx();
+    delay(50);
+    CHECK(CAN0.getReceived() > before);
+
+    //bus restart from the console in the middle of the stream
+    Serial.feedInput("CANEN0=0\r");
+    delay(50);
+    Serial.feedInput("CANEN0=1\r");
+    delay(300);
+
+    CAN0.stopTraffic();
+    delay(200); //last frames drained and flushed
+    uint64_t cameIn = CAN0.getGenerated() - CAN0.getMissed();
+    uint64_t read = CAN0.getReceived();
+    printf("%llu frames came due, %u missed, %llu read, %llu out the serial port, %u bytes dropped\n",
+           (unsigned long long)CAN0.getGenerated(), CAN0.getMissed(), (unsigned long long)read,
+           (unsigned long long)sink.frames.load(), serialGVRET.getDroppedBytes());
+    CHECK(read > 0);
+    CHECK(read <= cameIn); //frames queued when the bus went off are thrown away by the driver
+    //the RX task never waits on the ring. What didn't fit is dropped whole and counted, so everything read is accounted for
+    CHECK_EQ(sink.frames.load() + serialGVRET.getDroppedBytes() / BINARY_FRAME_SIZE, read);
+    CHECK_EQ(serialGVRET.getDroppedBytes() % BINARY_FRAME_SIZE, 0);
+    CHECK_EQ(sink.repeats.load(), 0);
+    CHECK_EQ(sink.outOfOrder.load(), 0);
+
+    //with nothing coming in, frames sent while the RX task is held off don't touch its counters and show up in
+    //the rate once it rolls the window over
+    delay(BUSLOAD_INTERVAL * 2); //the last received frames out of the window
+    canManager.pauseRx();
+    uint32_t framesBefore = canManager.getBusLoad(0).framesSoFar;
+    for (int i = 0; i < 200; i++)
+    {
+        CAN_FRAME frame = txFrame(0x700);
+        CHECK(canManager.sendFrame(&CAN0, frame));
+    }
+    CHECK_EQ(canManager.getBusLoad(0).framesSoFar, framesBefore);
+    canManager.resumeRx();
+    uint32_t mostPerSec = 0;
+    for (int i = 0; i < 60; i++)
+    {
+        delay(10);
+        if (canManager.getBusLoad(0).framesPerSec > mostPerSec) mostPerSec = canManager.getBusLoad(0).framesPerSec;
+    }
+    CHECK(mostPerSec > 0);
+    CHECK(mostPerSec <= 200 * 1000 / BUSLOAD_INTERVAL);
+}
+
+int main()
+{
+    testMultiProducerRing();
+    testThreadedSketch();
+    int result = testResult();
+    fflush(stdout);
+    fflush(stderr);
+    _exit(result); //the sketch's tasks never end
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include <Arduino.h>
+
+/*
+Fast replacements for the handful of printf conversions used on the frame output paths. Output is byte for
+byte what sprintf produces for the equivalent format string. None of these null terminate, they all return
+the number of characters written so calls can be chained by advancing the output pointer.
+*/
+class TextFormat
+{
+public:
+    //same as "%x" / "%X" when minDigits is 1, "%03x" when minDigits is 3, etc.
+    static int hex(char *out, uint32_t val, int minDigits, bool upper)
+    {
+        const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+        int numDigits = 1;
+        while (numDigits < 8 && (val >> (4 * numDigits))) numDigits++;
+        if (numDigits < minDigits) numDigits = minDigits;
+        for (int i = numDigits - 1; i >= 0; i--)
+        {
+            out[i] = digits[val & 0xF];
+            val >>= 4;
+        }
+        return numDigits;
+    }
+
+    //"%x" of a single byte. The most common case by far so it gets its own path
+    static int hexByte(char *out, uint8_t val, bool upper)
+    {
+        const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+        if (val < 16)
+        {
+            out[0] = digits[val];
+            return 1;
+        }
+        out[0] = digits[val >> 4];
+        out[1] = digits[val & 0xF];
+        return 2;
+    }
+
+    //"%02x" of a single byte
+    static int hexByte2(char *out, uint8_t val, bool upper)
+    {
+        const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+        out[0] = digits[val >> 4];
+        out[1] = digits[val & 0xF];
+        return 2;
+    }
+
+    //"%u". Works two digits at a time from a table to halve the number of divisions
+    static int uintDec(char *out, uint32_t val)
+    {
+        static const char pairs[] =
+            "0001020304050607080910111213141516171819"
+            "2021222324252627282930313233343536373839"
+            "4041424344454647484950515253545556575859"
+            "6061626364656667686970717273747576777879"
+            "8081828384858687888990919293949596979899";
+        char temp[10];
+        int pos = 10;
+        while (val >= 100)
+        {
+            uint32_t idx = (val % 100) * 2;
+            val /= 100;
+            temp[--pos] = pairs[idx + 1];
+            temp[--pos] = pairs[idx];
+        }
+        if (val >= 10)
+        {
+            temp[--pos] = pairs[val * 2 + 1];
+            temp[--pos] = pairs[val * 2];
+        }
+        else temp[--pos] = '0' + val;
+        memcpy(out, &temp[pos], 10 - pos);
+        return 10 - pos;
+    }
+
+    //"%d" / "%i"
+    static int intDec(char *out, int32_t val)
+    {
+        if (val >= 0) return uintDec(out, (uint32_t)val);
+        out[0] = '-';
+        return 1 + uintDec(out + 1, 0u - (uint32_t)val);
+    }
+
+    static int str(char *out, const char *str)
+    {
+        int len = strlen(str);
+        memcpy(out, str, len);
+        return len;
+    }
+};
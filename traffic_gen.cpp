@@ -0,0 +1,172 @@
+#include "traffic_gen.h"
+#include "Logger.h"
+#include "can_manager.h"
+#include "gvret_comm.h"
+#include "flush_policy.h"
+
+TrafficGenerator::TrafficGenerator()
+{
+    active = false;
+    sending = false;
+    rng = 0x2545F491;
+}
+
+bool TrafficGenerator::isRunning()
+{
+    return active;
+}
+
+//What the host link has taken so far. Only the one in use counts, same as displayFrame()
+uint32_t TrafficGenerator::hostBytes()
+{
+    return SysSettings.isWifiActive ? wifiFlush.getBytesFlushed() : serialFlush.getBytesFlushed();
+}
+
+uint32_t TrafficGenerator::hostDrops()
+{
+    return SysSettings.isWifiActive ? wifiGVRET.getDroppedBytes() : serialGVRET.getDroppedBytes();
+}
+
+bool TrafficGenerator::start(int bus, uint32_t frameRate, int length, int ids, bool random, uint32_t seconds)
+{
+    if (active) return false;
+    if (bus < 0 || bus >= SysSettings.numBuses || !canBuses[bus] || !settings.canSettings[bus].enabled) return false;
+    if (frameRate < 1 || frameRate > TRAFFIC_MAX_RATE) return false;
+    if (length < 0 || length > 8) return false;
+    if (ids < 1 || ids > TRAFFIC_MAX_IDS) return false;
+    if (seconds < 1 || seconds > 3600) return false;
+
+    txBus = bus;
+    rate = frameRate;
+    dlc = length;
+    numIDs = ids;
+    randomIDs = random;
+    duration = seconds * 1000000ul;
+    sent = 0;
+    sendFailures = 0;
+    nextID = 0;
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        received[i] = 0;
+        expectedSeq[i] = 0;
+        sequenceGaps[i] = 0;
+    }
+    hostBytesStart = hostBytes();
+    hostDropsStart = hostDrops();
+    startTime = micros();
+    sending = true;
+    active = true;
+    return true;
+}
+
+//Stops sending. The report comes once the last frames have had TRAFFIC_SETTLE_MS to come back
+void TrafficGenerator::stop()
+{
+    if (!sending) return;
+    sendTime = micros() - startTime;
+    sending = false;
+    settleStart = millis();
+}
+
+void TrafficGenerator::loop()
+{
+    if (!active) return;
+    if (!sending)
+    {
+        if ((millis() - settleStart) >= TRAFFIC_SETTLE_MS)
+        {
+            active = false;
+            report();
+        }
+        return;
+    }
+
+    uint32_t elapsed = micros() - startTime;
+    if (elapsed >= duration)
+    {
+        stop();
+        return;
+    }
+
+    //keep up with the schedule but never send more than a burst per pass so nothing else gets starved
+    uint32_t due = (uint32_t)(((uint64_t)rate * elapsed) / 1000000ull);
+    CAN_FRAME frame;
+    frame.extended = false;
+    frame.rtr = 0;
+    frame.length = dlc;
+    for (int burst = 0; sent < due && burst < TRAFFIC_BURST; burst++)
+    {
+        uint32_t idx;
+        if (randomIDs)
+        {
+            rng ^= rng << 13; //xorshift32
+            rng ^= rng >> 17;
+            rng ^= rng << 5;
+            idx = rng % numIDs;
+        }
+        else
+        {
+            idx = nextID;
+            if (++nextID >= (uint32_t)numIDs) nextID = 0;
+        }
+        frame.id = TRAFFIC_BASE_ID + idx;
+        for (int i = 0; i < dlc; i++) frame.data.uint8[i] = (i < 4) ? (uint8_t)(sent >> (8 * i)) : (uint8_t)(idx + i);
+        if (!canManager.sendFrame(canBuses[txBus], frame))
+        {
+            sendFailures++; //transmit queue is full. Try again next pass
+            break;
+        }
+        sent++;
+    }
+}
+
+//Picks our own frames out of everything received. Has to stay cheap since it sees every frame
+void TrafficGenerator::frameReceived(int bus, CAN_FRAME &frame)
+{
+    if (!active) return;
+    countFrame(bus, frame.id, frame.extended, frame.length, frame.data.uint8);
+}
+
+//Buses running in FD mode hand classic frames over as FD frames too
+void TrafficGenerator::frameReceived(int bus, CAN_FRAME_FD &frame)
+{
+    if (!active) return;
+    countFrame(bus, frame.id, frame.extended, frame.length, frame.data.uint8);
+}
+
+void TrafficGenerator::countFrame(int bus, uint32_t id, bool extended, int length, const uint8_t *data)
+{
+    if (extended || length != dlc) return;
+    if (id < TRAFFIC_BASE_ID || id >= (uint32_t)(TRAFFIC_BASE_ID + numIDs)) return;
+    received[bus]++;
+    if (dlc >= 4)
+    {
+        uint32_t seq = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+        if (seq != expectedSeq[bus]) sequenceGaps[bus]++;
+        expectedSeq[bus] = seq + 1;
+    }
+}
+
+void TrafficGenerator::report()
+{
+    uint32_t seconds100 = sendTime / 10000; //hundredths of a second
+    if (!seconds100) seconds100 = 1;
+
+    Logger::console("Traffic test, board type %i: CAN%i, %i frames/sec asked for, DLC %i, %i IDs %s", settings.systemType, txBus, rate,
+                    dlc, numIDs, randomIDs ? "at random" : "in turn");
+    Logger::console("  Sent %u frames in %u ms (%u frames/sec), transmit queue full %u times", sent, sendTime / 1000,
+                    (uint32_t)(((uint64_t)sent * 100) / seconds100), sendFailures);
+    bool anyReceived = false;
+    for (int i = 0; i < SysSettings.numBuses; i++)
+    {
+        if (!received[i]) continue; //in a two bus loopback the sending bus never sees its own frames
+        anyReceived = true;
+        uint32_t lost = (sent > received[i]) ? (sent - received[i]) : 0;
+        Logger::console("  CAN%i received %u frames (%u frames/sec), %u lost, %u sequence gaps", i, received[i],
+                        (uint32_t)(((uint64_t)received[i] * 100) / seconds100), lost, sequenceGaps[i]);
+    }
+    if (!anyReceived) Logger::console("  No frames came back on any bus. Check the loopback wiring or self reception");
+    uint32_t bytes = hostBytes() - hostBytesStart;
+    Logger::console("  Host link (%s): %u bytes sent (%u bytes/sec), %u bytes dropped", SysSettings.isWifiActive ? "WiFi" : "Serial",
+                    bytes, (uint32_t)(((uint64_t)bytes * 100) / seconds100), hostDrops() - hostDropsStart);
+}
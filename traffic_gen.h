@@ -0,0 +1,52 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+#include "esp32_can.h"
+
+/*
+Built in traffic generator for finding out how many frames a board can really capture. It sends standard frames
+on one bus at a fixed rate through canManager.sendFrame() while the receive side counts them coming back in,
+either on another bus wired to the first or on the same bus with the controller receiving its own frames.
+IDs are TRAFFIC_BASE_ID and up, taken in turn or at random. Frames of 4 or more bytes carry a sequence number
+in their first 4 bytes (LSB first) so gaps can be told apart from frames that never made it onto the bus.
+Received frames go to the host as usual so the report also shows what the host link kept up with.
+start() and loop() run with the rest of the comm side. frameReceived() is called from the CAN receive side.
+*/
+class TrafficGenerator
+{
+public:
+    TrafficGenerator();
+    bool start(int bus, uint32_t rate, int dlc, int ids, bool randomIDs, uint32_t seconds);
+    void stop();
+    void loop();
+    void frameReceived(int bus, CAN_FRAME &frame);
+    void frameReceived(int bus, CAN_FRAME_FD &frame);
+    bool isRunning();
+
+private:
+    volatile bool active; //sending or waiting for the last frames to arrive. Receive side counts while this is set
+    bool sending;
+    int txBus;
+    uint32_t rate;
+    int dlc;
+    int numIDs;
+    bool randomIDs;
+    uint32_t duration; //us
+    uint32_t startTime; //micros()
+    uint32_t sendTime; //us spent sending
+    uint32_t settleStart; //millis() sending stopped
+    uint32_t sent;
+    uint32_t sendFailures;
+    uint32_t nextID;
+    uint32_t rng;
+    volatile uint32_t received[NUM_BUSES];
+    uint32_t expectedSeq[NUM_BUSES];
+    uint32_t sequenceGaps[NUM_BUSES];
+    uint32_t hostBytesStart;
+    uint32_t hostDropsStart;
+
+    uint32_t hostBytes();
+    uint32_t hostDrops();
+    void countFrame(int bus, uint32_t id, bool extended, int length, const uint8_t *data);
+    void report();
+};
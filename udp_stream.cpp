@@ -0,0 +1,146 @@
+#include "udp_stream.h"
+#include "gvret_comm.h"
+#include "Logger.h"
+
+UDPStreamer::UDPStreamer()
+{
+    started = false;
+    subscribed = false;
+    subscriberPort = 0;
+    lastHeard = 0;
+    sequence = 0;
+    datagramsSent = 0;
+    framesSent = 0;
+}
+
+//Called once WiFi is up. Does nothing unless UDP streaming has been turned on.
+void UDPStreamer::setup()
+{
+    if (!settings.udpStream || started) return;
+    records.setMultiProducer(settings.threadedMode);
+    udp.begin(UDP_STREAM_PORT);
+    started = true;
+    Logger::console("UDP streaming listening on port %i", UDP_STREAM_PORT);
+}
+
+//Look for subscribe / keep alive datagrams and expire the subscriber if they stop
+void UDPStreamer::loop()
+{
+    if (!started) return;
+
+    if (udp.parsePacket() > 0)
+    {
+        if (!subscribed || subscriberIP != udp.remoteIP() || subscriberPort != udp.remotePort())
+        {
+            Logger::console("UDP stream now going to %s:%i", udp.remoteIP().toString().c_str(), udp.remotePort());
+        }
+        subscriberIP = udp.remoteIP();
+        subscriberPort = udp.remotePort();
+        lastHeard = millis();
+        subscribed = true;
+    }
+
+    if (subscribed && (millis() - lastHeard) > UDP_SUBSCRIBE_TIMEOUT)
+    {
+        Logger::console("UDP stream subscriber went quiet. Stopping stream");
+        subscribed = false;
+    }
+}
+
+bool UDPStreamer::isStreaming()
+{
+    return subscribed;
+}
+
+size_t UDPStreamer::numBufferedBytes()
+{
+    return records.numAvailableBytes();
+}
+
+void UDPStreamer::sendFrame(CAN_FRAME &frame, int whichBus)
+{
+    uint8_t buff[80];
+    if (!subscribed) return;
+    buff[0] = (uint8_t)CommBuffer::encodeBinaryFrame(frame, whichBus, buff + 1);
+    records.sendBytesToBuffer(buff, buff[0] + 1);
+}
+
+void UDPStreamer::sendFrame(CAN_FRAME_FD &frame, int whichBus)
+{
+    uint8_t buff[80];
+    if (!subscribed) return;
+    buff[0] = (uint8_t)CommBuffer::encodeBinaryFrame(frame, whichBus, buff + 1);
+    records.sendBytesToBuffer(buff, buff[0] + 1);
+}
+
+//copy a record out of the ring which might wrap in the middle of it
+void UDPStreamer::copyRecord(size_t offset, uint8_t *dest, size_t length)
+{
+    while (length > 0)
+    {
+        uint8_t *src;
+        size_t chunk = records.peekBytes(offset, &src);
+        if (chunk > length) chunk = length;
+        memcpy(dest, src, chunk);
+        dest += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+}
+
+//Pack everything buffered into as few datagrams as will hold it and send them out
+void UDPStreamer::flush()
+{
+    static uint8_t packet[UDP_STREAM_MTU];
+    size_t avail = records.numAvailableBytes();
+
+    if (avail == 0) return;
+    if (!subscribed)
+    {
+        records.clearBufferedBytes();
+        return;
+    }
+
+    while (avail > 0)
+    {
+        size_t len = 7; //header
+        size_t offset = 0;
+        int count = 0;
+        while (offset < avail && count < 255)
+        {
+            uint8_t *recLen;
+            records.peekBytes(offset, &recLen);
+            if (len + *recLen > UDP_STREAM_MTU) break;
+            copyRecord(offset + 1, &packet[len], *recLen);
+            len += *recLen;
+            offset += *recLen + 1;
+            count++;
+        }
+
+        packet[0] = 0xF1;
+        packet[1] = PROTO_UDP_BATCH;
+        packet[2] = (uint8_t)(sequence & 0xFF);
+        packet[3] = (uint8_t)(sequence >> 8);
+        packet[4] = (uint8_t)(sequence >> 16);
+        packet[5] = (uint8_t)(sequence >> 24);
+        packet[6] = (uint8_t)count;
+        udp.beginPacket(subscriberIP, subscriberPort);
+        udp.write(packet, len);
+        udp.endPacket();
+
+        records.consumeBytes(offset);
+        avail -= offset;
+        sequence++;
+        datagramsSent++;
+        framesSent += count;
+    }
+}
+
+void UDPStreamer::printStats()
+{
+    if (!started) return;
+    if (subscribed) Logger::console("UDP stream to %s:%i: %i datagrams, %i frames sent, %i frames dropped (%i bytes)",
+                                    subscriberIP.toString().c_str(), subscriberPort, datagramsSent, framesSent,
+                                    records.getOverflowCount(), records.getDroppedBytes());
+    else Logger::console("UDP stream: no subscriber on port %i", UDP_STREAM_PORT);
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <Arduino.h>
+#include <WiFiUdp.h>
+#include "config.h"
+#include "esp32_can.h"
+#include "commbuffer.h"
+
+/*
+Optional UDP streaming of received frames. A receiver subscribes by sending any datagram to UDP_STREAM_PORT
+and has to keep doing so at least every UDP_SUBSCRIBE_TIMEOUT ms or the stream stops. Frames go out as
+datagrams of the form:
+F1 PROTO_UDP_BATCH seq(4 bytes, LSB first) count(1 byte) then count binary GVRET frame records back to back.
+Frames are never split across datagrams and the sequence number goes up by one per datagram so a receiver
+can see exactly where it lost data instead of stalling the way TCP does on a lossy link.
+*/
+class UDPStreamer
+{
+public:
+    UDPStreamer();
+    void setup();
+    void loop();
+    void flush();
+    bool isStreaming();
+    size_t numBufferedBytes();
+    void sendFrame(CAN_FRAME &frame, int whichBus);
+    void sendFrame(CAN_FRAME_FD &frame, int whichBus);
+    void printStats();
+
+private:
+    WiFiUDP udp;
+    CommBuffer records; //encoded frames waiting to be batched, each one prefixed by its length byte
+    bool started;
+    volatile bool subscribed;
+    IPAddress subscriberIP;
+    uint16_t subscriberPort;
+    uint32_t lastHeard;
+    uint32_t sequence;
+    uint32_t datagramsSent;
+    uint32_t framesSent;
+
+    void copyRecord(size_t offset, uint8_t *dest, size_t length);
+};
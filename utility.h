@@ -1,4 +1,6 @@
 #pragma once
+#include <stdint.h>
+#include <esp_timer.h>
 
 class Utility
 {
@@ -19,4 +21,34 @@ public:
         for (int i = 0; i < length; i++) result += parseHexCharacter(str[i]) << (4 * (length - i - 1));
         return result;
     }
+
+    //Frames carry the low 32 bits of the 64 bit esp_timer clock (the same clock micros() reads) from when they
+    //were received. This puts the top half back on, which works as long as the frame is less than ~71 minutes
+    //old when it's encoded. A zero stamp means nobody stamped the frame so the current time is used.
+    static uint64_t frameTime64(uint32_t stamp)
+    {
+        uint64_t now = esp_timer_get_time();
+        if (stamp == 0) return now;
+        return now - (uint32_t)((uint32_t)now - stamp);
+    }
+
+    //CAN-FD DLC codes 9-15 stand for 12, 16, 20, 24, 32, 48 and 64 bytes
+    static uint8_t fdDLCToLength(uint8_t dlc)
+    {
+        static const uint8_t lengths[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+        return lengths[dlc & 0xF];
+    }
+
+    //smallest DLC code that can hold the given number of bytes
+    static uint8_t fdLengthToDLC(uint8_t length)
+    {
+        if (length <= 8) return length;
+        if (length <= 12) return 9;
+        if (length <= 16) return 10;
+        if (length <= 20) return 11;
+        if (length <= 24) return 12;
+        if (length <= 32) return 13;
+        if (length <= 48) return 14;
+        return 15;
+    }
 };
\ No newline at end of file
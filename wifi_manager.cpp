@@ -7,6 +7,9 @@
 #include <WiFi.h>
 #include <FastLED.h>
 #include "ELM327_Emulator.h"
+#include "Logger.h"
+#include "udp_stream.h"
+#include <lwip/sockets.h>
 
 extern CRGB leds[A5_NUM_LEDS];
 
@@ -15,6 +18,8 @@ static IPAddress broadcastAddr(255,255,255,255);
 WiFiManager::WiFiManager()
 {
     lastBroadcast = 0;
+    compressInBytes = 0;
+    compressOutBytes = 0;
 }
 
 void WiFiManager::setup()
@@ -26,7 +31,7 @@ void WiFiManager::setup()
         WiFi.setSleep(true); //sleeping could cause delays
         WiFi.begin((const char *)settings.SSID, (const char *)settings.WPA2Key);
 
-        WiFiEventId_t eventID = WiFi.onEvent([](WiFiEvent_t event, WiFiEventInfo_t info) 
+        WiFi.onEvent([](WiFiEvent_t, WiFiEventInfo_t info) 
         {
            if (SysSettings.fancyLED)
            {
@@ -103,6 +108,7 @@ void WiFiManager::loop()
                 Serial.println("TCP server started");
                 wifiOBDII.begin(1000); //setup for wifi linked ELM327 emulation
                 wifiOBDII.setNoDelay(true);
+                udpStreamer.setup();
                 ArduinoOTA.setPort(3232);
                 ArduinoOTA.setHostname(deviceName);
                 // No authentication by default
@@ -157,6 +163,10 @@ void WiFiManager::loop()
                             if (!SysSettings.clientNodes[i]) Serial.println("Couldn't accept client connection!");
                             else 
                             {
+                                resetClient(i);
+                                //formats are negotiated for the whole link, a new client starts everyone back on
+                                //the defaults since those are what it understands
+                                wifiGVRET.resetFormats();
                                 Serial.print("New client: ");
                                 Serial.print(i); Serial.print(' ');
                                 Serial.println(SysSettings.clientNodes[i].remoteIP());
@@ -204,14 +214,14 @@ void WiFiManager::loop()
                     {
                         if(SysSettings.clientNodes[i].available())
                         {
-                            //get data from the telnet client and push it to input processing
-                            while(SysSettings.clientNodes[i].available()) 
+                            //get data from the telnet client and push it to input processing. One chunk per pass,
+                            //the rest waits in the socket so a busy client can't hold off CAN reception
+                            uint8_t inputChunk[GVRET_INPUT_CHUNK];
+                            int inCnt = SysSettings.clientNodes[i].read(inputChunk, sizeof(inputChunk));
+                            if (inCnt > 0)
                             {
-                                uint8_t inByt;
-                                inByt = SysSettings.clientNodes[i].read();
                                 SysSettings.isWifiActive = true;
-                                //Serial.write(inByt); //echo to serial - just for debugging. Don't leave this on!
-                                wifiGVRET.processIncomingByte(inByt);
+                                wifiGVRET.processIncomingBytes(inputChunk, inCnt, gvretClients[i].input);
                             }
                         }
                     }
@@ -220,6 +230,7 @@ void WiFiManager::loop()
                         if (SysSettings.clientNodes[i]) 
                         {
                             SysSettings.clientNodes[i].stop();
+                            if (numClients() == 0) wifiGVRET.resetFormats(); //nobody left who negotiated anything
                             if (SysSettings.fancyLED)
                             {
                                 leds[SysSettings.LED_CONNECTION_STATUS] = CRGB::Green;
@@ -279,21 +290,202 @@ void WiFiManager::loop()
         wifiUDPServer.endPacket();
     }
 
+    if (SysSettings.isWifiConnected) udpStreamer.loop();
+
     ArduinoOTA.handle();
 }
 
+/*
+Fan the shared WiFi buffer out to every connected telnet client. Each client has its own bounded queue and
+everything buffered is either copied into a queue whole or dropped for that client, so a client that falls
+behind loses complete chunks of frames instead of getting a corrupted stream. The shared buffer is always
+emptied which keeps a stalled client from pushing back on capture or on the other clients.
+If the host turned on compression the whole chunk is packed into one PROTO_COMPRESSED_BLOCK first, unless that
+doesn't make it any smaller in which case it goes out as is. Either way clients only ever get complete messages.
+*/
 void WiFiManager::sendBufferedData()
 {
-    for(int i = 0; i < MAX_CLIENTS; i++)
+    size_t total = wifiGVRET.numAvailableBytes();
+
+    if (total > 0)
     {
-        size_t wifiLength = wifiGVRET.numAvailableBytes();
-        uint8_t* buff = wifiGVRET.getBufferedBytes();
-        if (SysSettings.clientNodes[i] && SysSettings.clientNodes[i].connected())
+        uint8_t *first, *second = NULL;
+        //peekBytes goes by where the producer is right now and in threaded mode that can already be past total.
+        //Only what gets consumed below may go out, anything more would be sent again on the next flush
+        size_t firstLength = wifiGVRET.peekBytes(0, &first);
+        if (firstLength > total) firstLength = total;
+        size_t secondLength = (firstLength < total) ? wifiGVRET.peekBytes(firstLength, &second) : 0;
+        if (secondLength > total - firstLength) secondLength = total - firstLength;
+        size_t blockLength = wifiGVRET.isCompressed() ? compressChunk(first, firstLength, second, secondLength) : 0;
+
+        if (blockLength > 0) fanOut(compressedBlock, blockLength, NULL, 0);
+        else fanOut(first, firstLength, second, secondLength);
+        wifiGVRET.consumeBytes(total);
+    }
+
+    drainClients();
+}
+
+/*
+A client that is caught up (empty queue) gets sent straight from the given data and only what the socket
+won't take right now is copied to its queue. Normally that's nothing so the data only gets copied once, by lwIP.
+The data can come in two pieces since the shared buffer may wrap.
+*/
+void WiFiManager::fanOut(const uint8_t *first, size_t firstLength, const uint8_t *second, size_t secondLength)
+{
+    const uint8_t *pieces[2] = {first, second};
+    size_t lengths[2] = {firstLength, secondLength};
+    size_t total = firstLength + secondLength;
+
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        if (!SysSettings.clientNodes[i] || !SysSettings.clientNodes[i].connected()) continue;
+        CommBuffer &queue = gvretClients[i].queue;
+        int piece = 0;
+        size_t offset = 0; //into the current piece
+        if (queue.numAvailableBytes() == 0)
         {
-            SysSettings.clientNodes[i].write(buff, wifiLength);
+            int sent = 0;
+            while (piece < 2)
+            {
+                if (offset == lengths[piece])
+                {
+                    piece++;
+                    offset = 0;
+                    continue;
+                }
+                sent = sendToClient(i, pieces[piece] + offset, lengths[piece] - offset);
+                if (sent <= 0) break;
+                offset += sent;
+                if (offset < lengths[piece]) break;
+            }
+            if (sent < 0) continue; //connection failed and the client was dropped
         }
+        else if (queue.numFreeBytes() < total)
+        {
+            queue.recordDrop(total);
+            continue;
+        }
+        for (; piece < 2; piece++, offset = 0)
+        {
+            if (offset < lengths[piece]) queue.sendBytesToBuffer(pieces[piece] + offset, lengths[piece] - offset);
+        }
+        if (queue.numAvailableBytes() > gvretClients[i].maxQueued) gvretClients[i].maxQueued = queue.numAvailableBytes();
+    }
+}
+
+/*
+Pack a chunk of the shared buffer into compressedBlock as F1 PROTO_COMPRESSED_BLOCK rawLen(2) blockLen(2) followed
+by an LZ4 block. Returns the full length or 0 if compressing didn't save anything. The pieces have to be exactly
+what sendBufferedData consumes, rawLen tells the host how much that was.
+*/
+size_t WiFiManager::compressChunk(const uint8_t *first, size_t firstLength, const uint8_t *second, size_t secondLength)
+{
+    const uint8_t *src = first;
+    size_t total = firstLength + secondLength;
+
+    if (total <= COMPRESSED_HEADER_SIZE + 1) return 0;
+    if (secondLength > 0) //LZ4 wants its input in one piece
+    {
+        memcpy(rawChunk, first, firstLength);
+        memcpy(rawChunk + firstLength, second, secondLength);
+        src = rawChunk;
+    }
+    size_t blockLength = compressor.compress(src, total, compressedBlock + COMPRESSED_HEADER_SIZE, total - COMPRESSED_HEADER_SIZE - 1);
+    compressInBytes += total;
+    if (blockLength == 0)
+    {
+        compressOutBytes += total;
+        return 0;
+    }
+    compressedBlock[0] = 0xF1;
+    compressedBlock[1] = PROTO_COMPRESSED_BLOCK;
+    compressedBlock[2] = (uint8_t)(total & 0xFF);
+    compressedBlock[3] = (uint8_t)(total >> 8);
+    compressedBlock[4] = (uint8_t)(blockLength & 0xFF);
+    compressedBlock[5] = (uint8_t)(blockLength >> 8);
+    compressOutBytes += blockLength + COMPRESSED_HEADER_SIZE;
+    return blockLength + COMPRESSED_HEADER_SIZE;
+}
+
+void WiFiManager::drainClients()
+{
+    for (int i = 0; i < MAX_CLIENTS; i++) drainClient(i);
+}
+
+//Send as much of the client queue as the socket will take right now without blocking
+void WiFiManager::drainClient(int which)
+{
+    WiFiClient &client = SysSettings.clientNodes[which];
+    CommBuffer &queue = gvretClients[which].queue;
+    size_t length;
+
+    if (queue.numAvailableBytes() == 0) return; //checked first since this runs on every pass
+    if (!client || !client.connected())
+    {
+        queue.clearBufferedBytes();
+        return;
+    }
+
+    while ((length = queue.numContiguousBytes()) > 0)
+    {
+        int sent = sendToClient(which, queue.getBufferedBytes(), length);
+        if (sent <= 0) return;
+        queue.consumeBytes(sent);
+        if ((size_t)sent < length) return; //socket buffer is full, try again next flush
+    }
+}
+
+//Non blocking send. Returns how much the socket took, which is 0 if its buffer is full, or -1 if the
+//connection failed in which case the client has been dropped.
+int WiFiManager::sendToClient(int which, const uint8_t *data, size_t length)
+{
+    WiFiClient &client = SysSettings.clientNodes[which];
+    int sent = send(client.fd(), data, length, MSG_DONTWAIT);
+    if (sent < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        Logger::warn("Send to client %i failed with error %i, dropping it", which, errno);
+        client.stop();
+        gvretClients[which].queue.clearBufferedBytes();
+        if (numClients() == 0) wifiGVRET.resetFormats();
+        return -1;
+    }
+    gvretClients[which].bytesSent += sent;
+    return sent;
+}
+
+void WiFiManager::resetClient(int which)
+{
+    gvretClients[which].queue.clearBufferedBytes();
+    gvretClients[which].queue.resetStats();
+    gvretClients[which].input.msgLength = 0;
+    gvretClients[which].bytesSent = 0;
+    gvretClients[which].maxQueued = 0;
+}
+
+int WiFiManager::numClients()
+{
+    int count = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        if (SysSettings.clientNodes[i] && SysSettings.clientNodes[i].connected()) count++;
+    }
+    return count;
+}
+
+void WiFiManager::printClientStats()
+{
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        if (!SysSettings.clientNodes[i] || !SysSettings.clientNodes[i].connected()) continue;
+        GVRETClient &cli = gvretClients[i];
+        Logger::console("Client %i (%s): %i bytes sent, %i queued (max %i), %i chunks dropped (%i bytes)", i, 
+                        SysSettings.clientNodes[i].remoteIP().toString().c_str(), cli.bytesSent, cli.queue.numAvailableBytes(), 
+                        cli.maxQueued, cli.queue.getOverflowCount(), cli.queue.getDroppedBytes());
     }
-    wifiGVRET.clearBufferedBytes();
+    if (compressInBytes > 0) Logger::console("WiFi compression: %u bytes in, %u out (%i%%)", compressInBytes, compressOutBytes,
+                                             (int)((compressOutBytes * 100ull) / compressInBytes));
 }
 
 // Utility to extract header value from headers
@@ -302,7 +494,7 @@ String getHeaderValue(String header, String headerName)
   return header.substring(strlen(headerName.c_str()));
 }
 
-void onOTAProgress(uint32_t progress, size_t fullSize)
+void onOTAProgress(uint32_t progress, size_t)
 {
     static int OTAcount = 0;
     //esp_task_wdt_reset();
@@ -425,7 +617,7 @@ void WiFiManager::attemptOTAUpdate()
             Serial.println("There is sufficient space to update. Beginning update. \n");
             size_t written = Update.writeStream(wifiClient);
 
-            if (written == contentLength)
+            if (written == (size_t)contentLength)
             {
                 Serial.println("\nWrote " + String(written) + " bytes to memory...");
             }
@@ -3,6 +3,21 @@
 #include <ESPmDNS.h>
 #include <WiFiUdp.h>
 #include <ArduinoOTA.h>
+#include "config.h"
+#include "commbuffer.h"
+#include "gvret_comm.h"
+#include "lz4_block.h"
+
+#define COMPRESSED_HEADER_SIZE  6
+
+//per telnet client bookkeeping. Each client gets its own bounded queue so a slow one can't hold up the others
+struct GVRETClient
+{
+    CommBuffer queue;
+    GVRET_INPUT input; //this client's message in progress so input from several clients can't get mixed up
+    uint32_t bytesSent;
+    uint32_t maxQueued; //deepest the queue has been, a measure of how far behind this client has fallen
+};
 
 class WiFiManager
 {
@@ -11,7 +26,10 @@ public:
     void setup();
     void loop();
     void sendBufferedData();
+    void drainClients();
     void attemptOTAUpdate();
+    void printClientStats();
+    int numClients();
     
 private:
     WiFiServer wifiServer;
@@ -19,4 +37,16 @@ private:
     WiFiClient wifiClient;
     WiFiUDP wifiUDPServer;
     uint32_t lastBroadcast;
+    GVRETClient gvretClients[MAX_CLIENTS];
+    LZ4Block compressor;
+    uint8_t rawChunk[WIFI_BUFF_SIZE]; //the shared buffer unwrapped when it has to be compressed
+    uint8_t compressedBlock[WIFI_BUFF_SIZE];
+    uint32_t compressInBytes;
+    uint32_t compressOutBytes;
+
+    void resetClient(int which);
+    void fanOut(const uint8_t *first, size_t firstLength, const uint8_t *second, size_t secondLength);
+    size_t compressChunk(const uint8_t *first, size_t firstLength, const uint8_t *second, size_t secondLength);
+    void drainClient(int which);
+    int sendToClient(int which, const uint8_t *data, size_t length);
 };